@@ -0,0 +1,126 @@
+#undef NDEBUG
+#include "bench.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <ctime>
+#include <sys/resource.h>
+
+#include <fmt/format.h>
+
+namespace {
+
+const std::array<const char *, 2> bench_cache_names{"warm", "cold"};
+
+int64_t to_ns(const timeval &tv) {
+    return tv.tv_sec * 1'000'000'000ll + tv.tv_usec * 1'000ll;
+}
+
+double median(std::vector<double> vals) {
+    if (vals.empty()) {
+        return 0;
+    }
+    std::sort(vals.begin(), vals.end());
+    return vals[vals.size() / 2];
+}
+
+} // namespace
+
+const char *to_string(bench_cache cache) {
+    return bench_cache_names.at((size_t)cache);
+}
+
+std::optional<bench_cache> parse_bench_cache(const std::string &str) {
+    for (size_t i = 0; i < bench_cache_names.size(); ++i) {
+        if (str == bench_cache_names[i]) {
+            return (bench_cache)i;
+        }
+    }
+    return std::nullopt;
+}
+
+phase_clock::sample phase_clock::now() {
+    rusage self, children;
+    assert(!getrusage(RUSAGE_SELF, &self));
+    assert(!getrusage(RUSAGE_CHILDREN, &children));
+    timespec thread_cpu;
+    assert(!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &thread_cpu));
+    return sample{std::chrono::steady_clock::now(),
+                  to_ns(self.ru_utime) + to_ns(self.ru_stime) + to_ns(children.ru_utime) +
+                      to_ns(children.ru_stime),
+                  thread_cpu.tv_sec * 1'000'000'000ll + thread_cpu.tv_nsec,
+                  self.ru_inblock + children.ru_inblock};
+}
+
+void phase_clock::enter(const char *phase) {
+    const auto end = now();
+    if (phase_) {
+        auto it = std::find_if(phases_.begin(), phases_.end(),
+                               [&](const phase_time &p) { return p.phase == phase_; });
+        if (it == phases_.end()) {
+            it = phases_.emplace(phases_.end(), phase_time{phase_});
+        }
+        it->wall_ms += std::chrono::duration<double, std::milli>(end.wall - start_.wall).count();
+        it->cpu_ms += (end.cpu_ns - start_.cpu_ns) / 1e6;
+        it->thread_cpu_ms += (end.thread_cpu_ns - start_.thread_cpu_ns) / 1e6;
+        it->blocks_in += end.blocks_in - start_.blocks_in;
+    }
+    phase_ = phase;
+    start_ = end;
+}
+
+std::vector<phase_time> phase_clock::finish() {
+    enter(nullptr);
+    return std::move(phases_);
+}
+
+void print_bench_report(const std::vector<std::vector<phase_time>> &runs, bench_cache cache) {
+    // phases in the order the first run went through them, later runs may skip some
+    std::vector<std::string> order;
+    for (const auto &run : runs) {
+        for (const auto &p : run) {
+            if (std::find(order.begin(), order.end(), p.phase) == order.end()) {
+                order.emplace_back(p.phase);
+            }
+        }
+    }
+
+    fmt::print("[-] Median of {:d} {:s}-cache runs\n", runs.size(), to_string(cache));
+    fmt::print("    {:<28s} {:>12s} {:>12s} {:>12s} {:>12s}\n", "phase", "wall ms", "cpu ms",
+               "wait ms", "blocks in");
+    std::vector<double> total_wall, total_cpu, total_wait, total_blocks;
+    for (const auto &phase : order) {
+        std::vector<double> wall, cpu, wait, blocks;
+        for (const auto &run : runs) {
+            phase_time t{phase};
+            for (const auto &p : run) {
+                if (p.phase == phase) {
+                    t = p;
+                }
+            }
+            wall.emplace_back(t.wall_ms);
+            cpu.emplace_back(t.cpu_ms);
+            // clocks of different resolution can put the thread's CPU time a hair over wall
+            wait.emplace_back(std::max(0.0, t.wall_ms - t.thread_cpu_ms));
+            blocks.emplace_back((double)t.blocks_in);
+        }
+        fmt::print("    {:<28s} {:>12.3f} {:>12.3f} {:>12.3f} {:>12.0f}\n", phase, median(wall),
+                   median(cpu), median(wait), median(blocks));
+    }
+    for (const auto &run : runs) {
+        phase_time total;
+        for (const auto &p : run) {
+            total.wall_ms += p.wall_ms;
+            total.cpu_ms += p.cpu_ms;
+            total.thread_cpu_ms += p.thread_cpu_ms;
+            total.blocks_in += p.blocks_in;
+        }
+        total_wall.emplace_back(total.wall_ms);
+        total_cpu.emplace_back(total.cpu_ms);
+        total_wait.emplace_back(std::max(0.0, total.wall_ms - total.thread_cpu_ms));
+        total_blocks.emplace_back((double)total.blocks_in);
+    }
+    fmt::print("    {:<28s} {:>12.3f} {:>12.3f} {:>12.3f} {:>12.0f}\n", "total",
+               median(total_wall), median(total_cpu), median(total_wait), median(total_blocks));
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Per-phase time accounting for --bench. Waiting is measured on the job's own thread, which
+// enters every phase: wall time it spent off the CPU, on storage, stub builds or worker threads.
+// Process CPU time can't tell that apart once workers run alongside.
+enum class bench_cache {
+    // an untimed run first, so inputs and SDK files come from the page cache
+    warm,
+    // the input is evicted from the page cache (or read from a fresh uncached copy) every run
+    cold,
+};
+
+const char *to_string(bench_cache cache);
+std::optional<bench_cache> parse_bench_cache(const std::string &str);
+
+struct phase_time {
+    std::string phase;
+    double wall_ms{0};
+    // the whole process and its finished children, so worker threads and stub builds count
+    double cpu_ms{0};
+    // the thread that entered the phase
+    double thread_cpu_ms{0};
+    // blocks read from storage, 0 if everything came from the page cache
+    int64_t blocks_in{0};
+};
+
+// Splits one run into phases at every enter(). Phases entered more than once (once per slice,
+// say) add up.
+class phase_clock {
+public:
+    void enter(const char *phase);
+    // Closes the current phase, returns them all in the order they were first entered.
+    std::vector<phase_time> finish();
+
+private:
+    struct sample {
+        std::chrono::steady_clock::time_point wall;
+        int64_t cpu_ns;
+        int64_t thread_cpu_ns;
+        int64_t blocks_in;
+    };
+    static sample now();
+
+    const char *phase_{nullptr};
+    sample start_{};
+    std::vector<phase_time> phases_;
+};
+
+// Medians over the runs of wall, CPU and waiting (wall - thread CPU) time per phase.
+void print_bench_report(const std::vector<std::vector<phase_time>> &runs, bench_cache cache);
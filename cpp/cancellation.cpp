@@ -0,0 +1,35 @@
+#include "cancellation.hpp"
+
+#include <cstdlib>
+
+cancel_token::cancel_token(double timeout_s) {
+    if (timeout_s > 0) {
+        deadline_ = clock::now() + std::chrono::duration_cast<clock::duration>(
+                                       std::chrono::duration<double>(timeout_s));
+    }
+}
+
+bool cancel_token::expired() const {
+    if (cancelled_.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    return deadline_ != std::nullopt && clock::now() >= *deadline_;
+}
+
+void cancel_token::checkpoint(const char *phase) {
+    phase_.store(phase, std::memory_order_relaxed);
+    // a job parked here can run past its deadline, so check after the hook
+    if (on_phase_) {
+        on_phase_();
+    }
+    check();
+}
+
+std::optional<double> parse_timeout(const std::string &str) {
+    char *end{nullptr};
+    const auto secs = strtod(str.c_str(), &end);
+    if (str.empty() || *end != '\0' || secs < 0) {
+        return std::nullopt;
+    }
+    return secs;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+
+// Thrown from a checkpoint once a job's token is cancelled or past its deadline. Caught at the
+// job boundary, unwinding releases everything the job held. Not a std::runtime_error so the
+// error handling around subprocesses and parsing doesn't swallow it.
+class job_cancelled : public std::exception {
+public:
+    explicit job_cancelled(const char *phase) : phase_{phase} {}
+
+    const char *what() const noexcept override {
+        return "job cancelled";
+    }
+    const char *phase() const {
+        return phase_;
+    }
+
+private:
+    const char *phase_;
+};
+
+// Cooperative cancellation for one job. Phases are string literals so recording them never
+// allocates.
+class cancel_token {
+public:
+    using clock = std::chrono::steady_clock;
+
+    cancel_token() = default;
+    // A timeout of 0 means no deadline.
+    explicit cancel_token(double timeout_s);
+
+    void cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+    bool expired() const;
+    // Records that the job reached phase, runs the phase boundary hook, then throws
+    // job_cancelled if it should stop.
+    void checkpoint(const char *phase);
+    // Called at every checkpoint; the scheduler uses it to park lower priority jobs.
+    void at_phase_boundary(std::function<void()> hook) {
+        on_phase_ = std::move(hook);
+    }
+    // For long loops, throws without changing the phase.
+    void check() const {
+        if (expired()) {
+            throw job_cancelled{phase()};
+        }
+    }
+    const char *phase() const {
+        return phase_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::optional<clock::time_point> deadline_;
+    std::atomic<bool> cancelled_{false};
+    std::atomic<const char *> phase_{"start"};
+    std::function<void()> on_phase_;
+};
+
+// Parses a timeout in (fractional) seconds.
+std::optional<double> parse_timeout(const std::string &str);
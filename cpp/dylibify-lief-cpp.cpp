@@ -1,13 +1,27 @@
 #undef NDEBUG
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dlfcn.h>
 #include <filesystem>
 #include <map>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <span>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
 #include <vector>
 
 #include <LIEF/MachO.hpp>
@@ -16,6 +30,32 @@
 #include <fmt/format.h>
 #include <subprocess.hpp>
 
+#include "bench.hpp"
+#include "cancellation.hpp"
+#include "file-io.hpp"
+#include "fixup-applier.hpp"
+#include "job-scheduler.hpp"
+#include "job-trace.hpp"
+#include "macho-model.hpp"
+#include "macho-view.hpp"
+#include "output-sink.hpp"
+#include "pack-file.hpp"
+#include "pass-manager.hpp"
+#include "policy-table.hpp"
+#include "profiler.hpp"
+#include "runtime-report.hpp"
+#include "sdk-index.hpp"
+#include "size-report.hpp"
+#include "symbol-dict.hpp"
+#include "synth-macho.hpp"
+#include "task-runtime.hpp"
+#include "tbd-file.hpp"
+#include "usage-profile.hpp"
+
+#if defined(DYLIBIFY_EMBEDDED_POLICY)
+#include DYLIBIFY_EMBEDDED_POLICY
+#endif
+
 namespace fs = std::filesystem;
 using namespace std::string_literals;
 using namespace LIEF::MachO;
@@ -37,6 +77,15 @@ static bool dylib_exists(const std::string &dylib_path) {
     }
 }
 
+static std::vector<uint8_t> read_file_bytes(const fs::path file) {
+    auto *fh = fopen(file.c_str(), "rb");
+    assert(fh);
+    std::vector<uint8_t> bytes(fs::file_size(file));
+    assert(fread(bytes.data(), bytes.size(), 1, fh) == 1);
+    assert(!fclose(fh));
+    return bytes;
+}
+
 static void write_string_to_file(const std::string &str, const fs::path file) {
     auto *fh = fopen(file.c_str(), "w");
     assert(fh);
@@ -87,15 +136,39 @@ static const std::map<CPU_TYPES, std::string> arch_map{
     {CPU_TYPES::CPU_TYPE_ARM64, "arm64"},
 };
 
+// Waits for a build tool, killing it if the job is cancelled in the meantime.
+static int wait_for_tool(subprocess::Popen &proc, const cancel_token &cancel) {
+    while (true) {
+        const auto res = proc.poll();
+        if (res != -1) {
+            return res;
+        }
+        if (cancel.expired()) {
+            proc.kill(SIGKILL);
+            proc.wait();
+            cancel.check();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{5});
+    }
+}
+
+// What a stub is built for: the clang target OS, e.g. "ios14.0.0", and the SDK to build it
+// against. Without an OS the stub is built for whatever the host defaults to.
+struct stub_target {
+    std::optional<std::string> os;
+    std::optional<fs::path> sysroot;
+};
+
 static std::optional<fs::path> create_thin_stub_dylib(const fs::path &fat_stub_filename,
-                                                      const fs::path &out_path,
+                                                      const fs::path &out_dir,
                                                       const fs::path &stub_dylib_path,
-                                                      const std::set<std::string> &stub_syms,
-                                                      const CPU_TYPES cpu_type) {
-    const auto objc = create_stub_objc(stub_syms);
+                                                      const std::string &objc,
+                                                      const std::vector<std::string> &link_flags,
+                                                      const CPU_TYPES cpu_type,
+                                                      const stub_target &target,
+                                                      const cancel_token &cancel) {
     const auto arch = arch_map.at(cpu_type);
 
-    const auto out_dir           = out_path.parent_path();
     auto thin_sub_dylib_filename = fat_stub_filename.stem();
     thin_sub_dylib_filename += "." + arch;
     auto thin_stub_src_filename{thin_sub_dylib_filename};
@@ -104,14 +177,25 @@ static std::optional<fs::path> create_thin_stub_dylib(const fs::path &fat_stub_f
     const auto thin_stub_dylib_path = out_dir / thin_sub_dylib_filename;
     const auto thin_stub_src_path   = out_dir / thin_stub_src_filename;
 
-    write_string_to_file(objc, thin_stub_src_filename);
+    write_string_to_file(objc, thin_stub_src_path);
 
-    const auto install_name_opt = "-Wl,-install_name,"s + stub_dylib_path.string();
+    std::vector<std::string> clang_args{"clang",
+                                        target.os ? "-target" : "-arch",
+                                        target.os ? arch + "-apple-" + *target.os : arch,
+                                        "-o",
+                                        thin_stub_dylib_path.string(),
+                                        thin_stub_src_path.string(),
+                                        "-shared",
+                                        "-fobjc-arc",
+                                        "-Wl,-install_name,"s + stub_dylib_path.string()};
+    if (target.sysroot) {
+        clang_args.insert(clang_args.end(), {"-isysroot", target.sysroot->string()});
+    }
+    clang_args.insert(clang_args.end(), link_flags.begin(), link_flags.end());
     int res{-1};
     try {
-        res = subprocess::call({"clang", "-arch", arch.c_str(), "-o", thin_stub_dylib_path.c_str(),
-                                thin_stub_src_filename.c_str(), "-shared", "-fobjc-arc",
-                                "-framework", "Foundation", install_name_opt.c_str()});
+        subprocess::Popen clang{clang_args};
+        res = wait_for_tool(clang, cancel);
     } catch (const std::runtime_error &e) {
         fmt::print("[-] Error when running stub dylib build: '{:s}'\n", e.what());
         return std::nullopt;
@@ -124,9 +208,10 @@ static std::optional<fs::path> create_thin_stub_dylib(const fs::path &fat_stub_f
     return thin_stub_dylib_path;
 }
 
-static bool create_fat_stub_dylib(const fs::path &fat_stub_filename, const fs::path &out_path,
-                                  const std::vector<fs::path> &thin_stubs) {
-    const auto fat_stub_path = out_path.parent_path() / fat_stub_filename;
+static bool create_fat_stub_dylib(const fs::path &fat_stub_filename, const fs::path &out_dir,
+                                  const std::vector<fs::path> &thin_stubs,
+                                  const cancel_token &cancel) {
+    const auto fat_stub_path = out_dir / fat_stub_filename;
     std::vector<std::string> stub_path_strs;
     for (const auto &sp : thin_stubs) {
         stub_path_strs.emplace_back(sp.string());
@@ -136,7 +221,8 @@ static bool create_fat_stub_dylib(const fs::path &fat_stub_filename, const fs::p
 
     int res{-1};
     try {
-        res = subprocess::call(cmd);
+        subprocess::Popen lipo{cmd};
+        res = wait_for_tool(lipo, cancel);
     } catch (const std::runtime_error &e) {
         fmt::print("[-] Error when running fat dylib lipo: '{:s}'\n", e.what());
         return false;
@@ -149,295 +235,2918 @@ static bool create_fat_stub_dylib(const fs::path &fat_stub_filename, const fs::p
     return true;
 }
 
-static bool dylibify(const std::string &in_path, const std::string &out_path,
-                     const std::optional<std::string> dylib_path,
-                     const std::vector<std::string> remove_dylibs,
-                     const bool auto_remove_dylibs = false, const bool remove_info_plist = false,
-                     const bool ios = false, const bool macos = false, const bool verbose = false) {
-    assert(!(ios && macos));
-
-    if (verbose) {
-        LIEF::logging::set_level(LIEF::logging::LOGGING_LEVEL::LOG_TRACE);
+static void index_dylib_exports(export_index &index, const fs::path &sdk_root,
+                                const std::string &install_name, const CPU_TYPES cpu_type,
+                                const bool verbose) {
+    if (index.contains(install_name)) {
+        return;
     }
+    // insert before recursing so re-export cycles terminate
+    auto &entry = index[install_name];
 
-    auto binaries = Parser::parse(in_path);
-
-    fs::path fat_stub_filename{"dylibify-stubs.dylib"};
-    std::optional<fs::path> stub_path;
-    std::vector<fs::path> thin_stubs;
+    if (install_name.starts_with("@")) {
+        return;
+    }
+    const auto dylib_path = sdk_root / fs::path{install_name}.relative_path();
+    if (!fs::exists(dylib_path)) {
+        if (verbose) {
+            fmt::print("[-] No dylib at '{:s}' to index exports of '{:s}'\n", dylib_path.string(),
+                       install_name);
+        }
+        return;
+    }
 
-    for (auto &binary : *binaries) {
-        std::map<std::string, const DylibCommand *> orig_libraries;
-        for (const auto &dylib_cmd : binary.libraries()) {
+    auto dylibs = Parser::parse(dylib_path.string());
+    if (!dylibs) {
+        fmt::print("[!] Failed to parse '{:s}' for export indexing\n", dylib_path.string());
+        return;
+    }
+    for (auto &dylib : *dylibs) {
+        if (dylib.header().cpu_type() != cpu_type) {
+            continue;
+        }
+        for (const auto &dylib_cmd : dylib.libraries()) {
             if (dylib_cmd.command() == LOAD_COMMAND_TYPES::LC_ID_DYLIB) {
-                continue;
+                entry.current_version = dylib_cmd.current_version();
+                entry.compat_version  = dylib_cmd.compatibility_version();
+            } else if (dylib_cmd.command() == LOAD_COMMAND_TYPES::LC_REEXPORT_DYLIB) {
+                entry.reexports.emplace_back(dylib_cmd.name());
             }
-            orig_libraries.emplace(std::make_pair(dylib_cmd.name(), &dylib_cmd));
         }
-
-        std::map<std::string, int32_t> orig_ordinal_map;
-        int32_t orig_ordinal_idx{1};
-        for (const auto &dylib_cmd : binary.libraries()) {
-            if (dylib_cmd.command() == LOAD_COMMAND_TYPES::LC_ID_DYLIB) {
+        std::vector<std::string> exports;
+        for (auto &sym : dylib.symbols()) {
+            if (!sym.has_export_info()) {
                 continue;
             }
-            orig_ordinal_map.emplace(std::make_pair(dylib_cmd.name(), orig_ordinal_idx));
-            ++orig_ordinal_idx;
-        }
-
-        std::map<std::string, std::string> orig_syms_to_libs;
-        for (auto &sym : binary.symbols()) {
-            if (!sym.has_binding_info() || !sym.binding_info()->has_library()) {
+            if (sym.export_info()->flags() &
+                (uint64_t)EXPORT_SYMBOL_FLAGS::EXPORT_SYMBOL_FLAGS_REEXPORT) {
                 continue;
             }
-            orig_syms_to_libs.emplace(sym.name(), sym.binding_info()->library()->name());
+            exports.emplace_back(sym.name());
+        }
+        entry.exports = symbol_dict{std::move(exports)};
+        break;
+    }
+    if (verbose) {
+        fmt::print("[-] Indexed {:d} exports and {:d} re-exported dylibs of '{:s}'\n",
+                   entry.exports.size(), entry.reexports.size(), install_name);
+    }
+
+    const auto reexports = entry.reexports;
+    for (const auto &reexport : reexports) {
+        index_dylib_exports(index, sdk_root, reexport, cpu_type, verbose);
+    }
+}
+
+static std::optional<std::string> find_implementing_dylib(const export_index &index,
+                                                          const std::string &install_name,
+                                                          const std::string &sym_name,
+                                                          std::set<std::string> &visited) {
+    if (!visited.emplace(install_name).second) {
+        return std::nullopt;
+    }
+    const auto it = index.find(install_name);
+    if (it == index.end()) {
+        return std::nullopt;
+    }
+    if (it->second.exports.contains(sym_name)) {
+        return install_name;
+    }
+    for (const auto &reexport : it->second.reexports) {
+        if (auto impl = find_implementing_dylib(index, reexport, sym_name, visited)) {
+            return impl;
         }
+    }
+    return std::nullopt;
+}
 
-        auto &hdr = binary.header();
-        assert(hdr.file_type() == FILE_TYPES::MH_EXECUTE);
+// Everything that may differ between the outputs produced from one input.
+struct output_variant {
+    std::string out_path;
+    std::optional<std::string> dylib_path;
+    std::vector<std::string> remove_dylibs;
+    std::optional<BuildVersion::PLATFORMS> platform;
+    BuildVersion::version_t minos{11, 0, 0};
+    BuildVersion::version_t sdk{11, 0, 0};
+};
+
+enum class conversion_engine {
+    native,
+    lief,
+    // both, failing the job if they disagree
+    cross_check,
+};
+
+struct dylibify_options {
+    std::string in_path;
+    // the first one is the -o output, the rest come from --variant
+    std::vector<output_variant> outputs;
+    bool auto_remove_dylibs{false};
+    bool remove_info_plist{false};
+    bool flatten_reexports{false};
+    fs::path sdk_root{"/"};
+    // link removed dylibs' symbols against prebuilt whole-framework stubs cached here
+    std::optional<fs::path> stub_catalog;
+    bool uncoalesce_weak_defs{false};
+    std::vector<std::string> keep_weak_defs;
+    bool rebase_self_binds{false};
+    bool merge_segments{false};
+    bool size_report{false};
+    bool runtime_report{false};
+    bool stats{false};
+    bool verbose{false};
+    // seconds, 0 for no deadline
+    double job_timeout{0};
+    job_priority priority{job_priority::normal};
+    conversion_engine engine{conversion_engine::native};
+    io_mode io{io_mode::buffered};
+    // --policy or the embedded one, mapped for the whole run
+    const policy_table *policy{nullptr};
+    // --usage-profile, shared by every job
+    const usage_profile *usage{nullptr};
+};
+
+struct conversion_stats {
+    size_t weak_defs_cleared{0};
+    size_t weak_defs_kept{0};
+    size_t weak_binds_removed{0};
+    size_t weak_bind_bytes_before{0};
+    size_t weak_bind_bytes_after{0};
+    size_t self_binds_rebased{0};
+    size_t self_lazy_binds_resolved{0};
+    // --merge-segments, summed over slices
+    size_t mappings_before{0};
+    size_t mappings_after{0};
+    // --usage-profile decisions, name -> the runs that made it
+    std::map<std::string, std::string> profile_removed_dylibs;
+    std::map<std::string, std::string> profile_weak_imports;
+    std::map<std::string, std::string> profile_eager_binds;
+    size_attribution size_deltas;
+};
+
+static void merge_stats(conversion_stats &into, const conversion_stats &from) {
+    into.weak_defs_cleared += from.weak_defs_cleared;
+    into.weak_defs_kept += from.weak_defs_kept;
+    into.weak_binds_removed += from.weak_binds_removed;
+    into.weak_bind_bytes_before += from.weak_bind_bytes_before;
+    into.weak_bind_bytes_after += from.weak_bind_bytes_after;
+    into.self_binds_rebased += from.self_binds_rebased;
+    into.self_lazy_binds_resolved += from.self_lazy_binds_resolved;
+    into.mappings_before += from.mappings_before;
+    into.mappings_after += from.mappings_after;
+    into.profile_removed_dylibs.insert(from.profile_removed_dylibs.begin(),
+                                       from.profile_removed_dylibs.end());
+    into.profile_weak_imports.insert(from.profile_weak_imports.begin(),
+                                     from.profile_weak_imports.end());
+    into.profile_eager_binds.insert(from.profile_eager_binds.begin(),
+                                    from.profile_eager_binds.end());
+    for (const auto &delta : from.size_deltas.file) {
+        into.size_deltas.file[delta.first] += delta.second;
+    }
+    for (const auto &delta : from.size_deltas.load_commands) {
+        into.size_deltas.load_commands[delta.first] += delta.second;
+    }
+}
+
+static void print_stats(const conversion_stats &stats) {
+    fmt::print("[-] Weak definitions: {:d} cleared, {:d} kept for coalescing\n",
+               stats.weak_defs_cleared, stats.weak_defs_kept);
+    fmt::print("[-] Weak binds: {:d} removed, opcodes {:d} -> {:d} bytes\n",
+               stats.weak_binds_removed, stats.weak_bind_bytes_before,
+               stats.weak_bind_bytes_after);
+    fmt::print("[-] Self binds: {:d} rebased, {:d} lazy resolved\n", stats.self_binds_rebased,
+               stats.self_lazy_binds_resolved);
+    if (stats.mappings_before) {
+        fmt::print("[-] Segment mappings: {:d} -> {:d}\n", stats.mappings_before,
+                   stats.mappings_after);
+    }
+    if (stats.profile_removed_dylibs.size() || stats.profile_weak_imports.size() ||
+        stats.profile_eager_binds.size()) {
+        fmt::print("[-] Usage profile: {:d} dylibs removed, {:d} weak imports, {:d} bound at "
+                   "load\n",
+                   stats.profile_removed_dylibs.size(), stats.profile_weak_imports.size(),
+                   stats.profile_eager_binds.size());
+    }
+    for (const auto &[dylib, why] : stats.profile_removed_dylibs) {
+        fmt::print("[-]   removed dylib '{:s}' ({:s})\n", dylib, why);
+    }
+    for (const auto &[sym, why] : stats.profile_weak_imports) {
+        fmt::print("[-]   weak import '{:s}' ({:s})\n", sym, why);
+    }
+    for (const auto &[sym, why] : stats.profile_eager_binds) {
+        fmt::print("[-]   bound at load '{:s}' ({:s})\n", sym, why);
+    }
+}
+
+using weak_def_set = std::set<std::string, std::less<>>;
+
+// --keep-weak-def names plus the ones --policy keeps.
+struct kept_weak_defs {
+    weak_def_set names;
+    const policy_table *policy{nullptr};
+
+    bool contains(std::string_view name) const {
+        return names.contains(name) || (policy && policy->lookup(policy_domain::symbol, name) &
+                                                      policy_flags::keep_weak_def);
+    }
+};
+
+// Whether a weak definition has to stay weak. One other images can't see (not external or
+// private extern) never coalesces with anything. Exported code can go regular, copies other
+// images keep only differ in their address, except for the replaceable operator new/delete a
+// program's replacement has to reach in every image. Exported weak data (typeinfo, template
+// static data members, inline variables, guard variables) has to stay unique across images.
+static bool weak_def_needs_coalescing(std::string_view name, uint8_t type, uint32_t sect_flags,
+                                      const kept_weak_defs &keep_weak_defs) {
+    static const std::array<std::string_view, 4> replaceable_prefixes{"__Znw", "__Zna", "__Zdl",
+                                                                      "__Zda"};
+    if (keep_weak_defs.contains(name)) {
+        return true;
+    }
+    if (!(type & macho::N_EXT) || (type & macho::N_PEXT)) {
+        return false;
+    }
+    if (!(sect_flags & (macho::S_ATTR_PURE_INSTRUCTIONS | macho::S_ATTR_SOME_INSTRUCTIONS))) {
+        return true;
+    }
+    for (const auto prefix : replaceable_prefixes) {
+        if (name.starts_with(prefix)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Flags of the section a symbol's n_sect names, 0 if there is none.
+static uint32_t symbol_section_flags(const std::vector<uint32_t> &sect_flags, uint8_t sect) {
+    return sect && sect <= sect_flags.size() ? sect_flags[sect - 1] : 0;
+}
+
+static bool has_chained_fixups(Binary &binary) {
+    for (const auto &lc : binary.commands()) {
+        if ((uint32_t)lc.command() == macho::LC_DYLD_CHAINED_FIXUPS) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Turns weak definitions nothing outside this image needs to coalesce with into regular ones.
+// Returns the demoted symbols so their weak-bind entries can be dropped once the binary is built.
+static weak_def_set uncoalesce_weak_defs(Binary &binary, const kept_weak_defs &keep_weak_defs,
+                                         conversion_stats &stats, const cancel_token &cancel,
+                                         const bool verbose) {
+    weak_def_set cleared;
+    size_t kept{0};
+    std::vector<uint32_t> sect_flags;
+    for (const auto &sect : binary.sections()) {
+        sect_flags.emplace_back(sect.flags());
+    }
+    for (auto &sym : binary.symbols()) {
+        cancel.check();
+        if (sym.origin() != SYMBOL_ORIGINS::SYM_ORIGIN_LC_SYMTAB) {
+            continue;
+        }
+        if ((sym.type() & macho::N_TYPE) != macho::N_SECT ||
+            !(sym.description() & macho::N_WEAK_DEF)) {
+            continue;
+        }
+        if (weak_def_needs_coalescing(sym.name(), sym.type(),
+                                      symbol_section_flags(sect_flags, sym.numberof_sections()),
+                                      keep_weak_defs)) {
+            ++kept;
+            continue;
+        }
+        sym.description(sym.description() & ~macho::N_WEAK_DEF);
+        if (sym.has_export_info()) {
+            auto *exp = sym.export_info();
+            exp->flags(exp->flags() &
+                       ~(uint64_t)EXPORT_SYMBOL_FLAGS::EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION);
+        }
+        cleared.emplace(sym.name());
+    }
+
+    size_t weak_binds_left{0};
+    for (auto &binding_info : binary.dyld_info()->bindings()) {
+        if (binding_info.binding_class() != BINDING_CLASS::BIND_CLASS_WEAK) {
+            continue;
+        }
+        if (!binding_info.has_symbol() || !cleared.contains(binding_info.symbol()->name())) {
+            ++weak_binds_left;
+        }
+    }
+
+    auto &hdr = binary.header();
+    if (!kept && (hdr.flags() & (uint32_t)HEADER_FLAGS::MH_WEAK_DEFINES)) {
         if (verbose) {
-            fmt::print("[-] Changing Mach-O type from executable to dylib\n");
+            fmt::print("[-] Removing WEAK_DEFINES flag\n");
         }
-        hdr.file_type(FILE_TYPES::MH_DYLIB);
+        hdr.flags(hdr.flags() & ~(uint32_t)HEADER_FLAGS::MH_WEAK_DEFINES);
+    }
+    if (!weak_binds_left && (hdr.flags() & (uint32_t)HEADER_FLAGS::MH_BINDS_TO_WEAK)) {
         if (verbose) {
-            fmt::print("[-] Adding NO_REXPORTED_LIBS flag\n");
+            fmt::print("[-] Removing BINDS_TO_WEAK flag\n");
         }
-        hdr.flags(hdr.flags() | (uint32_t)HEADER_FLAGS::MH_NO_REEXPORTED_DYLIBS);
+        hdr.flags(hdr.flags() & ~(uint32_t)HEADER_FLAGS::MH_BINDS_TO_WEAK);
+    }
+    if (verbose) {
+        fmt::print("[-] Cleared {:d} weak definitions, kept {:d} that need coalescing\n",
+                   cleared.size(), kept);
+    }
+    stats.weak_defs_cleared += cleared.size();
+    stats.weak_defs_kept += kept;
+    return cleared;
+}
 
-        if (binary.code_signature()) {
-            if (verbose) {
-                fmt::print("[-] Removing code signature\n");
-            }
-            assert(binary.remove_signature());
+// uncoalesce_weak_defs() for the native engine, which edits the trie and weak binds directly
+// so there is nothing left to strip after the build.
+static void uncoalesce_weak_defs_native(macho::model &model, const kept_weak_defs &keep_weak_defs,
+                                        conversion_stats &stats, const cancel_token &cancel,
+                                        const bool verbose) {
+    weak_def_set cleared;
+    size_t kept{0};
+    const auto sect_flags = model.section_flags();
+    for (auto &sym : model.symbols()) {
+        cancel.check();
+        if ((sym.type & macho::N_TYPE) != macho::N_SECT || !(sym.desc & macho::N_WEAK_DEF)) {
+            continue;
         }
-
-        if (const auto *pgz_seg = binary.get_segment("__PAGEZERO")) {
-            if (verbose) {
-                fmt::print("[-] Removing __PAGEZERO segment\n");
-            }
-            binary.remove(*pgz_seg);
+        if (weak_def_needs_coalescing(sym.name, sym.type,
+                                      symbol_section_flags(sect_flags, sym.sect),
+                                      keep_weak_defs)) {
+            ++kept;
+            continue;
         }
+        sym.desc &= ~macho::N_WEAK_DEF;
+        model.clear_export_flags(sym.name, macho::EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION);
+        cleared.emplace(sym.name);
+    }
 
-        fs::path new_dylib_path;
-        if (dylib_path != std::nullopt) {
-            new_dylib_path = *dylib_path;
-        } else {
-            fs::path dylib_path{out_path};
-            new_dylib_path = fs::path{"@executable_path"} / dylib_path.filename();
+    auto &weak_binds      = model.binds(macho::bind_kind::weak);
+    const auto encoded_size = [&] {
+        return weak_binds.empty()
+                   ? 0
+                   : macho::encode_binds(weak_binds, model.pointer_size(), macho::bind_kind::weak)
+                         .size();
+    };
+    const auto weak_binds_before = weak_binds.size();
+    const auto old_size          = encoded_size();
+    std::erase_if(weak_binds,
+                  [&](const macho::bind_entry &entry) { return cleared.contains(entry.symbol); });
+    const auto new_size = encoded_size();
+    const auto weak_binds_left = std::count_if(
+        weak_binds.begin(), weak_binds.end(),
+        [](const macho::bind_entry &entry) { return entry.has_location; });
+
+    if (!kept && (model.flags() & macho::MH_WEAK_DEFINES)) {
+        if (verbose) {
+            fmt::print("[-] Removing WEAK_DEFINES flag\n");
         }
+        model.flags(model.flags() & ~macho::MH_WEAK_DEFINES);
+    }
+    if (!weak_binds_left && (model.flags() & macho::MH_BINDS_TO_WEAK)) {
         if (verbose) {
-            fmt::print("[-] Setting ID_DYLIB path to: '{:s}'\n", new_dylib_path.string());
+            fmt::print("[-] Removing BINDS_TO_WEAK flag\n");
         }
-        const auto id_dylib_cmd = DylibCommand::id_dylib(new_dylib_path, 2, 0x00010000, 0x00010000);
-        binary.add(id_dylib_cmd);
+        model.flags(model.flags() & ~macho::MH_BINDS_TO_WEAK);
+    }
+    if (verbose) {
+        fmt::print("[-] Cleared {:d} weak definitions, kept {:d} that need coalescing\n",
+                   cleared.size(), kept);
+    }
+    stats.weak_defs_cleared += cleared.size();
+    stats.weak_defs_kept += kept;
+    if (weak_binds_before != weak_binds.size()) {
+        stats.weak_binds_removed += weak_binds_before - weak_binds.size();
+        stats.weak_bind_bytes_before += old_size;
+        stats.weak_bind_bytes_after += new_size;
+        // the model's LINKEDIT is rebuilt, the opcodes it no longer holds leave the file
+        stats.size_deltas.file["strip weak binds"] += (int64_t)new_size - (int64_t)old_size;
+    }
+}
 
-        if (remove_info_plist) {
-            if (const auto *plist_sect = binary.get_section("__TEXT", "__info_plist")) {
-                if (verbose) {
-                    fmt::print("[-] Removing __TEXT,__info_plist\n");
-                }
-                binary.remove_section("__TEXT", "__info_plist", true);
+// Replaces one of the LC_DYLD_INFO opcode streams, in place when it fits and otherwise appended
+// to __LINKEDIT.
+static bool replace_dyld_info_stream(std::vector<uint8_t> &slice_buf,
+                                     uint32_t macho::dyld_info_command::*off_field,
+                                     uint32_t macho::dyld_info_command::*size_field,
+                                     std::span<const uint8_t> opcodes) {
+    {
+        macho::image img{slice_buf};
+        auto *dyld_info = img.dyld_info();
+        auto old        = img.bytes(dyld_info->*off_field, dyld_info->*size_field);
+        if (opcodes.size() <= old.size()) {
+            std::copy(opcodes.begin(), opcodes.end(), old.begin());
+            std::fill(old.begin() + opcodes.size(), old.end(), 0);
+            dyld_info->*size_field = opcodes.size();
+            if (opcodes.empty()) {
+                dyld_info->*off_field = 0;
             }
+            return true;
         }
+        std::fill(old.begin(), old.end(), 0);
+    }
+    const auto new_off = macho::append_to_linkedit(slice_buf, opcodes);
+    if (new_off == std::nullopt) {
+        return false;
+    }
+    auto *dyld_info        = macho::image{slice_buf}.dyld_info();
+    dyld_info->*off_field  = *new_off;
+    dyld_info->*size_field = opcodes.size();
+    return true;
+}
 
-        if (const auto *dylinker_cmd = binary.dylinker()) {
-            if (verbose) {
-                fmt::print("[-] Removing dynlinker command\n");
-            }
-            binary.remove(*dylinker_cmd);
+// Drops weak-bind entries for symbols uncoalesce_weak_defs() demoted.
+static void strip_weak_binds(std::vector<uint8_t> &slice_buf, const weak_def_set &cleared,
+                             conversion_stats &stats, const bool verbose) {
+    macho::image img{slice_buf};
+    const auto *dyld_info = img.dyld_info();
+    if (!dyld_info) {
+        return;
+    }
+    const auto opcodes  = img.bytes(dyld_info->weak_bind_off, dyld_info->weak_bind_size);
+    const auto bindings = macho::decode_binds(opcodes, img.pointer_size(), macho::bind_kind::weak);
+    if (bindings == std::nullopt) {
+        fmt::print("[!] Couldn't decode weak binding opcodes, leaving them untouched\n");
+        return;
+    }
+
+    std::vector<macho::bind_entry> kept;
+    for (const auto &binding : *bindings) {
+        if (!cleared.contains(binding.symbol)) {
+            kept.emplace_back(binding);
         }
+    }
+    const auto removed = bindings->size() - kept.size();
+    if (!removed) {
+        return;
+    }
 
-        if (const auto *main_cmd = binary.main_command()) {
-            if (verbose) {
-                fmt::print("[-] Removing MAIN command\n");
-            }
-            binary.remove(*main_cmd);
+    std::vector<uint8_t> new_opcodes;
+    if (!kept.empty()) {
+        new_opcodes = macho::encode_binds(kept, img.pointer_size(), macho::bind_kind::weak);
+    }
+    const auto old_size       = opcodes.size();
+    const auto old_slice_size = slice_buf.size();
+    if (!replace_dyld_info_stream(slice_buf, &macho::dyld_info_command::weak_bind_off,
+                                  &macho::dyld_info_command::weak_bind_size, new_opcodes)) {
+        fmt::print("[!] Couldn't rewrite weak binding opcodes\n");
+        return;
+    }
+    if (verbose) {
+        fmt::print("[-] Removed {:d} weak bindings, opcodes {:d} -> {:d} bytes\n", removed,
+                   old_size, new_opcodes.size());
+    }
+
+    stats.weak_binds_removed += removed;
+    stats.weak_bind_bytes_before += old_size;
+    stats.weak_bind_bytes_after += new_opcodes.size();
+    // shrinking in place leaves the file as it was
+    stats.size_deltas.file["strip weak binds"] +=
+        (int64_t)slice_buf.size() - (int64_t)old_slice_size;
+}
+
+static bool is_self_bind_ordinal(int64_t ordinal) {
+    // BIND_SPECIAL_DYLIB_SELF, _MAIN_EXECUTABLE and _FLAT_LOOKUP
+    return ordinal == 0 || ordinal == -1 || ordinal == -2;
+}
+
+// Resolves binds to symbols the image defines itself into rebases to the symbol's address so dyld
+// doesn't look them up at load time. Once the image is a dylib, binds through the main executable
+// ordinal would resolve against the host instead of this image, so those get fixed up as well.
+// Lazy binds are resolved by pointing the lazy pointer straight at the target and blanking their
+// lazy bind entry, the stub helper never runs.
+static void rebase_self_binds(std::vector<uint8_t> &slice_buf, conversion_stats &stats,
+                              const cancel_token &cancel, const bool verbose) {
+    std::vector<uint8_t> new_rebase_opcodes;
+    std::vector<uint8_t> new_bind_opcodes;
+    size_t rebased{0};
+    size_t lazy_resolved{0};
+    {
+        macho::image img{slice_buf};
+        if (img.find_command(macho::LC_DYLD_CHAINED_FIXUPS)) {
+            // the binds are in the fixup chains, nothing edits those
+            fmt::print("[!] --rebase-self-binds can't edit chained fixups, leaving the self binds "
+                       "of {:s} alone\n", macho::arch_name(img.cputype()));
+            return;
+        }
+        const auto *dyld_info = img.dyld_info();
+        if (!dyld_info) {
+            return;
         }
+        const auto ptr_size = img.pointer_size();
+        const auto segments = img.segments();
 
-        if (const auto *src_cmd = binary.source_version()) {
-            if (verbose) {
-                fmt::print("[-] Remvoing source version command\n");
-            }
-            binary.remove(*src_cmd);
+        // the symbol table and the opcode streams don't depend on each other
+        std::map<std::string_view, macho::defined_symbol> defined_syms;
+        std::optional<std::vector<macho::rebase_entry>> rebases;
+        std::optional<std::vector<macho::bind_entry>> binds, lazy_binds;
+        task_group decode;
+        decode.run([&] {
+            rebases = macho::decode_rebases(
+                img.bytes(dyld_info->rebase_off, dyld_info->rebase_size), ptr_size);
+        });
+        decode.run([&] {
+            binds = macho::decode_binds(img.bytes(dyld_info->bind_off, dyld_info->bind_size),
+                                        ptr_size, macho::bind_kind::regular);
+        });
+        decode.run([&] {
+            lazy_binds = macho::decode_binds(
+                img.bytes(dyld_info->lazy_bind_off, dyld_info->lazy_bind_size), ptr_size,
+                macho::bind_kind::lazy);
+        });
+        for (const auto &sym : macho::defined_symbols(img)) {
+            defined_syms.emplace(sym.name, sym);
+        }
+        decode.wait();
+        if (rebases == std::nullopt || binds == std::nullopt || lazy_binds == std::nullopt) {
+            fmt::print("[!] Couldn't decode rebase/binding opcodes, leaving self binds alone\n");
+            return;
         }
 
-        if (ios || macos) {
-            if (const auto *minver_cmd = binary.version_min()) {
-                if (verbose) {
-                    const auto &ver = minver_cmd->version();
-                    const auto &sdk = minver_cmd->sdk();
-                    fmt::print("[-] Removing old VERSION_MIN command (version: '{:d}.{:d}.{:d}' "
-                               "SDK: '{:d}.{:d}.{:d}')\n",
-                               ver[0], ver[1], ver[2], sdk[0], sdk[1], sdk[2]);
-                }
-                binary.remove(*minver_cmd);
+        // where a self bind points, none if it can't be resolved here
+        auto self_target = [&](const macho::bind_entry &bind) -> std::optional<uint64_t> {
+            if (!is_self_bind_ordinal(bind.ordinal) || bind.type != macho::BIND_TYPE_POINTER ||
+                bind.seg_index >= segments.size() ||
+                bind.seg_offset + ptr_size > segments[bind.seg_index].filesize) {
+                return std::nullopt;
             }
-            if (const auto *buildver_cmd = binary.build_version()) {
-                if (verbose) {
-                    const auto *plat  = to_string(buildver_cmd->platform());
-                    const auto &minos = buildver_cmd->minos();
-                    const auto &sdk   = buildver_cmd->sdk();
-                    fmt::print("[-] Removing old BUILD_VERSION command (platform: '{:s}' version: "
-                               "'{:d}.{:d}.{:d}' SDK: '{:d}.{:d}.{:d}')\n",
-                               plat, minos[0], minos[1], minos[2], sdk[0], sdk[1], sdk[2]);
-                }
-                binary.remove(*buildver_cmd);
+            const auto sym_it = defined_syms.find(bind.symbol);
+            if (sym_it == defined_syms.end()) {
+                return std::nullopt;
+            }
+            uint64_t target = sym_it->second.address;
+            if (img.cputype() == macho::CPU_TYPE_ARM &&
+                (sym_it->second.desc & macho::N_ARM_THUMB_DEF)) {
+                target |= 1;
             }
-            const BuildVersion::version_t new_minos{11, 0, 0};
-            const BuildVersion::version_t new_sdk{new_minos};
-            BuildVersion::PLATFORMS new_plat;
-            if (ios) {
-                new_plat = BuildVersion::PLATFORMS::IOS;
+            return target + bind.addend;
+        };
+        // writes the resolved pointer and rebases it
+        auto rebase_to = [&](const macho::bind_entry &bind, uint64_t target) {
+            const auto &seg = segments[bind.seg_index];
+            auto *ptr       = slice_buf.data() + seg.fileoff + bind.seg_offset;
+            if (ptr_size == 8) {
+                memcpy(ptr, &target, sizeof(target));
             } else {
-                new_plat = BuildVersion::PLATFORMS::MACOS;
+                const uint32_t target32 = target;
+                memcpy(ptr, &target32, sizeof(target32));
             }
+            rebases->emplace_back(
+                macho::rebase_entry{bind.seg_index, bind.seg_offset, macho::REBASE_TYPE_POINTER});
             if (verbose) {
-                fmt::print("[-] Adding new BUILD_VERSION command (platform: '{:s}' version: "
-                           "'{:d}.{:d}.{:d}' SDK: '{:d}.{:d}.{:d}')\n",
-                           to_string(new_plat), new_minos[0], new_minos[1], new_minos[2],
-                           new_sdk[0], new_sdk[1], new_sdk[2]);
+                fmt::print("[-] Rebasing self bind of '{:s}' at {:s}+{:#x}\n", bind.symbol,
+                           seg.name, bind.seg_offset);
             }
-            auto new_buildver_cmd = BuildVersion{new_plat, new_minos, new_sdk, {}};
-            binary.add(new_buildver_cmd);
-        }
+        };
 
-        std::set<std::string> remove_dylib_set;
-        for (const auto &dylib : remove_dylibs) {
-            if (!orig_libraries.contains(dylib)) {
-                fmt::print("[!] Asked to remove dylib '{:s}' but it wasn't found in the imports\n");
-                return false;
+        std::vector<macho::bind_entry> kept_binds;
+        for (const auto &bind : *binds) {
+            cancel.check();
+            if (const auto target = self_target(bind)) {
+                rebase_to(bind, *target);
+                ++rebased;
+            } else {
+                kept_binds.emplace_back(bind);
             }
-            remove_dylib_set.emplace(dylib);
         }
 
-        if (auto_remove_dylibs) {
-            for (const auto &i : orig_libraries) {
-                if (!dylib_exists(i.first)) {
-                    if (verbose) {
-                        fmt::print("[-] Marking unavailable dylib '{:s}' for removal\n", i.first);
-                    }
-                    remove_dylib_set.emplace(i.first);
-                }
+        // the stub helpers hand dyld lazy entries by offset, so the stream can't be re-encoded.
+        // An entry whose binds all resolve is blanked to BIND_OPCODE_DONE in place instead, dyld
+        // skips those when it binds lazy pointers eagerly.
+        std::map<uint32_t, std::vector<std::pair<const macho::bind_entry *, uint64_t>>> entries;
+        std::set<uint32_t> unresolved_entries;
+        for (const auto &bind : *lazy_binds) {
+            cancel.check();
+            if (const auto target = self_target(bind)) {
+                entries[bind.lazy_offset].emplace_back(&bind, *target);
+            } else {
+                unresolved_entries.emplace(bind.lazy_offset);
+                entries.try_emplace(bind.lazy_offset);
             }
         }
-
-        std::set<std::string> remove_sym_set;
-        for (const auto &sym_map : orig_syms_to_libs) {
-            if (remove_dylib_set.contains(sym_map.second)) {
-                if (verbose) {
-                    fmt::print("[-] Marking symbol '{:s}' from dylib '{:s}' for stubbing\n",
-                               sym_map.first, sym_map.second);
-                }
-                remove_sym_set.emplace(sym_map.first);
+        auto lazy_stream = img.bytes(dyld_info->lazy_bind_off, dyld_info->lazy_bind_size);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.empty() || unresolved_entries.contains(it->first)) {
+                continue;
             }
+            for (const auto &[bind, target] : it->second) {
+                rebase_to(*bind, target);
+                ++lazy_resolved;
+            }
+            const auto next = std::next(it);
+            const auto end  = next == entries.end() ? lazy_stream.size() : next->first;
+            std::fill(lazy_stream.begin() + it->first, lazy_stream.begin() + end, 0);
+        }
+        if (!rebased && !lazy_resolved) {
+            return;
         }
 
-        std::set<int32_t> removed_ordinals;
-        for (const auto &dylib : remove_dylib_set) {
-            const auto *dylib_cmd = orig_libraries[dylib];
-            if (verbose) {
-                fmt::print("[-] Removing dependant dylib '{:s}'\n", dylib);
-            }
-            removed_ordinals.emplace(orig_ordinal_map[dylib_cmd->name()]);
-            binary.remove(*dylib_cmd);
+        std::sort(rebases->begin(), rebases->end());
+        rebases->erase(std::unique(rebases->begin(), rebases->end()), rebases->end());
+        new_rebase_opcodes = macho::encode_rebases(*rebases, ptr_size);
+        if (!kept_binds.empty()) {
+            new_bind_opcodes =
+                macho::encode_binds(kept_binds, ptr_size, macho::bind_kind::regular);
         }
+    }
 
-        if (remove_sym_set.size()) {
-            *stub_path = new_dylib_path.parent_path() / fat_stub_filename;
+    const auto old_slice_size = slice_buf.size();
+    if (!replace_dyld_info_stream(slice_buf, &macho::dyld_info_command::bind_off,
+                                  &macho::dyld_info_command::bind_size, new_bind_opcodes) ||
+        !replace_dyld_info_stream(slice_buf, &macho::dyld_info_command::rebase_off,
+                                  &macho::dyld_info_command::rebase_size, new_rebase_opcodes)) {
+        fmt::print("[!] Couldn't rewrite rebase/binding opcodes\n");
+        return;
+    }
+    if (verbose) {
+        fmt::print("[-] Rebased {:d} self binds and {:d} lazy self binds\n", rebased,
+                   lazy_resolved);
+    }
+    stats.size_deltas.file["rebase self binds"] +=
+        (int64_t)slice_buf.size() - (int64_t)old_slice_size;
+    stats.self_binds_rebased += rebased;
+    stats.self_lazy_binds_resolved += lazy_resolved;
+}
+
+// Binds the lazy pointers of symbols --usage-profile says are cheaper to bind at load than on
+// first call. The lazy entries stay where the stub helpers expect them, they just never run.
+static void bind_hot_lazy_symbols(std::vector<uint8_t> &slice_buf, const usage_profile &usage,
+                                  conversion_stats &stats, const cancel_token &cancel,
+                                  const bool verbose) {
+    std::vector<uint8_t> new_opcodes;
+    size_t bound{0};
+    {
+        macho::image img{slice_buf};
+        const auto *dyld_info = img.dyld_info();
+        if (!dyld_info || !dyld_info->lazy_bind_size) {
+            return;
+        }
+        const auto ptr_size = img.pointer_size();
+        auto binds = macho::decode_binds(img.bytes(dyld_info->bind_off, dyld_info->bind_size),
+                                         ptr_size, macho::bind_kind::regular);
+        const auto lazy_binds = macho::decode_binds(
+            img.bytes(dyld_info->lazy_bind_off, dyld_info->lazy_bind_size), ptr_size,
+            macho::bind_kind::lazy);
+        if (binds == std::nullopt || lazy_binds == std::nullopt) {
+            fmt::print("[!] Couldn't decode binding opcodes, leaving lazy binds lazy\n");
+            return;
+        }
+        for (const auto &bind : *lazy_binds) {
+            cancel.check();
+            // self binds have no first call worth saving, weak imports are never called
+            if (bind.ordinal <= 0 || (bind.symbol_flags & macho::BIND_SYMBOL_FLAGS_WEAK_IMPORT) ||
+                !usage.binds_eagerly(bind.symbol)) {
+                continue;
+            }
             if (verbose) {
-                fmt::print("Creating stub library import '{:s}'\n", stub_path->string());
+                fmt::print("[-] Binding '{:s}' at load ({:s})\n", bind.symbol,
+                           usage.evidence(bind.symbol));
             }
-            const auto stub_dylib_cmd =
-                DylibCommand::load_dylib(*stub_path, 2, 0x00010000, 0x00010000);
-            binary.add(stub_dylib_cmd);
+            binds->emplace_back(bind);
+            stats.profile_eager_binds.emplace(bind.symbol, usage.evidence(bind.symbol));
+            ++bound;
+        }
+        if (!bound) {
+            return;
         }
+        new_opcodes = macho::encode_binds(*binds, ptr_size, macho::bind_kind::regular);
+    }
 
-        std::map<std::string, int32_t> new_ordinal_map;
+    const auto old_slice_size = slice_buf.size();
+    if (!replace_dyld_info_stream(slice_buf, &macho::dyld_info_command::bind_off,
+                                  &macho::dyld_info_command::bind_size, new_opcodes)) {
+        fmt::print("[!] Couldn't rewrite binding opcodes\n");
+        return;
+    }
+    if (verbose) {
+        fmt::print("[-] Bound {:d} lazy symbols at load\n", bound);
+    }
+    stats.size_deltas.file["bind hot symbols at load"] +=
+        (int64_t)slice_buf.size() - (int64_t)old_slice_size;
+}
+
+// Analysis results that only depend on the input and the host, shared by every output.
+// Shared by all jobs of a run, which may run concurrently.
+struct conversion_cache {
+    // --index, consulted first and without locking, jobs pin one version for their whole run
+    snapshot<sdk_index> indexes;
+    // what the snapshot didn't cover, learned on demand
+    std::mutex lock;
+    std::map<std::string, bool> dylib_available;
+    std::map<CPU_TYPES, export_index> export_indexes;
+    // --stub-catalog, tbd exports by install name and arch, empty without a tbd
+    std::map<std::pair<std::string, CPU_TYPES>, symbol_dict> tbd_exports;
+    std::mutex catalog_lock;
+};
+
+static bool cached_dylib_exists(const dylibify_options &opts, conversion_cache &cache,
+                                const sdk_index &indexes, const std::string &dylib_path) {
+    // a compiled policy says so with one probe, then the loaded index without a lock
+    const auto policy = opts.policy ? opts.policy->lookup(policy_domain::dylib, dylib_path) : 0;
+    if (policy & (policy_flags::available | policy_flags::unavailable)) {
+        return policy & policy_flags::available;
+    }
+    if (const auto it = indexes.dylib_available.find(dylib_path);
+        it != indexes.dylib_available.end()) {
+        return it->second;
+    }
+    std::lock_guard lk{cache.lock};
+    const auto it = cache.dylib_available.find(dylib_path);
+    if (it != cache.dylib_available.end()) {
+        return it->second;
+    }
+    const auto exists = dylib_exists(dylib_path);
+    cache.dylib_available.emplace(dylib_path, exists);
+    return exists;
+}
+
+static bool policy_removes_dylib(const dylibify_options &opts, const std::string &install_name) {
+    if (!opts.policy || !(opts.policy->lookup(policy_domain::dylib, install_name) &
+                          policy_flags::remove)) {
+        return false;
+    }
+    if (opts.verbose) {
+        fmt::print("[-] Removing dylib '{:s}' by policy\n", install_name);
+    }
+    return true;
+}
+
+// Dependencies --usage-profile saw no run use, unless a symbol bound to them was called anyway.
+static bool profile_removes_dylib(const dylibify_options &opts, const std::string &install_name,
+                                  const std::map<std::string, std::string> &syms_to_libs,
+                                  conversion_stats &stats) {
+    if (!opts.usage || !opts.usage->unused_dylib(install_name)) {
+        return false;
+    }
+    for (const auto &sym_map : syms_to_libs) {
+        if (sym_map.second == install_name && opts.usage->called(sym_map.first)) {
+            return false;
+        }
+    }
+    if (opts.verbose) {
+        fmt::print("[-] Removing dylib '{:s}' unused in {:d} profiled runs\n", install_name,
+                   opts.usage->runs);
+    }
+    stats.profile_removed_dylibs.emplace(install_name,
+                                         fmt::format("used in 0/{:d} runs", opts.usage->runs));
+    return true;
+}
+
+// The symbols of removed dylibs --usage-profile saw never called, taken out of remove_sym_set.
+// Only symbols the image reaches through their stub alone qualify, the profile counts calls
+// through stubs and can't tell whether a pointer to the symbol is used. They are bound through
+// flat lookup as weak imports, which dyld leaves unresolved, so they need no stub.
+static std::set<std::string, std::less<>>
+profile_weak_imports(const dylibify_options &opts,
+                     const std::map<std::string, std::string> &syms_to_libs,
+                     const std::set<std::string> &non_lazy_syms,
+                     std::set<std::string> &remove_sym_set, conversion_stats &stats) {
+    std::set<std::string, std::less<>> weak_imports;
+    if (!opts.usage) {
+        return weak_imports;
+    }
+    for (auto it = remove_sym_set.begin(); it != remove_sym_set.end();) {
+        const auto lib_it = syms_to_libs.find(*it);
+        if (lib_it == syms_to_libs.end() || !opts.usage->covers_dylib(lib_it->second) ||
+            opts.usage->called(*it) || non_lazy_syms.contains(*it)) {
+            ++it;
+            continue;
+        }
+        if (opts.verbose) {
+            fmt::print("[-] Weak importing symbol '{:s}' instead of stubbing it ({:s})\n", *it,
+                       opts.usage->evidence(*it));
+        }
+        stats.profile_weak_imports.emplace(*it, opts.usage->evidence(*it));
+        weak_imports.emplace(*it);
+        it = remove_sym_set.erase(it);
+    }
+    return weak_imports;
+}
+
+// The current snapshot with everything learned since on top, for --write-index.
+static sdk_index learned_index(conversion_cache &cache) {
+    auto index = *cache.indexes.load();
+    std::lock_guard lk{cache.lock};
+    for (const auto &avail : cache.dylib_available) {
+        index.dylib_available.insert(avail);
+    }
+    for (const auto &[cpu_type, exp_index] : cache.export_indexes) {
+        auto &merged = index.export_indexes[(uint32_t)cpu_type];
+        merged.insert(exp_index.begin(), exp_index.end());
+    }
+    return index;
+}
+
+static fs::path variant_id_dylib_path(const output_variant &variant) {
+    if (variant.dylib_path != std::nullopt) {
+        return *variant.dylib_path;
+    }
+    return fs::path{"@executable_path"} / fs::path{variant.out_path}.filename();
+}
+
+static uint32_t encode_version(const BuildVersion::version_t &version) {
+    return (version[0] << 16) | (version[1] << 8) | version[2];
+}
+
+struct converted_image {
+    std::vector<uint8_t> bytes;
+    std::optional<fs::path> fat_stub_path;
+    // --stub-catalog stubs the image links against, copied next to every output
+    std::vector<fs::path> catalog_stub_paths;
+};
+
+// The stub dylib of a conversion is named after its first output, so jobs and variant groups
+// writing to the same directory or pack don't replace each other's stubs.
+static fs::path stub_filename(const output_variant &variant) {
+    return fs::path{variant.out_path}.stem().string() + "-stubs.dylib";
+}
+
+// The iOS SDK xcrun knows about, looked up once. None if there's no Xcode to ask.
+static const std::optional<fs::path> &xcrun_ios_sdk() {
+    static const auto sdk = []() -> std::optional<fs::path> {
+        try {
+            const auto out = subprocess::check_output({"xcrun", "--sdk", "iphoneos",
+                                                       "--show-sdk-path"});
+            std::string path{out.buf.data(), out.length};
+            while (!path.empty() && std::isspace((unsigned char)path.back())) {
+                path.pop_back();
+            }
+            if (!path.empty()) {
+                return path;
+            }
+        } catch (const std::exception &e) {
+            fmt::print("[!] Couldn't find the iOS SDK with xcrun: '{:s}'\n", e.what());
+        }
+        return std::nullopt;
+    }();
+    return sdk;
+}
+
+// The target of a variant's stubs. iOS stubs are built against --sdk-root if one was given and
+// the iOS SDK otherwise, the host's macOS SDK can't link them. No OS if the variant keeps the
+// input's platform.
+static stub_target variant_stub_target(const dylibify_options &opts,
+                                       const output_variant &variant) {
+    if (variant.platform == std::nullopt) {
+        return {};
+    }
+    stub_target target;
+    target.os = fmt::format("{:s}{:d}.{:d}.{:d}",
+                            variant.platform == BuildVersion::PLATFORMS::IOS ? "ios" : "macos",
+                            variant.minos[0], variant.minos[1], variant.minos[2]);
+    if (variant.platform == BuildVersion::PLATFORMS::IOS) {
+        target.sysroot = opts.sdk_root != "/" ? std::optional{opts.sdk_root} : xcrun_ios_sdk();
+    }
+    return target;
+}
+
+// Builds one thin stub dylib per slice that lost imports and joins them into the fat stub.
+static bool build_stub_dylibs(
+    const std::vector<std::pair<CPU_TYPES, std::set<std::string>>> &stub_builds,
+    const fs::path &fat_stub_filename, const fs::path &stub_dir, const fs::path &stub_path,
+    const stub_target &target, cancel_token &cancel, const bool verbose) {
+    cancel.checkpoint("build stubs");
+    std::vector<fs::path> thin_stubs;
+    for (const auto &stub_build : stub_builds) {
+        const auto cpu_type = stub_build.first;
+        if (verbose) {
+            fmt::print("[-] Codegening and building stub dylib for arch {:s} '{:s}'\n",
+                       to_string(cpu_type), stub_path.string());
+        }
+        const auto thin_stub_path =
+            create_thin_stub_dylib(fat_stub_filename, stub_dir, stub_path,
+                                   create_stub_objc(stub_build.second),
+                                   {"-framework", "Foundation"}, cpu_type, target, cancel);
+        if (thin_stub_path == std::nullopt) {
+            fmt::print("[!] Error generating stub dylib for arch {:s}!\n", to_string(cpu_type));
+            return false;
+        } else {
+            thin_stubs.emplace_back(*thin_stub_path);
+        }
+    }
+
+    if (verbose) {
+        fmt::print("[-] Generating fat stub dylib at '{:s}'\n", fat_stub_filename.string());
+    }
+    if (!create_fat_stub_dylib(fat_stub_filename, stub_dir, thin_stubs, cancel)) {
+        fmt::print("[!] Error generating fat stub dylib!\n");
+        return false;
+    }
+    return true;
+}
+
+// Stubs every export of a catalogued dylib. Symbols are bound by name with asm labels and
+// classes are root classes, so nothing clashes with the framework's own headers and the stub
+// doesn't need Foundation, which may well be the dylib being stubbed.
+static std::string create_catalog_stub_objc(const symbol_dict &exports) {
+    std::string objc = R"objc(
+#undef NDEBUG
+#include <assert.h>
+)objc";
+
+    const auto objc_class_prefix     = "_OBJC_CLASS_$_"s;
+    const auto objc_metaclass_prefix = "_OBJC_METACLASS_$_"s;
+    size_t idx{0};
+    for (const auto &sym : exports) {
+        // the class's @implementation defines its metaclass
+        if (sym.starts_with(objc_metaclass_prefix) &&
+            exports.contains(objc_class_prefix + sym.substr(objc_metaclass_prefix.size()))) {
+            continue;
+        }
+        if (sym.starts_with(objc_class_prefix)) {
+            const auto objc_class_name = sym.substr(objc_class_prefix.size());
+            objc += fmt::format(R"objc(
+__attribute__((objc_root_class))
+@interface {:s}
+@end
+@implementation {:s}
+@end
+)objc",
+                                objc_class_name, objc_class_name);
+        } else {
+            objc += fmt::format(R"objc(
+void dylibify_catalog_{:d}(void) __asm__("{:s}");
+void dylibify_catalog_{:d}(void) {{
+    assert(!"unimplemented symbol '{:s}'");
+}}
+)objc",
+                                idx, sym, idx, sym);
+            ++idx;
+        }
+    }
+
+    return objc;
+}
+
+static bool is_objc_identifier(const std::string &name) {
+    if (name.empty() || std::isdigit((unsigned char)name.front())) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(),
+                       [](char c) { return std::isalnum((unsigned char)c) || c == '_'; });
+}
+
+// What a catalog stub for install_name can define for one arch, empty if the SDK has no tbd.
+static const symbol_dict &catalog_exports(const dylibify_options &opts,
+                                          conversion_cache &cache,
+                                          const std::string &install_name,
+                                          const CPU_TYPES cpu_type) {
+    std::lock_guard lk{cache.lock};
+    const auto key = std::make_pair(install_name, cpu_type);
+    if (const auto it = cache.tbd_exports.find(key); it != cache.tbd_exports.end()) {
+        return it->second;
+    }
+    auto &exports  = cache.tbd_exports[key];
+    const auto tbd = find_tbd(opts.sdk_root, install_name);
+    if (tbd == std::nullopt) {
+        return exports;
+    }
+    const auto tbd_exports = read_tbd_exports(*tbd, arch_map.at(cpu_type));
+    if (tbd_exports == std::nullopt) {
+        fmt::print("[!] Couldn't read '{:s}', not cataloguing '{:s}'\n", tbd->string(),
+                   install_name);
+        return exports;
+    }
+    const auto objc_class_prefix = "_OBJC_CLASS_$_"s;
+    std::vector<std::string> usable;
+    for (const auto &sym : *tbd_exports) {
+        if (sym.find_first_of("\"\\\n") != std::string::npos ||
+            (sym.starts_with(objc_class_prefix) &&
+             !is_objc_identifier(sym.substr(objc_class_prefix.size())))) {
+            continue;
+        }
+        usable.emplace_back(sym);
+    }
+    exports = symbol_dict{std::move(usable)};
+    if (opts.verbose) {
+        fmt::print("[-] Catalogued {:d} exports of '{:s}' from '{:s}'\n", exports.size(),
+                   install_name, tbd->string());
+    }
+    return exports;
+}
+
+// The stem alone isn't unique, the same name can be a public and a private framework or a dylib
+// in several directories.
+static fs::path catalog_stub_filename(const std::string &install_name) {
+    const auto dir_id = (uint32_t)path_hash(fs::path{install_name}.parent_path().string());
+    return fmt::format("dylibify-catalog-{:s}-{:08x}.dylib",
+                       fs::path{install_name}.stem().string(), dir_id);
+}
+
+// Catalog stubs are shared by every input built against the same SDK for the same target OS and
+// archs.
+static fs::path catalog_stub_dir(const dylibify_options &opts, const std::vector<uint8_t> &in_bytes,
+                                 const stub_target &target) {
+    std::vector<std::string> archs;
+    for (const auto &slice : macho::slices(in_bytes)) {
+        archs.emplace_back(arch_map.at((CPU_TYPES)slice.cputype));
+    }
+    const auto sdk_id = path_hash(fs::absolute(opts.sdk_root).lexically_normal().string());
+    return *opts.stub_catalog / fmt::format("{:016x}", sdk_id) / target.os.value_or("host") /
+           fmt::format("{}", fmt::join(archs, "-"));
+}
+
+// Sends the symbols of removed dylibs that the dylib's catalog stub exports there instead of to
+// the per-binary stub. Returns the catalog stub install name of every removed dylib that has
+// one, the symbols it covers move from remove_sym_set to redirected_syms.
+static std::map<std::string, std::string>
+route_to_catalog(const dylibify_options &opts, conversion_cache &cache, const fs::path &load_dir,
+                 const std::set<std::string> &remove_dylib_set,
+                 const std::map<std::string, std::string> &orig_syms_to_libs,
+                 const CPU_TYPES cpu_type, std::set<std::string> &remove_sym_set,
+                 std::map<std::string, std::string, std::less<>> &redirected_syms) {
+    std::map<std::string, std::string> catalog_libs;
+    if (opts.stub_catalog == std::nullopt) {
+        return catalog_libs;
+    }
+    for (const auto &dylib : remove_dylib_set) {
+        const auto &exports = catalog_exports(opts, cache, dylib, cpu_type);
+        if (exports.empty()) {
+            continue;
+        }
+        const auto catalog_name = (load_dir / catalog_stub_filename(dylib)).string();
+        catalog_libs.emplace(dylib, catalog_name);
+        for (const auto &sym_map : orig_syms_to_libs) {
+            if (sym_map.second != dylib || !exports.contains(sym_map.first)) {
+                continue;
+            }
+            if (opts.verbose) {
+                fmt::print("[-] Binding symbol '{:s}' to catalog stub '{:s}'\n", sym_map.first,
+                           catalog_name);
+            }
+            redirected_syms.emplace(sym_map.first, catalog_name);
+            remove_sym_set.erase(sym_map.first);
+        }
+    }
+    return catalog_libs;
+}
+
+// Builds the catalog stubs of install_names that aren't in the catalog yet. Builds go through a
+// private directory and are renamed into place, so concurrent runs sharing a catalog never see a
+// partial stub.
+static std::optional<std::vector<fs::path>>
+ensure_catalog_stubs(const dylibify_options &opts, conversion_cache &cache,
+                     const std::vector<uint8_t> &in_bytes,
+                     const std::set<std::string> &install_names, const stub_target &target,
+                     cancel_token &cancel) {
+    cancel.checkpoint("build catalog stubs");
+    const auto dir = catalog_stub_dir(opts, in_bytes, target);
+    // no phase boundaries in here so a parked job never holds the lock
+    std::lock_guard catalog_guard{cache.catalog_lock};
+    std::vector<fs::path> stub_paths;
+    for (const auto &install_name : install_names) {
+        const auto filename = catalog_stub_filename(install_name);
+        stub_paths.emplace_back(dir / filename);
+        if (fs::exists(stub_paths.back())) {
+            continue;
+        }
+        if (opts.verbose) {
+            fmt::print("[-] Building catalog stub for '{:s}' at '{:s}'\n", install_name,
+                       stub_paths.back().string());
+        }
+        const auto build_dir = dir / fmt::format(".build-{:d}", getpid());
+        fs::remove_all(build_dir);
+        fs::create_directories(build_dir);
+        std::vector<fs::path> thin_stubs;
+        for (const auto &slice : macho::slices(in_bytes)) {
+            const auto cpu_type = (CPU_TYPES)slice.cputype;
+            const auto thin_stub_path = create_thin_stub_dylib(
+                filename, build_dir, "@rpath" / filename,
+                create_catalog_stub_objc(catalog_exports(opts, cache, install_name, cpu_type)),
+                {"-lobjc"}, cpu_type, target, cancel);
+            if (thin_stub_path == std::nullopt) {
+                fmt::print("[!] Error building catalog stub for '{:s}' for arch {:s}!\n",
+                           install_name, to_string(cpu_type));
+                return std::nullopt;
+            }
+            thin_stubs.emplace_back(*thin_stub_path);
+        }
+        if (!create_fat_stub_dylib(filename, build_dir, thin_stubs, cancel)) {
+            fmt::print("[!] Error generating fat catalog stub for '{:s}'!\n", install_name);
+            return std::nullopt;
+        }
+        fs::rename(build_dir / filename, stub_paths.back());
+        fs::remove_all(build_dir);
+    }
+    return stub_paths;
+}
+
+// The passes that work on the built image's raw opcode streams.
+static void post_process_binds(std::vector<uint8_t> &raw, const dylibify_options &opts,
+                               const std::vector<weak_def_set> &uncoalesced_weak_defs,
+                               conversion_stats &stats, const cancel_token &cancel) {
+    if (!opts.uncoalesce_weak_defs && !opts.rebase_self_binds && !opts.usage) {
+        return;
+    }
+    const auto layout = macho::slices(raw);
+    auto slice_bufs   = macho::split_fat(raw);
+    // slices are independent once split out
+    std::vector<conversion_stats> slice_stats(slice_bufs.size());
+    parallel_for(slice_bufs.size(), [&](size_t i) {
+        if (opts.uncoalesce_weak_defs) {
+            strip_weak_binds(slice_bufs[i], uncoalesced_weak_defs.at(i), slice_stats[i],
+                             opts.verbose);
+        }
+        if (opts.rebase_self_binds) {
+            if (opts.verbose) {
+                fmt::print("[-] Rebasing binds to the image's own symbols\n");
+            }
+            rebase_self_binds(slice_bufs[i], slice_stats[i], cancel, opts.verbose);
+        }
+        if (opts.usage) {
+            bind_hot_lazy_symbols(slice_bufs[i], *opts.usage, slice_stats[i], cancel,
+                                  opts.verbose);
+        }
+    });
+    for (const auto &slice : slice_stats) {
+        merge_stats(stats, slice);
+    }
+    raw = macho::join_fat(slice_bufs, layout, macho::is_fat(raw));
+}
+
+static std::optional<converted_image> convert_lief(const std::vector<uint8_t> &in_bytes,
+                                                   const dylibify_options &opts,
+                                                   const output_variant &variant,
+                                                   const fs::path &new_dylib_path,
+                                                   output_sink &sink, conversion_cache &cache,
+                                                   const sdk_index &indexes,
+                                                   conversion_stats &stats,
+                                                   cancel_token &cancel) {
+    cancel.checkpoint("parse");
+    auto binaries = Parser::parse(in_bytes, opts.in_path);
+
+    const auto fat_stub_filename = stub_filename(variant);
+    const auto stub_dir = sink.stub_dir(variant.out_path);
+    std::optional<fs::path> stub_path;
+    std::vector<std::pair<CPU_TYPES, std::set<std::string>>> stub_builds;
+    const kept_weak_defs keep_weak_defs{{opts.keep_weak_defs.begin(), opts.keep_weak_defs.end()},
+                                        opts.policy};
+    std::vector<weak_def_set> uncoalesced_weak_defs;
+    std::set<std::string> catalog_install_names;
+    // everything edited here is a load command, only the code signature also takes file bytes
+    auto &size_deltas = stats.size_deltas.load_commands;
+
+    for (auto &binary : *binaries) {
+        cancel.checkpoint("edit load commands");
+        std::map<std::string, const DylibCommand *> orig_libraries;
+        for (const auto &dylib_cmd : binary.libraries()) {
+            if (dylib_cmd.command() == LOAD_COMMAND_TYPES::LC_ID_DYLIB) {
+                continue;
+            }
+            orig_libraries.emplace(std::make_pair(dylib_cmd.name(), &dylib_cmd));
+        }
+
+        std::map<std::string, int32_t> orig_ordinal_map;
+        int32_t orig_ordinal_idx{1};
+        for (const auto &dylib_cmd : binary.libraries()) {
+            if (dylib_cmd.command() == LOAD_COMMAND_TYPES::LC_ID_DYLIB) {
+                continue;
+            }
+            orig_ordinal_map.emplace(std::make_pair(dylib_cmd.name(), orig_ordinal_idx));
+            ++orig_ordinal_idx;
+        }
+
+        std::map<std::string, std::string> orig_syms_to_libs;
+        for (auto &sym : binary.symbols()) {
+            if (!sym.has_binding_info() || !sym.binding_info()->has_library()) {
+                continue;
+            }
+            orig_syms_to_libs.emplace(sym.name(), sym.binding_info()->library()->name());
+        }
+
+        auto &hdr = binary.header();
+        assert(hdr.file_type() == FILE_TYPES::MH_EXECUTE);
+        if (opts.verbose) {
+            fmt::print("[-] Changing Mach-O type from executable to dylib\n");
+        }
+        hdr.file_type(FILE_TYPES::MH_DYLIB);
+        if (opts.verbose) {
+            fmt::print("[-] Adding NO_REXPORTED_LIBS flag\n");
+        }
+        hdr.flags(hdr.flags() | (uint32_t)HEADER_FLAGS::MH_NO_REEXPORTED_DYLIBS);
+
+        if (const auto *sig_cmd = binary.code_signature()) {
+            if (opts.verbose) {
+                fmt::print("[-] Removing code signature\n");
+            }
+            size_deltas["remove code signature"] -= sig_cmd->size();
+            stats.size_deltas.file["remove code signature"] -= sig_cmd->data_size();
+            assert(binary.remove_signature());
+        }
+
+        if (const auto *pgz_seg = binary.get_segment("__PAGEZERO")) {
+            if (opts.verbose) {
+                fmt::print("[-] Removing __PAGEZERO segment\n");
+            }
+            size_deltas["remove __PAGEZERO"] -= pgz_seg->size();
+            binary.remove(*pgz_seg);
+        }
+
+        if (opts.verbose) {
+            fmt::print("[-] Setting ID_DYLIB path to: '{:s}'\n", new_dylib_path.string());
+        }
+        const auto id_dylib_cmd = DylibCommand::id_dylib(new_dylib_path, 2, 0x00010000, 0x00010000);
+        size_deltas["add ID_DYLIB"] += id_dylib_cmd.size();
+        binary.add(id_dylib_cmd);
+
+        if (opts.remove_info_plist) {
+            if (binary.get_section("__TEXT", "__info_plist")) {
+                if (opts.verbose) {
+                    fmt::print("[-] Removing __TEXT,__info_plist\n");
+                }
+                // the contents are zeroed where they are, only the section header goes
+                size_deltas["remove __info_plist"] -=
+                    (uint32_t)hdr.cpu_type() & macho::CPU_ARCH_ABI64 ? sizeof(macho::section_64)
+                                                                     : sizeof(macho::section);
+                binary.remove_section("__TEXT", "__info_plist", true);
+            }
+        }
+
+        if (const auto *dylinker_cmd = binary.dylinker()) {
+            if (opts.verbose) {
+                fmt::print("[-] Removing dynlinker command\n");
+            }
+            size_deltas["remove dyld-only commands"] -= dylinker_cmd->size();
+            binary.remove(*dylinker_cmd);
+        }
+
+        if (const auto *main_cmd = binary.main_command()) {
+            if (opts.verbose) {
+                fmt::print("[-] Removing MAIN command\n");
+            }
+            size_deltas["remove dyld-only commands"] -= main_cmd->size();
+            binary.remove(*main_cmd);
+        }
+
+        if (const auto *src_cmd = binary.source_version()) {
+            if (opts.verbose) {
+                fmt::print("[-] Remvoing source version command\n");
+            }
+            size_deltas["remove dyld-only commands"] -= src_cmd->size();
+            binary.remove(*src_cmd);
+        }
+
+        if (variant.platform != std::nullopt) {
+            if (const auto *minver_cmd = binary.version_min()) {
+                if (opts.verbose) {
+                    const auto &ver = minver_cmd->version();
+                    const auto &sdk = minver_cmd->sdk();
+                    fmt::print("[-] Removing old VERSION_MIN command (version: '{:d}.{:d}.{:d}' "
+                               "SDK: '{:d}.{:d}.{:d}')\n",
+                               ver[0], ver[1], ver[2], sdk[0], sdk[1], sdk[2]);
+                }
+                size_deltas["replace platform version"] -= minver_cmd->size();
+                binary.remove(*minver_cmd);
+            }
+            if (const auto *buildver_cmd = binary.build_version()) {
+                if (opts.verbose) {
+                    const auto *plat  = to_string(buildver_cmd->platform());
+                    const auto &minos = buildver_cmd->minos();
+                    const auto &sdk   = buildver_cmd->sdk();
+                    fmt::print("[-] Removing old BUILD_VERSION command (platform: '{:s}' version: "
+                               "'{:d}.{:d}.{:d}' SDK: '{:d}.{:d}.{:d}')\n",
+                               plat, minos[0], minos[1], minos[2], sdk[0], sdk[1], sdk[2]);
+                }
+                size_deltas["replace platform version"] -= buildver_cmd->size();
+                binary.remove(*buildver_cmd);
+            }
+            const auto &new_minos = variant.minos;
+            const auto &new_sdk   = variant.sdk;
+            const auto new_plat   = *variant.platform;
+            if (opts.verbose) {
+                fmt::print("[-] Adding new BUILD_VERSION command (platform: '{:s}' version: "
+                           "'{:d}.{:d}.{:d}' SDK: '{:d}.{:d}.{:d}')\n",
+                           to_string(new_plat), new_minos[0], new_minos[1], new_minos[2],
+                           new_sdk[0], new_sdk[1], new_sdk[2]);
+            }
+            auto new_buildver_cmd = BuildVersion{new_plat, new_minos, new_sdk, {}};
+            size_deltas["replace platform version"] += new_buildver_cmd.size();
+            binary.add(new_buildver_cmd);
+        }
+
+        std::set<std::string> remove_dylib_set;
+        for (const auto &dylib : variant.remove_dylibs) {
+            if (!orig_libraries.contains(dylib)) {
+                fmt::print("[!] Asked to remove dylib '{:s}' but it wasn't found in the imports\n",
+                           dylib);
+                return std::nullopt;
+            }
+            remove_dylib_set.emplace(dylib);
+        }
+        for (const auto &i : orig_libraries) {
+            if (policy_removes_dylib(opts, i.first) ||
+                profile_removes_dylib(opts, i.first, orig_syms_to_libs, stats)) {
+                remove_dylib_set.emplace(i.first);
+            }
+        }
+
+        if (opts.auto_remove_dylibs) {
+            for (const auto &i : orig_libraries) {
+                if (!cached_dylib_exists(opts, cache, indexes, i.first)) {
+                    if (opts.verbose) {
+                        fmt::print("[-] Marking unavailable dylib '{:s}' for removal\n", i.first);
+                    }
+                    remove_dylib_set.emplace(i.first);
+                }
+            }
+        }
+
+        std::set<std::string> remove_sym_set;
+        for (const auto &sym_map : orig_syms_to_libs) {
+            if (remove_dylib_set.contains(sym_map.second)) {
+                if (opts.verbose) {
+                    fmt::print("[-] Marking symbol '{:s}' from dylib '{:s}' for stubbing\n",
+                               sym_map.first, sym_map.second);
+                }
+                remove_sym_set.emplace(sym_map.first);
+            }
+        }
+
+        std::map<std::string, std::string, std::less<>> redirected_syms;
+        const auto catalog_libs =
+            route_to_catalog(opts, cache, new_dylib_path.parent_path(), remove_dylib_set,
+                             orig_syms_to_libs, binary.header().cpu_type(), remove_sym_set,
+                             redirected_syms);
+        std::set<std::string> non_lazy_syms;
+        for (const auto &binding_info : binary.dyld_info()->bindings()) {
+            if (binding_info.binding_class() != BINDING_CLASS::BIND_CLASS_LAZY &&
+                binding_info.has_symbol()) {
+                non_lazy_syms.emplace(binding_info.symbol()->name());
+            }
+        }
+        const auto weak_imports =
+            profile_weak_imports(opts, orig_syms_to_libs, non_lazy_syms, remove_sym_set, stats);
+
+        std::set<int32_t> removed_ordinals;
+        for (const auto &dylib : remove_dylib_set) {
+            const auto *dylib_cmd = orig_libraries[dylib];
+            if (opts.verbose) {
+                fmt::print("[-] Removing dependant dylib '{:s}'\n", dylib);
+            }
+            removed_ordinals.emplace(orig_ordinal_map[dylib_cmd->name()]);
+            size_deltas["remove dependent dylibs"] -= dylib_cmd->size();
+            binary.remove(*dylib_cmd);
+        }
+
+        if (remove_sym_set.size()) {
+            stub_path = new_dylib_path.parent_path() / fat_stub_filename;
+            if (opts.verbose) {
+                fmt::print("Creating stub library import '{:s}'\n", stub_path->string());
+            }
+            const auto stub_dylib_cmd =
+                DylibCommand::load_dylib(*stub_path, 2, 0x00010000, 0x00010000);
+            size_deltas["add stub dylib"] += stub_dylib_cmd.size();
+            binary.add(stub_dylib_cmd);
+        }
+
+        std::set<std::string> added_catalog_stubs;
+        for (const auto &catalog_lib : catalog_libs) {
+            catalog_install_names.emplace(catalog_lib.first);
+            if (!added_catalog_stubs.emplace(catalog_lib.second).second) {
+                continue;
+            }
+            const auto catalog_dylib_cmd =
+                DylibCommand::load_dylib(catalog_lib.second, 2, 0x00010000, 0x00010000);
+            size_deltas["add catalog stubs"] += catalog_dylib_cmd.size();
+            binary.add(catalog_dylib_cmd);
+        }
+
+        if (opts.flatten_reexports) {
+            const auto cpu_type = binary.header().cpu_type();
+            // a snapshot covering the arch is authoritative and read without the lock
+            const auto *snap_index = indexes.exports_for((uint32_t)cpu_type);
+            std::unique_lock lk{cache.lock, std::defer_lock};
+            if (!snap_index) {
+                lk.lock();
+            }
+            const auto &exp_index = snap_index ? *snap_index : cache.export_indexes[cpu_type];
+            // implementations to load in the order they come up, weakly if every umbrella
+            // leading to them was weak
+            std::vector<std::pair<std::string, bool>> added_dylibs;
+            for (const auto &sym_map : orig_syms_to_libs) {
+                if (remove_dylib_set.contains(sym_map.second)) {
+                    continue;
+                }
+                if (!snap_index) {
+                    index_dylib_exports(cache.export_indexes[cpu_type], opts.sdk_root,
+                                        sym_map.second, cpu_type, opts.verbose);
+                }
+                std::set<std::string> visited;
+                const auto impl =
+                    find_implementing_dylib(exp_index, sym_map.second, sym_map.first, visited);
+                if (impl == std::nullopt || *impl == sym_map.second ||
+                    remove_dylib_set.contains(*impl)) {
+                    continue;
+                }
+                if (!orig_libraries.contains(*impl)) {
+                    const bool weak = orig_libraries.at(sym_map.second)->command() ==
+                                      LOAD_COMMAND_TYPES::LC_LOAD_WEAK_DYLIB;
+                    const auto added_it =
+                        std::find_if(added_dylibs.begin(), added_dylibs.end(),
+                                     [&](const auto &added) { return added.first == *impl; });
+                    if (added_it == added_dylibs.end()) {
+                        added_dylibs.emplace_back(*impl, weak);
+                    } else {
+                        added_it->second = added_it->second && weak;
+                    }
+                }
+                if (opts.verbose) {
+                    fmt::print("[-] Flattening symbol '{:s}' from '{:s}' to '{:s}'\n",
+                               sym_map.first, sym_map.second, *impl);
+                }
+                redirected_syms.emplace(sym_map.first, *impl);
+            }
+            for (const auto &[impl, weak] : added_dylibs) {
+                const auto &impl_exports = exp_index.at(impl);
+                if (opts.verbose) {
+                    fmt::print("[-] Adding {:s}direct dependency on re-exported dylib '{:s}'\n",
+                               weak ? "weak " : "", impl);
+                }
+                const auto impl_dylib_cmd =
+                    weak ? DylibCommand::weak_lib(impl, 2, impl_exports.current_version,
+                                                  impl_exports.compat_version)
+                         : DylibCommand::load_dylib(impl, 2, impl_exports.current_version,
+                                                    impl_exports.compat_version);
+                size_deltas["flatten re-exports"] += impl_dylib_cmd.size();
+                binary.add(impl_dylib_cmd);
+            }
+        }
+
+        std::map<std::string, int32_t> new_ordinal_map;
         int32_t new_ordinal_idx{1};
         for (const auto &dylib_cmd : binary.libraries()) {
             if (dylib_cmd.command() == LOAD_COMMAND_TYPES::LC_ID_DYLIB) {
                 continue;
             }
-            new_ordinal_map.emplace(std::make_pair(dylib_cmd.name(), new_ordinal_idx));
-            ++new_ordinal_idx;
+            new_ordinal_map.emplace(std::make_pair(dylib_cmd.name(), new_ordinal_idx));
+            ++new_ordinal_idx;
+        }
+
+        std::map<int32_t, int32_t> orig_to_new_ordinal_map;
+        for (const auto &old_it : orig_ordinal_map) {
+            const auto &orig_lib = old_it.first;
+            const auto orig_ord  = old_it.second;
+            if (new_ordinal_map.contains(orig_lib)) {
+                orig_to_new_ordinal_map.emplace(
+                    std::make_pair(orig_ord, new_ordinal_map[orig_lib]));
+            } else {
+                assert(remove_dylib_set.contains(orig_lib));
+                const auto catalog_it = catalog_libs.find(orig_lib);
+                // with every symbol weak imported the slice has no stub to bind to
+                int32_t new_ord{macho::BIND_SPECIAL_DYLIB_FLAT_LOOKUP};
+                if (catalog_it != catalog_libs.end()) {
+                    new_ord = new_ordinal_map[catalog_it->second];
+                } else if (stub_path && new_ordinal_map.contains(stub_path->string())) {
+                    new_ord = new_ordinal_map[stub_path->string()];
+                }
+                orig_to_new_ordinal_map.emplace(std::make_pair(orig_ord, new_ord));
+            }
+        }
+
+        cancel.checkpoint("rewrite bindings");
+        if (opts.verbose) {
+            fmt::print("[-] Updating library ordinals in binding info\n");
+        }
+        for (auto &binding_info : binary.dyld_info()->bindings()) {
+            cancel.check();
+            if (binding_info.has_symbol()) {
+                if (weak_imports.contains(binding_info.symbol()->name())) {
+                    binding_info.library_ordinal(macho::BIND_SPECIAL_DYLIB_FLAT_LOOKUP);
+                    binding_info.set_weak_import();
+                    continue;
+                }
+                const auto flat_it = redirected_syms.find(binding_info.symbol()->name());
+                if (flat_it != redirected_syms.end()) {
+                    binding_info.library_ordinal(new_ordinal_map.at(flat_it->second));
+                    continue;
+                }
+            }
+            binding_info.library_ordinal(
+                orig_to_new_ordinal_map.at(binding_info.library_ordinal()));
+        }
+
+        if (opts.verbose) {
+            fmt::print("[-] Updating library ordinals in symtab\n");
+        }
+        for (auto &sym : binary.symbols()) {
+            cancel.check();
+            if (sym.origin() != SYMBOL_ORIGINS::SYM_ORIGIN_LC_SYMTAB) {
+                continue;
+            }
+            const auto orig_ord = get_library_ordinal(sym.description());
+            if (orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::SELF_LIBRARY_ORDINAL ||
+                orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::DYNAMIC_LOOKUP_ORDINAL ||
+                orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::EXECUTABLE_ORDINAL) {
+                continue;
+            }
+            const auto flat_it = redirected_syms.find(sym.name());
+            const auto new_ord = flat_it != redirected_syms.end()
+                                     ? new_ordinal_map.at(flat_it->second)
+                                     : orig_to_new_ordinal_map.at(orig_ord);
+            auto new_desc      = sym.description();
+            set_library_ordinal(new_desc, new_ord);
+            if (weak_imports.contains(sym.name())) {
+                set_library_ordinal(new_desc,
+                                    (uint8_t)SYMBOL_DESCRIPTIONS::DYNAMIC_LOOKUP_ORDINAL);
+                new_desc |= macho::N_WEAK_REF;
+            }
+            sym.description(new_desc);
+        }
+
+        if (opts.uncoalesce_weak_defs && has_chained_fixups(binary)) {
+            // the weak binds and export flags live in the chained fixups, nothing edits those
+            fmt::print("[!] --uncoalesce-weak-defs can't edit chained fixups, leaving the weak "
+                       "definitions of {:s} alone\n",
+                       macho::arch_name((uint32_t)binary.header().cpu_type()));
+            uncoalesced_weak_defs.emplace_back();
+        } else if (opts.uncoalesce_weak_defs) {
+            cancel.checkpoint("uncoalesce weak defs");
+            if (opts.verbose) {
+                fmt::print("[-] Removing weak definitions that don't need coalescing\n");
+            }
+            uncoalesced_weak_defs.emplace_back(
+                uncoalesce_weak_defs(binary, keep_weak_defs, stats, cancel, opts.verbose));
+        }
+
+        if (remove_sym_set.size()) {
+            stub_builds.emplace_back(binary.header().cpu_type(), std::move(remove_sym_set));
+        }
+    }
+
+    if (stub_builds.size() &&
+        !build_stub_dylibs(stub_builds, fat_stub_filename, stub_dir, *stub_path,
+                           variant_stub_target(opts, variant), cancel, opts.verbose)) {
+        return std::nullopt;
+    }
+    std::vector<fs::path> catalog_stub_paths;
+    if (catalog_install_names.size()) {
+        auto paths = ensure_catalog_stubs(opts, cache, in_bytes, catalog_install_names,
+                                          variant_stub_target(opts, variant), cancel);
+        if (paths == std::nullopt) {
+            return std::nullopt;
+        }
+        catalog_stub_paths = std::move(*paths);
+    }
+
+    cancel.checkpoint("build");
+    auto raw = binaries->raw();
+    binaries.reset();
+    cancel.checkpoint("post-process binds");
+    post_process_binds(raw, opts, uncoalesced_weak_defs, stats, cancel);
+    converted_image res{std::move(raw), std::nullopt, std::move(catalog_stub_paths)};
+    if (stub_builds.size()) {
+        res.fat_stub_path = stub_dir / fat_stub_filename;
+    }
+    return res;
+}
+
+// Which parts of a slice's model the native passes read and write, for scheduling them.
+namespace model_part {
+constexpr uint32_t header   = 1 << 0;
+constexpr uint32_t commands = 1 << 1;
+constexpr uint32_t fixups   = 1 << 2;
+constexpr uint32_t symbols  = 1 << 3;
+constexpr uint32_t exports  = 1 << 4;
+// section contents
+constexpr uint32_t contents = 1 << 5;
+// the conversion_stats the passes add to
+constexpr uint32_t stats = 1 << 6;
+} // namespace model_part
+
+// What happens to the dylibs a slice imports and to their symbols, decided on the input.
+struct removal_plan {
+    // false after a user error, which was already printed
+    bool ok{true};
+    std::set<std::string> dylibs;
+    // the symbols the per-binary stub defines
+    std::set<std::string> stub_syms;
+    std::set<std::string, std::less<>> weak_imports;
+    // removed dylib -> its catalog stub
+    std::map<std::string, std::string> catalog_libs;
+    std::map<std::string, std::string, std::less<>> redirected_syms;
+    // --usage-profile decisions, counted by the pass that removes the dylibs
+    conversion_stats decisions;
+};
+
+// --flatten-reexports, symbols bound to the dylib that actually implements them.
+struct reexport_plan {
+    std::map<std::string, std::string, std::less<>> redirected_syms;
+    // implementations the slice doesn't load yet: install name, load command, current and compat
+    // version. Weakly loaded if every umbrella leading to them was.
+    std::vector<std::tuple<std::string, uint32_t, uint32_t, uint32_t>> added_dylibs;
+};
+
+static int32_t library_ordinal(const std::vector<std::string_view> &libraries,
+                               std::string_view name) {
+    const auto it = std::find(libraries.begin(), libraries.end(), name);
+    assert(it != libraries.end());
+    return (int32_t)(it - libraries.begin()) + 1;
+}
+
+// Where the ordinal rewriting passes send a symbol bound to an original ordinal.
+struct ordinal_rewrite {
+    const removal_plan &removal;
+    const reexport_plan *reexports;
+    const std::vector<std::string_view> &libraries;
+    const std::map<int64_t, int32_t> &ordinals;
+
+    bool weak_import(std::string_view sym) const {
+        return removal.weak_imports.contains(sym);
+    }
+    int32_t ordinal(std::string_view sym, int64_t orig_ordinal) const {
+        if (const auto it = removal.redirected_syms.find(sym);
+            it != removal.redirected_syms.end()) {
+            return library_ordinal(libraries, it->second);
+        }
+        if (reexports) {
+            if (const auto it = reexports->redirected_syms.find(sym);
+                it != reexports->redirected_syms.end()) {
+                return library_ordinal(libraries, it->second);
+            }
+        }
+        return ordinals.at(orig_ordinal);
+    }
+};
+
+// convert_native() on one slice as passes over its model, each analysis is only computed if a
+// pass that runs needs it. Returns false with reason set if the model can't do it, or with an
+// empty reason on user errors. stub_syms is what the slice needs from the per-binary stub.
+static bool run_native_passes(macho::model &model, const dylibify_options &opts,
+                              const output_variant &variant, const fs::path &new_dylib_path,
+                              const fs::path &stub_path, conversion_cache &cache,
+                              const sdk_index &indexes, const kept_weak_defs &keep_weak_defs,
+                              conversion_stats &stats,
+                              std::set<std::string> &catalog_install_names,
+                              std::set<std::string> &stub_syms, cancel_token &cancel,
+                              std::string &reason) {
+    const auto cpu_type = (CPU_TYPES)model.cputype();
+    // everything edited here is a load command, only the code signature also takes file bytes
+    auto &size_deltas   = stats.size_deltas.load_commands;
+    pass_manager pm;
+
+    const auto orig_libraries = pm.add_analysis<std::vector<std::string>>(
+        "original libraries", model_part::commands, {}, true, [&](pass_manager &) {
+            std::vector<std::string> libraries;
+            for (const auto name : model.libraries()) {
+                libraries.emplace_back(name);
+            }
+            return libraries;
+        });
+    const auto weak_libraries = pm.add_analysis<std::set<std::string, std::less<>>>(
+        "weak libraries", model_part::commands, {}, true, [&](pass_manager &) {
+            std::set<std::string, std::less<>> libraries;
+            for (const auto name : model.libraries()) {
+                if (model.commands()[*model.find_library(name)].cmd == macho::LC_LOAD_WEAK_DYLIB) {
+                    libraries.emplace(name);
+                }
+            }
+            return libraries;
+        });
+    const auto syms_to_libs = pm.add_analysis<std::map<std::string, std::string>>(
+        "symbol libraries", model_part::fixups, {orig_libraries}, true, [&](pass_manager &pm) {
+            const auto &libraries = pm.get(orig_libraries);
+            std::map<std::string, std::string> syms;
+            for (const auto kind : {macho::bind_kind::regular, macho::bind_kind::lazy}) {
+                for (const auto &binding : model.binds(kind)) {
+                    if (binding.ordinal <= 0 || (size_t)binding.ordinal > libraries.size()) {
+                        continue;
+                    }
+                    syms.emplace(binding.symbol, libraries[binding.ordinal - 1]);
+                }
+            }
+            return syms;
+        });
+    const auto non_lazy_syms = pm.add_analysis<std::set<std::string>>(
+        "non-lazy symbols", model_part::fixups, {}, true, [&](pass_manager &) {
+            std::set<std::string> syms;
+            for (const auto kind : {macho::bind_kind::regular, macho::bind_kind::weak}) {
+                for (const auto &binding : model.binds(kind)) {
+                    syms.emplace(binding.symbol);
+                }
+            }
+            return syms;
+        });
+    std::vector<analysis_id> removal_deps{orig_libraries, syms_to_libs};
+    if (opts.usage) {
+        removal_deps.emplace_back(non_lazy_syms);
+    }
+    const auto removal = pm.add_analysis<removal_plan>(
+        "removal plan", 0, removal_deps, true, [&](pass_manager &pm) {
+            const auto &libraries = pm.get(orig_libraries);
+            const auto &syms      = pm.get(syms_to_libs);
+            removal_plan plan;
+            for (const auto &dylib : variant.remove_dylibs) {
+                if (std::find(libraries.begin(), libraries.end(), dylib) == libraries.end()) {
+                    fmt::print("[!] Asked to remove dylib '{:s}' but it wasn't found in the "
+                               "imports\n",
+                               dylib);
+                    plan.ok = false;
+                    return plan;
+                }
+                plan.dylibs.emplace(dylib);
+            }
+            for (const auto &dylib : libraries) {
+                if (policy_removes_dylib(opts, dylib) ||
+                    profile_removes_dylib(opts, dylib, syms, plan.decisions)) {
+                    plan.dylibs.emplace(dylib);
+                }
+            }
+            if (opts.auto_remove_dylibs) {
+                for (const auto &dylib : libraries) {
+                    if (!cached_dylib_exists(opts, cache, indexes, dylib)) {
+                        if (opts.verbose) {
+                            fmt::print("[-] Marking unavailable dylib '{:s}' for removal\n",
+                                       dylib);
+                        }
+                        plan.dylibs.emplace(dylib);
+                    }
+                }
+            }
+            for (const auto &sym_map : syms) {
+                if (plan.dylibs.contains(sym_map.second)) {
+                    plan.stub_syms.emplace(sym_map.first);
+                }
+            }
+            plan.catalog_libs =
+                route_to_catalog(opts, cache, new_dylib_path.parent_path(), plan.dylibs, syms,
+                                 cpu_type, plan.stub_syms, plan.redirected_syms);
+            if (opts.usage) {
+                plan.weak_imports = profile_weak_imports(opts, syms, pm.get(non_lazy_syms),
+                                                         plan.stub_syms, plan.decisions);
+            }
+            return plan;
+        });
+    const auto reexports = pm.add_analysis<reexport_plan>(
+        "re-export plan", 0, {orig_libraries, weak_libraries, syms_to_libs, removal}, true,
+        [&](pass_manager &pm) {
+            const auto &libraries = pm.get(orig_libraries);
+            const auto &weak_libs = pm.get(weak_libraries);
+            const auto &plan      = pm.get(removal);
+            const auto *snap_index = indexes.exports_for((uint32_t)cpu_type);
+            std::unique_lock lk{cache.lock, std::defer_lock};
+            if (!snap_index) {
+                lk.lock();
+            }
+            const auto &exp_index = snap_index ? *snap_index : cache.export_indexes[cpu_type];
+            reexport_plan flat;
+            for (const auto &sym_map : pm.get(syms_to_libs)) {
+                if (plan.dylibs.contains(sym_map.second)) {
+                    continue;
+                }
+                if (!snap_index) {
+                    index_dylib_exports(cache.export_indexes[cpu_type], opts.sdk_root,
+                                        sym_map.second, cpu_type, opts.verbose);
+                }
+                std::set<std::string> visited;
+                const auto impl =
+                    find_implementing_dylib(exp_index, sym_map.second, sym_map.first, visited);
+                if (impl == std::nullopt || *impl == sym_map.second ||
+                    plan.dylibs.contains(*impl)) {
+                    continue;
+                }
+                const auto cmd = weak_libs.contains(sym_map.second) ? macho::LC_LOAD_WEAK_DYLIB
+                                                                    : macho::LC_LOAD_DYLIB;
+                const auto added_it =
+                    std::find_if(flat.added_dylibs.begin(), flat.added_dylibs.end(),
+                                 [&](const auto &added) { return std::get<0>(added) == *impl; });
+                const bool loaded =
+                    std::find(libraries.begin(), libraries.end(), *impl) != libraries.end();
+                if (!loaded && added_it == flat.added_dylibs.end()) {
+                    const auto &impl_exports = exp_index.at(*impl);
+                    flat.added_dylibs.emplace_back(*impl, cmd, impl_exports.current_version,
+                                                   impl_exports.compat_version);
+                } else if (!loaded && cmd == macho::LC_LOAD_DYLIB) {
+                    std::get<1>(*added_it) = cmd;
+                }
+                if (opts.verbose) {
+                    fmt::print("[-] Flattening symbol '{:s}' from '{:s}' to '{:s}'\n",
+                               sym_map.first, sym_map.second, *impl);
+                }
+                flat.redirected_syms.emplace(sym_map.first, *impl);
+            }
+            return flat;
+        });
+    const auto libraries = pm.add_analysis<std::vector<std::string_view>>(
+        "libraries", model_part::commands, {}, false,
+        [&](pass_manager &) { return model.libraries(); });
+    const auto ordinals = pm.add_analysis<std::map<int64_t, int32_t>>(
+        "ordinal map", 0, {orig_libraries, removal, libraries}, false, [&](pass_manager &pm) {
+            const auto &orig_libs = pm.get(orig_libraries);
+            const auto &plan      = pm.get(removal);
+            const auto &new_libs  = pm.get(libraries);
+            const auto has_stub =
+                std::find(new_libs.begin(), new_libs.end(), stub_path.string()) != new_libs.end();
+            std::map<int64_t, int32_t> map;
+            for (size_t i = 0; i < orig_libs.size(); ++i) {
+                const auto &orig_lib  = orig_libs[i];
+                const auto catalog_it = plan.catalog_libs.find(orig_lib);
+                if (!plan.dylibs.contains(orig_lib)) {
+                    map.emplace(i + 1, library_ordinal(new_libs, orig_lib));
+                } else if (catalog_it != plan.catalog_libs.end()) {
+                    map.emplace(i + 1, library_ordinal(new_libs, catalog_it->second));
+                } else if (has_stub) {
+                    map.emplace(i + 1, library_ordinal(new_libs, stub_path.string()));
+                } else {
+                    // with every symbol weak imported the slice has no stub to bind to
+                    map.emplace(i + 1, macho::BIND_SPECIAL_DYLIB_FLAT_LOOKUP);
+                }
+            }
+            return map;
+        });
+
+    pm.add_pass({.name   = "patch header",
+                 .phase  = "edit load commands",
+                 .writes = model_part::header,
+                 .run    = [&](pass_manager &) {
+                     assert(model.filetype() == macho::MH_EXECUTE);
+                     if (opts.verbose) {
+                         fmt::print("[-] Changing Mach-O type from executable to dylib\n");
+                     }
+                     model.filetype(macho::MH_DYLIB);
+                     model.flags(model.flags() | macho::MH_NO_REEXPORTED_DYLIBS);
+                     return true;
+                 }});
+    pm.add_pass({.name   = "remove code signature",
+                 .writes = model_part::commands | model_part::stats,
+                 .run    = [&](pass_manager &) {
+                     if (const auto idx = model.find_command(macho::LC_CODE_SIGNATURE)) {
+                         if (opts.verbose) {
+                             fmt::print("[-] Removing code signature\n");
+                         }
+                         macho::linkedit_data_command sig_cmd;
+                         std::memcpy(&sig_cmd, model.commands()[*idx].bytes.data(),
+                                     sizeof(sig_cmd));
+                         size_deltas["remove code signature"] -= sig_cmd.cmdsize;
+                         stats.size_deltas.file["remove code signature"] -= sig_cmd.datasize;
+                         model.remove_command(*idx);
+                     }
+                     return true;
+                 }});
+    pm.add_pass({.name   = "remove __PAGEZERO",
+                 .writes = model_part::commands | model_part::fixups | model_part::stats,
+                 .run    = [&](pass_manager &) {
+                     if (const auto removed = model.remove_empty_segment("__PAGEZERO", reason)) {
+                         if (opts.verbose) {
+                             fmt::print("[-] Removing __PAGEZERO segment\n");
+                         }
+                         size_deltas["remove __PAGEZERO"] -= *removed;
+                     }
+                     return reason.empty();
+                 }});
+    pm.add_pass({.name   = "add ID_DYLIB",
+                 .writes = model_part::commands | model_part::stats,
+                 .run    = [&](pass_manager &) {
+                     if (opts.verbose) {
+                         fmt::print("[-] Setting ID_DYLIB path to: '{:s}'\n",
+                                    new_dylib_path.string());
+                     }
+                     size_deltas["add ID_DYLIB"] +=
+                         model.add_dylib(macho::LC_ID_DYLIB, new_dylib_path.string(), 0x00010000,
+                                         0x00010000);
+                     return true;
+                 }});
+    if (opts.remove_info_plist) {
+        pm.add_pass({.name   = "remove __info_plist",
+                     .reads  = model_part::symbols,
+                     .writes = model_part::commands | model_part::symbols | model_part::contents |
+                               model_part::stats,
+                     .run    = [&](pass_manager &) {
+                         const auto removed =
+                             model.remove_section("__TEXT", "__info_plist", reason);
+                         if (removed) {
+                             if (opts.verbose) {
+                                 fmt::print("[-] Removing __TEXT,__info_plist\n");
+                             }
+                             // the contents are zeroed where they are, only the section
+                             // header goes
+                             size_deltas["remove __info_plist"] -=
+                                 model.pointer_size() == 8 ? sizeof(macho::section_64)
+                                                           : sizeof(macho::section);
+                         }
+                         return reason.empty();
+                     }});
+    }
+    pm.add_pass({.name   = "remove dyld-only commands",
+                 .writes = model_part::commands | model_part::stats,
+                 .run    = [&](pass_manager &) {
+                     for (const auto cmd : {macho::LC_LOAD_DYLINKER, macho::LC_MAIN,
+                                            macho::LC_SOURCE_VERSION}) {
+                         if (const auto idx = model.find_command(cmd)) {
+                             size_deltas["remove dyld-only commands"] -= model.remove_command(*idx);
+                         }
+                     }
+                     return true;
+                 }});
+    if (variant.platform != std::nullopt) {
+        pm.add_pass({.name   = "replace platform version",
+                     .writes = model_part::commands | model_part::stats,
+                     .run    = [&](pass_manager &) {
+                         for (const auto cmd :
+                              {macho::LC_VERSION_MIN_MACOSX, macho::LC_VERSION_MIN_IPHONEOS,
+                               macho::LC_VERSION_MIN_TVOS, macho::LC_VERSION_MIN_WATCHOS,
+                               macho::LC_BUILD_VERSION}) {
+                             while (const auto idx = model.find_command(cmd)) {
+                                 size_deltas["replace platform version"] -=
+                                     model.remove_command(*idx);
+                             }
+                         }
+                         if (opts.verbose) {
+                             fmt::print("[-] Adding new BUILD_VERSION command (platform: '{:s}' "
+                                        "version: '{:d}.{:d}.{:d}' SDK: '{:d}.{:d}.{:d}')\n",
+                                        to_string(*variant.platform), variant.minos[0],
+                                        variant.minos[1], variant.minos[2], variant.sdk[0],
+                                        variant.sdk[1], variant.sdk[2]);
+                         }
+                         size_deltas["replace platform version"] += model.add_build_version(
+                             (uint32_t)*variant.platform, encode_version(variant.minos),
+                             encode_version(variant.sdk));
+                         return true;
+                     }});
+    }
+    pm.add_pass({.name   = "remove dylibs",
+                 .uses   = {removal},
+                 .writes = model_part::commands | model_part::stats,
+                 .run    = [&](pass_manager &pm) {
+                     const auto &plan = pm.get(removal);
+                     if (!plan.ok) {
+                         return false;
+                     }
+                     merge_stats(stats, plan.decisions);
+                     for (const auto &dylib : plan.dylibs) {
+                         if (opts.verbose) {
+                             fmt::print("[-] Removing dependant dylib '{:s}'\n", dylib);
+                         }
+                         const auto lib_idx = model.find_library(dylib);
+                         assert(lib_idx != std::nullopt);
+                         size_deltas["remove dependent dylibs"] -= model.remove_command(*lib_idx);
+                     }
+                     return true;
+                 }});
+    pm.add_pass({.name   = "add stub dylibs",
+                 .uses   = {removal},
+                 .writes = model_part::commands | model_part::stats,
+                 .run    = [&](pass_manager &pm) {
+                     const auto &plan = pm.get(removal);
+                     if (plan.stub_syms.size()) {
+                         size_deltas["add stub dylib"] += model.add_dylib(
+                             macho::LC_LOAD_DYLIB, stub_path.string(), 0x00010000, 0x00010000);
+                     }
+                     for (const auto &catalog_lib : plan.catalog_libs) {
+                         catalog_install_names.emplace(catalog_lib.first);
+                         if (model.find_library(catalog_lib.second) == std::nullopt) {
+                             size_deltas["add catalog stubs"] += model.add_dylib(
+                                 macho::LC_LOAD_DYLIB, catalog_lib.second, 0x00010000, 0x00010000);
+                         }
+                     }
+                     return true;
+                 }});
+    if (opts.flatten_reexports) {
+        pm.add_pass({.name   = "flatten re-exports",
+                     .uses   = {reexports},
+                     .writes = model_part::commands | model_part::stats,
+                     .run    = [&](pass_manager &pm) {
+                         const auto &flat = pm.get(reexports);
+                         for (const auto &[name, cmd, current, compat] : flat.added_dylibs) {
+                             size_deltas["flatten re-exports"] +=
+                                 model.add_dylib(cmd, name, current, compat);
+                         }
+                         return true;
+                     }});
+    }
+
+    std::vector<analysis_id> rewrite_uses{removal, libraries, ordinals};
+    if (opts.flatten_reexports) {
+        rewrite_uses.emplace_back(reexports);
+    }
+    const auto rewrite = [&, reexports](pass_manager &pm) {
+        return ordinal_rewrite{pm.get(removal),
+                               opts.flatten_reexports ? &pm.get(reexports) : nullptr,
+                               pm.get(libraries), pm.get(ordinals)};
+    };
+    // the binds and the symbol table are rewritten at the same time
+    pm.add_pass({.name   = "rewrite bind ordinals",
+                 .phase  = "rewrite bindings",
+                 .uses   = rewrite_uses,
+                 .writes = model_part::fixups,
+                 .run    = [&](pass_manager &pm) {
+                     const auto rw = rewrite(pm);
+                     for (const auto kind : {macho::bind_kind::regular, macho::bind_kind::lazy}) {
+                         for (auto &binding : model.binds(kind)) {
+                             cancel.check();
+                             if (binding.ordinal <= 0) {
+                                 continue;
+                             }
+                             if (rw.weak_import(binding.symbol)) {
+                                 binding.ordinal = macho::BIND_SPECIAL_DYLIB_FLAT_LOOKUP;
+                                 binding.symbol_flags |= macho::BIND_SYMBOL_FLAGS_WEAK_IMPORT;
+                             } else {
+                                 binding.ordinal = rw.ordinal(binding.symbol, binding.ordinal);
+                             }
+                         }
+                     }
+                     return true;
+                 }});
+    pm.add_pass({.name   = "rewrite symbol ordinals",
+                 .uses   = rewrite_uses,
+                 .writes = model_part::symbols,
+                 .run    = [&](pass_manager &pm) {
+                     const auto rw = rewrite(pm);
+                     for (auto &sym : model.symbols()) {
+                         cancel.check();
+                         const auto orig_ord = get_library_ordinal(sym.desc);
+                         if (orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::SELF_LIBRARY_ORDINAL ||
+                             orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::DYNAMIC_LOOKUP_ORDINAL ||
+                             orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::EXECUTABLE_ORDINAL) {
+                             continue;
+                         }
+                         if (rw.weak_import(sym.name)) {
+                             set_library_ordinal(
+                                 sym.desc, (uint8_t)SYMBOL_DESCRIPTIONS::DYNAMIC_LOOKUP_ORDINAL);
+                             sym.desc |= macho::N_WEAK_REF;
+                         } else {
+                             set_library_ordinal(sym.desc, rw.ordinal(sym.name, orig_ord));
+                         }
+                     }
+                     return true;
+                 }});
+    if (opts.uncoalesce_weak_defs) {
+        pm.add_pass({.name   = "uncoalesce weak defs",
+                     .phase  = "uncoalesce weak defs",
+                     .reads  = model_part::header | model_part::symbols | model_part::exports |
+                               model_part::fixups,
+                     .writes = model_part::header | model_part::symbols | model_part::exports |
+                               model_part::fixups | model_part::stats,
+                     .run    = [&](pass_manager &) {
+                         uncoalesce_weak_defs_native(model, keep_weak_defs, stats, cancel,
+                                                     opts.verbose);
+                         return true;
+                     }});
+    }
+
+    if (!pm.run(cancel)) {
+        return false;
+    }
+    if (opts.verbose) {
+        fmt::print("[-] Ran {:d} passes in {:d} steps, computed {}\n", pm.num_passes(),
+                   pm.num_steps(), fmt::join(pm.computed_analyses(), ", "));
+    }
+    stub_syms = pm.get(removal).stub_syms;
+    return true;
+}
+
+// The same conversion as convert_lief() on the native model. Returns nullopt with an empty
+// reason on the same user errors, or with the reason the model can't handle the input.
+static std::optional<converted_image> convert_native(const std::vector<uint8_t> &in_bytes,
+                                                     const dylibify_options &opts,
+                                                     const output_variant &variant,
+                                                     const fs::path &new_dylib_path,
+                                                     output_sink &sink, conversion_cache &cache,
+                                                     const sdk_index &indexes,
+                                                     conversion_stats &stats,
+                                                     cancel_token &cancel, std::string &reason) {
+    cancel.checkpoint("parse");
+    const auto layout = macho::slices(in_bytes);
+    std::vector<macho::model> models;
+    for (const auto &slice : layout) {
+        auto model = macho::model::parse(std::span{in_bytes}.subspan(slice.offset, slice.size),
+                                         reason);
+        if (model == std::nullopt) {
+            return std::nullopt;
+        }
+        models.emplace_back(std::move(*model));
+    }
+
+    const auto fat_stub_filename = stub_filename(variant);
+    const auto stub_dir = sink.stub_dir(variant.out_path);
+    std::optional<fs::path> stub_path;
+    std::vector<std::pair<CPU_TYPES, std::set<std::string>>> stub_builds;
+    const kept_weak_defs keep_weak_defs{{opts.keep_weak_defs.begin(), opts.keep_weak_defs.end()},
+                                        opts.policy};
+    // only merged once the whole conversion went through, a fallback starts from scratch
+    conversion_stats native_stats;
+    std::set<std::string> catalog_install_names;
+    std::vector<std::vector<uint8_t>> slice_bufs;
+
+    for (auto &model : models) {
+        const auto cpu_type = (CPU_TYPES)model.cputype();
+        const auto slice_stub_path = new_dylib_path.parent_path() / fat_stub_filename;
+        std::set<std::string> remove_sym_set;
+        if (!run_native_passes(model, opts, variant, new_dylib_path, slice_stub_path, cache,
+                               indexes, keep_weak_defs, native_stats, catalog_install_names,
+                               remove_sym_set, cancel, reason)) {
+            return std::nullopt;
+        }
+        if (remove_sym_set.size()) {
+            stub_path = slice_stub_path;
+        }
+
+        cancel.checkpoint("build");
+        auto slice_buf = model.serialize(reason);
+        if (slice_buf == std::nullopt) {
+            return std::nullopt;
+        }
+        slice_bufs.emplace_back(std::move(*slice_buf));
+        if (remove_sym_set.size()) {
+            stub_builds.emplace_back(cpu_type, std::move(remove_sym_set));
+        }
+    }
+
+    if (stub_builds.size() &&
+        !build_stub_dylibs(stub_builds, fat_stub_filename, stub_dir, *stub_path,
+                           variant_stub_target(opts, variant), cancel, opts.verbose)) {
+        return std::nullopt;
+    }
+    std::vector<fs::path> catalog_stub_paths;
+    if (catalog_install_names.size()) {
+        auto paths = ensure_catalog_stubs(opts, cache, in_bytes, catalog_install_names,
+                                          variant_stub_target(opts, variant), cancel);
+        if (paths == std::nullopt) {
+            return std::nullopt;
+        }
+        catalog_stub_paths = std::move(*paths);
+    }
+
+    auto raw = macho::join_fat(slice_bufs, layout, macho::is_fat(in_bytes));
+    cancel.checkpoint("post-process binds");
+    // weak binds were already dropped from the model
+    post_process_binds(raw, opts, std::vector<weak_def_set>(layout.size()), native_stats, cancel);
+    merge_stats(stats, native_stats);
+    converted_image res{std::move(raw), std::nullopt, std::move(catalog_stub_paths)};
+    if (stub_builds.size()) {
+        res.fat_stub_path = stub_dir / fat_stub_filename;
+    }
+    return res;
+}
+
+static std::optional<converted_image> convert(const std::vector<uint8_t> &in_bytes,
+                                              const dylibify_options &opts,
+                                              const output_variant &variant,
+                                              const fs::path &new_dylib_path,
+                                              output_sink &sink, conversion_cache &cache,
+                                              const sdk_index &indexes, conversion_stats &stats,
+                                              cancel_token &cancel) {
+    if (opts.engine == conversion_engine::lief) {
+        return convert_lief(in_bytes, opts, variant, new_dylib_path, sink, cache, indexes, stats,
+                            cancel);
+    }
+    std::string reason;
+    auto native = convert_native(in_bytes, opts, variant, new_dylib_path, sink, cache, indexes,
+                                 stats, cancel, reason);
+    if (native == std::nullopt) {
+        if (reason.empty()) {
+            return std::nullopt;
+        }
+        if (opts.verbose || opts.engine == conversion_engine::cross_check) {
+            fmt::print("[-] Native engine can't convert '{:s}' ({:s}), falling back to LIEF\n",
+                       opts.in_path, reason);
+        }
+        return convert_lief(in_bytes, opts, variant, new_dylib_path, sink, cache, indexes, stats,
+                            cancel);
+    }
+    if (opts.engine != conversion_engine::cross_check) {
+        return native;
+    }
+
+    cancel.checkpoint("cross-check");
+    conversion_stats lief_stats;
+    const auto lief = convert_lief(in_bytes, opts, variant, new_dylib_path, sink, cache, indexes,
+                                   lief_stats, cancel);
+    if (lief == std::nullopt) {
+        fmt::print("[!] LIEF engine failed where the native one succeeded\n");
+        return std::nullopt;
+    }
+    const auto native_facts = macho::image_facts(native->bytes);
+    const auto lief_facts   = macho::image_facts(lief->bytes);
+    std::vector<std::string> only_native;
+    std::vector<std::string> only_lief;
+    std::set_difference(native_facts.begin(), native_facts.end(), lief_facts.begin(),
+                        lief_facts.end(), std::back_inserter(only_native));
+    std::set_difference(lief_facts.begin(), lief_facts.end(), native_facts.begin(),
+                        native_facts.end(), std::back_inserter(only_lief));
+    if (only_native.empty() && only_lief.empty()) {
+        return native;
+    }
+    fmt::print("[!] Native and LIEF engines disagree on '{:s}': {:d} facts only native, {:d} "
+               "only LIEF\n",
+               opts.in_path, only_native.size(), only_lief.size());
+    for (size_t i = 0; i < std::min<size_t>(only_native.size(), 5); ++i) {
+        fmt::print("[!]   native: {:s}\n", only_native[i]);
+    }
+    for (size_t i = 0; i < std::min<size_t>(only_lief.size(), 5); ++i) {
+        fmt::print("[!]   LIEF:   {:s}\n", only_lief[i]);
+    }
+    return std::nullopt;
+}
+
+// --merge-segments, run on the output of either engine. Slices the native model can't take are
+// left as they are.
+static void merge_output_segments(std::vector<uint8_t> &raw, conversion_stats &stats,
+                                  cancel_token &cancel, bool verbose) {
+    cancel.checkpoint("merge segments");
+    const auto layout = macho::slices(raw);
+    auto slice_bufs   = macho::split_fat(raw);
+    std::vector<std::vector<uint8_t>> merged_bufs;
+    size_t num_merged{0};
+    for (const auto &slice_buf : slice_bufs) {
+        std::string reason;
+        auto model      = macho::model::parse(slice_buf, reason);
+        const auto arch = macho::arch_name(macho::image::read_only(slice_buf).cputype());
+        if (model == std::nullopt) {
+            fmt::print("[-] Not merging segments of {:s} ({:s})\n", arch, reason);
+            merged_bufs.emplace_back(slice_buf);
+            continue;
+        }
+        const auto before = model->num_mapped_segments();
+        uint32_t saved{0};
+        std::vector<std::string> skipped;
+        const auto merged = model->merge_data_segments(saved, skipped);
+        for (const auto &why : skipped) {
+            fmt::print("[-] Not merging segments of {:s} ({:s})\n", arch, why);
+        }
+        auto merged_buf   = merged ? model->serialize(reason) : std::nullopt;
+        if (merged && merged_buf == std::nullopt) {
+            fmt::print("[-] Not merging segments of {:s} ({:s})\n", arch, reason);
+        }
+        if (merged_buf == std::nullopt) {
+            stats.mappings_before += before;
+            stats.mappings_after += before;
+            merged_bufs.emplace_back(slice_buf);
+            continue;
+        }
+        if (verbose) {
+            fmt::print("[-] Merged {:d} segments of {:s}, {:d} -> {:d} mappings\n", merged, arch,
+                       before, before - merged);
+        }
+        stats.mappings_before += before;
+        stats.mappings_after += before - merged;
+        stats.size_deltas.load_commands["merge segments"] -= saved;
+        merged_bufs.emplace_back(std::move(*merged_buf));
+        ++num_merged;
+    }
+    if (num_merged) {
+        raw = macho::join_fat(merged_bufs, layout, macho::is_fat(raw));
+    }
+}
+
+// Applies the fixed-size per-variant edits to a converted image and returns the byte ranges
+// touched, everything else is identical between variants of the same group.
+static std::vector<byte_range> patch_variant(std::vector<uint8_t> &raw,
+                                             const output_variant &variant,
+                                             const fs::path &id_dylib_path) {
+    std::vector<byte_range> patched;
+    const auto id_name = id_dylib_path.string();
+    for (const auto &slice : macho::slices(raw)) {
+        macho::image img{std::span{raw}.subspan(slice.offset, slice.size)};
+        if (const auto lc = img.find_command(macho::LC_ID_DYLIB)) {
+            const auto *id_cmd = img.command_at<macho::dylib_command>(lc->offset);
+            auto name =
+                img.bytes(lc->offset + id_cmd->name_offset, lc->cmdsize - id_cmd->name_offset);
+            assert(id_name.size() < name.size());
+            std::fill(name.begin(), name.end(), 0);
+            std::copy(id_name.begin(), id_name.end(), name.begin());
+            patched.emplace_back(byte_range{slice.offset + lc->offset, lc->cmdsize});
+        }
+        if (variant.platform == std::nullopt) {
+            continue;
+        }
+        if (const auto lc = img.find_command(macho::LC_BUILD_VERSION)) {
+            auto *buildver_cmd     = img.command_at<macho::build_version_command>(lc->offset);
+            buildver_cmd->platform = (uint32_t)*variant.platform;
+            buildver_cmd->minos    = encode_version(variant.minos);
+            buildver_cmd->sdk      = encode_version(variant.sdk);
+            patched.emplace_back(byte_range{slice.offset + lc->offset, lc->cmdsize});
+        }
+    }
+    return patched;
+}
+
+static bool dylibify(const dylibify_options &opts, const std::vector<uint8_t> &in_bytes,
+                     output_sink &sink, conversion_cache &cache, cancel_token &cancel) {
+    if (opts.verbose) {
+        LIEF::logging::set_level(LIEF::logging::LOGGING_LEVEL::LOG_TRACE);
+    }
+
+    conversion_stats stats;
+    // a new --index only applies to jobs that start after it was loaded
+    const auto indexes = cache.indexes.load();
+
+    // Outputs that agree on these only differ in fixed-size load command fields, so they share a
+    // single conversion and get patched afterwards. The stub dylib's install name lives next to
+    // the ID_DYLIB path, so that directory has to match too, and the stub is built for one
+    // platform and deployment target.
+    using group_key = std::tuple<std::set<std::string>, fs::path,
+                                 std::optional<BuildVersion::PLATFORMS>, BuildVersion::version_t>;
+    std::map<group_key, std::vector<const output_variant *>> groups;
+    for (const auto &variant : opts.outputs) {
+        group_key key{{variant.remove_dylibs.begin(), variant.remove_dylibs.end()},
+                      variant_id_dylib_path(variant).parent_path(), variant.platform,
+                      variant.minos};
+        groups[key].emplace_back(&variant);
+    }
+
+    for (const auto &group : groups) {
+        const auto &members = group.second;
+        // reserve room in ID_DYLIB for the longest install name of the group
+        fs::path template_id_path;
+        for (const auto *variant : members) {
+            const auto id_path = variant_id_dylib_path(*variant);
+            if (id_path.string().size() > template_id_path.string().size()) {
+                template_id_path = id_path;
+            }
         }
 
-        std::map<int32_t, int32_t> orig_to_new_ordinal_map;
-        for (const auto &old_it : orig_ordinal_map) {
-            const auto &orig_lib = old_it.first;
-            const auto orig_ord  = old_it.second;
-            if (new_ordinal_map.contains(orig_lib)) {
-                orig_to_new_ordinal_map.emplace(
-                    std::make_pair(orig_ord, new_ordinal_map[orig_lib]));
+        conversion_stats group_stats;
+        auto converted =
+            convert(in_bytes, opts, *members.front(), template_id_path, sink, cache, *indexes,
+                    group_stats, cancel);
+        if (converted == std::nullopt) {
+            return false;
+        }
+        if (opts.merge_segments) {
+            merge_output_segments(converted->bytes, group_stats, cancel, opts.verbose);
+        }
+        if (opts.size_report) {
+            fmt::print("[-] Size report for '{:s}'\n", members.front()->out_path);
+            print_size_report(in_bytes, converted->bytes, group_stats.size_deltas);
+        }
+        if (opts.runtime_report) {
+            fmt::print("[-] Runtime launch costs for '{:s}'\n", members.front()->out_path);
+            print_runtime_report(converted->bytes);
+        }
+        merge_stats(stats, group_stats);
+
+        cancel.checkpoint("write");
+        const auto &first_out = members.front()->out_path;
+        for (const auto *variant : members) {
+            cancel.check();
+            const auto patched =
+                patch_variant(converted->bytes, *variant, variant_id_dylib_path(*variant));
+            if (&variant->out_path == &first_out) {
+                if (!sink.write(variant->out_path, converted->bytes)) {
+                    return false;
+                }
             } else {
-                assert(remove_dylib_set.contains(orig_lib));
-                orig_to_new_ordinal_map.emplace(
-                    std::make_pair(orig_ord, new_ordinal_map[*stub_path]));
+                if (opts.verbose) {
+                    fmt::print("[-] Writing variant '{:s}' as a clone of '{:s}'\n",
+                               variant->out_path, first_out);
+                }
+                if (!sink.write_variant(first_out, variant->out_path, converted->bytes, patched)) {
+                    return false;
+                }
+            }
+            if (converted->fat_stub_path != std::nullopt) {
+                const auto stub_copy = fs::path{variant->out_path}.parent_path() /
+                                       converted->fat_stub_path->filename();
+                if (!sink.copy(*converted->fat_stub_path, stub_copy)) {
+                    fmt::print("[!] Couldn't copy stub dylib to '{:s}'\n", stub_copy.string());
+                    return false;
+                }
+            }
+            for (const auto &catalog_stub : converted->catalog_stub_paths) {
+                const auto stub_copy =
+                    fs::path{variant->out_path}.parent_path() / catalog_stub.filename();
+                if (!sink.copy(catalog_stub, stub_copy)) {
+                    fmt::print("[!] Couldn't copy catalog stub to '{:s}'\n", stub_copy.string());
+                    return false;
+                }
             }
         }
+    }
 
-        if (verbose) {
-            fmt::print("[-] Updating library ordinals in binding info\n");
+    if (opts.stats) {
+        print_stats(stats);
+    }
+    return true;
+}
+
+// Short option letters of the passes a job ran, for traces.
+static std::string job_flags(const dylibify_options &opts) {
+    std::string flags;
+    const auto &primary = opts.outputs.front();
+    if (opts.auto_remove_dylibs) {
+        flags += 'R';
+    }
+    if (!primary.remove_dylibs.empty()) {
+        flags += 'r';
+    }
+    if (opts.remove_info_plist) {
+        flags += 'P';
+    }
+    if (primary.platform == BuildVersion::PLATFORMS::IOS) {
+        flags += 'I';
+    } else if (primary.platform == BuildVersion::PLATFORMS::MACOS) {
+        flags += 'M';
+    }
+    if (opts.flatten_reexports) {
+        flags += 'F';
+    }
+    if (opts.stub_catalog != std::nullopt) {
+        flags += 'C';
+    }
+    if (opts.uncoalesce_weak_defs) {
+        flags += 'W';
+    }
+    if (opts.rebase_self_binds) {
+        flags += 'B';
+    }
+    if (opts.merge_segments) {
+        flags += 'G';
+    }
+    if (opts.usage) {
+        flags += 'U';
+    }
+    return flags.empty() ? "-" : flags;
+}
+
+// Completion latencies per priority class, filled in from the scheduler's workers.
+class latency_by_class {
+public:
+    void add(job_priority prio, std::chrono::steady_clock::duration latency) {
+        std::lock_guard lk{lock_};
+        ms_[(size_t)prio].emplace_back(
+            std::chrono::duration<double, std::milli>(latency).count());
+    }
+    void print(const char *what) const;
+
+private:
+    mutable std::mutex lock_;
+    std::array<std::vector<double>, num_job_priorities> ms_;
+};
+
+// Runs dylibify() under the job's deadline. A cancelled job unwinds out of whatever phase it
+// was in, so all of its buffers are gone by the time this returns. Whatever a failed job wrote is
+// handed back to the sink.
+// Under a scheduler, phase boundaries are also where the job gives way to higher priority ones.
+static bool run_cancellable(const dylibify_options &opts, const std::vector<uint8_t> &in_bytes,
+                            output_sink &sink, conversion_cache &cache, job_scheduler *sched) {
+    const auto start = std::chrono::steady_clock::now();
+    cancel_token cancel{opts.job_timeout};
+    if (sched) {
+        cancel.at_phase_boundary([sched, prio = opts.priority] { sched->yield(prio); });
+    }
+    job_sink outputs{sink};
+    bool ok{false};
+    try {
+        ok = dylibify(opts, in_bytes, outputs, cache, cancel);
+    } catch (const job_cancelled &e) {
+        fmt::print("[!] Job '{:s}' cancelled after {:.3f} s in phase '{:s}'\n", opts.in_path,
+                   std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                   e.phase());
+    } catch (const std::exception &e) {
+        // parse errors, filesystem errors and the like only fail this job
+        fmt::print("[!] Job '{:s}' failed: {:s}\n", opts.in_path, e.what());
+    }
+    if (!ok) {
+        outputs.discard_written();
+    }
+    return ok;
+}
+
+static bool run_job(const dylibify_options &opts, output_sink &sink, conversion_cache &cache,
+                    job_scheduler *sched, trace_writer *trace, int64_t arrival_ms) {
+    // batch inputs aren't looked at until their job runs, a bad one only fails its own job
+    std::error_code ec;
+    if (!fs::is_regular_file(opts.in_path, ec) || access(opts.in_path.c_str(), R_OK)) {
+        fmt::print("[!] Input '{:s}' isn't a readable file\n", opts.in_path);
+        return false;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const auto input = read_file(opts.in_path, opts.io);
+    if (input == std::nullopt) {
+        return false;
+    }
+    const auto &in_bytes = *input;
+    const auto res       = run_cancellable(opts, in_bytes, sink, cache, sched);
+    if (trace) {
+        job_record rec;
+        rec.arrival_ms  = arrival_ms;
+        rec.input_id    = trace->input_id(fs::absolute(opts.in_path).string());
+        rec.input_size  = in_bytes.size();
+        rec.cputypes    = input_cputypes(in_bytes);
+        rec.num_outputs = opts.outputs.size();
+        rec.flags       = job_flags(opts);
+        rec.priority    = to_string(opts.priority);
+        rec.duration_ms = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+        rec.ok = res;
+        trace->record(rec);
+    }
+    return res;
+}
+
+// --bench, converts the single job runs times in a row and reports where the time of each phase
+// went. The scheduler and deadline hooks aren't installed, phase boundaries only split the clock.
+static bool run_bench(const dylibify_options &opts, output_sink &sink, conversion_cache &cache,
+                      size_t runs, bench_cache mode) {
+    auto bench_opts = opts;
+    const auto fresh_path =
+        fs::temp_directory_path() / fmt::format("dylibify-bench-{:d}.input", getpid());
+    std::vector<std::vector<phase_time>> timed;
+    const size_t warmups = mode == bench_cache::warm ? 1 : 0;
+    bool ok{true};
+    for (size_t i = 0; ok && i < warmups + runs; ++i) {
+        if (mode == bench_cache::cold && !evict_page_cache(opts.in_path)) {
+            // nothing to evict with here, convert a fresh copy that never went through the cache
+            bench_opts.in_path = fresh_path.string();
+            const auto orig = read_file(opts.in_path, io_mode::buffered);
+            if (orig == std::nullopt || !write_file(fresh_path, *orig, io_mode::direct)) {
+                ok = false;
+                break;
+            }
         }
-        for (auto &binding_info : binary.dyld_info()->bindings()) {
-            binding_info.library_ordinal(
-                orig_to_new_ordinal_map.at(binding_info.library_ordinal()));
+        phase_clock clock;
+        clock.enter("read input");
+        const auto in_bytes = read_file(bench_opts.in_path, opts.io);
+        if (in_bytes == std::nullopt) {
+            ok = false;
+            break;
+        }
+        cancel_token cancel;
+        clock.enter(cancel.phase());
+        cancel.at_phase_boundary([&] { clock.enter(cancel.phase()); });
+        ok          = dylibify(bench_opts, *in_bytes, sink, cache, cancel);
+        auto phases = clock.finish();
+        if (ok && i >= warmups) {
+            timed.emplace_back(std::move(phases));
         }
+    }
+    if (bench_opts.in_path != opts.in_path) {
+        std::error_code ec;
+        fs::remove(fresh_path, ec);
+    }
+    if (!ok) {
+        fmt::print("[!] Benchmark run of '{:s}' failed\n", opts.in_path);
+        return false;
+    }
+    print_bench_report(timed, mode);
+    return true;
+}
 
-        if (verbose) {
-            fmt::print("[-] Updating library ordinals in symtab\n");
+static std::optional<BuildVersion::version_t> parse_version(const std::string &str) {
+    BuildVersion::version_t version{0, 0, 0};
+    size_t idx{0};
+    std::string_view rest{str};
+    while (!rest.empty()) {
+        if (idx == version.size()) {
+            return std::nullopt;
         }
-        for (auto &sym : binary.symbols()) {
-            if (sym.origin() != SYMBOL_ORIGINS::SYM_ORIGIN_LC_SYMTAB) {
-                continue;
-            }
-            const auto orig_ord = get_library_ordinal(sym.description());
-            if (orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::SELF_LIBRARY_ORDINAL ||
-                orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::DYNAMIC_LOOKUP_ORDINAL ||
-                orig_ord == (uint8_t)SYMBOL_DESCRIPTIONS::EXECUTABLE_ORDINAL) {
-                continue;
+        const auto dot  = rest.find('.');
+        const auto part = rest.substr(0, dot);
+        const auto res  = std::from_chars(part.data(), part.data() + part.size(), version[idx]);
+        if (res.ec != std::errc{} || res.ptr != part.data() + part.size()) {
+            return std::nullopt;
+        }
+        ++idx;
+        rest = dot == std::string_view::npos ? std::string_view{} : rest.substr(dot + 1);
+    }
+    if (!idx) {
+        return std::nullopt;
+    }
+    return version;
+}
+
+static std::vector<std::string> split_string(const std::string &str, char sep) {
+    std::vector<std::string> res;
+    size_t start{0};
+    while (start <= str.size()) {
+        const auto end = std::min(str.find(sep, start), str.size());
+        if (end > start) {
+            res.emplace_back(str.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return res;
+}
+
+// e.g. out=foo-ios.dylib,platform=ios,minos=14.0,sdk=14.5,dylib-path=@rpath/foo.dylib,remove=a:b
+static std::optional<output_variant> parse_variant(const std::string &spec,
+                                                   const output_variant &defaults) {
+    auto variant     = defaults;
+    variant.out_path = {};
+    for (const auto &field : split_string(spec, ',')) {
+        const auto eq = field.find('=');
+        if (eq == std::string::npos) {
+            fmt::print(stderr, "Variant field '{:s}' isn't key=value\n", field);
+            return std::nullopt;
+        }
+        const auto key = field.substr(0, eq);
+        const auto val = field.substr(eq + 1);
+        if (key == "out") {
+            variant.out_path = val;
+        } else if (key == "dylib-path") {
+            variant.dylib_path = val;
+        } else if (key == "remove") {
+            variant.remove_dylibs = split_string(val, ':');
+        } else if (key == "platform" && val == "ios") {
+            variant.platform = BuildVersion::PLATFORMS::IOS;
+        } else if (key == "platform" && val == "macos") {
+            variant.platform = BuildVersion::PLATFORMS::MACOS;
+        } else if ((key == "minos" || key == "sdk") && parse_version(val)) {
+            (key == "minos" ? variant.minos : variant.sdk) = *parse_version(val);
+        } else {
+            fmt::print(stderr, "Bad variant field '{:s}'\n", field);
+            return std::nullopt;
+        }
+    }
+    if (variant.out_path.empty()) {
+        fmt::print(stderr, "Variant '{:s}' has no out= path\n", spec);
+        return std::nullopt;
+    }
+    return variant;
+}
+
+struct batch_job {
+    std::string in_path;
+    std::string out_path;
+    std::optional<double> timeout;
+    std::optional<job_priority> priority;
+};
+
+// One job per line, "<input> <output> [timeout seconds] [interactive|normal|bulk]". Fields of a
+// line with a tab in it are tab separated so paths can have spaces, otherwise they're space
+// separated. Blank lines and lines starting with '#' are skipped.
+static std::optional<std::vector<batch_job>> read_batch_file(const fs::path &path) {
+    if (!fs::exists(path)) {
+        fmt::print(stderr, "Error parsing arguments: batch file '{:s}' doesn't exist\n",
+                   path.string());
+        return std::nullopt;
+    }
+    const auto bytes = read_file_bytes(path);
+    const std::string contents{bytes.begin(), bytes.end()};
+    std::vector<batch_job> jobs;
+    size_t line_num{0};
+    for (const auto &line : split_string(contents, '\n')) {
+        ++line_num;
+        if (line.starts_with('#')) {
+            continue;
+        }
+        const auto fields = split_string(line, line.find('\t') != std::string::npos ? '\t' : ' ');
+        if (fields.empty()) {
+            continue;
+        }
+        bool good = fields.size() >= 2 && fields.size() <= 4;
+        batch_job job{good ? fields[0] : "", good ? fields[1] : "", std::nullopt, std::nullopt};
+        for (size_t i = 2; good && i < fields.size(); ++i) {
+            if (const auto prio = parse_priority(fields[i]); prio && !job.priority) {
+                job.priority = prio;
+            } else if (const auto timeout = parse_timeout(fields[i]); timeout && !job.timeout) {
+                job.timeout = timeout;
+            } else {
+                good = false;
             }
-            const auto new_ord = orig_to_new_ordinal_map.at(orig_ord);
-            auto new_desc      = sym.description();
-            set_library_ordinal(new_desc, new_ord);
-            sym.description(new_desc);
         }
+        if (!good) {
+            fmt::print(stderr, "Error parsing batch file '{:s}': bad job on line {:d}\n",
+                       path.string(), line_num);
+            return std::nullopt;
+        }
+        jobs.emplace_back(std::move(job));
+    }
+    return jobs;
+}
 
-        if (remove_sym_set.size()) {
-            const auto cpu_type = binary.header().cpu_type();
-            if (verbose) {
-                fmt::print("[-] Codegening and building stub dylib for arch {:s} '{:s}'\n",
-                           to_string(cpu_type), stub_path->string());
+static bool run_batch(const dylibify_options &opts, const std::vector<batch_job> &jobs,
+                      output_sink &sink, conversion_cache &cache, trace_writer *trace,
+                      size_t num_workers) {
+    // every job of a batch is submitted at once
+    const auto arrival_ms = wall_clock_ms();
+    const auto submitted  = std::chrono::steady_clock::now();
+    std::atomic<size_t> num_failed{0};
+    latency_by_class latencies;
+    job_scheduler sched{num_workers};
+    for (const auto &job : jobs) {
+        auto job_opts                     = opts;
+        job_opts.in_path                  = job.in_path;
+        job_opts.outputs.front().out_path = job.out_path;
+        job_opts.job_timeout              = job.timeout.value_or(opts.job_timeout);
+        job_opts.priority                 = job.priority.value_or(opts.priority);
+        sched.submit(job_opts.priority, [&, job_opts] {
+            if (opts.verbose) {
+                fmt::print("[-] Batch job '{:s}' -> '{:s}' ({:s})\n", job_opts.in_path,
+                           job_opts.outputs.front().out_path, to_string(job_opts.priority));
             }
-            const auto thin_stub_path = create_thin_stub_dylib(
-                fat_stub_filename, out_path, *stub_path, remove_sym_set, cpu_type);
-            if (thin_stub_path == std::nullopt) {
-                fmt::print("[!] Error generating stub dylib for arch {:s}!\n", to_string(cpu_type));
-                return false;
-            } else {
-                thin_stubs.emplace_back(*thin_stub_path);
+            if (!run_job(job_opts, sink, cache, &sched, trace, arrival_ms)) {
+                fmt::print("[!] Batch job '{:s}' failed\n", job_opts.in_path);
+                ++num_failed;
             }
+            latencies.add(job_opts.priority, std::chrono::steady_clock::now() - submitted);
+        });
+    }
+    sched.wait_idle();
+    num_failed += sched.failed();
+
+    if (opts.stats) {
+        latencies.print("Batch latency");
+        fmt::print("[-] {:d} jobs gave way to higher priority ones\n", sched.preemptions());
+    }
+    if (num_failed) {
+        fmt::print("[!] {:d} of {:d} batch jobs failed\n", num_failed.load(), jobs.size());
+    }
+    return !num_failed;
+}
+
+// The policy compiled in with DYLIBIFY_EMBEDDED_POLICY, if any.
+static std::optional<policy_table> embedded_policy() {
+#if defined(DYLIBIFY_EMBEDDED_POLICY)
+    auto policy = policy_table::view(dylibify_embedded_policy);
+    assert(policy != std::nullopt);
+    return policy;
+#else
+    return std::nullopt;
+#endif
+}
+
+// --compile-policy, the --index availability and the --remove-dylib and --keep-weak-def lists
+// as a policy table.
+static bool compile_policy_file(const fs::path &out_path,
+                                const std::optional<fs::path> &header_path,
+                                const std::optional<fs::path> &index_path,
+                                const std::vector<std::string> &remove_dylibs,
+                                const std::vector<std::string> &keep_weak_defs) {
+    std::vector<policy_entry> entries;
+    if (index_path != std::nullopt) {
+        const auto index = read_sdk_index(*index_path);
+        if (index == std::nullopt) {
+            return false;
+        }
+        for (const auto &[install_name, avail] : index->dylib_available) {
+            entries.emplace_back(policy_entry{
+                policy_domain::dylib, install_name,
+                avail ? policy_flags::available : policy_flags::unavailable});
         }
     }
+    for (const auto &dylib : remove_dylibs) {
+        entries.emplace_back(policy_entry{policy_domain::dylib, dylib, policy_flags::remove});
+    }
+    for (const auto &sym : keep_weak_defs) {
+        entries.emplace_back(policy_entry{policy_domain::symbol, sym, policy_flags::keep_weak_def});
+    }
+    const auto table = compile_policy(entries);
+    if (!write_file(out_path, table, io_mode::buffered)) {
+        return false;
+    }
+    fmt::print("[-] Compiled {:d} policy entries into '{:s}' ({:d} bytes)\n",
+               policy_table::view(table)->size(), out_path.string(), table.size());
+    return header_path == std::nullopt || write_policy_header(*header_path, table);
+}
 
-    if (thin_stubs.size()) {
+static bool unpack(const fs::path &pack_path, const fs::path &dest_dir, bool verbose) {
+    const auto reader = pack_reader::open(pack_path);
+    if (reader == std::nullopt) {
+        return false;
+    }
+    for (const auto &entry : reader->entries()) {
+        const auto rel_path = fs::path{entry.name}.relative_path().lexically_normal();
+        if (rel_path.empty() || *rel_path.begin() == "..") {
+            fmt::print("[!] Skipping pack entry '{:s}' outside of the destination\n", entry.name);
+            continue;
+        }
         if (verbose) {
-            fmt::print("[-] Generating fat stub dylib at '{:s}'\n", fat_stub_filename.string());
+            fmt::print("[-] Extracting '{:s}' ({:d} bytes)\n", entry.name, entry.size);
         }
-        if (!create_fat_stub_dylib(fat_stub_filename, out_path, thin_stubs)) {
-            fmt::print("[!] Error generating fat stub dylib!\n");
+        if (!reader->extract(entry, dest_dir / rel_path)) {
             return false;
         }
     }
-
-    binaries->write(out_path);
     return true;
 }
 
+static double percentile(std::vector<double> vals, double pct) {
+    if (vals.empty()) {
+        return 0;
+    }
+    std::sort(vals.begin(), vals.end());
+    const auto idx = (size_t)std::max(0.0, std::ceil(pct / 100 * vals.size()) - 1);
+    return vals[std::min(idx, vals.size() - 1)];
+}
+
+void latency_by_class::print(const char *what) const {
+    std::lock_guard lk{lock_};
+    for (size_t i = 0; i < num_job_priorities; ++i) {
+        if (ms_[i].empty()) {
+            continue;
+        }
+        fmt::print("[-] {:s} {:<11s} {:5d} jobs  p50 {:.3f} ms  p99 {:.3f} ms\n", what,
+                   to_string((job_priority)i), ms_[i].size(), percentile(ms_[i], 50),
+                   percentile(ms_[i], 99));
+    }
+}
+
+// Replays a trace against batch mode with synthetic inputs of the recorded sizes and slice
+// layouts, honoring the recorded arrival times scaled by 1/speed (0 submits everything at once)
+// and priority classes. Passes that depend on the host's dylibs or SDK (R, r, F) aren't
+// replayed.
+static bool replay(const fs::path &trace_path, double speed, const fs::path &work_dir,
+                   const dylibify_options &base_opts, output_sink &sink, conversion_cache &cache,
+                   size_t num_workers) {
+    auto records = read_trace(trace_path);
+    if (records == std::nullopt) {
+        return false;
+    }
+    if (records->empty()) {
+        fmt::print("[!] Trace '{:s}' has no jobs\n", trace_path.string());
+        return false;
+    }
+    std::stable_sort(records->begin(), records->end(),
+                     [](const job_record &a, const job_record &b) {
+                         return a.arrival_ms < b.arrival_ms;
+                     });
+    fs::create_directories(work_dir);
+
+    std::map<std::tuple<uint64_t, uint64_t, std::vector<uint32_t>>, std::vector<uint8_t>> inputs;
+    for (const auto &rec : *records) {
+        auto cputypes = rec.cputypes;
+        if (cputypes.empty()) {
+            cputypes.emplace_back((uint32_t)CPU_TYPES::CPU_TYPE_ARM64);
+        }
+        const auto key = std::make_tuple(rec.input_id, rec.input_size, rec.cputypes);
+        if (!inputs.contains(key)) {
+            inputs.emplace(key, synthesize_executable(cputypes, rec.input_size));
+        }
+    }
+    fmt::print("[-] Replaying {:d} jobs over {:d} synthetic inputs\n", records->size(),
+               inputs.size());
+
+    std::mutex results_lock;
+    std::vector<double> latencies, service_times, recorded_times;
+    latency_by_class class_latencies;
+    std::atomic<size_t> num_failed{0};
+    uint64_t bytes_in{0};
+    job_scheduler sched{num_workers};
+    const auto first_arrival = records->front().arrival_ms;
+    const auto replay_start  = std::chrono::steady_clock::now();
+    for (const auto &rec : *records) {
+        const auto due =
+            replay_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double, std::milli>(
+                                   speed > 0 ? (rec.arrival_ms - first_arrival) / speed : 0));
+        std::this_thread::sleep_until(due);
+
+        auto opts                 = base_opts;
+        opts.in_path              = fmt::format("replay-{:016x}", rec.input_id);
+        opts.remove_info_plist    = rec.flags.find('P') != std::string::npos;
+        opts.uncoalesce_weak_defs = rec.flags.find('W') != std::string::npos;
+        opts.rebase_self_binds    = rec.flags.find('B') != std::string::npos;
+        opts.merge_segments       = rec.flags.find('G') != std::string::npos;
+        auto primary              = opts.outputs.front();
+        primary.platform          = std::nullopt;
+        if (rec.flags.find('I') != std::string::npos) {
+            primary.platform = BuildVersion::PLATFORMS::IOS;
+        } else if (rec.flags.find('M') != std::string::npos) {
+            primary.platform = BuildVersion::PLATFORMS::MACOS;
+        }
+        primary.remove_dylibs.clear();
+        opts.priority = parse_priority(rec.priority).value_or(job_priority::normal);
+        opts.outputs.clear();
+        for (uint32_t i = 0; i < std::max(rec.num_outputs, 1u); ++i) {
+            primary.out_path =
+                (work_dir / fmt::format("{:016x}-{:d}.dylib", rec.input_id, i)).string();
+            opts.outputs.emplace_back(primary);
+        }
+
+        const auto &in_bytes =
+            inputs.at(std::make_tuple(rec.input_id, rec.input_size, rec.cputypes));
+        bytes_in += in_bytes.size();
+        sched.submit(opts.priority, [&, opts, due, recorded = rec.duration_ms] {
+            const auto start = std::chrono::steady_clock::now();
+            if (!run_cancellable(opts, in_bytes, sink, cache, &sched)) {
+                ++num_failed;
+            }
+            const auto end = std::chrono::steady_clock::now();
+            class_latencies.add(opts.priority, end - due);
+            std::lock_guard lk{results_lock};
+            latencies.emplace_back(std::chrono::duration<double, std::milli>(end - due).count());
+            service_times.emplace_back(
+                std::chrono::duration<double, std::milli>(end - start).count());
+            recorded_times.emplace_back(recorded);
+        });
+    }
+    sched.wait_idle();
+    num_failed += sched.failed();
+    const auto wall_s =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+
+    fmt::print("[-] Replayed {:d} jobs ({:d} failed) in {:.3f} s on {:d} workers\n",
+               records->size(), num_failed.load(), wall_s, num_workers);
+    fmt::print("[-] Throughput: {:.2f} jobs/s, {:.2f} MiB/s of input\n",
+               records->size() / wall_s, bytes_in / wall_s / (1024 * 1024));
+    fmt::print("[-] Latency (arrival to done):  p50 {:.3f} ms  p99 {:.3f} ms\n",
+               percentile(latencies, 50), percentile(latencies, 99));
+    fmt::print("[-] Service time:               p50 {:.3f} ms  p99 {:.3f} ms\n",
+               percentile(service_times, 50), percentile(service_times, 99));
+    fmt::print("[-] Recorded service time:      p50 {:.3f} ms  p99 {:.3f} ms\n",
+               percentile(recorded_times, 50), percentile(recorded_times, 99));
+    class_latencies.print("Latency");
+    fmt::print("[-] {:d} jobs gave way to higher priority ones\n", sched.preemptions());
+    return !num_failed;
+}
+
 int main(int argc, const char **argv) {
     argparse::ArgumentParser parser(getprogname());
-    parser.add_argument("-i", "--in").required().help("input Mach-O executable");
-    parser.add_argument("-o", "--out").required().help("output Mach-O dylib");
+    parser.add_argument("-i", "--in").help("input Mach-O executable");
+    parser.add_argument("-o", "--out").help("output Mach-O dylib");
     parser.add_argument("-d", "--dylib-path")
         .help("path for LC_ID_DYLIB command. e.g. @executable_path/Frameworks/libfoo.dylib");
     parser.add_argument("-r", "--remove-dylib")
@@ -459,6 +3168,131 @@ int main(int argc, const char **argv) {
         .default_value(false)
         .implicit_value(true)
         .help("patch platform to macOS");
+    parser.add_argument("--minos")
+        .default_value("11.0.0"s)
+        .help("minimum OS version for the new BUILD_VERSION command");
+    parser.add_argument("--sdk-version")
+        .default_value("11.0.0"s)
+        .help("SDK version for the new BUILD_VERSION command");
+    parser.add_argument("--variant")
+        .nargs(argparse::nargs_pattern::any)
+        .help("extra output from the same analysis, e.g. "
+              "out=foo-ios.dylib,platform=ios,minos=14.0,sdk=14.5,dylib-path=...,remove=a:b");
+    parser.add_argument("-F", "--flatten-reexports")
+        .default_value(false)
+        .implicit_value(true)
+        .help("bind re-exported symbols directly to the implementing dylib");
+    parser.add_argument("-S", "--sdk-root")
+        .default_value("/"s)
+        .help("root to resolve dependent dylibs under when indexing exports, also the SDK iOS "
+              "stubs are built against");
+    parser.add_argument("--stub-catalog")
+        .help("stub removed dylibs with whole-framework stubs built once from the SDK's .tbd "
+              "files and cached in this directory");
+    parser.add_argument("-W", "--uncoalesce-weak-defs")
+        .default_value(false)
+        .implicit_value(true)
+        .help("demote weak definitions that don't need cross-image coalescing");
+    parser.add_argument("--keep-weak-def")
+        .nargs(argparse::nargs_pattern::any)
+        .help("weak definition to keep coalesced with --uncoalesce-weak-defs");
+    parser.add_argument("-B", "--rebase-self-binds")
+        .default_value(false)
+        .implicit_value(true)
+        .help("turn binds to the image's own symbols into rebases, not for chained fixups");
+    parser.add_argument("-G", "--merge-segments")
+        .default_value(false)
+        .implicit_value(true)
+        .help("merge adjacent data segments dyld maps the same way, to save mappings at load");
+    parser.add_argument("--size-report")
+        .default_value(false)
+        .implicit_value(true)
+        .help("print input/output size breakdown and per-operation attribution");
+    parser.add_argument("--runtime-report")
+        .default_value(false)
+        .implicit_value(true)
+        .help("print the Objective-C and Swift runtime work the output does at load time");
+    parser.add_argument("--stats")
+        .default_value(false)
+        .implicit_value(true)
+        .help("print conversion statistics");
+    parser.add_argument("--batch").help(
+        "convert every '<input> <output>' line of this file, the other options apply to all jobs. "
+        "Separate the fields with tabs if the paths have spaces");
+    parser.add_argument("--pack").help(
+        "write all outputs and stub dylibs into this single pack file instead of separate files");
+    parser.add_argument("--durable")
+        .help("stage outputs and publish them all at once after a single sync, journaling the "
+              "staged files here so an interrupted run is cleaned up by the next one");
+    parser.add_argument("--unpack").help("extract the files of a pack written with --pack");
+    parser.add_argument("--unpack-to")
+        .default_value("."s)
+        .help("directory to extract --unpack entries under");
+    parser.add_argument("-j", "--jobs")
+        .default_value("1"s)
+        .help("number of conversion jobs to run at once for --batch and --replay");
+    parser.add_argument("--priority")
+        .default_value("normal"s)
+        .help("priority class of jobs without their own: interactive, normal or bulk");
+    parser.add_argument("--timeout")
+        .default_value("0"s)
+        .help("per-job deadline in seconds, 0 for none. Batch lines can override it");
+    parser.add_argument("--trace").help("append a record of every conversion job to this trace");
+    parser.add_argument("--replay").help(
+        "replay a --trace against batch mode with synthetic inputs and report latency");
+    parser.add_argument("--replay-speed")
+        .default_value("1"s)
+        .help("time scale for --replay arrivals, 0 submits every job at once");
+    parser.add_argument("--replay-dir")
+        .default_value("dylibify-replay"s)
+        .help("directory --replay writes its outputs to");
+    parser.add_argument("--profile").help(
+        "sample the conversion with a built-in profiler and write a pprof profile here");
+    parser.add_argument("--profile-hz")
+        .default_value("997"s)
+        .help("sampling frequency for --profile");
+    parser.add_argument("--bench").help(
+        "convert the single job this many times and report wall, CPU and I/O wait per phase");
+    parser.add_argument("--bench-cache")
+        .default_value("warm"s)
+        .help("page cache state for --bench runs: warm (after an untimed run) or cold (input "
+              "evicted before every run)");
+    parser.add_argument("--io-mode")
+        .default_value("buffered"s)
+        .help("how inputs and outputs go through the page cache: buffered, direct (O_DIRECT) or "
+              "dontneed (dropped after each file)");
+    parser.add_argument("--index").help(
+        "dylib availability and export index to use before probing the host and SDK, reloaded "
+        "whenever the file is replaced");
+    parser.add_argument("--write-index")
+        .help("write the --index contents plus everything learned during the run here");
+    parser.add_argument("--policy").help(
+        "compiled policy of dylibs to remove, dylib availability and weak defs to keep");
+    parser.add_argument("--usage-profile")
+        .help("pick which dylibs to drop, which symbols to weak import instead of stub and which "
+              "to bind at load from this profile of stub hits, first-call times and dylib use");
+    parser.add_argument("--compile-policy")
+        .help("compile the --index availability and the --remove-dylib and --keep-weak-def "
+              "lists into a policy file for --policy, then exit");
+    parser.add_argument("--compile-policy-header")
+        .help("with --compile-policy, also write a C++ header embedding it, for "
+              "-DDYLIBIFY_EMBEDDED_POLICY");
+    parser.add_argument("--apply-fixups")
+        .help("map this image at --fixup-slide, apply its rebases and binds and report fixups per "
+              "second and unresolved symbols, then exit");
+    parser.add_argument("--fixup-slide")
+        .default_value("0x100000"s)
+        .help("slide --apply-fixups loads the image at");
+    parser.add_argument("--fixup-dylib")
+        .nargs(argparse::nargs_pattern::any)
+        .help("Mach-O dylib to resolve --apply-fixups imports against, matched by install name "
+              "or file name. Falls back on dylibs next to the image, --index and --sdk-root");
+    parser.add_argument("--fixup-dump").help(
+        "with --apply-fixups, write each slice's fixed up image to this path plus .<arch>");
+    parser.add_argument("--engine")
+        .default_value("native"s)
+        .help("conversion engine: native (falls back to LIEF on images it can't edit), lief or "
+              "cross-check (both, failing if they disagree)");
     parser.add_argument("-V", "--verbose")
         .default_value(false)
         .implicit_value(true)
@@ -471,11 +3305,263 @@ int main(int argc, const char **argv) {
         return -1;
     }
 
-    const auto res = dylibify(
-        parser.get<std::string>("--in"), parser.get<std::string>("--out"),
-        parser.present("--dylib-path"), parser.get<std::vector<std::string>>("--remove-dylib"),
-        parser.get<bool>("--auto-remove-dylibs"), parser.get<bool>("--remove-info-plist"),
-        parser.get<bool>("--ios"), parser.get<bool>("--macos"), parser.get<bool>("--verbose"));
+    if (const auto pack_path = parser.present("--unpack")) {
+        return unpack(*pack_path, parser.get<std::string>("--unpack-to"),
+                      parser.get<bool>("--verbose"))
+                   ? 0
+                   : 1;
+    }
+
+    if (const auto policy_path = parser.present("--compile-policy")) {
+        const auto index_path = parser.present("--index");
+        return compile_policy_file(*policy_path, parser.present("--compile-policy-header"),
+                                   index_path ? std::optional<fs::path>{*index_path}
+                                              : std::nullopt,
+                                   parser.get<std::vector<std::string>>("--remove-dylib"),
+                                   parser.get<std::vector<std::string>>("--keep-weak-def"))
+                   ? 0
+                   : 1;
+    }
+
+    if (const auto image_path = parser.present("--apply-fixups")) {
+        char *end{nullptr};
+        const auto slide_str = parser.get<std::string>("--fixup-slide");
+        fixup_options fixup_opts;
+        fixup_opts.slide = strtoull(slide_str.c_str(), &end, 0);
+        if (slide_str.empty() || *end != '\0') {
+            fmt::print(stderr, "Error parsing arguments: bad --fixup-slide '{:s}'\n", slide_str);
+            return -1;
+        }
+        std::optional<sdk_index> index;
+        if (const auto index_path = parser.present("--index")) {
+            index = read_sdk_index(*index_path);
+            if (index == std::nullopt) {
+                return 1;
+            }
+            fixup_opts.index = &*index;
+        }
+        for (const auto &dylib : parser.get<std::vector<std::string>>("--fixup-dylib")) {
+            fixup_opts.dylibs.emplace_back(dylib);
+        }
+        fixup_opts.sdk_root = parser.get<std::string>("--sdk-root");
+        if (const auto dump_prefix = parser.present("--fixup-dump")) {
+            fixup_opts.dump_prefix = *dump_prefix;
+        }
+        fixup_opts.verbose = parser.get<bool>("--verbose");
+        return apply_fixups(*image_path, fixup_opts) ? 0 : 1;
+    }
+
+    const auto batch_path  = parser.present("--batch");
+    const auto replay_path = parser.present("--replay");
+    if (batch_path == std::nullopt && replay_path == std::nullopt &&
+        (!parser.present("--in") || !parser.present("--out"))) {
+        fmt::print(stderr, "Error parsing arguments: -i/--in and -o/--out are required\n");
+        return -1;
+    }
+    if (batch_path != std::nullopt && parser.is_used("--variant")) {
+        fmt::print(stderr, "Error parsing arguments: --variant can't be used with --batch\n");
+        return -1;
+    }
+
+    const auto ios   = parser.get<bool>("--ios");
+    const auto macos = parser.get<bool>("--macos");
+    assert(!(ios && macos));
+    const auto minos = parse_version(parser.get<std::string>("--minos"));
+    const auto sdk   = parse_version(parser.get<std::string>("--sdk-version"));
+    if (minos == std::nullopt || sdk == std::nullopt) {
+        fmt::print(stderr, "Error parsing arguments: bad --minos or --sdk-version\n");
+        return -1;
+    }
+
+    output_variant primary;
+    primary.out_path      = parser.present("--out").value_or("");
+    primary.dylib_path    = parser.present("--dylib-path");
+    primary.remove_dylibs = parser.get<std::vector<std::string>>("--remove-dylib");
+    if (ios) {
+        primary.platform = BuildVersion::PLATFORMS::IOS;
+    } else if (macos) {
+        primary.platform = BuildVersion::PLATFORMS::MACOS;
+    }
+    primary.minos = *minos;
+    primary.sdk   = *sdk;
+
+    dylibify_options opts;
+    opts.in_path = parser.present("--in").value_or("");
+    opts.outputs.emplace_back(primary);
+    for (const auto &spec : parser.get<std::vector<std::string>>("--variant")) {
+        auto variant = parse_variant(spec, primary);
+        if (variant == std::nullopt) {
+            return -1;
+        }
+        opts.outputs.emplace_back(std::move(*variant));
+    }
+    opts.auto_remove_dylibs   = parser.get<bool>("--auto-remove-dylibs");
+    opts.remove_info_plist    = parser.get<bool>("--remove-info-plist");
+    opts.flatten_reexports    = parser.get<bool>("--flatten-reexports");
+    opts.sdk_root             = parser.get<std::string>("--sdk-root");
+    if (const auto catalog = parser.present("--stub-catalog")) {
+        opts.stub_catalog = *catalog;
+    }
+    opts.uncoalesce_weak_defs = parser.get<bool>("--uncoalesce-weak-defs");
+    opts.keep_weak_defs       = parser.get<std::vector<std::string>>("--keep-weak-def");
+    opts.rebase_self_binds    = parser.get<bool>("--rebase-self-binds");
+    opts.merge_segments       = parser.get<bool>("--merge-segments");
+    opts.size_report          = parser.get<bool>("--size-report");
+    opts.runtime_report       = parser.get<bool>("--runtime-report");
+    opts.stats                = parser.get<bool>("--stats");
+    opts.verbose              = parser.get<bool>("--verbose");
+    const auto timeout        = parse_timeout(parser.get<std::string>("--timeout"));
+    if (timeout == std::nullopt) {
+        fmt::print(stderr, "Error parsing arguments: bad --timeout\n");
+        return -1;
+    }
+    opts.job_timeout = *timeout;
+    const auto priority = parse_priority(parser.get<std::string>("--priority"));
+    if (priority == std::nullopt) {
+        fmt::print(stderr, "Error parsing arguments: bad --priority\n");
+        return -1;
+    }
+    opts.priority = *priority;
+    const auto io = parse_io_mode(parser.get<std::string>("--io-mode"));
+    if (io == std::nullopt) {
+        fmt::print(stderr, "Error parsing arguments: bad --io-mode\n");
+        return -1;
+    }
+    opts.io           = *io;
+    const auto engine = parser.get<std::string>("--engine");
+    if (engine == "native") {
+        opts.engine = conversion_engine::native;
+    } else if (engine == "lief") {
+        opts.engine = conversion_engine::lief;
+    } else if (engine == "cross-check") {
+        opts.engine = conversion_engine::cross_check;
+    } else {
+        fmt::print(stderr, "Error parsing arguments: bad --engine\n");
+        return -1;
+    }
+    size_t num_workers{0};
+    const auto jobs_str = parser.get<std::string>("--jobs");
+    const auto jobs_res =
+        std::from_chars(jobs_str.data(), jobs_str.data() + jobs_str.size(), num_workers);
+    if (jobs_res.ec != std::errc{} || jobs_res.ptr != jobs_str.data() + jobs_str.size() ||
+        !num_workers) {
+        fmt::print(stderr, "Error parsing arguments: bad --jobs '{:s}'\n", jobs_str);
+        return -1;
+    }
+
+    const auto pack_path = parser.present("--pack");
+    file_sink files{opts.io};
+    std::optional<pack_sink> pack =
+        pack_path != std::nullopt ? pack_sink::create(*pack_path, opts.io) : std::nullopt;
+    if (pack_path != std::nullopt && pack == std::nullopt) {
+        return 1;
+    }
+    const auto journal_path = parser.present("--durable");
+    if (journal_path != std::nullopt && pack_path != std::nullopt) {
+        fmt::print(stderr, "Error parsing arguments: --durable doesn't apply to --pack\n");
+        return -1;
+    }
+    std::optional<durable_sink> durable =
+        journal_path != std::nullopt ? durable_sink::create(*journal_path, opts.io) : std::nullopt;
+    if (journal_path != std::nullopt && durable == std::nullopt) {
+        return 1;
+    }
+    output_sink *sink = &files;
+    if (pack != std::nullopt) {
+        sink = &*pack;
+    } else if (durable != std::nullopt) {
+        sink = &*durable;
+    }
+
+    const auto trace_path = parser.present("--trace");
+    std::optional<trace_writer> trace =
+        trace_path != std::nullopt ? trace_writer::open(*trace_path) : std::nullopt;
+    if (trace_path != std::nullopt && trace == std::nullopt) {
+        return 1;
+    }
+    auto *trace_ptr = trace != std::nullopt ? &*trace : nullptr;
+
+    const auto profile_path = parser.present("--profile");
+    uint32_t profile_hz{0};
+    const auto profile_hz_str = parser.get<std::string>("--profile-hz");
+    const auto profile_hz_res = std::from_chars(
+        profile_hz_str.data(), profile_hz_str.data() + profile_hz_str.size(), profile_hz);
+    if (profile_hz_res.ec != std::errc{} || !profile_hz || profile_hz > 100000) {
+        fmt::print(stderr, "Error parsing arguments: bad --profile-hz '{:s}'\n", profile_hz_str);
+        return -1;
+    }
+    sampling_profiler profiler{profile_hz};
+    if (profile_path != std::nullopt && !profiler.start()) {
+        return 1;
+    }
+
+    const auto policy_path = parser.present("--policy");
+    const auto policy =
+        policy_path != std::nullopt ? policy_table::map(*policy_path) : embedded_policy();
+    if (policy_path != std::nullopt && policy == std::nullopt) {
+        return 1;
+    }
+    if (policy != std::nullopt) {
+        opts.policy = &*policy;
+    }
+    std::optional<usage_profile> usage;
+    if (const auto usage_path = parser.present("--usage-profile")) {
+        usage = read_usage_profile(*usage_path);
+        if (usage == std::nullopt) {
+            return 1;
+        }
+        opts.usage = &*usage;
+    }
+
+    // dylib availability and export indexes only depend on the SDK, share them between jobs
+    conversion_cache cache;
+    std::optional<index_watcher> index_watch;
+    if (const auto index_path = parser.present("--index")) {
+        index_watch.emplace(*index_path, cache.indexes);
+        if (!index_watch->start()) {
+            return 1;
+        }
+    }
+
+    bool res{false};
+    if (replay_path != std::nullopt) {
+        char *end{nullptr};
+        const auto speed_str = parser.get<std::string>("--replay-speed");
+        const auto speed     = strtod(speed_str.c_str(), &end);
+        if (*end != '\0' || speed < 0) {
+            fmt::print(stderr, "Error parsing arguments: bad --replay-speed '{:s}'\n", speed_str);
+            return -1;
+        }
+        res = replay(*replay_path, speed, parser.get<std::string>("--replay-dir"), opts, *sink,
+                     cache, num_workers);
+    } else if (const auto bench_str = parser.present("--bench")) {
+        size_t runs{0};
+        const auto runs_res =
+            std::from_chars(bench_str->data(), bench_str->data() + bench_str->size(), runs);
+        const auto bench_mode = parse_bench_cache(parser.get<std::string>("--bench-cache"));
+        if (runs_res.ec != std::errc{} || !runs || bench_mode == std::nullopt) {
+            fmt::print(stderr, "Error parsing arguments: bad --bench or --bench-cache\n");
+            return -1;
+        }
+        res = run_bench(opts, *sink, cache, runs, *bench_mode);
+    } else if (batch_path != std::nullopt) {
+        const auto jobs = read_batch_file(*batch_path);
+        if (jobs == std::nullopt) {
+            return -1;
+        }
+        res = run_batch(opts, *jobs, *sink, cache, trace_ptr, num_workers);
+    } else {
+        res = run_job(opts, *sink, cache, nullptr, trace_ptr, wall_clock_ms());
+    }
+    res = sink->finish() && res;
+    if (const auto write_index_path = parser.present("--write-index")) {
+        res = write_sdk_index(*write_index_path, learned_index(cache)) && res;
+    }
+
+    if (profile_path != std::nullopt) {
+        profiler.stop();
+        res = profiler.write_pprof(*profile_path) && res;
+    }
 
     return res ? 0 : 1;
 }
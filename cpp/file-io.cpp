@@ -0,0 +1,269 @@
+#undef NDEBUG
+#include "file-io.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// logical block size of anything we're likely to run on, O_DIRECT offsets, sizes and buffers
+// have to be multiples of it
+constexpr size_t direct_align = 4096;
+constexpr size_t direct_chunk = 4 * 1024 * 1024;
+
+const std::array<const char *, 3> io_mode_names{"buffered", "direct", "dontneed"};
+
+struct aligned_free {
+    void operator()(uint8_t *p) const {
+        std::free(p);
+    }
+};
+using aligned_buffer = std::unique_ptr<uint8_t, aligned_free>;
+
+aligned_buffer make_aligned_buffer() {
+    return aligned_buffer{static_cast<uint8_t *>(std::aligned_alloc(direct_align, direct_chunk))};
+}
+
+// -1 if the platform or filesystem doesn't do O_DIRECT.
+int open_direct(const fs::path &path, int flags) {
+#if defined(O_DIRECT)
+    return ::open(path.c_str(), flags | O_DIRECT, 0666);
+#else
+    (void)path;
+    (void)flags;
+    return -1;
+#endif
+}
+
+std::optional<std::vector<uint8_t>> read_direct(const fs::path &path) {
+    const int fd = open_direct(path, O_RDONLY);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    struct stat st;
+    assert(!fstat(fd, &st));
+    std::vector<uint8_t> bytes(st.st_size);
+    auto buf = make_aligned_buffer();
+    bool ok{true};
+    for (size_t off = 0; ok && off < bytes.size(); off += direct_chunk) {
+        const auto want   = std::min(direct_chunk, bytes.size() - off);
+        const auto padded = (want + direct_align - 1) & ~(direct_align - 1);
+        // the last block comes back short
+        const auto res = pread(fd, buf.get(), padded, off);
+        ok             = res >= (ssize_t)want;
+        if (ok) {
+            std::memcpy(bytes.data() + off, buf.get(), want);
+        }
+    }
+    assert(!close(fd));
+    if (!ok) {
+        return std::nullopt;
+    }
+    return bytes;
+}
+
+bool write_direct(const fs::path &path, std::span<const uint8_t> bytes) {
+    const int fd = open_direct(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+        return false;
+    }
+    auto buf = make_aligned_buffer();
+    bool ok{true};
+    for (size_t off = 0; ok && off < bytes.size(); off += direct_chunk) {
+        const auto len    = std::min(direct_chunk, bytes.size() - off);
+        const auto padded = (len + direct_align - 1) & ~(direct_align - 1);
+        std::memcpy(buf.get(), bytes.data() + off, len);
+        std::memset(buf.get() + len, 0, padded - len);
+        ok = pwrite(fd, buf.get(), padded, off) == (ssize_t)padded;
+    }
+    // drop the padding of the last block
+    ok = ok && !ftruncate(fd, bytes.size());
+    assert(!close(fd));
+    return ok;
+}
+
+} // namespace
+
+const char *to_string(io_mode mode) {
+    return io_mode_names.at((size_t)mode);
+}
+
+std::optional<io_mode> parse_io_mode(const std::string &str) {
+    for (size_t i = 0; i < io_mode_names.size(); ++i) {
+        if (str == io_mode_names[i]) {
+            return (io_mode)i;
+        }
+    }
+    return std::nullopt;
+}
+
+void avoid_page_cache(int fd) {
+#if defined(__APPLE__)
+    fcntl(fd, F_NOCACHE, 1);
+#else
+    (void)fd;
+#endif
+}
+
+void drop_page_cache(int fd) {
+#if defined(__linux__)
+    // dirty pages can't be dropped, waiting for them is left to the batch's sync
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+#endif
+}
+
+bool evict_page_cache(const fs::path &path) {
+#if defined(__linux__)
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    const bool ok = !posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    assert(!close(fd));
+    return ok;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+bool fsync_path(const fs::path &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    const bool ok = !fsync(fd);
+    assert(!close(fd));
+    return ok;
+}
+
+bool sync_filesystems(const std::vector<fs::path> &files) {
+    std::set<fs::path> dirs;
+    for (const auto &file : files) {
+        dirs.emplace(file.parent_path().empty() ? fs::path{"."} : file.parent_path());
+    }
+#if defined(__linux__)
+    std::set<dev_t> synced;
+    for (const auto &dir : dirs) {
+        const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        assert(!fstat(fd, &st));
+        const bool ok = !synced.emplace(st.st_dev).second || !syncfs(fd);
+        assert(!close(fd));
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+#else
+    for (const auto &path : files) {
+        if (!fsync_path(path)) {
+            return false;
+        }
+    }
+    for (const auto &dir : dirs) {
+        if (!fsync_path(dir)) {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+std::optional<std::vector<uint8_t>> read_file(const fs::path &path, io_mode mode) {
+    if (mode == io_mode::direct) {
+        if (auto bytes = read_direct(path)) {
+            return bytes;
+        }
+    }
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fmt::print("[!] Couldn't open '{:s}': {:s}\n", path.string(), strerror(errno));
+        return std::nullopt;
+    }
+    if (mode != io_mode::buffered) {
+        avoid_page_cache(fd);
+    }
+    struct stat st;
+    bool ok = !fstat(fd, &st);
+    std::vector<uint8_t> bytes(ok ? st.st_size : 0);
+    errno = 0;
+    for (size_t off = 0; ok && off < bytes.size();) {
+        const auto res = pread(fd, bytes.data() + off, bytes.size() - off, off);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        // a file that shrank underneath us comes back short
+        ok = res > 0;
+        off += ok ? res : 0;
+    }
+    if (!ok) {
+        fmt::print("[!] Couldn't read '{:s}': {:s}\n", path.string(),
+                   errno ? strerror(errno) : "file shrank while reading");
+    }
+    if (mode != io_mode::buffered) {
+        drop_page_cache(fd);
+    }
+    assert(!close(fd));
+    if (!ok) {
+        return std::nullopt;
+    }
+    return bytes;
+}
+
+bool write_file(const fs::path &path, std::span<const uint8_t> bytes, io_mode mode) {
+    if (mode == io_mode::direct && write_direct(path, bytes)) {
+        return true;
+    }
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fmt::print("[!] Couldn't create '{:s}': {:s}\n", path.string(), strerror(errno));
+        return false;
+    }
+    if (mode != io_mode::buffered) {
+        avoid_page_cache(fd);
+    }
+    bool ok{true};
+    for (size_t off = 0; ok && off < bytes.size();) {
+        const auto res = pwrite(fd, bytes.data() + off, bytes.size() - off, off);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = res > 0;
+        off += ok ? res : 0;
+    }
+    if (ok && mode != io_mode::buffered) {
+        drop_page_cache(fd);
+    }
+    // delayed allocation can still fail on close, e.g. on NFS
+    ok = !close(fd) && ok;
+    if (!ok) {
+        fmt::print("[!] Couldn't write '{:s}': {:s}\n", path.string(), strerror(errno));
+    }
+    return ok;
+}
+
+std::string rest_of(std::istream &fields) {
+    std::string rest;
+    std::getline(fields >> std::ws, rest);
+    return rest;
+}
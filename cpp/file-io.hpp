@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// Whole-file reads and writes for job inputs and outputs, with a choice of how much they leave
+// behind in the page cache. Bulk runs stream far more data than they will ever read again, so
+// caching it only evicts the working sets of whatever else runs on the host.
+enum class io_mode {
+    // plain cached reads and writes
+    buffered,
+    // O_DIRECT through aligned bounce buffers (F_NOCACHE on macOS), dontneed where the
+    // filesystem refuses it
+    direct,
+    // cached, but the file's pages are written back and dropped once it is done with
+    dontneed,
+};
+
+const char *to_string(io_mode mode);
+std::optional<io_mode> parse_io_mode(const std::string &str);
+
+// Both report what went wrong and return nothing or false, an unreadable input or a full disk
+// only fails the job at hand.
+std::optional<std::vector<uint8_t>> read_file(const std::filesystem::path &path, io_mode mode);
+bool write_file(const std::filesystem::path &path, std::span<const uint8_t> bytes, io_mode mode);
+
+// For writers that manage their own descriptors. avoid_page_cache() is called right after
+// opening and only does anything where the platform can bypass the cache without alignment
+// rules. drop_page_cache() starts writing back what the descriptor dirtied without waiting for
+// it and evicts the pages that are already clean, the rest go with evict_page_cache() once a
+// sync covering the whole batch has written them.
+void avoid_page_cache(int fd);
+void drop_page_cache(int fd);
+
+// Evicts a clean file's cached pages so the next read goes to storage, false where the platform
+// can't.
+bool evict_page_cache(const std::filesystem::path &path);
+
+// fsync() of a file or directory by path.
+bool fsync_path(const std::filesystem::path &path);
+// Waits until everything written to the filesystems the files are on is on disk. One
+// syncfs() covers a whole filesystem however many files landed on it, elsewhere every file and
+// directory is fsynced.
+bool sync_filesystems(const std::vector<std::filesystem::path> &files);
+
+// For the line-oriented text files (--sdk-index, --usage-profile): the rest of the line after
+// the separating space, names may contain spaces of their own.
+std::string rest_of(std::istream &fields);
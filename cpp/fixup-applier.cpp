@@ -0,0 +1,771 @@
+#undef NDEBUG
+#include "fixup-applier.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string_view>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "file-io.hpp"
+#include "macho-view.hpp"
+#include "tbd-file.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t VM_PROT_WRITE = 0x2;
+
+constexpr int64_t BIND_SPECIAL_DYLIB_SELF            = 0;
+constexpr int64_t BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE = -1;
+constexpr int64_t BIND_SPECIAL_DYLIB_FLAT_LOOKUP     = -2;
+
+// every dependent dylib gets a made-up 4 GiB range after the image
+constexpr uint64_t dylib_stride = 1ull << 32;
+// for exports without an address of their own
+constexpr uint64_t synthetic_export_stride = 16;
+// page_start[] follows page_count directly, sizeof would include the struct's tail padding
+constexpr size_t chained_starts_size =
+    offsetof(macho::dyld_chained_starts_in_segment, page_count) + sizeof(uint16_t);
+// the top byte pointers carry through chained rebases
+constexpr uint64_t POINTER_HIGH8_MASK = 0xff00000000000000ull;
+
+template <typename T> T load(const uint8_t *p) {
+    T val;
+    std::memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+uint64_t bits(uint64_t val, unsigned shift, unsigned width) {
+    return (val >> shift) & ((1ull << width) - 1);
+}
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+bool is_dylib_load(uint32_t cmd) {
+    return cmd == macho::LC_LOAD_DYLIB || cmd == macho::LC_LOAD_WEAK_DYLIB ||
+           cmd == macho::LC_REEXPORT_DYLIB || cmd == macho::LC_LOAD_UPWARD_DYLIB ||
+           cmd == macho::LC_LAZY_LOAD_DYLIB;
+}
+
+std::string dylib_name(const macho::image &img, const macho::load_command_ref &lc) {
+    const auto *cmd  = img.command_at<macho::dylib_command>(lc.offset);
+    const auto *name = reinterpret_cast<const char *>(cmd) + cmd->name_offset;
+    return std::string{name, strnlen(name, lc.cmdsize - cmd->name_offset)};
+}
+
+// Where the mach header gets loaded, rebase targets of the offset formats are relative to it.
+uint64_t load_vmaddr(const std::vector<macho::segment_ref> &segs) {
+    for (const auto &seg : segs) {
+        if (seg.fileoff == 0 && seg.filesize) {
+            return seg.vmaddr;
+        }
+    }
+    return 0;
+}
+
+// __PAGEZERO and its like only reserve address space.
+bool is_mapped(const macho::segment_ref &seg) {
+    return seg.vmsize && (seg.filesize || seg.initprot);
+}
+
+bool is_thin_macho(std::span<const uint8_t> bytes) {
+    if (bytes.size() < sizeof(macho::mach_header)) {
+        return false;
+    }
+    const auto magic = load<uint32_t>(bytes.data());
+    return magic == macho::MH_MAGIC || magic == macho::MH_MAGIC_64;
+}
+
+bool is_macho(std::span<const uint8_t> file) {
+    return file.size() >= sizeof(macho::mach_header) &&
+           (macho::is_fat(file) || is_thin_macho(file));
+}
+
+// The slice of a possibly fat file for cputype.
+std::optional<std::span<const uint8_t>> slice_for(std::span<const uint8_t> file,
+                                                  uint32_t cputype) {
+    if (!is_macho(file)) {
+        return std::nullopt;
+    }
+    for (const auto &slice : macho::slices(file)) {
+        const auto bytes = file.subspan(slice.offset, slice.size);
+        if (slice.cputype == cputype && is_thin_macho(bytes)) {
+            return bytes;
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> id_dylib_name(std::span<const uint8_t> slice) {
+    const auto img = macho::image::read_only(slice);
+    const auto lc  = img.find_command(macho::LC_ID_DYLIB);
+    return lc ? std::optional{dylib_name(img, *lc)} : std::nullopt;
+}
+
+struct export_table {
+    std::string install_name;
+    // where the table came from, for --verbose
+    std::string source;
+    std::map<std::string, uint64_t, std::less<>> symbols;
+
+    std::optional<uint64_t> find(std::string_view symbol) const {
+        const auto it = symbols.find(symbol);
+        return it != symbols.end() ? std::optional{it->second} : std::nullopt;
+    }
+};
+
+export_table macho_exports(std::span<const uint8_t> slice, uint64_t base) {
+    const auto img = macho::image::read_only(slice);
+    export_table table;
+    table.install_name = id_dylib_name(slice).value_or("");
+    const auto vmaddr  = load_vmaddr(img.segments());
+    for (const auto &sym : macho::defined_symbols(img)) {
+        table.symbols.emplace(sym.name, base + (sym.address - vmaddr));
+    }
+    return table;
+}
+
+void add_synthetic_exports(export_table &table, uint64_t base,
+                           const std::vector<std::string> &names) {
+    for (const auto &name : names) {
+        table.symbols.emplace(name, base + (table.symbols.size() + 1) * synthetic_export_stride);
+    }
+}
+
+// An index entry's exports and, recursively, those of the dylibs it re-exports.
+void add_index_exports(export_table &table, uint64_t base, const export_index &index,
+                       const std::string &install_name, std::set<std::string> &visited) {
+    const auto it = index.find(install_name);
+    if (it == index.end() || !visited.emplace(install_name).second) {
+        return;
+    }
+    add_synthetic_exports(table, base, {it->second.exports.begin(), it->second.exports.end()});
+    for (const auto &reexport : it->second.reexports) {
+        add_index_exports(table, base, index, reexport, visited);
+    }
+}
+
+// The dylibs an image loads, by bind ordinal, each with an address for every symbol it exports.
+class import_resolver {
+public:
+    import_resolver(const macho::image &img, const fs::path &image_path,
+                    const fixup_options &opts, uint64_t dylibs_base) {
+        for (const auto &sym : macho::defined_symbols(img)) {
+            self_.symbols.emplace(sym.name, sym.address + opts.slide);
+        }
+        std::vector<std::vector<uint8_t>> given;
+        for (const auto &path : opts.dylibs) {
+            auto bytes = fs::exists(path) ? read_file(path, io_mode::buffered) : std::nullopt;
+            given.emplace_back(bytes ? std::move(*bytes) : std::vector<uint8_t>{});
+        }
+        for (const auto &lc : img.commands()) {
+            if (!is_dylib_load(lc.cmd)) {
+                continue;
+            }
+            const auto base = dylibs_base + dylibs_.size() * dylib_stride;
+            dylibs_.emplace_back(find_exports(img.cputype(), dylib_name(img, lc), base,
+                                              image_path, opts, given));
+        }
+    }
+
+    std::optional<uint64_t> resolve(int64_t ordinal, std::string_view symbol) const {
+        if (ordinal > 0) {
+            if ((uint64_t)ordinal > dylibs_.size() || dylibs_[ordinal - 1] == std::nullopt) {
+                return std::nullopt;
+            }
+            return dylibs_[ordinal - 1]->find(symbol);
+        }
+        if (ordinal == BIND_SPECIAL_DYLIB_SELF) {
+            return self_.find(symbol);
+        }
+        // the main executable, flat and weak lookups all search everything in load order
+        if (const auto addr = self_.find(symbol)) {
+            return addr;
+        }
+        for (const auto &dylib : dylibs_) {
+            if (dylib == std::nullopt) {
+                continue;
+            }
+            if (const auto addr = dylib->find(symbol)) {
+                return addr;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::string describe(int64_t ordinal) const {
+        if (ordinal > 0 && (uint64_t)ordinal <= dylibs_.size()) {
+            return names_[ordinal - 1];
+        }
+        switch (ordinal) {
+        case BIND_SPECIAL_DYLIB_SELF:
+            return "self";
+        case BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE:
+            return "main executable";
+        case BIND_SPECIAL_DYLIB_FLAT_LOOKUP:
+            return "flat lookup";
+        default:
+            return fmt::format("ordinal {:d}", ordinal);
+        }
+    }
+
+    std::vector<std::string> missing_dylibs() const {
+        std::vector<std::string> res;
+        for (size_t i = 0; i < dylibs_.size(); ++i) {
+            if (dylibs_[i] == std::nullopt) {
+                res.emplace_back(names_[i]);
+            }
+        }
+        return res;
+    }
+
+    void print_sources() const {
+        for (size_t i = 0; i < dylibs_.size(); ++i) {
+            if (dylibs_[i] != std::nullopt) {
+                fmt::print("[-] Resolving '{:s}' against {:s} ({:d} exports)\n", names_[i],
+                           dylibs_[i]->source, dylibs_[i]->symbols.size());
+            }
+        }
+    }
+
+private:
+    std::optional<export_table> find_exports(uint32_t cputype, const std::string &install_name,
+                                             uint64_t base, const fs::path &image_path,
+                                             const fixup_options &opts,
+                                             const std::vector<std::vector<uint8_t>> &given) {
+        names_.emplace_back(install_name);
+        const auto filename = fs::path{install_name}.filename();
+        for (size_t i = 0; i < given.size(); ++i) {
+            const auto slice = slice_for(given[i], cputype);
+            if (slice == std::nullopt) {
+                continue;
+            }
+            if (id_dylib_name(*slice) == install_name || opts.dylibs[i].filename() == filename) {
+                auto table   = macho_exports(*slice, base);
+                table.source = fmt::format("'{:s}'", opts.dylibs[i].string());
+                return table;
+            }
+        }
+        if (install_name.starts_with('@')) {
+            const auto beside = image_path.parent_path() / filename;
+            if (fs::is_regular_file(beside)) {
+                const auto bytes = read_file(beside, io_mode::buffered);
+                if (const auto slice = bytes ? slice_for(*bytes, cputype) : std::nullopt) {
+                    auto table   = macho_exports(*slice, base);
+                    table.source = fmt::format("'{:s}'", beside.string());
+                    return table;
+                }
+            }
+        }
+        const auto *index = opts.index ? opts.index->exports_for(cputype) : nullptr;
+        if (index && index->contains(install_name)) {
+            export_table table{install_name, "the export index", {}};
+            std::set<std::string> visited;
+            add_index_exports(table, base, *index, install_name, visited);
+            return table;
+        }
+        if (const auto tbd = find_tbd(opts.sdk_root, install_name)) {
+            if (const auto exports = read_tbd_exports(*tbd, macho::arch_name(cputype))) {
+                export_table table{install_name, fmt::format("'{:s}'", tbd->string()), {}};
+                add_synthetic_exports(table, base, {exports->begin(), exports->end()});
+                return table;
+            }
+        }
+        return std::nullopt;
+    }
+
+    export_table self_;
+    std::vector<std::optional<export_table>> dylibs_;
+    std::vector<std::string> names_;
+};
+
+// Anonymous memory standing in for the image's address range.
+class image_mapping {
+public:
+    explicit image_mapping(uint64_t size) : size_{size} {
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                          0);
+        assert(addr != MAP_FAILED);
+        data_ = static_cast<uint8_t *>(addr);
+    }
+    image_mapping(const image_mapping &) = delete;
+    ~image_mapping() {
+        munmap(data_, size_);
+    }
+
+    uint8_t *data() const {
+        return data_;
+    }
+    uint64_t size() const {
+        return size_;
+    }
+
+private:
+    uint8_t *data_;
+    uint64_t size_;
+};
+
+// Applies fixups to a mapped image and keeps the tally.
+class fixup_applier {
+public:
+    fixup_applier(const macho::image &img, image_mapping &mapping, uint64_t vmbase,
+                  const import_resolver &resolver, const fixup_options &opts, fixup_result &res)
+        : img_{img}, segs_{img.segments()}, mapping_{mapping}, vmbase_{vmbase},
+          resolver_{resolver}, opts_{opts}, res_{res} {}
+
+    bool apply_opcodes() {
+        const auto *info = img_.dyld_info();
+        if (!info) {
+            return true;
+        }
+        const auto ptr_size = img_.pointer_size();
+        const auto rebases  = macho::decode_rebases(
+            img_.bytes(info->rebase_off, info->rebase_size), ptr_size);
+        if (rebases == std::nullopt) {
+            fmt::print("[!] Couldn't decode the rebase opcodes\n");
+            return false;
+        }
+        for (const auto &rebase : *rebases) {
+            const auto off = location(rebase.seg_index, rebase.seg_offset);
+            if (off == std::nullopt || (rebase.type != macho::REBASE_TYPE_POINTER &&
+                                        rebase.type != REBASE_TYPE_TEXT_ABSOLUTE32)) {
+                fmt::print("[!] Bad rebase at segment {:d} offset {:#x}\n", rebase.seg_index,
+                           rebase.seg_offset);
+                return false;
+            }
+            const auto size = rebase.type == macho::REBASE_TYPE_POINTER ? ptr_size : 4;
+            write(*off, read(*off, size) + opts_.slide, size);
+            rebased_.emplace_back(*off);
+        }
+        res_.rebases += rebases->size();
+
+        const std::array<std::pair<macho::bind_kind, std::span<const uint8_t>>, 3> streams{{
+            {macho::bind_kind::regular, img_.bytes(info->bind_off, info->bind_size)},
+            {macho::bind_kind::weak, img_.bytes(info->weak_bind_off, info->weak_bind_size)},
+            {macho::bind_kind::lazy, img_.bytes(info->lazy_bind_off, info->lazy_bind_size)},
+        }};
+        for (const auto &[kind, opcodes] : streams) {
+            const auto binds = macho::decode_binds(opcodes, ptr_size, kind);
+            if (binds == std::nullopt) {
+                fmt::print("[!] Couldn't decode the bind opcodes (threaded binds?)\n");
+                return false;
+            }
+            if (!apply_binds(*binds, kind)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool apply_chained() {
+        const auto lc = img_.find_command(macho::LC_DYLD_CHAINED_FIXUPS);
+        if (!lc) {
+            return true;
+        }
+        res_.chained    = true;
+        const auto *cmd = img_.command_at<macho::linkedit_data_command>(lc->offset);
+        const auto blob = img_.bytes(cmd->dataoff, cmd->datasize);
+        if (blob.size() < sizeof(macho::dyld_chained_fixups_header)) {
+            fmt::print("[!] Truncated chained fixups\n");
+            return false;
+        }
+        const auto hdr = load<macho::dyld_chained_fixups_header>(blob.data());
+        if (hdr.starts_offset + sizeof(uint32_t) > blob.size()) {
+            fmt::print("[!] Truncated chained fixups\n");
+            return false;
+        }
+        if (hdr.symbols_format) {
+            fmt::print("[!] Compressed chained fixup symbols aren't supported\n");
+            return false;
+        }
+        if (!resolve_chained_imports(blob, hdr)) {
+            return false;
+        }
+
+        const auto *starts   = blob.data() + hdr.starts_offset;
+        const auto seg_count = load<uint32_t>(starts);
+        if (hdr.starts_offset + (1 + (uint64_t)seg_count) * sizeof(uint32_t) > blob.size()) {
+            fmt::print("[!] Truncated chained fixups\n");
+            return false;
+        }
+        const auto image_off = load_vmaddr(segs_) - vmbase_;
+        for (uint32_t seg = 0; seg < seg_count; ++seg) {
+            const auto info_off = load<uint32_t>(starts + (1 + seg) * sizeof(uint32_t));
+            if (!info_off) {
+                continue;
+            }
+            if (hdr.starts_offset + info_off + chained_starts_size > blob.size()) {
+                fmt::print("[!] Truncated chained fixups\n");
+                return false;
+            }
+            const auto *seg_starts = starts + info_off;
+            const auto info        = load<macho::dyld_chained_starts_in_segment>(seg_starts);
+            if (hdr.starts_offset + info_off + chained_starts_size +
+                    info.page_count * sizeof(uint16_t) >
+                blob.size()) {
+                fmt::print("[!] Truncated chained fixups\n");
+                return false;
+            }
+            for (uint16_t page = 0; page < info.page_count; ++page) {
+                const auto start =
+                    load<uint16_t>(seg_starts + chained_starts_size + page * sizeof(uint16_t));
+                if (start == macho::DYLD_CHAINED_PTR_START_NONE) {
+                    continue;
+                }
+                if (start & macho::DYLD_CHAINED_PTR_START_MULTI) {
+                    fmt::print("[!] Chains with several starts per page aren't supported\n");
+                    return false;
+                }
+                const auto off =
+                    image_off + info.segment_offset + (uint64_t)page * info.page_size + start;
+                if (!walk_chain(off, info.pointer_format)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Rebased pointers have to land inside the slid image.
+    void check_rebases() {
+        const auto begin = vmbase_ + opts_.slide;
+        const auto end   = begin + mapping_.size();
+        for (const auto off : rebased_) {
+            const auto size = img_.pointer_size();
+            const auto ptr  = size == 8 ? read(off, 8) & ~POINTER_HIGH8_MASK : read(off, 4);
+            if (ptr < begin || ptr >= end) {
+                ++res_.bad_rebases;
+            }
+        }
+    }
+
+    std::vector<std::string> unresolved() const {
+        return {unresolved_.begin(), unresolved_.end()};
+    }
+
+private:
+    static constexpr uint8_t REBASE_TYPE_TEXT_ABSOLUTE32 = 2;
+
+    std::optional<uint64_t> location(uint8_t seg_index, uint64_t seg_offset) const {
+        if (seg_index >= segs_.size()) {
+            return std::nullopt;
+        }
+        const auto &seg = segs_[seg_index];
+        if (!is_mapped(seg) || seg_offset + img_.pointer_size() > seg.vmsize) {
+            return std::nullopt;
+        }
+        return seg.vmaddr - vmbase_ + seg_offset;
+    }
+
+    uint64_t read(uint64_t off, uint8_t size) const {
+        return size == 8 ? load<uint64_t>(mapping_.data() + off)
+                         : load<uint32_t>(mapping_.data() + off);
+    }
+
+    void write(uint64_t off, uint64_t val, uint8_t size) {
+        if (size == 8) {
+            std::memcpy(mapping_.data() + off, &val, sizeof(val));
+        } else {
+            const uint32_t val32 = val;
+            std::memcpy(mapping_.data() + off, &val32, sizeof(val32));
+        }
+    }
+
+    // nullopt for unresolved imports, which are recorded, and 0 for missing weak imports
+    std::optional<uint64_t> resolve(int64_t ordinal, std::string_view symbol, bool weak_import) {
+        if (const auto addr = resolver_.resolve(ordinal, symbol)) {
+            return addr;
+        }
+        if (weak_import) {
+            ++res_.missing_weak;
+            return 0;
+        }
+        unresolved_.emplace(fmt::format("{:s} ({:s})", symbol, resolver_.describe(ordinal)));
+        return std::nullopt;
+    }
+
+    bool apply_binds(const std::vector<macho::bind_entry> &binds, macho::bind_kind kind) {
+        const auto ptr_size = img_.pointer_size();
+        // consecutive binds of one symbol are common, dyld only looks it up once too
+        std::optional<std::pair<int64_t, std::string_view>> last;
+        std::optional<uint64_t> last_addr;
+        for (const auto &bind : binds) {
+            if (!bind.has_location) {
+                continue;
+            }
+            const auto off = location(bind.seg_index, bind.seg_offset);
+            if (off == std::nullopt || bind.type != macho::BIND_TYPE_POINTER) {
+                fmt::print("[!] Bad bind of '{:s}' at segment {:d} offset {:#x}\n", bind.symbol,
+                           bind.seg_index, bind.seg_offset);
+                return false;
+            }
+            ++res_.binds;
+            if (kind == macho::bind_kind::weak) {
+                // coalesces onto the first definition in load order. The image is loaded as if
+                // it were the main executable, so its own definition wins over its dependents'
+                if (const auto addr = resolver_.resolve(BIND_SPECIAL_DYLIB_FLAT_LOOKUP,
+                                                        bind.symbol)) {
+                    write(*off, *addr + bind.addend, ptr_size);
+                }
+                continue;
+            }
+            if (last != std::pair{bind.ordinal, bind.symbol}) {
+                last      = std::pair{bind.ordinal, bind.symbol};
+                last_addr = resolve(bind.ordinal, bind.symbol,
+                                    bind.symbol_flags & macho::BIND_SYMBOL_FLAGS_WEAK_IMPORT);
+            }
+            if (last_addr != std::nullopt) {
+                write(*off, *last_addr ? *last_addr + bind.addend : 0, ptr_size);
+            }
+        }
+        return true;
+    }
+
+    bool resolve_chained_imports(std::span<const uint8_t> blob,
+                                 const macho::dyld_chained_fixups_header &hdr) {
+        size_t import_size{0};
+        switch (hdr.imports_format) {
+        case macho::DYLD_CHAINED_IMPORT:
+            import_size = sizeof(uint32_t);
+            break;
+        case macho::DYLD_CHAINED_IMPORT_ADDEND:
+            import_size = 2 * sizeof(uint32_t);
+            break;
+        case macho::DYLD_CHAINED_IMPORT_ADDEND64:
+            import_size = 2 * sizeof(uint64_t);
+            break;
+        default:
+            fmt::print("[!] Unknown chained import format {:d}\n", hdr.imports_format);
+            return false;
+        }
+        if (hdr.imports_offset + (uint64_t)hdr.imports_count * import_size > blob.size() ||
+            hdr.symbols_offset > blob.size()) {
+            fmt::print("[!] Truncated chained fixup imports\n");
+            return false;
+        }
+        const auto symbols = blob.subspan(hdr.symbols_offset);
+        imports_.clear();
+        imports_.reserve(hdr.imports_count);
+        for (uint32_t i = 0; i < hdr.imports_count; ++i) {
+            const auto *imp = blob.data() + hdr.imports_offset + i * import_size;
+            int64_t ordinal;
+            bool weak_import;
+            uint64_t name_off;
+            int64_t addend{0};
+            if (hdr.imports_format == macho::DYLD_CHAINED_IMPORT_ADDEND64) {
+                const auto raw = load<uint64_t>(imp);
+                ordinal        = bits(raw, 0, 16) > 0xfff0 ? (int16_t)raw : bits(raw, 0, 16);
+                weak_import    = bits(raw, 16, 1);
+                name_off       = bits(raw, 32, 32);
+                addend         = load<int64_t>(imp + sizeof(uint64_t));
+            } else {
+                const auto raw = load<uint32_t>(imp);
+                ordinal        = bits(raw, 0, 8) > 0xf0 ? (int8_t)raw : bits(raw, 0, 8);
+                weak_import    = bits(raw, 8, 1);
+                name_off       = bits(raw, 9, 23);
+                if (hdr.imports_format == macho::DYLD_CHAINED_IMPORT_ADDEND) {
+                    addend = load<int32_t>(imp + sizeof(uint32_t));
+                }
+            }
+            if (name_off >= symbols.size()) {
+                fmt::print("[!] Chained import {:d} has a bad name offset\n", i);
+                return false;
+            }
+            const auto *name = reinterpret_cast<const char *>(symbols.data() + name_off);
+            const auto addr =
+                resolve(ordinal, {name, strnlen(name, symbols.size() - name_off)}, weak_import);
+            imports_.emplace_back(addr != std::nullopt && *addr ? std::optional{*addr + addend}
+                                                                : addr);
+        }
+        return true;
+    }
+
+    bool walk_chain(uint64_t off, uint16_t format) {
+        if (!macho::is_supported_chained_format(format)) {
+            fmt::print("[!] Chained pointer format {:d} isn't supported\n", format);
+            return false;
+        }
+        const auto stride    = macho::chained_stride(format);
+        const auto load_addr = load_vmaddr(segs_) + opts_.slide;
+        for (;;) {
+            if (off + sizeof(uint64_t) > mapping_.size()) {
+                fmt::print("[!] Fixup chain runs off the image at {:#x}\n", vmbase_ + off);
+                return false;
+            }
+            const auto ptr = macho::decode_chained_pointer(read(off, 8), format);
+            uint64_t val{0};
+            if (ptr.import != std::nullopt) {
+                if (*ptr.import >= imports_.size()) {
+                    fmt::print("[!] Chained bind to import {:d} of {:d}\n", *ptr.import,
+                               imports_.size());
+                    return false;
+                }
+                const auto target = imports_[*ptr.import];
+                // unresolved imports were recorded already, they're left null
+                val = target != std::nullopt && *target ? *target + ptr.addend : 0;
+                ++res_.binds;
+            } else {
+                // no pointer authentication here, signed rebases get just their target
+                val = (ptr.vmaddr_target ? ptr.target + opts_.slide : load_addr + ptr.target) |
+                      (uint64_t)ptr.high8 << 56;
+                rebased_.emplace_back(off);
+                ++res_.rebases;
+            }
+            write(off, val, 8);
+            if (!ptr.next) {
+                return true;
+            }
+            off += ptr.next * stride;
+        }
+    }
+
+    const macho::image &img_;
+    std::vector<macho::segment_ref> segs_;
+    image_mapping &mapping_;
+    uint64_t vmbase_;
+    const import_resolver &resolver_;
+    const fixup_options &opts_;
+    fixup_result &res_;
+    // resolved address plus addend of every chained import
+    std::vector<std::optional<uint64_t>> imports_;
+    std::vector<uint64_t> rebased_;
+    std::set<std::string> unresolved_;
+};
+
+} // namespace
+
+std::optional<fixup_result> apply_slice_fixups(std::span<const uint8_t> slice,
+                                               const fs::path &image_path,
+                                               const fixup_options &opts) {
+    const auto img  = macho::image::read_only(slice);
+    const auto segs = img.segments();
+    fixup_result res;
+    res.cputype = img.cputype();
+
+    uint64_t vmbase{UINT64_MAX}, vmend{0};
+    for (const auto &seg : segs) {
+        if (!is_mapped(seg)) {
+            continue;
+        }
+        if (seg.fileoff + std::min(seg.filesize, seg.vmsize) > slice.size()) {
+            fmt::print("[!] Segment '{:s}' is past the end of the file\n", seg.name);
+            return std::nullopt;
+        }
+        vmbase = std::min(vmbase, seg.vmaddr);
+        vmend  = std::max(vmend, seg.vmaddr + seg.vmsize);
+        ++res.segments;
+    }
+    if (!res.segments) {
+        fmt::print("[!] Nothing to map\n");
+        return std::nullopt;
+    }
+
+    // dependent dylibs go above the slid image, aligned so their symbols are easy to tell apart
+    const auto dylibs_base = (vmend + opts.slide + dylib_stride) & ~(dylib_stride - 1);
+    const import_resolver resolver{img, image_path, opts, dylibs_base};
+    if (opts.verbose) {
+        resolver.print_sources();
+    }
+    res.missing_dylibs = resolver.missing_dylibs();
+
+    const auto map_start = std::chrono::steady_clock::now();
+    image_mapping mapping{vmend - vmbase};
+    for (const auto &seg : segs) {
+        if (is_mapped(seg)) {
+            std::memcpy(mapping.data() + (seg.vmaddr - vmbase), slice.data() + seg.fileoff,
+                        std::min(seg.filesize, seg.vmsize));
+        }
+    }
+    res.map_ms       = ms_since(map_start);
+    res.mapped_bytes = mapping.size();
+
+    fixup_applier applier{img, mapping, vmbase, resolver, opts, res};
+    const auto fixup_start = std::chrono::steady_clock::now();
+    if (!applier.apply_opcodes() || !applier.apply_chained()) {
+        return std::nullopt;
+    }
+    res.fixup_ms = ms_since(fixup_start);
+    applier.check_rebases();
+    res.unresolved = applier.unresolved();
+
+    // drop write access where dyld would once fixups are done, nothing here is ever executable
+    const auto page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    for (const auto &seg : segs) {
+        const auto off = seg.vmaddr - vmbase;
+        if (is_mapped(seg) && !(seg.initprot & VM_PROT_WRITE) && off % page_size == 0 &&
+            seg.vmsize % page_size == 0) {
+            assert(!mprotect(mapping.data() + off, seg.vmsize, PROT_READ));
+        }
+    }
+    if (opts.dump_prefix != std::nullopt) {
+        auto dump_path = *opts.dump_prefix;
+        dump_path += "." + macho::arch_name(res.cputype);
+        if (!write_file(dump_path, {mapping.data(), mapping.size()}, io_mode::buffered)) {
+            fmt::print("[!] Couldn't write '{:s}'\n", dump_path.string());
+            return std::nullopt;
+        }
+    }
+    return res;
+}
+
+bool apply_fixups(const fs::path &path, const fixup_options &opts) {
+    if (!fs::is_regular_file(path)) {
+        fmt::print("[!] '{:s}' doesn't exist\n", path.string());
+        return false;
+    }
+    const auto contents = read_file(path, io_mode::buffered);
+    if (contents == std::nullopt) {
+        return false;
+    }
+    const auto &file = *contents;
+    if (!is_macho(file)) {
+        fmt::print("[!] '{:s}' isn't a Mach-O\n", path.string());
+        return false;
+    }
+    bool good{true};
+    for (const auto &slice : macho::slices(file)) {
+        const auto arch = macho::arch_name(slice.cputype);
+        const auto res =
+            apply_slice_fixups(std::span{file}.subspan(slice.offset, slice.size), path, opts);
+        if (res == std::nullopt) {
+            fmt::print("[!] {:s}: couldn't apply fixups\n", arch);
+            good = false;
+            continue;
+        }
+        const auto num_fixups = res->rebases + res->binds;
+        fmt::print("[-] {:s}: mapped {:d} segments ({:d} KiB) at slide {:#x} in {:.3f} ms\n", arch,
+                   res->segments, res->mapped_bytes / 1024, opts.slide, res->map_ms);
+        fmt::print("[-] {:s}: applied {:d} rebases and {:d} binds from {:s} in {:.3f} ms, {:.0f} "
+                   "fixups/s\n",
+                   arch, res->rebases, res->binds, res->chained ? "fixup chains" : "opcodes",
+                   res->fixup_ms, res->fixup_ms > 0 ? num_fixups / (res->fixup_ms / 1e3) : 0.0);
+        if (res->missing_weak) {
+            fmt::print("[-] {:s}: {:d} weak imports have no definition and are null\n", arch,
+                       res->missing_weak);
+        }
+        for (const auto &dylib : res->missing_dylibs) {
+            fmt::print("[!] {:s}: no export table for '{:s}'\n", arch, dylib);
+        }
+        for (const auto &sym : res->unresolved) {
+            fmt::print("[!] {:s}: unresolved symbol {:s}\n", arch, sym);
+        }
+        if (res->bad_rebases) {
+            fmt::print("[!] {:s}: {:d} rebased pointers point outside the image\n", arch,
+                       res->bad_rebases);
+        }
+        good = good && res->unresolved.empty() && !res->bad_rebases;
+    }
+    return good;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "sdk-index.hpp"
+
+// Loads an output the way dyld would, short of running it: maps every slice's segments into
+// anonymous memory at a chosen slide and applies its rebases and binds, from the opcode streams
+// or the chained fixups. Checks outputs and gives a feel for what they cost at launch without
+// Apple hardware.
+//
+// Binds resolve against export tables for the dylibs the image loads, the first of
+//   - a Mach-O passed as an export table, matched by install name or file name
+//   - a Mach-O next to the image for @-relative install names, like the generated stub
+//   - the --index export index
+//   - the SDK's .tbd, whose Objective-C classes also provide their metaclass symbols
+// Symbols without an address of their own (index and tbd exports) get a distinct one inside the
+// dylib's made-up load address range.
+struct fixup_options {
+    uint64_t slide{0};
+    // Mach-O dylibs to resolve imports against
+    std::vector<std::filesystem::path> dylibs;
+    std::filesystem::path sdk_root{"/"};
+    const sdk_index *index{nullptr};
+    // writes each slice's fixed up image to <prefix>.<arch>
+    std::optional<std::filesystem::path> dump_prefix;
+    bool verbose{false};
+};
+
+struct fixup_result {
+    uint32_t cputype{0};
+    bool chained{false};
+    size_t segments{0};
+    uint64_t mapped_bytes{0};
+    size_t rebases{0};
+    size_t binds{0};
+    // rebases that don't point into the image after sliding
+    size_t bad_rebases{0};
+    // weak imports nothing defines, bound to 0 like dyld does
+    size_t missing_weak{0};
+    // "<symbol> (<install name>)", sorted
+    std::vector<std::string> unresolved;
+    // install names no export table was found for
+    std::vector<std::string> missing_dylibs;
+    double map_ms{0};
+    double fixup_ms{0};
+};
+
+// For one thin slice, nullopt if it can't be loaded (malformed or unsupported fixups).
+std::optional<fixup_result> apply_slice_fixups(std::span<const uint8_t> slice,
+                                               const std::filesystem::path &image_path,
+                                               const fixup_options &opts);
+
+// Applies the fixups of every slice of the image at path and prints what it took, false if a
+// slice couldn't be loaded or has unresolved imports or rebases outside the image.
+bool apply_fixups(const std::filesystem::path &path, const fixup_options &opts);
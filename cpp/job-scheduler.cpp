@@ -0,0 +1,215 @@
+#undef NDEBUG
+#include "job-scheduler.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include <fmt/format.h>
+
+namespace {
+
+constexpr uint64_t stride_scale = 1 << 20;
+
+const std::array<const char *, num_job_priorities> priority_names{"interactive", "normal",
+                                                                  "bulk"};
+
+} // namespace
+
+const char *to_string(job_priority prio) {
+    return priority_names.at((size_t)prio);
+}
+
+std::optional<job_priority> parse_priority(const std::string &str) {
+    for (size_t i = 0; i < priority_names.size(); ++i) {
+        if (str == priority_names[i]) {
+            return (job_priority)i;
+        }
+    }
+    return std::nullopt;
+}
+
+job_scheduler::job_scheduler(size_t slots, const weights &class_weights,
+                             task_runtime &runtime)
+    : runtime_{runtime}, free_slots_{slots} {
+    assert(slots > 0);
+    for (size_t i = 0; i < num_job_priorities; ++i) {
+        assert(class_weights[i] > 0);
+        strides_[i] = stride_scale / class_weights[i];
+    }
+}
+
+job_scheduler::~job_scheduler() {
+    wait_idle();
+}
+
+void job_scheduler::submit(job_priority prio, std::function<void()> job) {
+    size_t runners;
+    {
+        std::lock_guard lk{lock_};
+        auto &queue = queues_[(size_t)prio];
+        if (queue.empty()) {
+            // a class coming back from idle doesn't get credit for the time it wasn't competing
+            passes_[(size_t)prio] = std::max(passes_[(size_t)prio], vtime_);
+        }
+        queue.emplace_back(std::move(job));
+        ++unfinished_;
+        runners = dispatch();
+    }
+    spawn_runners(runners);
+}
+
+void job_scheduler::wait_idle() {
+    runtime_.help_until(
+        [&] {
+            std::lock_guard lk{lock_};
+            return !unfinished_;
+        },
+        true);
+}
+
+void job_scheduler::yield(job_priority prio) {
+    size_t runners;
+    {
+        std::lock_guard lk{lock_};
+        if (free_slots_ || !has_queued_above(prio)) {
+            return;
+        }
+        ++free_slots_;
+        ++preemptions_;
+        ++parked_[(size_t)prio];
+        runners = dispatch();
+    }
+    spawn_runners(runners);
+    // the jobs run meanwhile are of higher classes, dispatch holds everything else back
+    runtime_.help_until(
+        [&] {
+            std::lock_guard lk{lock_};
+            if (!free_slots_ || has_queued_above(prio)) {
+                return false;
+            }
+            --free_slots_;
+            --parked_[(size_t)prio];
+            return true;
+        },
+        true);
+    {
+        std::lock_guard lk{lock_};
+        // lower classes held back for us may have free slots to go to now
+        runners = dispatch();
+    }
+    spawn_runners(runners);
+}
+
+size_t job_scheduler::preemptions() const {
+    std::lock_guard lk{lock_};
+    return preemptions_;
+}
+
+size_t job_scheduler::failed() const {
+    std::lock_guard lk{lock_};
+    return failed_;
+}
+
+size_t job_scheduler::dispatch() {
+    size_t runners{0};
+    const auto dispatchable = num_dispatchable();
+    while (free_slots_ && dispatched_ < dispatchable) {
+        --free_slots_;
+        ++dispatched_;
+        ++runners;
+    }
+    return runners;
+}
+
+void job_scheduler::spawn_runners(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        runtime_.spawn_job([this] { run_one(); });
+    }
+}
+
+void job_scheduler::run_one() {
+    // the job is only picked once the runner starts so the stride order sees everything queued
+    // until then
+    std::optional<std::function<void()>> job;
+    {
+        std::lock_guard lk{lock_};
+        --dispatched_;
+        job = pick();
+        if (job == std::nullopt) {
+            // a job parked since this was dispatched and holds the queue back
+            ++free_slots_;
+        }
+    }
+    bool threw{false};
+    if (job != std::nullopt) {
+        // a runner must not take its worker down, and its slot has to be given back
+        try {
+            (*job)();
+        } catch (const std::exception &e) {
+            fmt::print("[!] Job failed: {:s}\n", e.what());
+            threw = true;
+        } catch (...) {
+            fmt::print("[!] Job failed\n");
+            threw = true;
+        }
+    }
+    // the scheduler may be gone once the last job is finished
+    auto &runtime = runtime_;
+    size_t runners;
+    {
+        std::lock_guard lk{lock_};
+        if (job != std::nullopt) {
+            ++free_slots_;
+            --unfinished_;
+        }
+        failed_ += threw;
+        runners = dispatch();
+    }
+    if (runners) {
+        spawn_runners(runners);
+    }
+    runtime.wake();
+}
+
+size_t job_scheduler::dispatch_limit() const {
+    for (size_t i = 0; i < num_job_priorities; ++i) {
+        if (parked_[i]) {
+            return i;
+        }
+    }
+    return num_job_priorities;
+}
+
+size_t job_scheduler::num_dispatchable() const {
+    size_t num{0};
+    for (size_t i = 0; i < dispatch_limit(); ++i) {
+        num += queues_[i].size();
+    }
+    return num;
+}
+
+bool job_scheduler::has_queued_above(job_priority prio) const {
+    for (size_t i = 0; i < (size_t)prio; ++i) {
+        if (!queues_[i].empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::optional<std::function<void()>> job_scheduler::pick() {
+    std::optional<size_t> best;
+    for (size_t i = 0; i < dispatch_limit(); ++i) {
+        if (!queues_[i].empty() && (best == std::nullopt || passes_[i] < passes_[*best])) {
+            best = i;
+        }
+    }
+    if (best == std::nullopt) {
+        return std::nullopt;
+    }
+    vtime_ = passes_[*best];
+    passes_[*best] += strides_[*best];
+    auto job = std::move(queues_[*best].front());
+    queues_[*best].pop_front();
+    return job;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "task-runtime.hpp"
+
+enum class job_priority {
+    interactive,
+    normal,
+    bulk,
+};
+constexpr size_t num_job_priorities = 3;
+
+const char *to_string(job_priority prio);
+std::optional<job_priority> parse_priority(const std::string &str);
+
+// Runs jobs on a fixed number of slots with one FIFO queue per priority class. Classes share the
+// slots by stride scheduling on their weights, so bulk work still progresses while interactive
+// jobs are queued, just more slowly. Running jobs call yield() at phase boundaries: when a higher
+// class is waiting and every slot is busy, the caller gives up its slot and parks until the
+// higher class has been served, which bounds how long an interactive job waits behind a long
+// bulk conversion to one phase. Jobs run as tasks on the task runtime, a parked job's thread
+// runs other tasks meanwhile, usually the job that took its slot. A job that throws is counted as
+// failed, its slot goes back to the others.
+class job_scheduler {
+public:
+    using weights = std::array<uint32_t, num_job_priorities>;
+
+    explicit job_scheduler(size_t slots, const weights &class_weights = {16, 4, 1},
+                           task_runtime &runtime = task_runtime::instance());
+    job_scheduler(const job_scheduler &) = delete;
+    // Waits for every submitted job.
+    ~job_scheduler();
+
+    void submit(job_priority prio, std::function<void()> job);
+    void wait_idle();
+    void yield(job_priority prio);
+
+    size_t preemptions() const;
+    // Jobs that threw.
+    size_t failed() const;
+
+private:
+    // Reserves free slots for queued jobs, returns how many runners to spawn.
+    size_t dispatch();
+    void spawn_runners(size_t count);
+    void run_one();
+    // Queued jobs can only take a slot over a parked job of a lower class.
+    size_t dispatch_limit() const;
+    size_t num_dispatchable() const;
+    bool has_queued_above(job_priority prio) const;
+    std::optional<std::function<void()>> pick();
+
+    task_runtime &runtime_;
+    mutable std::mutex lock_;
+    std::array<std::deque<std::function<void()>>, num_job_priorities> queues_;
+    std::array<uint64_t, num_job_priorities> strides_;
+    std::array<uint64_t, num_job_priorities> passes_{};
+    std::array<size_t, num_job_priorities> parked_{};
+    uint64_t vtime_{0};
+    size_t free_slots_;
+    size_t dispatched_{0};
+    size_t unfinished_{0};
+    size_t preemptions_{0};
+    size_t failed_{0};
+};
@@ -0,0 +1,215 @@
+#undef NDEBUG
+#include "job-trace.hpp"
+
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string_view>
+
+#include <fmt/format.h>
+
+#include "macho-view.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::vector<std::string> split_fields(const std::string &line) {
+    std::vector<std::string> fields;
+    size_t start{0};
+    while (start < line.size()) {
+        const auto end = std::min(line.find_first_of(" \t", start), line.size());
+        if (end > start) {
+            fields.emplace_back(line.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return fields;
+}
+
+// SipHash-2-4
+uint64_t siphash(const std::array<uint64_t, 2> &key, std::string_view data) {
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6d;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261;
+    uint64_t v3 = key[1] ^ 0x7465646279746573;
+    const auto rotl  = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    const auto round = [&] {
+        v0 += v1;
+        v1 = rotl(v1, 13) ^ v0;
+        v0 = rotl(v0, 32);
+        v2 += v3;
+        v3 = rotl(v3, 16) ^ v2;
+        v0 += v3;
+        v3 = rotl(v3, 21) ^ v0;
+        v2 += v1;
+        v1 = rotl(v1, 17) ^ v2;
+        v2 = rotl(v2, 32);
+    };
+    const auto compress = [&](uint64_t m) {
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    };
+    size_t off{0};
+    for (; off + 8 <= data.size(); off += 8) {
+        uint64_t m;
+        memcpy(&m, data.data() + off, sizeof(m));
+        compress(m);
+    }
+    uint64_t last = (uint64_t)data.size() << 56;
+    for (size_t i = 0; off + i < data.size(); ++i) {
+        last |= (uint64_t)(uint8_t)data[off + i] << (8 * i);
+    }
+    compress(last);
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; ++i) {
+        round();
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+template <typename T> bool parse_num(const std::string &str, T &val, int base = 10) {
+    const auto res = std::from_chars(str.data(), str.data() + str.size(), val, base);
+    return res.ec == std::errc{} && res.ptr == str.data() + str.size();
+}
+
+} // namespace
+
+std::optional<trace_writer> trace_writer::open(const fs::path &path) {
+    auto *fh = fopen(path.c_str(), "a");
+    if (!fh) {
+        fmt::print("[!] Couldn't open trace '{:s}': {:s}\n", path.string(), strerror(errno));
+        return std::nullopt;
+    }
+    return trace_writer{fh};
+}
+
+trace_writer::trace_writer(FILE *fh) : fh_{fh} {
+    std::random_device rd;
+    for (auto &word : key_) {
+        word = ((uint64_t)rd() << 32) | rd();
+    }
+}
+
+trace_writer::trace_writer(trace_writer &&other) noexcept : fh_{other.fh_}, key_{other.key_} {
+    other.fh_ = nullptr;
+}
+
+trace_writer::~trace_writer() {
+    if (fh_) {
+        assert(!fclose(fh_));
+    }
+}
+
+void trace_writer::record(const job_record &rec) {
+    assert(fh_);
+    std::vector<std::string> cputypes;
+    for (const auto cputype : rec.cputypes) {
+        cputypes.emplace_back(fmt::format("{:x}", cputype));
+    }
+    std::lock_guard lk{lock_};
+    fmt::print(fh_, "{:d} {:016x} {:d} {:s} {:d} {:s} {:.3f} {:d} {:s}\n", rec.arrival_ms,
+               rec.input_id, rec.input_size,
+               cputypes.empty() ? "-" : fmt::format("{}", fmt::join(cputypes, ",")),
+               rec.num_outputs, rec.flags.empty() ? "-" : rec.flags, rec.duration_ms,
+               rec.ok ? 1 : 0, rec.priority);
+    // traces are most interesting for runs that don't finish cleanly
+    fflush(fh_);
+}
+
+uint64_t trace_writer::input_id(const std::string &path) const {
+    return siphash(key_, path);
+}
+
+std::optional<std::vector<job_record>> read_trace(const fs::path &path) {
+    auto *fh = fopen(path.c_str(), "r");
+    if (!fh) {
+        fmt::print("[!] Couldn't open trace '{:s}': {:s}\n", path.string(), strerror(errno));
+        return std::nullopt;
+    }
+    std::vector<job_record> records;
+    char line_buf[512];
+    size_t line_num{0};
+    while (fgets(line_buf, sizeof(line_buf), fh)) {
+        ++line_num;
+        std::string line{line_buf};
+        if (line.starts_with('#')) {
+            continue;
+        }
+        const auto fields = split_fields(line.substr(0, line.find('\n')));
+        if (fields.empty()) {
+            continue;
+        }
+        job_record rec;
+        int ok{0};
+        bool good = (fields.size() == 8 || fields.size() == 9) &&
+                    parse_num(fields[0], rec.arrival_ms) &&
+                    parse_num(fields[1], rec.input_id, 16) &&
+                    parse_num(fields[2], rec.input_size) &&
+                    parse_num(fields[4], rec.num_outputs) && parse_num(fields[7], ok);
+        if (good) {
+            rec.flags = fields[5];
+            rec.ok    = ok;
+            if (fields.size() == 9) {
+                rec.priority = fields[8];
+            }
+            char *end{nullptr};
+            rec.duration_ms = strtod(fields[6].c_str(), &end);
+            good            = *end == '\0';
+        }
+        if (good && fields[3] != "-") {
+            size_t start{0};
+            while (good && start <= fields[3].size()) {
+                const auto end = std::min(fields[3].find(',', start), fields[3].size());
+                uint32_t cputype{0};
+                good = parse_num(fields[3].substr(start, end - start), cputype, 16);
+                rec.cputypes.emplace_back(cputype);
+                start = end + 1;
+            }
+        }
+        if (!good) {
+            fmt::print("[!] Bad record on line {:d} of trace '{:s}'\n", line_num, path.string());
+            assert(!fclose(fh));
+            return std::nullopt;
+        }
+        records.emplace_back(std::move(rec));
+    }
+    assert(!fclose(fh));
+    return records;
+}
+
+uint64_t path_hash(const std::string &path) {
+    // FNV-1a
+    uint64_t hash{0xcbf29ce484222325};
+    for (const auto c : path) {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+std::vector<uint32_t> input_cputypes(std::span<const uint8_t> bytes) {
+    if (bytes.size() < sizeof(macho::mach_header)) {
+        return {};
+    }
+    uint32_t magic;
+    memcpy(&magic, bytes.data(), sizeof(magic));
+    if (!macho::is_fat(bytes) && magic != macho::MH_MAGIC && magic != macho::MH_MAGIC_64) {
+        return {};
+    }
+    std::vector<uint32_t> cputypes;
+    for (const auto &slice : macho::slices(bytes)) {
+        cputypes.emplace_back(slice.cputype);
+    }
+    return cputypes;
+}
+
+int64_t wall_clock_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
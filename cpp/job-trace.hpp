@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// Production-shaped job traces for replaying against batch mode. One text line per job:
+//   <arrival_ms> <input_id> <input_size> <cputypes> <num_outputs> <flags> <duration_ms> <ok>
+//   [<priority>]
+// arrival_ms is wall clock so traces appended by separate runs interleave correctly, input_id is
+// a keyed hash of the input path, cputypes is a comma separated hex list and flags are the short
+// option letters of the passes that ran ("-" for none). Traces without a priority class predate
+// them and replay as normal.
+struct job_record {
+    int64_t arrival_ms{0};
+    uint64_t input_id{0};
+    uint64_t input_size{0};
+    std::vector<uint32_t> cputypes;
+    uint32_t num_outputs{1};
+    std::string flags{"-"};
+    double duration_ms{0};
+    bool ok{false};
+    std::string priority{"normal"};
+};
+
+class trace_writer {
+public:
+    // Appends to an existing trace. Records can come from several jobs at once.
+    static std::optional<trace_writer> open(const std::filesystem::path &path);
+    trace_writer(trace_writer &&other) noexcept;
+    trace_writer(const trace_writer &) = delete;
+    ~trace_writer();
+
+    void record(const job_record &rec);
+    // The input_id of path. The key is random and never written, so ids can't be reversed by
+    // hashing guessed paths, and only match between the records of one run.
+    uint64_t input_id(const std::string &path) const;
+
+private:
+    explicit trace_writer(FILE *fh);
+
+    FILE *fh_{nullptr};
+    std::array<uint64_t, 2> key_{};
+    std::mutex lock_;
+};
+
+std::optional<std::vector<job_record>> read_trace(const std::filesystem::path &path);
+
+// Stable across runs and hosts, for naming things after a path. Doesn't hide the path.
+uint64_t path_hash(const std::string &path);
+// Empty if bytes aren't a Mach-O.
+std::vector<uint32_t> input_cputypes(std::span<const uint8_t> bytes);
+int64_t wall_clock_ms();
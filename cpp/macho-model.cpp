@@ -0,0 +1,1095 @@
+#undef NDEBUG
+#include "macho-model.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <map>
+
+#include <fmt/format.h>
+
+#include "task-runtime.hpp"
+
+namespace macho {
+
+namespace {
+
+uint64_t align_up(uint64_t val, uint64_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+bool is_zerofill(uint32_t flags) {
+    const auto type = flags & SECTION_TYPE;
+    return type == S_ZEROFILL || type == S_GB_ZEROFILL || type == S_THREAD_LOCAL_ZEROFILL;
+}
+
+bool is_library_command(uint32_t cmd) {
+    return cmd == LC_LOAD_DYLIB || cmd == LC_LOAD_WEAK_DYLIB || cmd == LC_REEXPORT_DYLIB ||
+           cmd == LC_LAZY_LOAD_DYLIB || cmd == LC_LOAD_UPWARD_DYLIB;
+}
+
+// linkedit_data_command payloads, copied as opaque blobs
+bool is_linkedit_data_command(uint32_t cmd) {
+    return cmd == LC_CODE_SIGNATURE || cmd == LC_SEGMENT_SPLIT_INFO || cmd == LC_FUNCTION_STARTS ||
+           cmd == LC_DATA_IN_CODE || cmd == LC_DYLIB_CODE_SIGN_DRS ||
+           cmd == LC_LINKER_OPTIMIZATION_HINT || cmd == LC_DYLD_EXPORTS_TRIE;
+}
+
+template <typename T> T read_struct(std::span<const uint8_t> bytes, uint64_t offset = 0) {
+    assert(offset + sizeof(T) <= bytes.size());
+    T val;
+    memcpy(&val, bytes.data() + offset, sizeof(T));
+    return val;
+}
+
+template <typename T> T *struct_at(std::vector<uint8_t> &buf, uint64_t offset) {
+    assert(offset + sizeof(T) <= buf.size());
+    return reinterpret_cast<T *>(buf.data() + offset);
+}
+
+std::string_view dylib_name(std::span<const uint8_t> cmd_bytes) {
+    const auto cmd = read_struct<dylib_command>(cmd_bytes);
+    if (cmd.name_offset >= cmd_bytes.size()) {
+        return {};
+    }
+    const auto *name = reinterpret_cast<const char *>(cmd_bytes.data() + cmd.name_offset);
+    return {name, strnlen(name, cmd_bytes.size() - cmd.name_offset)};
+}
+
+// Rewrites a ULEB in place without changing its length, padding with continuation bytes.
+bool write_uleb_fixed(std::span<uint8_t> buf, uint64_t val) {
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = (val & 0x7f) | (i + 1 < buf.size() ? 0x80 : 0);
+        val >>= 7;
+    }
+    return !val;
+}
+
+bool set_ordinal_in_place(std::span<uint8_t> opcode, int64_t ordinal) {
+    if (ordinal <= 0) {
+        if (opcode.size() != 1) {
+            return false;
+        }
+        opcode[0] = BIND_OPCODE_SET_DYLIB_SPECIAL_IMM | (ordinal & BIND_IMMEDIATE_MASK);
+        return true;
+    }
+    if (opcode.size() == 1) {
+        if (ordinal > BIND_IMMEDIATE_MASK) {
+            return false;
+        }
+        opcode[0] = BIND_OPCODE_SET_DYLIB_ORDINAL_IMM | ordinal;
+        return true;
+    }
+    opcode[0] = BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB;
+    return write_uleb_fixed(opcode.subspan(1), ordinal);
+}
+
+// Lazy entries are addressed by offset from the stub helpers, so their ordinals, symbol flags,
+// segment indexes and segment offsets are rewritten without moving anything. entries are the
+// stream's decoded binds, orig_entries what the stream says now.
+bool patch_lazy_binds(std::span<uint8_t> opcodes, std::span<const bind_entry> entries,
+                      std::span<const bind_entry> orig_entries) {
+    if (entries.size() != orig_entries.size()) {
+        return false;
+    }
+    size_t pos{0};
+    size_t idx{0};
+    std::optional<std::pair<size_t, size_t>> ordinal_opcode;
+    std::optional<size_t> symbol_opcode;
+    std::optional<size_t> segment_opcode;
+    // the offset ULEB of the last SET_SEGMENT_AND_OFFSET, while nothing has moved on from it
+    std::optional<std::pair<size_t, size_t>> offset_uleb;
+    while (pos < opcodes.size()) {
+        const auto start     = pos;
+        const uint8_t opcode = opcodes[pos] & BIND_OPCODE_MASK;
+        ++pos;
+        switch (opcode) {
+        case BIND_OPCODE_DONE:
+        case BIND_OPCODE_SET_TYPE_IMM:
+            break;
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+        case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+            ordinal_opcode = {start, 1};
+            break;
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+            read_uleb(opcodes, pos);
+            ordinal_opcode = {start, pos - start};
+            break;
+        case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+            symbol_opcode = start;
+            while (pos < opcodes.size() && opcodes[pos]) {
+                ++pos;
+            }
+            ++pos;
+            break;
+        case BIND_OPCODE_SET_ADDEND_SLEB:
+            read_sleb(opcodes, pos);
+            break;
+        case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+            segment_opcode = start;
+            read_uleb(opcodes, pos);
+            offset_uleb = {start + 1, pos - start - 1};
+            break;
+        case BIND_OPCODE_ADD_ADDR_ULEB:
+            read_uleb(opcodes, pos);
+            offset_uleb.reset();
+            break;
+        case BIND_OPCODE_DO_BIND: {
+            if (idx >= entries.size() || !ordinal_opcode || !segment_opcode) {
+                return false;
+            }
+            const auto &orig_entry = orig_entries[idx];
+            const auto &entry      = entries[idx++];
+            if (entry.seg_index > BIND_IMMEDIATE_MASK ||
+                !set_ordinal_in_place(
+                    opcodes.subspan(ordinal_opcode->first, ordinal_opcode->second),
+                    entry.ordinal)) {
+                return false;
+            }
+            if (entry.symbol_flags != orig_entry.symbol_flags) {
+                if (!symbol_opcode || entry.symbol_flags > BIND_IMMEDIATE_MASK) {
+                    return false;
+                }
+                opcodes[*symbol_opcode] =
+                    BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM | entry.symbol_flags;
+            }
+            opcodes[*segment_opcode] = BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | entry.seg_index;
+            if (entry.seg_offset != orig_entry.seg_offset &&
+                (!offset_uleb ||
+                 !write_uleb_fixed(opcodes.subspan(offset_uleb->first, offset_uleb->second),
+                                   entry.seg_offset))) {
+                return false;
+            }
+            offset_uleb.reset();
+            break;
+        }
+        default:
+            // dyld only ever sees single DO_BINDs in lazy streams
+            return false;
+        }
+    }
+    return idx == entries.size();
+}
+
+struct segment_fields {
+    std::string_view name;
+    uint64_t vmaddr;
+    uint64_t vmsize;
+    uint64_t fileoff;
+    uint64_t filesize;
+    uint32_t maxprot;
+    uint32_t initprot;
+    uint32_t nsects;
+    uint32_t flags;
+};
+
+template <typename Segment> segment_fields read_segment(std::span<const uint8_t> bytes) {
+    const auto seg   = read_struct<Segment>(bytes);
+    const auto *name = reinterpret_cast<const char *>(bytes.data() + offsetof(Segment, segname));
+    return segment_fields{{name, strnlen(name, sizeof(seg.segname))},
+                          seg.vmaddr,
+                          seg.vmsize,
+                          seg.fileoff,
+                          seg.filesize,
+                          seg.maxprot,
+                          seg.initprot,
+                          seg.nsects,
+                          seg.flags};
+}
+
+bool is_mergeable_segment(std::string_view name) {
+    return name == "__DATA" || name == "__DATA_DIRTY";
+}
+
+template <typename Segment, typename Section>
+std::vector<std::string_view> section_names(std::span<const uint8_t> seg_bytes) {
+    const auto seg = read_struct<Segment>(seg_bytes);
+    std::vector<std::string_view> names;
+    for (uint32_t i = 0; i < seg.nsects; ++i) {
+        const auto *name = reinterpret_cast<const char *>(
+            seg_bytes.data() + sizeof(Segment) + i * sizeof(Section) + offsetof(Section, sectname));
+        names.emplace_back(name, strnlen(name, sizeof(Section::sectname)));
+    }
+    return names;
+}
+
+// Whether second can be mapped as the tail of first: same protections and flags, back to back
+// in memory and in the file, and no zero fill in between.
+bool can_map_segments_together(const segment_fields &first, const segment_fields &second) {
+    return is_mergeable_segment(first.name) && is_mergeable_segment(second.name) &&
+           first.maxprot == second.maxprot && first.initprot == second.initprot &&
+           first.flags == second.flags && first.vmaddr + first.vmsize == second.vmaddr &&
+           (!second.filesize || (first.filesize == first.vmsize &&
+                                 first.fileoff + first.filesize == second.fileoff));
+}
+
+// can_map_segments_together() and no section name in both, getsectiondata() and the ObjC runtime
+// only find the first section of a name. reason is set when only the names are in the way.
+template <typename Segment, typename Section>
+bool can_merge_segments(const segment_fields &first, std::span<const uint8_t> first_bytes,
+                        const segment_fields &second, std::span<const uint8_t> second_bytes,
+                        std::string &reason) {
+    if (!can_map_segments_together(first, second)) {
+        return false;
+    }
+    const auto first_sects = section_names<Segment, Section>(first_bytes);
+    for (const auto sect : section_names<Segment, Section>(second_bytes)) {
+        if (std::find(first_sects.begin(), first_sects.end(), sect) != first_sects.end()) {
+            reason = fmt::format("{:s} and {:s} both have a {:s} section", first.name,
+                                 second.name, sect);
+            return false;
+        }
+    }
+    return true;
+}
+
+// first's command covering both segments, with every section renamed into it.
+template <typename Segment, typename Section>
+void write_merged_segment(std::span<uint8_t> out, std::span<const uint8_t> first,
+                          std::span<const uint8_t> second, std::string_view name) {
+    auto seg        = read_struct<Segment>(first);
+    const auto next = read_struct<Segment>(second);
+    seg.cmdsize     = out.size();
+    seg.vmsize      = next.vmaddr + next.vmsize - seg.vmaddr;
+    if (next.filesize) {
+        seg.filesize = next.fileoff + next.filesize - seg.fileoff;
+    }
+    std::fill(std::begin(seg.segname), std::end(seg.segname), 0);
+    std::copy(name.begin(), name.end(), seg.segname);
+
+    auto sect_off = sizeof(Segment);
+    for (const auto &[bytes, nsects] : {std::pair{first, seg.nsects}, {second, next.nsects}}) {
+        for (uint32_t i = 0; i < nsects; ++i) {
+            auto sect = read_struct<Section>(bytes, sizeof(Segment) + i * sizeof(Section));
+            std::fill(std::begin(sect.segname), std::end(sect.segname), 0);
+            std::copy(name.begin(), name.end(), sect.segname);
+            memcpy(out.data() + sect_off, &sect, sizeof(sect));
+            sect_off += sizeof(Section);
+        }
+    }
+    seg.nsects += next.nsects;
+    memcpy(out.data(), &seg, sizeof(seg));
+}
+
+template <typename NList>
+bool parse_symbols(std::span<const uint8_t> data, const symtab_command &symtab,
+                   std::vector<model_symbol> &res) {
+    if (symtab.symoff + (uint64_t)symtab.nsyms * sizeof(NList) > data.size() ||
+        symtab.stroff + (uint64_t)symtab.strsize > data.size()) {
+        return false;
+    }
+    const auto strtab = data.subspan(symtab.stroff, symtab.strsize);
+    res.reserve(symtab.nsyms);
+    for (uint32_t i = 0; i < symtab.nsyms; ++i) {
+        const auto sym = read_struct<NList>(data, symtab.symoff + (uint64_t)i * sizeof(NList));
+        std::string_view name;
+        if (sym.n_strx < strtab.size()) {
+            const auto *str = reinterpret_cast<const char *>(strtab.data() + sym.n_strx);
+            name            = {str, strnlen(str, strtab.size() - sym.n_strx)};
+        }
+        res.emplace_back(model_symbol{name, sym.n_type, sym.n_sect, sym.n_desc, sym.n_value});
+    }
+    return true;
+}
+
+template <typename NList>
+void write_symbols(std::span<uint8_t> nlists, const std::vector<model_symbol> &symbols) {
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        NList sym;
+        memcpy(&sym, nlists.data() + i * sizeof(NList), sizeof(NList));
+        sym.n_sect = symbols[i].sect;
+        sym.n_desc = symbols[i].desc;
+        memcpy(nlists.data() + i * sizeof(NList), &sym, sizeof(NList));
+    }
+}
+
+} // namespace
+
+std::span<uint8_t> arena::allocate(size_t size) {
+    size = align_up(size, 8);
+    if (size > block_size) {
+        // oversized requests get a block of their own, the current one keeps filling
+        auto block = std::make_unique<uint8_t[]>(size);
+        auto *ptr  = block.get();
+        blocks_.insert(blocks_.empty() ? blocks_.end() : blocks_.end() - 1, std::move(block));
+        return {ptr, size};
+    }
+    if (used_ + size > block_size) {
+        blocks_.emplace_back(std::make_unique<uint8_t[]>(block_size));
+        used_ = 0;
+    }
+    auto *ptr = blocks_.back().get() + used_;
+    used_ += size;
+    return {ptr, size};
+}
+
+model::model(std::span<const uint8_t> data) : data_{data} {
+    header_ = read_struct<mach_header>(data);
+    is64_   = header_.magic == MH_MAGIC_64;
+}
+
+std::optional<model> model::parse(std::span<const uint8_t> slice, std::string &reason) {
+    if (slice.size() < sizeof(mach_header)) {
+        reason = "truncated header";
+        return std::nullopt;
+    }
+    const auto magic = read_struct<uint32_t>(slice);
+    if (magic != MH_MAGIC && magic != MH_MAGIC_64) {
+        reason = fmt::format("unexpected magic {:#x}", magic);
+        return std::nullopt;
+    }
+    model m{slice};
+    const auto img = image::read_only(slice);
+
+    const auto linkedit = img.segment("__LINKEDIT");
+    if (!linkedit) {
+        reason = "no __LINKEDIT segment";
+        return std::nullopt;
+    }
+    m.orig_commands_end_ = img.load_commands_size();
+    m.commands_limit_    = linkedit->fileoff;
+    for (const auto &seg : img.segments()) {
+        if (seg.fileoff > linkedit->fileoff) {
+            reason = "__LINKEDIT isn't the last segment";
+            return std::nullopt;
+        }
+        if (seg.fileoff && seg.filesize) {
+            m.commands_limit_ = std::min(m.commands_limit_, seg.fileoff);
+        }
+    }
+    for (const auto &sect : img.sections()) {
+        if (sect.offset && sect.size && !is_zerofill(sect.flags)) {
+            m.commands_limit_ = std::min<uint64_t>(m.commands_limit_, sect.offset);
+        }
+    }
+
+    std::optional<std::span<const uint8_t>> exports;
+    for (const auto &lc : img.commands()) {
+        const auto bytes = slice.subspan(lc.offset, lc.cmdsize);
+        m.commands_.emplace_back(model_command{lc.cmd, bytes});
+        switch (lc.cmd) {
+        case LC_DYLD_CHAINED_FIXUPS:
+            reason = "chained fixups";
+            return std::nullopt;
+        case LC_SYMTAB: {
+            const auto symtab = read_struct<symtab_command>(bytes);
+            const bool ok     = m.is64_ ? parse_symbols<nlist_64>(slice, symtab, m.symbols_)
+                                        : parse_symbols<nlist>(slice, symtab, m.symbols_);
+            if (!ok) {
+                reason = "symbol table out of bounds";
+                return std::nullopt;
+            }
+            break;
+        }
+        case LC_DYSYMTAB: {
+            const auto dysymtab = read_struct<dysymtab_command>(bytes);
+            if (dysymtab.nextrel || dysymtab.nlocrel || dysymtab.ntoc || dysymtab.nmodtab ||
+                dysymtab.nextrefsyms) {
+                reason = "relocations or a pre-dyld-info dynamic symbol table";
+                return std::nullopt;
+            }
+            break;
+        }
+        case LC_DYLD_EXPORTS_TRIE: {
+            const auto cmd = read_struct<linkedit_data_command>(bytes);
+            exports        = slice.subspan(cmd.dataoff, cmd.datasize);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    if (const auto *dyld_info = img.dyld_info()) {
+        const auto ptr_size = m.pointer_size();
+        auto rebases =
+            decode_rebases(img.bytes(dyld_info->rebase_off, dyld_info->rebase_size), ptr_size);
+        auto binds      = decode_binds(img.bytes(dyld_info->bind_off, dyld_info->bind_size),
+                                       ptr_size, bind_kind::regular);
+        auto weak_binds = decode_binds(
+            img.bytes(dyld_info->weak_bind_off, dyld_info->weak_bind_size), ptr_size,
+            bind_kind::weak);
+        auto lazy_binds = decode_binds(
+            img.bytes(dyld_info->lazy_bind_off, dyld_info->lazy_bind_size), ptr_size,
+            bind_kind::lazy);
+        if (!rebases || !binds || !weak_binds || !lazy_binds) {
+            reason = "undecodable rebase/binding opcodes";
+            return std::nullopt;
+        }
+        m.rebases_                              = std::move(*rebases);
+        m.binds_[(size_t)bind_kind::regular] = std::move(*binds);
+        m.binds_[(size_t)bind_kind::weak]    = std::move(*weak_binds);
+        m.binds_[(size_t)bind_kind::lazy]    = std::move(*lazy_binds);
+        if (dyld_info->export_size) {
+            if (exports) {
+                reason = "two export tries";
+                return std::nullopt;
+            }
+            exports = img.bytes(dyld_info->export_off, dyld_info->export_size);
+        }
+    }
+    if (exports) {
+        m.exports_.assign(exports->begin(), exports->end());
+    }
+    return m;
+}
+
+std::optional<size_t> model::find_command(uint32_t cmd) const {
+    for (size_t i = 0; i < commands_.size(); ++i) {
+        if (commands_[i].cmd == cmd) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+uint32_t model::remove_command(size_t idx) {
+    assert(idx < commands_.size());
+    const uint32_t size = commands_[idx].bytes.size();
+    commands_.erase(commands_.begin() + idx);
+    return size;
+}
+
+uint32_t model::add_command(std::span<uint8_t> bytes) {
+    const auto lc = read_struct<load_command>(bytes);
+    assert(lc.cmdsize == bytes.size());
+    commands_.emplace_back(model_command{lc.cmd, bytes});
+    return lc.cmdsize;
+}
+
+uint32_t model::add_dylib(uint32_t cmd, std::string_view name, uint32_t current_version,
+                          uint32_t compat_version) {
+    const uint32_t size = align_up(sizeof(dylib_command) + name.size() + 1, pointer_size());
+    auto bytes          = arena_.allocate(size).first(size);
+    // same timestamp as ld64 and LIEF
+    const dylib_command dylib{cmd, size, sizeof(dylib_command), 2, current_version,
+                              compat_version};
+    memcpy(bytes.data(), &dylib, sizeof(dylib));
+    std::copy(name.begin(), name.end(), bytes.begin() + sizeof(dylib));
+    return add_command(bytes);
+}
+
+uint32_t model::add_build_version(uint32_t platform, uint32_t minos, uint32_t sdk) {
+    constexpr uint32_t size = sizeof(build_version_command);
+    auto bytes              = arena_.allocate(size).first(size);
+    const build_version_command build_version{
+        LC_BUILD_VERSION, size, platform, minos, sdk, 0};
+    memcpy(bytes.data(), &build_version, sizeof(build_version));
+    return add_command(bytes);
+}
+
+std::vector<std::string_view> model::libraries() const {
+    std::vector<std::string_view> res;
+    for (const auto &lc : commands_) {
+        if (is_library_command(lc.cmd)) {
+            res.emplace_back(dylib_name(lc.bytes));
+        }
+    }
+    return res;
+}
+
+std::optional<size_t> model::find_library(std::string_view name) const {
+    for (size_t i = 0; i < commands_.size(); ++i) {
+        if (is_library_command(commands_[i].cmd) && dylib_name(commands_[i].bytes) == name) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<size_t> model::find_segment(std::string_view name, uint32_t &seg_index) const {
+    seg_index = 0;
+    for (size_t i = 0; i < commands_.size(); ++i) {
+        const auto &lc = commands_[i];
+        if (lc.cmd != LC_SEGMENT && lc.cmd != LC_SEGMENT_64) {
+            continue;
+        }
+        // segname sits at the same offset in both layouts
+        const auto seg = read_struct<segment_command>(lc.bytes);
+        if (std::string_view{seg.segname, strnlen(seg.segname, sizeof(seg.segname))} == name) {
+            return i;
+        }
+        ++seg_index;
+    }
+    return std::nullopt;
+}
+
+std::optional<uint32_t> model::remove_empty_segment(std::string_view name,
+                                                    std::string &reason) {
+    uint32_t seg_index;
+    const auto idx = find_segment(name, seg_index);
+    if (!idx) {
+        return std::nullopt;
+    }
+    const auto &bytes       = commands_[*idx].bytes;
+    const uint64_t filesize = is64_ ? read_struct<segment_command_64>(bytes).filesize
+                                    : read_struct<segment_command>(bytes).filesize;
+    const uint32_t nsects   = is64_ ? read_struct<segment_command_64>(bytes).nsects
+                                    : read_struct<segment_command>(bytes).nsects;
+    if (filesize || nsects) {
+        reason = fmt::format("segment {:s} isn't empty", name);
+        return std::nullopt;
+    }
+    for (const auto &rebase : rebases_) {
+        if (rebase.seg_index == seg_index) {
+            reason = fmt::format("segment {:s} has rebases", name);
+            return std::nullopt;
+        }
+    }
+    for (const auto &binds : binds_) {
+        for (const auto &bind : binds) {
+            if (bind.has_location && bind.seg_index == seg_index) {
+                reason = fmt::format("segment {:s} has binds", name);
+                return std::nullopt;
+            }
+        }
+    }
+
+    for (auto &rebase : rebases_) {
+        if (rebase.seg_index > seg_index) {
+            --rebase.seg_index;
+        }
+    }
+    for (auto &binds : binds_) {
+        for (auto &bind : binds) {
+            if (bind.has_location && bind.seg_index > seg_index) {
+                --bind.seg_index;
+            }
+        }
+    }
+    return remove_command(*idx);
+}
+
+std::optional<uint64_t> model::remove_section(std::string_view segname, std::string_view sectname,
+                                              std::string &reason) {
+    uint32_t seg_index;
+    const auto idx = find_segment(segname, seg_index);
+    if (!idx) {
+        return std::nullopt;
+    }
+    // section numbers count through every segment, starting at 1
+    uint32_t sect_base{0};
+    for (size_t i = 0; i < *idx; ++i) {
+        if (commands_[i].cmd == LC_SEGMENT_64) {
+            sect_base += read_struct<segment_command_64>(commands_[i].bytes).nsects;
+        } else if (commands_[i].cmd == LC_SEGMENT) {
+            sect_base += read_struct<segment_command>(commands_[i].bytes).nsects;
+        }
+    }
+
+    const auto &old_bytes  = commands_[*idx].bytes;
+    const size_t seg_size  = is64_ ? sizeof(segment_command_64) : sizeof(segment_command);
+    const size_t sect_size = is64_ ? sizeof(section_64) : sizeof(section);
+    const uint32_t nsects  = is64_ ? read_struct<segment_command_64>(old_bytes).nsects
+                                   : read_struct<segment_command>(old_bytes).nsects;
+    std::optional<uint32_t> found;
+    uint64_t offset{0}, size{0};
+    uint32_t flags{0};
+    for (uint32_t i = 0; i < nsects; ++i) {
+        const auto sect_off = seg_size + i * sect_size;
+        // names and the 32-bit fields up to flags share offsets, only addr and size widen
+        const auto sect = read_struct<section>(old_bytes, sect_off);
+        if (std::string_view{sect.sectname, strnlen(sect.sectname, sizeof(sect.sectname))} !=
+            sectname) {
+            continue;
+        }
+        found = i;
+        if (is64_) {
+            const auto sect64 = read_struct<section_64>(old_bytes, sect_off);
+            offset            = sect64.offset;
+            size              = sect64.size;
+            flags             = sect64.flags;
+        } else {
+            offset = sect.offset;
+            size   = sect.size;
+            flags  = sect.flags;
+        }
+        break;
+    }
+    if (!found) {
+        return std::nullopt;
+    }
+    const uint32_t sect_num = sect_base + *found + 1;
+    for (const auto &sym : symbols_) {
+        if ((sym.type & N_TYPE) == N_SECT && sym.sect == sect_num) {
+            reason = fmt::format("symbol '{:s}' is defined in {:s},{:s}", sym.name, segname,
+                                 sectname);
+            return std::nullopt;
+        }
+    }
+
+    const uint32_t new_size = old_bytes.size() - sect_size;
+    auto bytes              = arena_.allocate(new_size).first(new_size);
+    const auto skip         = seg_size + *found * sect_size;
+    std::copy(old_bytes.begin(), old_bytes.begin() + skip, bytes.begin());
+    std::copy(old_bytes.begin() + skip + sect_size, old_bytes.end(), bytes.begin() + skip);
+    if (is64_) {
+        auto seg    = read_struct<segment_command_64>(bytes);
+        seg.cmdsize = new_size;
+        --seg.nsects;
+        memcpy(bytes.data(), &seg, sizeof(seg));
+    } else {
+        auto seg    = read_struct<segment_command>(bytes);
+        seg.cmdsize = new_size;
+        --seg.nsects;
+        memcpy(bytes.data(), &seg, sizeof(seg));
+    }
+    commands_[*idx].bytes = bytes;
+
+    for (auto &sym : symbols_) {
+        if ((sym.type & N_TYPE) == N_SECT && sym.sect > sect_num) {
+            --sym.sect;
+        }
+    }
+    if (offset && !is_zerofill(flags)) {
+        zeroed_.emplace_back(offset, size);
+    }
+    return size;
+}
+
+size_t model::merge_data_segments(uint32_t &saved_bytes, std::vector<std::string> &skipped) {
+    const auto fields = [&](const model_command &lc) {
+        return is64_ ? read_segment<segment_command_64>(lc.bytes)
+                     : read_segment<segment_command>(lc.bytes);
+    };
+    const auto can_merge = [&](const model_command &first, const model_command &second,
+                               std::string &reason) {
+        return is64_ ? can_merge_segments<segment_command_64, section_64>(
+                           fields(first), first.bytes, fields(second), second.bytes, reason)
+                     : can_merge_segments<segment_command, section>(
+                           fields(first), first.bytes, fields(second), second.bytes, reason);
+    };
+    size_t merged{0};
+    for (;;) {
+        // command indexes of the segment commands, position is the segment index
+        std::vector<size_t> segs;
+        for (size_t i = 0; i < commands_.size(); ++i) {
+            if (commands_[i].cmd == LC_SEGMENT || commands_[i].cmd == LC_SEGMENT_64) {
+                segs.emplace_back(i);
+            }
+        }
+        std::optional<uint32_t> second_index;
+        std::vector<std::string> blocked;
+        for (uint32_t i = 1; i < segs.size() && !second_index; ++i) {
+            std::string reason;
+            if (can_merge(commands_[segs[i - 1]], commands_[segs[i]], reason)) {
+                second_index = i;
+            } else if (!reason.empty()) {
+                blocked.emplace_back(std::move(reason));
+            }
+        }
+        if (!second_index) {
+            // only the last scan's, the earlier ones saw the same pairs
+            skipped.insert(skipped.end(), blocked.begin(), blocked.end());
+            return merged;
+        }
+
+        const auto &first_cmd  = commands_[segs[*second_index - 1]];
+        const auto &second_cmd = commands_[segs[*second_index]];
+        const auto first       = fields(first_cmd);
+        const auto second      = fields(second_cmd);
+        // keep the name code most likely passes to getsectiondata()
+        const auto name        = second.name == "__DATA" ? second.name : first.name;
+        const size_t sect_size = is64_ ? sizeof(section_64) : sizeof(section);
+        const size_t seg_size  = is64_ ? sizeof(segment_command_64) : sizeof(segment_command);
+        const uint32_t size    = seg_size + (first.nsects + second.nsects) * sect_size;
+        auto bytes             = arena_.allocate(size).first(size);
+        if (is64_) {
+            write_merged_segment<segment_command_64, section_64>(bytes, first_cmd.bytes,
+                                                                 second_cmd.bytes, name);
+        } else {
+            write_merged_segment<segment_command, section>(bytes, first_cmd.bytes,
+                                                           second_cmd.bytes, name);
+        }
+        const auto delta = second.vmaddr - first.vmaddr;
+        saved_bytes += first_cmd.bytes.size() + second_cmd.bytes.size() - size;
+        commands_[segs[*second_index - 1]].bytes = bytes;
+        remove_command(segs[*second_index]);
+
+        const auto renumber = [&](uint8_t &seg_index, uint64_t &seg_offset) {
+            if (seg_index == *second_index) {
+                --seg_index;
+                seg_offset += delta;
+            } else if (seg_index > *second_index) {
+                --seg_index;
+            }
+        };
+        for (auto &rebase : rebases_) {
+            renumber(rebase.seg_index, rebase.seg_offset);
+        }
+        for (auto &binds : binds_) {
+            for (auto &bind : binds) {
+                if (bind.has_location) {
+                    renumber(bind.seg_index, bind.seg_offset);
+                }
+            }
+        }
+        ++merged;
+    }
+}
+
+std::vector<uint32_t> model::section_flags() const {
+    std::vector<uint32_t> flags;
+    for (const auto &lc : commands_) {
+        if (lc.cmd == LC_SEGMENT_64) {
+            const auto seg = read_struct<segment_command_64>(lc.bytes);
+            for (uint32_t i = 0; i < seg.nsects; ++i) {
+                flags.emplace_back(
+                    read_struct<section_64>(lc.bytes, sizeof(seg) + i * sizeof(section_64)).flags);
+            }
+        } else if (lc.cmd == LC_SEGMENT) {
+            const auto seg = read_struct<segment_command>(lc.bytes);
+            for (uint32_t i = 0; i < seg.nsects; ++i) {
+                flags.emplace_back(
+                    read_struct<section>(lc.bytes, sizeof(seg) + i * sizeof(section)).flags);
+            }
+        }
+    }
+    return flags;
+}
+
+size_t model::num_mapped_segments() const {
+    size_t num{0};
+    for (const auto &lc : commands_) {
+        if (lc.cmd != LC_SEGMENT && lc.cmd != LC_SEGMENT_64) {
+            continue;
+        }
+        const auto seg = is64_ ? read_segment<segment_command_64>(lc.bytes)
+                               : read_segment<segment_command>(lc.bytes);
+        if (seg.vmsize && (seg.filesize || seg.initprot)) {
+            ++num;
+        }
+    }
+    return num;
+}
+
+bool model::clear_export_flags(std::string_view name, uint64_t flags) {
+    size_t node{0};
+    while (node < exports_.size()) {
+        size_t pos            = node;
+        const auto term_size  = read_uleb(exports_, pos);
+        if (name.empty()) {
+            if (!term_size) {
+                return false;
+            }
+            const auto flags_pos = pos;
+            const auto old_flags = read_uleb(exports_, pos);
+            return write_uleb_fixed(std::span{exports_}.subspan(flags_pos, pos - flags_pos),
+                                    old_flags & ~flags);
+        }
+        pos += term_size;
+        if (pos >= exports_.size()) {
+            return false;
+        }
+        const uint8_t num_children = exports_[pos++];
+        std::optional<size_t> next;
+        for (uint8_t i = 0; i < num_children && pos < exports_.size(); ++i) {
+            const auto *edge_str = reinterpret_cast<const char *>(exports_.data() + pos);
+            const std::string_view edge{edge_str, strnlen(edge_str, exports_.size() - pos)};
+            pos += edge.size() + 1;
+            const auto child = read_uleb(exports_, pos);
+            if (name.starts_with(edge)) {
+                name.remove_prefix(edge.size());
+                next = child;
+                break;
+            }
+        }
+        if (!next) {
+            return false;
+        }
+        node = *next;
+    }
+    return false;
+}
+
+std::optional<std::vector<uint8_t>> model::serialize(std::string &reason) const {
+    const auto img           = image::read_only(data_);
+    const auto linkedit      = *img.segment("__LINKEDIT");
+    const uint64_t hdr_size  = is64_ ? sizeof(mach_header) + sizeof(uint32_t) : sizeof(mach_header);
+    uint64_t commands_size{0};
+    for (const auto &lc : commands_) {
+        commands_size += lc.bytes.size();
+    }
+    if (hdr_size + commands_size > commands_limit_) {
+        reason = fmt::format("load commands need {:d} bytes, only {:d} before the first section",
+                             hdr_size + commands_size, commands_limit_);
+        return std::nullopt;
+    }
+
+    // segment contents stay in place
+    std::vector<uint8_t> out(data_.begin(), data_.begin() + linkedit.fileoff);
+    for (const auto &range : zeroed_) {
+        std::fill_n(out.begin() + range.first, range.second, 0);
+    }
+    std::fill_n(out.begin(), std::max(orig_commands_end_, hdr_size + commands_size), 0);
+    auto hdr       = header_;
+    hdr.ncmds      = commands_.size();
+    hdr.sizeofcmds = commands_size;
+    memcpy(out.data(), &hdr, sizeof(hdr));
+    std::vector<uint64_t> cmd_offsets;
+    uint64_t cmd_off = hdr_size;
+    for (const auto &lc : commands_) {
+        std::copy(lc.bytes.begin(), lc.bytes.end(), out.begin() + cmd_off);
+        cmd_offsets.emplace_back(cmd_off);
+        cmd_off += lc.bytes.size();
+    }
+
+    auto dyld_info_idx = find_command(LC_DYLD_INFO_ONLY);
+    if (!dyld_info_idx) {
+        dyld_info_idx = find_command(LC_DYLD_INFO);
+    }
+    const auto symtab_idx   = find_command(LC_SYMTAB);
+    const auto dysymtab_idx = find_command(LC_DYSYMTAB);
+    auto *dyld_info =
+        dyld_info_idx ? struct_at<dyld_info_command>(out, cmd_offsets[*dyld_info_idx]) : nullptr;
+    auto *symtab = symtab_idx ? struct_at<symtab_command>(out, cmd_offsets[*symtab_idx]) : nullptr;
+    auto *dysymtab =
+        dysymtab_idx ? struct_at<dysymtab_command>(out, cmd_offsets[*dysymtab_idx]) : nullptr;
+    const auto ptr_size = pointer_size();
+
+    // The tables that change are encoded concurrently into buffers of their own, so this takes
+    // as long as the largest of them rather than all of them.
+    std::vector<uint8_t> rebase_opcodes, bind_opcodes, weak_bind_opcodes, lazy_opcodes, nlists;
+    bool lazy_fits{true};
+    task_group encode;
+    if (dyld_info) {
+        encode.run([&] {
+            auto rebases = rebases_;
+            std::sort(rebases.begin(), rebases.end());
+            if (!rebases.empty()) {
+                rebase_opcodes = encode_rebases(rebases, ptr_size);
+            }
+        });
+        encode.run([&] {
+            if (const auto &binds = binds_[(size_t)bind_kind::regular]; !binds.empty()) {
+                bind_opcodes = encode_binds(binds, ptr_size, bind_kind::regular);
+            }
+        });
+        encode.run([&] {
+            if (const auto &binds = binds_[(size_t)bind_kind::weak]; !binds.empty()) {
+                weak_bind_opcodes = encode_binds(binds, ptr_size, bind_kind::weak);
+            }
+        });
+        const auto old_lazy = data_.subspan(dyld_info->lazy_bind_off, dyld_info->lazy_bind_size);
+        encode.run([&, old_lazy] {
+            lazy_opcodes.assign(old_lazy.begin(), old_lazy.end());
+            const auto orig_lazy = decode_binds(old_lazy, ptr_size, bind_kind::lazy);
+            lazy_fits            = orig_lazy && patch_lazy_binds(lazy_opcodes,
+                                                                 binds_[(size_t)bind_kind::lazy],
+                                                                 *orig_lazy);
+        });
+    }
+    if (symtab) {
+        const auto nlist_size = is64_ ? sizeof(nlist_64) : sizeof(nlist);
+        const auto old_nlists = data_.subspan(symtab->symoff, symtab->nsyms * nlist_size);
+        encode.run([&, old_nlists] {
+            nlists.assign(old_nlists.begin(), old_nlists.end());
+            if (is64_) {
+                write_symbols<nlist_64>(nlists, symbols_);
+            } else {
+                write_symbols<nlist>(nlists, symbols_);
+            }
+        });
+    }
+    encode.wait();
+    if (!lazy_fits) {
+        reason = "lazy bindings don't fit in place";
+        return std::nullopt;
+    }
+
+    // __LINKEDIT is laid out from scratch in ld64's order, anything no command points at is
+    // dropped. Every size is known by now, so the layout is only arithmetic. Blobs are pointer
+    // aligned, which covers the 4 byte function starts and 8 byte chained fixups, and the code
+    // signature goes last at the 16 bytes codesign expects.
+    struct placed_blob {
+        std::span<const uint8_t> bytes;
+        uint64_t offset;
+    };
+    std::vector<placed_blob> blobs;
+    uint64_t linkedit_size{0};
+    auto put = [&](std::span<const uint8_t> blob, uint64_t align) -> uint32_t {
+        if (blob.empty()) {
+            return 0;
+        }
+        linkedit_size = align_up(linkedit_size, align);
+        blobs.emplace_back(placed_blob{blob, linkedit_size});
+        const auto blob_off = linkedit.fileoff + linkedit_size;
+        linkedit_size += blob.size();
+        return blob_off;
+    };
+
+    if (dyld_info) {
+        const bool has_exports    = dyld_info->export_size;
+        dyld_info->rebase_off     = put(rebase_opcodes, ptr_size);
+        dyld_info->rebase_size    = rebase_opcodes.size();
+        dyld_info->bind_off       = put(bind_opcodes, ptr_size);
+        dyld_info->bind_size      = bind_opcodes.size();
+        dyld_info->weak_bind_off  = put(weak_bind_opcodes, ptr_size);
+        dyld_info->weak_bind_size = weak_bind_opcodes.size();
+        dyld_info->lazy_bind_off  = put(lazy_opcodes, ptr_size);
+        dyld_info->lazy_bind_size = lazy_opcodes.size();
+        if (has_exports) {
+            dyld_info->export_off  = put(exports_, ptr_size);
+            dyld_info->export_size = exports_.size();
+        }
+    }
+
+    std::optional<size_t> code_signature_idx;
+    for (size_t i = 0; i < commands_.size(); ++i) {
+        if (!is_linkedit_data_command(commands_[i].cmd)) {
+            continue;
+        }
+        if (commands_[i].cmd == LC_CODE_SIGNATURE) {
+            code_signature_idx = i;
+            continue;
+        }
+        auto *cmd = struct_at<linkedit_data_command>(out, cmd_offsets[i]);
+        const auto blob =
+            commands_[i].cmd == LC_DYLD_EXPORTS_TRIE
+                ? std::span<const uint8_t>{exports_}
+                : data_.subspan(cmd->dataoff, cmd->datasize);
+        cmd->dataoff  = put(blob, ptr_size);
+        cmd->datasize = blob.size();
+    }
+
+    if (symtab) {
+        symtab->symoff = put(nlists, ptr_size);
+    }
+    if (dysymtab) {
+        dysymtab->indirectsymoff =
+            put(data_.subspan(dysymtab->indirectsymoff, dysymtab->nindirectsyms * sizeof(uint32_t)),
+                ptr_size);
+    }
+    if (symtab) {
+        symtab->stroff = put(data_.subspan(symtab->stroff, symtab->strsize), ptr_size);
+    }
+    if (code_signature_idx) {
+        auto *cmd       = struct_at<linkedit_data_command>(out, cmd_offsets[*code_signature_idx]);
+        const auto blob = data_.subspan(cmd->dataoff, cmd->datasize);
+        cmd->dataoff    = put(blob, 16);
+        cmd->datasize   = blob.size();
+    }
+
+    uint32_t linkedit_index;
+    const auto linkedit_idx = *find_segment("__LINKEDIT", linkedit_index);
+    if (is64_) {
+        auto *seg     = struct_at<segment_command_64>(out, cmd_offsets[linkedit_idx]);
+        seg->filesize = linkedit_size;
+        seg->vmsize   = align_up(linkedit_size, page_size(header_.cputype));
+    } else {
+        auto *seg     = struct_at<segment_command>(out, cmd_offsets[linkedit_idx]);
+        seg->filesize = linkedit_size;
+        seg->vmsize   = align_up(linkedit_size, page_size(header_.cputype));
+    }
+    if (linkedit.fileoff + linkedit_size > UINT32_MAX) {
+        reason = "image grew past 4 GiB";
+        return std::nullopt;
+    }
+    // straight into the output, alignment padding stays zero. Copies are bound by memory
+    // bandwidth, splitting them over threads doesn't make them faster.
+    out.resize(linkedit.fileoff + linkedit_size);
+    for (const auto &blob : blobs) {
+        std::memcpy(out.data() + linkedit.fileoff + blob.offset, blob.bytes.data(),
+                    blob.bytes.size());
+    }
+    return out;
+}
+
+namespace {
+
+std::string ordinal_name(int64_t ordinal, const std::vector<std::string_view> &libraries) {
+    if (ordinal > 0 && (size_t)ordinal <= libraries.size()) {
+        return std::string{libraries[ordinal - 1]};
+    }
+    return fmt::format("ordinal {:d}", ordinal);
+}
+
+} // namespace
+
+std::set<std::string> image_facts(std::span<const uint8_t> file) {
+    std::set<std::string> facts;
+    for (const auto &slice : slices(file)) {
+        const auto img    = image::read_only(file.subspan(slice.offset, slice.size));
+        const auto prefix = fmt::format("[{:#x}] ", img.cputype());
+        facts.emplace(prefix + fmt::format("flags {:#x}", img.flags()));
+        facts.emplace(prefix + fmt::format("filetype {:#x}",
+                                           read_struct<mach_header>(img.data()).filetype));
+
+        std::map<uint32_t, size_t> command_counts;
+        std::vector<std::string_view> libraries;
+        for (const auto &lc : img.commands()) {
+            ++command_counts[lc.cmd];
+            const auto bytes = img.data().subspan(lc.offset, lc.cmdsize);
+            if (is_library_command(lc.cmd)) {
+                libraries.emplace_back(dylib_name(bytes));
+                facts.emplace(prefix + fmt::format("library {:#x} {:s}", lc.cmd, libraries.back()));
+            } else if (lc.cmd == LC_ID_DYLIB) {
+                facts.emplace(prefix + fmt::format("id {:s}", dylib_name(bytes)));
+            }
+        }
+        for (const auto &count : command_counts) {
+            facts.emplace(prefix + fmt::format("command {:#x} x{:d}", count.first, count.second));
+        }
+
+        const auto segments = img.segments();
+        const auto location = [&](uint8_t seg_index, uint64_t seg_offset) {
+            const auto seg = seg_index < segments.size() ? segments[seg_index].name : "?";
+            return fmt::format("{:s}+{:#x}", seg, seg_offset);
+        };
+        if (const auto *dyld_info = img.dyld_info()) {
+            const auto ptr_size = img.pointer_size();
+            const auto rebases =
+                decode_rebases(img.bytes(dyld_info->rebase_off, dyld_info->rebase_size), ptr_size);
+            for (const auto &rebase : rebases.value_or(std::vector<rebase_entry>{})) {
+                facts.emplace(prefix + "rebase " + location(rebase.seg_index, rebase.seg_offset));
+            }
+            const std::array<std::tuple<const char *, uint32_t, uint32_t, bind_kind>, 3> streams{
+                {{"bind", dyld_info->bind_off, dyld_info->bind_size, bind_kind::regular},
+                 {"weak bind", dyld_info->weak_bind_off, dyld_info->weak_bind_size,
+                  bind_kind::weak},
+                 {"lazy bind", dyld_info->lazy_bind_off, dyld_info->lazy_bind_size,
+                  bind_kind::lazy}}};
+            for (const auto &[what, off, size, kind] : streams) {
+                const auto binds = decode_binds(img.bytes(off, size), ptr_size, kind);
+                if (!binds) {
+                    facts.emplace(prefix + fmt::format("undecodable {:s} opcodes", what));
+                    continue;
+                }
+                for (const auto &bind : *binds) {
+                    facts.emplace(
+                        prefix +
+                        fmt::format("{:s} {:s} {:s} from {:s} addend {:d}", what,
+                                    bind.has_location ? location(bind.seg_index, bind.seg_offset)
+                                                      : "-",
+                                    bind.symbol,
+                                    kind == bind_kind::weak ? "-"
+                                                            : ordinal_name(bind.ordinal, libraries),
+                                    bind.addend));
+                }
+            }
+        }
+
+        if (const auto lc = img.find_command(LC_SYMTAB)) {
+            std::vector<model_symbol> symbols;
+            const auto symtab = *img.command_at<symtab_command>(lc->offset);
+            if (img.is64()) {
+                parse_symbols<nlist_64>(img.data(), symtab, symbols);
+            } else {
+                parse_symbols<nlist>(img.data(), symtab, symbols);
+            }
+            for (const auto &sym : symbols) {
+                if ((sym.type & N_TYPE) == N_SECT) {
+                    facts.emplace(prefix + fmt::format("symbol {:s} defined at {:#x} desc {:#x}",
+                                                       sym.name, sym.value, sym.desc));
+                } else {
+                    facts.emplace(prefix + fmt::format("symbol {:s} type {:#x} from {:s}", sym.name,
+                                                       sym.type,
+                                                       ordinal_name(sym.desc >> 8, libraries)));
+                }
+            }
+        }
+    }
+    return facts;
+}
+
+} // namespace macho
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "macho-view.hpp"
+
+// Native editing model for one thin Mach-O, the LIEF-free conversion engine. Load commands,
+// symbols and fixups are flat arrays; untouched commands, symbol names and LINKEDIT blobs stay
+// views into the input, which must outlive the model, and new commands live in an arena the
+// model owns. serialize() leaves every segment's contents where they are and rebuilds the load
+// commands and __LINKEDIT, so images that would need code or data to move are refused with a
+// reason and the caller falls back to LIEF.
+namespace macho {
+
+// Bump allocator for bytes the edits create. Blocks never move, so views stay valid when the
+// arena does.
+class arena {
+public:
+    // Zeroed and pointer aligned.
+    std::span<uint8_t> allocate(size_t size);
+
+private:
+    static constexpr size_t block_size = 1 << 16;
+
+    std::vector<std::unique_ptr<uint8_t[]>> blocks_;
+    size_t used_{block_size};
+};
+
+struct model_command {
+    uint32_t cmd;
+    // the whole command, header included
+    std::span<const uint8_t> bytes;
+};
+
+struct model_symbol {
+    std::string_view name;
+    uint8_t type;
+    uint8_t sect;
+    uint16_t desc;
+    uint64_t value;
+};
+
+class model {
+public:
+    // reason says what the model couldn't handle when this fails.
+    static std::optional<model> parse(std::span<const uint8_t> slice, std::string &reason);
+
+    uint32_t cputype() const {
+        return header_.cputype;
+    }
+    uint8_t pointer_size() const {
+        return is64_ ? 8 : 4;
+    }
+    uint32_t filetype() const {
+        return header_.filetype;
+    }
+    void filetype(uint32_t filetype) {
+        header_.filetype = filetype;
+    }
+    uint32_t flags() const {
+        return header_.flags;
+    }
+    void flags(uint32_t flags) {
+        header_.flags = flags;
+    }
+
+    const std::vector<model_command> &commands() const {
+        return commands_;
+    }
+    std::optional<size_t> find_command(uint32_t cmd) const;
+    // Returns the removed command's size.
+    uint32_t remove_command(size_t idx);
+    // Appended after the existing commands. Return the new command's size.
+    uint32_t add_dylib(uint32_t cmd, std::string_view name, uint32_t current_version,
+                       uint32_t compat_version);
+    uint32_t add_build_version(uint32_t platform, uint32_t minos, uint32_t sdk);
+
+    // Install names of the dependent dylibs, library ordinal i + 1 is libraries()[i].
+    std::vector<std::string_view> libraries() const;
+    std::optional<size_t> find_library(std::string_view name) const;
+
+    // Only segments without file contents (__PAGEZERO) can go, fixups into later segments are
+    // renumbered. Returns the removed command's size, reason is set if the segment exists but
+    // can't go.
+    std::optional<uint32_t> remove_empty_segment(std::string_view name, std::string &reason);
+    // Zeroes the section's contents and drops its header, symbols in later sections are
+    // renumbered. Fails if a symbol is defined in it. Returns the section's size, reason is set
+    // if the section exists but can't go.
+    std::optional<uint64_t> remove_section(std::string_view segname, std::string_view sectname,
+                                           std::string &reason);
+    // Folds every data segment into the one before it when dyld would map both the same way,
+    // so one mapping covers them. Only __DATA and __DATA_DIRTY qualify, the runtimes look data
+    // sections up in either. Segments with a section name in common stay apart, the runtimes
+    // only find the first section of a name, why is added to skipped. Fixups into later
+    // segments are renumbered, section numbers don't change. Returns how many segments went
+    // away and adds the load command bytes saved to saved_bytes.
+    size_t merge_data_segments(uint32_t &saved_bytes, std::vector<std::string> &skipped);
+    // Segments dyld maps, __PAGEZERO and other reservations don't count.
+    size_t num_mapped_segments() const;
+
+    // Flags of every section, symbol section number n is [n - 1].
+    std::vector<uint32_t> section_flags() const;
+
+    std::vector<model_symbol> &symbols() {
+        return symbols_;
+    }
+    std::vector<bind_entry> &binds(bind_kind kind) {
+        return binds_[(size_t)kind];
+    }
+    std::vector<rebase_entry> &rebases() {
+        return rebases_;
+    }
+    // Clears flags on an exported symbol in place, false if it isn't exported.
+    bool clear_export_flags(std::string_view name, uint64_t flags);
+
+    std::optional<std::vector<uint8_t>> serialize(std::string &reason) const;
+
+private:
+    explicit model(std::span<const uint8_t> data);
+
+    uint32_t add_command(std::span<uint8_t> bytes);
+    std::optional<size_t> find_segment(std::string_view name, uint32_t &seg_index) const;
+
+    std::span<const uint8_t> data_;
+    bool is64_;
+    mach_header header_;
+    // end of the space the load commands may grow into
+    uint64_t commands_limit_{0};
+    uint64_t orig_commands_end_{0};
+    std::vector<model_command> commands_;
+    std::vector<model_symbol> symbols_;
+    std::array<std::vector<bind_entry>, 3> binds_;
+    std::vector<rebase_entry> rebases_;
+    std::vector<uint8_t> exports_;
+    // file ranges of removed sections
+    std::vector<std::pair<uint64_t, uint64_t>> zeroed_;
+    arena arena_;
+};
+
+// Order-independent description of what a file means to dyld: header, load command types,
+// libraries and every fixup and symbol resolved to names. Two conversions of the same input
+// agree when these are equal, whatever layout they picked.
+std::set<std::string> image_facts(std::span<const uint8_t> file);
+
+} // namespace macho
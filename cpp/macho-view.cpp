@@ -0,0 +1,773 @@
+#undef NDEBUG
+#include "macho-view.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+#include <fmt/format.h>
+
+#include "task-runtime.hpp"
+
+namespace macho {
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t read_be64(const uint8_t *p) {
+    return ((uint64_t)read_be32(p) << 32) | read_be32(p + 4);
+}
+
+static void write_be32(uint8_t *p, uint32_t val) {
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static void write_be64(uint8_t *p, uint64_t val) {
+    write_be32(p, val >> 32);
+    write_be32(p + 4, val);
+}
+
+static uint64_t align_up(uint64_t val, uint64_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+bool is_fat(std::span<const uint8_t> file) {
+    assert(file.size() >= sizeof(uint32_t));
+    const auto magic = read_be32(file.data());
+    return magic == FAT_MAGIC || magic == FAT_MAGIC_64;
+}
+
+std::string arch_name(uint32_t cputype) {
+    switch (cputype) {
+    case 7:
+        return "i386";
+    case 0x1000007:
+        return "x86_64";
+    case 12:
+        return "armv7";
+    case 0x100000c:
+        return "arm64";
+    default:
+        return fmt::format("cpu {:#x}", cputype);
+    }
+}
+
+uint64_t page_size(uint32_t cputype) {
+    return cputype == CPU_TYPE_ARM64 ? 0x4000 : 0x1000;
+}
+
+std::vector<fat_slice> slices(std::span<const uint8_t> file) {
+    if (!is_fat(file)) {
+        assert(file.size() >= sizeof(mach_header));
+        const auto *hdr = reinterpret_cast<const mach_header *>(file.data());
+        return {{hdr->cputype, hdr->cpusubtype, 0, file.size(), 0}};
+    }
+    const auto magic = read_be32(file.data());
+
+    const bool fat64     = magic == FAT_MAGIC_64;
+    const auto nfat_arch = read_be32(file.data() + 4);
+    const size_t arch_sz = fat64 ? 32 : 20;
+    assert(8 + nfat_arch * arch_sz <= file.size());
+
+    std::vector<fat_slice> res;
+    for (uint32_t i = 0; i < nfat_arch; ++i) {
+        const auto *arch = file.data() + 8 + i * arch_sz;
+        fat_slice slice;
+        slice.cputype    = read_be32(arch);
+        slice.cpusubtype = read_be32(arch + 4);
+        if (fat64) {
+            slice.offset = read_be64(arch + 8);
+            slice.size   = read_be64(arch + 16);
+            slice.align  = read_be32(arch + 24);
+        } else {
+            slice.offset = read_be32(arch + 8);
+            slice.size   = read_be32(arch + 12);
+            slice.align  = read_be32(arch + 16);
+        }
+        assert(slice.offset + slice.size <= file.size());
+        res.emplace_back(slice);
+    }
+    return res;
+}
+
+std::vector<std::vector<uint8_t>> split_fat(std::span<const uint8_t> file) {
+    std::vector<std::vector<uint8_t>> res;
+    for (const auto &slice : slices(file)) {
+        const auto bytes = file.subspan(slice.offset, slice.size);
+        res.emplace_back(bytes.begin(), bytes.end());
+    }
+    return res;
+}
+
+static std::vector<fat_slice> fat_layout(const std::vector<std::vector<uint8_t>> &slice_bufs,
+                                         std::span<const fat_slice> layout, size_t arch_sz) {
+    std::vector<fat_slice> res;
+    uint64_t off = 8 + arch_sz * layout.size();
+    for (size_t i = 0; i < layout.size(); ++i) {
+        auto slice   = layout[i];
+        slice.offset = align_up(off, (uint64_t)1 << slice.align);
+        slice.size   = slice_bufs[i].size();
+        off          = slice.offset + slice.size;
+        res.emplace_back(slice);
+    }
+    return res;
+}
+
+std::vector<uint8_t> join_fat(std::vector<std::vector<uint8_t>> &slice_bufs,
+                              std::span<const fat_slice> layout, bool fat) {
+    assert(slice_bufs.size() == layout.size());
+    if (!fat) {
+        assert(slice_bufs.size() == 1);
+        return std::move(slice_bufs[0]);
+    }
+
+    auto new_layout = fat_layout(slice_bufs, layout, 20);
+    const bool fat64 = new_layout.back().offset + new_layout.back().size > UINT32_MAX;
+    if (fat64) {
+        new_layout = fat_layout(slice_bufs, layout, 32);
+    }
+    const size_t arch_sz = fat64 ? 32 : 20;
+
+    std::vector<uint8_t> res(new_layout.back().offset + new_layout.back().size);
+    write_be32(res.data(), fat64 ? FAT_MAGIC_64 : FAT_MAGIC);
+    write_be32(res.data() + 4, new_layout.size());
+    for (size_t i = 0; i < new_layout.size(); ++i) {
+        const auto &slice = new_layout[i];
+        auto *arch        = res.data() + 8 + i * arch_sz;
+        write_be32(arch, slice.cputype);
+        write_be32(arch + 4, slice.cpusubtype);
+        if (fat64) {
+            write_be64(arch + 8, slice.offset);
+            write_be64(arch + 16, slice.size);
+            write_be32(arch + 24, slice.align);
+        } else {
+            write_be32(arch + 8, slice.offset);
+            write_be32(arch + 12, slice.size);
+            write_be32(arch + 16, slice.align);
+        }
+        std::copy(slice_bufs[i].begin(), slice_bufs[i].end(), res.begin() + slice.offset);
+    }
+    return res;
+}
+
+image::image(std::span<uint8_t> data) : data_{data} {
+    assert(data_.size() >= sizeof(mach_header));
+    const auto magic = header().magic;
+    assert(magic == MH_MAGIC || magic == MH_MAGIC_64);
+    is64_ = magic == MH_MAGIC_64;
+    assert(header_size() + header().sizeofcmds <= data_.size());
+}
+
+std::vector<load_command_ref> image::commands() const {
+    std::vector<load_command_ref> res;
+    res.reserve(header().ncmds);
+    uint64_t off = header_size();
+    for (uint32_t i = 0; i < header().ncmds; ++i) {
+        const auto *lc = command_at<load_command>(off);
+        assert(lc->cmdsize >= sizeof(load_command));
+        assert(off + lc->cmdsize <= header_size() + header().sizeofcmds);
+        res.emplace_back(load_command_ref{lc->cmd, lc->cmdsize, off});
+        off += lc->cmdsize;
+    }
+    return res;
+}
+
+std::optional<load_command_ref> image::find_command(uint32_t cmd) const {
+    for (const auto &lc : commands()) {
+        if (lc.cmd == cmd) {
+            return lc;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<segment_ref> image::segments() const {
+    std::vector<segment_ref> res;
+    uint32_t idx{0};
+    for (const auto &lc : commands()) {
+        if (lc.cmd == LC_SEGMENT_64) {
+            const auto *seg = command_at<segment_command_64>(lc.offset);
+            res.emplace_back(segment_ref{{seg->segname, strnlen(seg->segname, 16)},
+                                         seg->vmaddr,
+                                         seg->vmsize,
+                                         seg->fileoff,
+                                         seg->filesize,
+                                         seg->maxprot,
+                                         seg->initprot,
+                                         seg->flags,
+                                         idx++,
+                                         lc.offset});
+        } else if (lc.cmd == LC_SEGMENT) {
+            const auto *seg = command_at<segment_command>(lc.offset);
+            res.emplace_back(segment_ref{{seg->segname, strnlen(seg->segname, 16)},
+                                         seg->vmaddr,
+                                         seg->vmsize,
+                                         seg->fileoff,
+                                         seg->filesize,
+                                         seg->maxprot,
+                                         seg->initprot,
+                                         seg->flags,
+                                         idx++,
+                                         lc.offset});
+        }
+    }
+    return res;
+}
+
+template <typename Segment, typename Section>
+static void collect_sections(const image &img, uint64_t cmd_offset,
+                             std::vector<section_ref> &res) {
+    const auto *seg   = img.command_at<Segment>(cmd_offset);
+    const auto *sects = reinterpret_cast<const Section *>(seg + 1);
+    for (uint32_t i = 0; i < seg->nsects; ++i) {
+        const auto &sect = sects[i];
+        res.emplace_back(section_ref{{sect.segname, strnlen(sect.segname, 16)},
+                                     {sect.sectname, strnlen(sect.sectname, 16)},
+                                     sect.addr,
+                                     sect.size,
+                                     sect.offset,
+                                     sect.flags});
+    }
+}
+
+std::vector<section_ref> image::sections() const {
+    std::vector<section_ref> res;
+    for (const auto &lc : commands()) {
+        if (lc.cmd == LC_SEGMENT_64) {
+            collect_sections<segment_command_64, section_64>(*this, lc.offset, res);
+        } else if (lc.cmd == LC_SEGMENT) {
+            collect_sections<segment_command, section>(*this, lc.offset, res);
+        }
+    }
+    return res;
+}
+
+std::optional<segment_ref> image::segment(std::string_view name) const {
+    for (const auto &seg : segments()) {
+        if (seg.name == name) {
+            return seg;
+        }
+    }
+    return std::nullopt;
+}
+
+dyld_info_command *image::dyld_info() const {
+    auto lc = find_command(LC_DYLD_INFO_ONLY);
+    if (!lc) {
+        lc = find_command(LC_DYLD_INFO);
+    }
+    return lc ? command_at<dyld_info_command>(lc->offset) : nullptr;
+}
+
+// large symbol tables are scanned in chunks on the task runtime
+constexpr uint32_t symbol_chunk_size = 1 << 15;
+
+template <typename NList>
+static void collect_defined_symbols(const image &img, const symtab_command &symtab,
+                                    std::vector<defined_symbol> &res) {
+    const auto strtab = img.bytes(symtab.stroff, symtab.strsize);
+    const auto *syms  = reinterpret_cast<const NList *>(img.data().data() + symtab.symoff);
+    assert(symtab.symoff + (uint64_t)symtab.nsyms * sizeof(NList) <= img.data().size());
+    const auto num_chunks = (symtab.nsyms + symbol_chunk_size - 1) / symbol_chunk_size;
+    std::vector<std::vector<defined_symbol>> chunks(num_chunks);
+    parallel_for(num_chunks, [&](size_t chunk) {
+        const uint32_t begin = chunk * symbol_chunk_size;
+        const uint32_t end   = std::min(begin + symbol_chunk_size, symtab.nsyms);
+        for (uint32_t i = begin; i < end; ++i) {
+            const auto &sym = syms[i];
+            if ((sym.n_type & N_TYPE) != N_SECT || !(sym.n_type & N_EXT) ||
+                sym.n_strx >= strtab.size()) {
+                continue;
+            }
+            const auto *name = reinterpret_cast<const char *>(strtab.data() + sym.n_strx);
+            chunks[chunk].emplace_back(
+                defined_symbol{{name, strnlen(name, strtab.size() - sym.n_strx)},
+                               sym.n_value,
+                               sym.n_desc});
+        }
+    });
+    // keep symbol table order
+    for (const auto &chunk : chunks) {
+        res.insert(res.end(), chunk.begin(), chunk.end());
+    }
+}
+
+std::vector<defined_symbol> defined_symbols(const image &img) {
+    std::vector<defined_symbol> res;
+    const auto lc = img.find_command(LC_SYMTAB);
+    if (!lc) {
+        return res;
+    }
+    const auto &symtab = *img.command_at<symtab_command>(lc->offset);
+    if (img.is64()) {
+        collect_defined_symbols<nlist_64>(img, symtab, res);
+    } else {
+        collect_defined_symbols<nlist>(img, symtab, res);
+    }
+    return res;
+}
+
+std::optional<uint32_t> append_to_linkedit(std::vector<uint8_t> &slice_buf,
+                                           std::span<const uint8_t> blob) {
+    image img{slice_buf};
+    const auto linkedit = img.segment("__LINKEDIT");
+    if (!linkedit || linkedit->fileoff + linkedit->filesize != slice_buf.size()) {
+        return std::nullopt;
+    }
+    const uint64_t blob_off = align_up(slice_buf.size(), img.pointer_size());
+    const uint64_t new_size = blob_off + blob.size();
+    if (new_size > UINT32_MAX) {
+        return std::nullopt;
+    }
+    const auto seg_cmd_off = linkedit->cmd_offset;
+    const bool is64        = img.is64();
+    const auto page        = page_size(img.cputype());
+    slice_buf.resize(new_size);
+    std::copy(blob.begin(), blob.end(), slice_buf.begin() + blob_off);
+
+    // keep the same page rounding the linker used for the segment
+    const auto filesize = new_size - linkedit->fileoff;
+    const auto vmsize   = std::max(linkedit->vmsize, align_up(filesize, page));
+    if (is64) {
+        auto *seg     = reinterpret_cast<segment_command_64 *>(slice_buf.data() + seg_cmd_off);
+        seg->filesize = filesize;
+        seg->vmsize   = vmsize;
+    } else {
+        auto *seg     = reinterpret_cast<segment_command *>(slice_buf.data() + seg_cmd_off);
+        seg->filesize = filesize;
+        seg->vmsize   = vmsize;
+    }
+    return blob_off;
+}
+
+std::optional<std::vector<rebase_entry>> decode_rebases(std::span<const uint8_t> opcodes,
+                                                        uint8_t pointer_size) {
+    std::vector<rebase_entry> res;
+    rebase_entry cur;
+    size_t pos{0};
+    while (pos < opcodes.size()) {
+        const uint8_t opcode = opcodes[pos] & REBASE_OPCODE_MASK;
+        const uint8_t imm    = opcodes[pos] & REBASE_IMMEDIATE_MASK;
+        ++pos;
+        switch (opcode) {
+        case REBASE_OPCODE_DONE:
+            return res;
+        case REBASE_OPCODE_SET_TYPE_IMM:
+            cur.type = imm;
+            break;
+        case REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+            cur.seg_index  = imm;
+            cur.seg_offset = read_uleb(opcodes, pos);
+            break;
+        case REBASE_OPCODE_ADD_ADDR_ULEB:
+            cur.seg_offset += read_uleb(opcodes, pos);
+            break;
+        case REBASE_OPCODE_ADD_ADDR_IMM_SCALED:
+            cur.seg_offset += (uint64_t)imm * pointer_size;
+            break;
+        case REBASE_OPCODE_DO_REBASE_IMM_TIMES:
+            for (uint8_t i = 0; i < imm; ++i) {
+                res.emplace_back(cur);
+                cur.seg_offset += pointer_size;
+            }
+            break;
+        case REBASE_OPCODE_DO_REBASE_ULEB_TIMES: {
+            const auto count = read_uleb(opcodes, pos);
+            for (uint64_t i = 0; i < count; ++i) {
+                res.emplace_back(cur);
+                cur.seg_offset += pointer_size;
+            }
+            break;
+        }
+        case REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB:
+            res.emplace_back(cur);
+            cur.seg_offset += read_uleb(opcodes, pos) + pointer_size;
+            break;
+        case REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB: {
+            const auto count = read_uleb(opcodes, pos);
+            const auto skip  = read_uleb(opcodes, pos);
+            for (uint64_t i = 0; i < count; ++i) {
+                res.emplace_back(cur);
+                cur.seg_offset += skip + pointer_size;
+            }
+            break;
+        }
+        default:
+            return std::nullopt;
+        }
+    }
+    return res;
+}
+
+std::vector<uint8_t> encode_rebases(std::span<const rebase_entry> entries, uint8_t pointer_size) {
+    std::vector<uint8_t> res;
+    uint8_t type{0};
+    std::optional<uint8_t> seg_index;
+    uint64_t seg_offset{0};
+
+    size_t i{0};
+    while (i < entries.size()) {
+        const auto &entry = entries[i];
+        if (type != entry.type) {
+            res.emplace_back(REBASE_OPCODE_SET_TYPE_IMM | entry.type);
+            type = entry.type;
+        }
+        if (seg_index != entry.seg_index || entry.seg_offset < seg_offset) {
+            res.emplace_back(REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | entry.seg_index);
+            write_uleb(res, entry.seg_offset);
+            seg_index = entry.seg_index;
+        } else if (entry.seg_offset > seg_offset) {
+            const auto delta = entry.seg_offset - seg_offset;
+            if (!(delta % pointer_size) && delta / pointer_size <= REBASE_IMMEDIATE_MASK) {
+                res.emplace_back(REBASE_OPCODE_ADD_ADDR_IMM_SCALED |
+                                 (uint8_t)(delta / pointer_size));
+            } else {
+                res.emplace_back(REBASE_OPCODE_ADD_ADDR_ULEB);
+                write_uleb(res, delta);
+            }
+        }
+
+        // fold the run of contiguous pointers starting here
+        uint64_t run{1};
+        while (i + run < entries.size() && entries[i + run].seg_index == entry.seg_index &&
+               entries[i + run].type == entry.type &&
+               entries[i + run].seg_offset == entry.seg_offset + run * pointer_size) {
+            ++run;
+        }
+        if (run <= REBASE_IMMEDIATE_MASK) {
+            res.emplace_back(REBASE_OPCODE_DO_REBASE_IMM_TIMES | (uint8_t)run);
+        } else {
+            res.emplace_back(REBASE_OPCODE_DO_REBASE_ULEB_TIMES);
+            write_uleb(res, run);
+        }
+        seg_offset = entry.seg_offset + run * pointer_size;
+        i += run;
+    }
+
+    res.emplace_back(REBASE_OPCODE_DONE);
+    while (res.size() % pointer_size) {
+        res.emplace_back(REBASE_OPCODE_DONE);
+    }
+    return res;
+}
+
+uint64_t read_uleb(std::span<const uint8_t> buf, size_t &pos) {
+    uint64_t res{0};
+    unsigned shift{0};
+    uint8_t byte;
+    do {
+        assert(pos < buf.size());
+        byte = buf[pos++];
+        if (shift < 64) {
+            res |= (uint64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    return res;
+}
+
+int64_t read_sleb(std::span<const uint8_t> buf, size_t &pos) {
+    int64_t res{0};
+    unsigned shift{0};
+    uint8_t byte;
+    do {
+        assert(pos < buf.size());
+        byte = buf[pos++];
+        if (shift < 64) {
+            res |= (int64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+        res |= -((int64_t)1 << shift);
+    }
+    return res;
+}
+
+void write_uleb(std::vector<uint8_t> &buf, uint64_t val) {
+    do {
+        uint8_t byte = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            byte |= 0x80;
+        }
+        buf.emplace_back(byte);
+    } while (val);
+}
+
+void write_sleb(std::vector<uint8_t> &buf, int64_t val) {
+    bool more;
+    do {
+        uint8_t byte = val & 0x7f;
+        val >>= 7;
+        more = !((val == 0 && !(byte & 0x40)) || (val == -1 && (byte & 0x40)));
+        if (more) {
+            byte |= 0x80;
+        }
+        buf.emplace_back(byte);
+    } while (more);
+}
+
+static uint64_t chain_bits(uint64_t val, unsigned shift, unsigned width) {
+    return (val >> shift) & ((1ull << width) - 1);
+}
+
+static bool is_arm64e_chained_format(uint16_t format) {
+    return format == DYLD_CHAINED_PTR_ARM64E || format == DYLD_CHAINED_PTR_ARM64E_USERLAND ||
+           format == DYLD_CHAINED_PTR_ARM64E_USERLAND24;
+}
+
+bool is_supported_chained_format(uint16_t format) {
+    return is_arm64e_chained_format(format) || format == DYLD_CHAINED_PTR_64 ||
+           format == DYLD_CHAINED_PTR_64_OFFSET;
+}
+
+uint32_t chained_stride(uint16_t format) {
+    return is_arm64e_chained_format(format) ? 8 : 4;
+}
+
+chained_pointer decode_chained_pointer(uint64_t raw, uint16_t format) {
+    assert(is_supported_chained_format(format));
+    const bool vm_targets = format == DYLD_CHAINED_PTR_64 || format == DYLD_CHAINED_PTR_ARM64E;
+    chained_pointer ptr;
+    if (is_arm64e_chained_format(format)) {
+        // bit 63 is auth, 62 bind
+        ptr.next = chain_bits(raw, 51, 11);
+        ptr.auth = chain_bits(raw, 63, 1);
+        if (chain_bits(raw, 62, 1)) {
+            ptr.import = chain_bits(raw, 0, format == DYLD_CHAINED_PTR_ARM64E_USERLAND24 ? 24 : 16);
+            if (!ptr.auth) {
+                // 19 bit signed
+                ptr.addend = (int64_t)(chain_bits(raw, 32, 19) << 45) >> 45;
+            }
+        } else if (ptr.auth) {
+            // diversity, address diversity and key sit above the 32 bit offset
+            ptr.target = chain_bits(raw, 0, 32);
+        } else {
+            ptr.target        = chain_bits(raw, 0, 43);
+            ptr.vmaddr_target = vm_targets;
+            ptr.high8         = chain_bits(raw, 43, 8);
+        }
+    } else {
+        ptr.next = chain_bits(raw, 51, 12);
+        if (chain_bits(raw, 63, 1)) {
+            ptr.import = chain_bits(raw, 0, 24);
+            ptr.addend = chain_bits(raw, 24, 8);
+        } else {
+            ptr.target        = chain_bits(raw, 0, 36);
+            ptr.vmaddr_target = vm_targets;
+            ptr.high8         = chain_bits(raw, 36, 8);
+        }
+    }
+    return ptr;
+}
+
+std::vector<uint16_t> chained_pointer_formats(const image &img) {
+    std::vector<uint16_t> formats(img.segments().size());
+    const auto lc = img.find_command(LC_DYLD_CHAINED_FIXUPS);
+    if (!lc) {
+        return formats;
+    }
+    const auto *cmd = img.command_at<linkedit_data_command>(lc->offset);
+    if ((uint64_t)cmd->dataoff + cmd->datasize > img.data().size() ||
+        cmd->datasize < sizeof(dyld_chained_fixups_header)) {
+        return formats;
+    }
+    const auto blob = img.bytes(cmd->dataoff, cmd->datasize);
+    dyld_chained_fixups_header hdr;
+    std::memcpy(&hdr, blob.data(), sizeof(hdr));
+    if ((uint64_t)hdr.starts_offset + sizeof(uint32_t) > blob.size()) {
+        return formats;
+    }
+    uint32_t seg_count;
+    std::memcpy(&seg_count, blob.data() + hdr.starts_offset, sizeof(seg_count));
+    for (uint32_t seg = 0; seg < seg_count && seg < formats.size(); ++seg) {
+        const auto info_pos = hdr.starts_offset + (1 + (uint64_t)seg) * sizeof(uint32_t);
+        if (info_pos + sizeof(uint32_t) > blob.size()) {
+            break;
+        }
+        uint32_t info_off;
+        std::memcpy(&info_off, blob.data() + info_pos, sizeof(info_off));
+        const auto format_pos = hdr.starts_offset + (uint64_t)info_off +
+                                offsetof(dyld_chained_starts_in_segment, pointer_format);
+        if (!info_off || format_pos + sizeof(uint16_t) > blob.size()) {
+            continue;
+        }
+        std::memcpy(&formats[seg], blob.data() + format_pos, sizeof(uint16_t));
+    }
+    return formats;
+}
+
+std::optional<std::vector<bind_entry>> decode_binds(std::span<const uint8_t> opcodes,
+                                                    uint8_t pointer_size, bind_kind kind) {
+    std::vector<bind_entry> res;
+    bind_entry cur;
+    size_t pos{0};
+    while (pos < opcodes.size()) {
+        const uint8_t opcode = opcodes[pos] & BIND_OPCODE_MASK;
+        const uint8_t imm    = opcodes[pos] & BIND_IMMEDIATE_MASK;
+        ++pos;
+        switch (opcode) {
+        case BIND_OPCODE_DONE:
+            // lazy streams terminate every entry, the others terminate the whole stream
+            if (kind != bind_kind::lazy) {
+                return res;
+            }
+            cur.lazy_offset = pos;
+            break;
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+            cur.ordinal = imm;
+            break;
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+            cur.ordinal = (int64_t)read_uleb(opcodes, pos);
+            break;
+        case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+            cur.ordinal = imm ? (int8_t)(BIND_OPCODE_MASK | imm) : 0;
+            break;
+        case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM: {
+            const auto *name = reinterpret_cast<const char *>(opcodes.data() + pos);
+            const auto len   = strnlen(name, opcodes.size() - pos);
+            if (pos + len >= opcodes.size()) {
+                return std::nullopt;
+            }
+            cur.symbol       = {name, len};
+            cur.symbol_flags = imm;
+            pos += len + 1;
+            if (kind == bind_kind::weak && (imm & BIND_SYMBOL_FLAGS_NON_WEAK_DEFINITION)) {
+                auto strong_def         = cur;
+                strong_def.has_location = false;
+                res.emplace_back(strong_def);
+            }
+            break;
+        }
+        case BIND_OPCODE_SET_TYPE_IMM:
+            cur.type = imm;
+            break;
+        case BIND_OPCODE_SET_ADDEND_SLEB:
+            cur.addend = read_sleb(opcodes, pos);
+            break;
+        case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+            cur.seg_index  = imm;
+            cur.seg_offset = read_uleb(opcodes, pos);
+            break;
+        case BIND_OPCODE_ADD_ADDR_ULEB:
+            cur.seg_offset += read_uleb(opcodes, pos);
+            break;
+        case BIND_OPCODE_DO_BIND:
+            res.emplace_back(cur);
+            cur.seg_offset += pointer_size;
+            break;
+        case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+            res.emplace_back(cur);
+            cur.seg_offset += read_uleb(opcodes, pos) + pointer_size;
+            break;
+        case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+            res.emplace_back(cur);
+            cur.seg_offset += (uint64_t)imm * pointer_size + pointer_size;
+            break;
+        case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB: {
+            const auto count = read_uleb(opcodes, pos);
+            const auto skip  = read_uleb(opcodes, pos);
+            for (uint64_t i = 0; i < count; ++i) {
+                res.emplace_back(cur);
+                cur.seg_offset += skip + pointer_size;
+            }
+            break;
+        }
+        default:
+            // BIND_OPCODE_THREADED and anything newer
+            return std::nullopt;
+        }
+    }
+    return res;
+}
+
+std::vector<uint8_t> encode_binds(std::span<const bind_entry> entries, uint8_t pointer_size,
+                                  bind_kind kind) {
+    // lazy entries are addressed by offset from the stub helpers, they can't be re-laid out
+    assert(kind != bind_kind::lazy);
+
+    std::vector<uint8_t> res;
+    std::optional<int64_t> ordinal;
+    std::optional<std::string_view> symbol;
+    uint8_t symbol_flags{0};
+    uint8_t type{0};
+    int64_t addend{0};
+    std::optional<uint8_t> seg_index;
+    uint64_t seg_offset{0};
+    // position of the trailing DO_BIND so it can be folded with a following address bump
+    std::optional<size_t> last_do_bind;
+
+    for (const auto &entry : entries) {
+        if (kind == bind_kind::regular && ordinal != entry.ordinal) {
+            if (entry.ordinal <= 0) {
+                res.emplace_back(BIND_OPCODE_SET_DYLIB_SPECIAL_IMM |
+                                 (entry.ordinal & BIND_IMMEDIATE_MASK));
+            } else if (entry.ordinal <= BIND_IMMEDIATE_MASK) {
+                res.emplace_back(BIND_OPCODE_SET_DYLIB_ORDINAL_IMM | entry.ordinal);
+            } else {
+                res.emplace_back(BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB);
+                write_uleb(res, entry.ordinal);
+            }
+            ordinal      = entry.ordinal;
+            last_do_bind = std::nullopt;
+        }
+        if (symbol != entry.symbol || symbol_flags != entry.symbol_flags) {
+            res.emplace_back(BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM | entry.symbol_flags);
+            res.insert(res.end(), entry.symbol.begin(), entry.symbol.end());
+            res.emplace_back('\0');
+            symbol       = entry.symbol;
+            symbol_flags = entry.symbol_flags;
+            last_do_bind = std::nullopt;
+        }
+        if (!entry.has_location) {
+            continue;
+        }
+        if (type != entry.type) {
+            res.emplace_back(BIND_OPCODE_SET_TYPE_IMM | entry.type);
+            type         = entry.type;
+            last_do_bind = std::nullopt;
+        }
+        if (addend != entry.addend) {
+            res.emplace_back(BIND_OPCODE_SET_ADDEND_SLEB);
+            write_sleb(res, entry.addend);
+            addend       = entry.addend;
+            last_do_bind = std::nullopt;
+        }
+        if (seg_index != entry.seg_index || entry.seg_offset < seg_offset) {
+            res.emplace_back(BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | entry.seg_index);
+            write_uleb(res, entry.seg_offset);
+            seg_index    = entry.seg_index;
+            last_do_bind = std::nullopt;
+        } else if (entry.seg_offset > seg_offset) {
+            const auto delta = entry.seg_offset - seg_offset;
+            if (last_do_bind && *last_do_bind == res.size() - 1 && !(delta % pointer_size) &&
+                delta / pointer_size <= BIND_IMMEDIATE_MASK) {
+                res[*last_do_bind] =
+                    BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED | (uint8_t)(delta / pointer_size);
+            } else if (last_do_bind && *last_do_bind == res.size() - 1) {
+                res[*last_do_bind] = BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB;
+                write_uleb(res, delta);
+            } else {
+                res.emplace_back(BIND_OPCODE_ADD_ADDR_ULEB);
+                write_uleb(res, delta);
+            }
+        }
+        last_do_bind = res.size();
+        res.emplace_back(BIND_OPCODE_DO_BIND);
+        seg_offset = entry.seg_offset + pointer_size;
+    }
+
+    res.emplace_back(BIND_OPCODE_DONE);
+    while (res.size() % pointer_size) {
+        res.emplace_back(BIND_OPCODE_DONE);
+    }
+    return res;
+}
+
+} // namespace macho
@@ -0,0 +1,503 @@
+#pragma once
+
+#include <compare>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Minimal zero-copy view over raw Mach-O bytes. LIEF owns the object model for the bulk of the
+// conversion; this is for the places where we need to touch bytes LIEF doesn't expose an API
+// for (opcode streams, LINKEDIT layout) and for cheap walks that don't need a full parse.
+namespace macho {
+
+constexpr uint32_t MH_MAGIC     = 0xfeedface;
+constexpr uint32_t MH_MAGIC_64  = 0xfeedfacf;
+constexpr uint32_t FAT_MAGIC    = 0xcafebabe;
+constexpr uint32_t FAT_MAGIC_64 = 0xcafebabf;
+
+constexpr uint32_t MH_EXECUTE = 0x2;
+constexpr uint32_t MH_DYLIB   = 0x6;
+
+constexpr uint32_t MH_WEAK_DEFINES         = 0x8000;
+constexpr uint32_t MH_BINDS_TO_WEAK        = 0x10000;
+constexpr uint32_t MH_NO_REEXPORTED_DYLIBS = 0x100000;
+
+constexpr uint8_t N_EXT       = 0x01;
+constexpr uint8_t N_TYPE      = 0x0e;
+constexpr uint8_t N_SECT      = 0x0e;
+constexpr uint8_t N_PEXT      = 0x10;
+constexpr uint16_t N_WEAK_REF = 0x0040;
+constexpr uint16_t N_WEAK_DEF = 0x0080;
+
+constexpr uint32_t LC_REQ_DYLD                 = 0x80000000;
+constexpr uint32_t LC_SEGMENT                  = 0x1;
+constexpr uint32_t LC_SYMTAB                   = 0x2;
+constexpr uint32_t LC_DYSYMTAB                 = 0xb;
+constexpr uint32_t LC_LOAD_DYLIB               = 0xc;
+constexpr uint32_t LC_ID_DYLIB                 = 0xd;
+constexpr uint32_t LC_LOAD_DYLINKER            = 0xe;
+constexpr uint32_t LC_LOAD_WEAK_DYLIB          = 0x18 | LC_REQ_DYLD;
+constexpr uint32_t LC_SEGMENT_64               = 0x19;
+constexpr uint32_t LC_CODE_SIGNATURE           = 0x1d;
+constexpr uint32_t LC_SEGMENT_SPLIT_INFO       = 0x1e;
+constexpr uint32_t LC_REEXPORT_DYLIB           = 0x1f | LC_REQ_DYLD;
+constexpr uint32_t LC_LAZY_LOAD_DYLIB          = 0x20;
+constexpr uint32_t LC_DYLD_INFO                = 0x22;
+constexpr uint32_t LC_DYLD_INFO_ONLY           = 0x22 | LC_REQ_DYLD;
+constexpr uint32_t LC_LOAD_UPWARD_DYLIB        = 0x23 | LC_REQ_DYLD;
+constexpr uint32_t LC_VERSION_MIN_MACOSX       = 0x24;
+constexpr uint32_t LC_VERSION_MIN_IPHONEOS     = 0x25;
+constexpr uint32_t LC_FUNCTION_STARTS          = 0x26;
+constexpr uint32_t LC_MAIN                     = 0x28 | LC_REQ_DYLD;
+constexpr uint32_t LC_DATA_IN_CODE             = 0x29;
+constexpr uint32_t LC_SOURCE_VERSION           = 0x2a;
+constexpr uint32_t LC_DYLIB_CODE_SIGN_DRS      = 0x2b;
+constexpr uint32_t LC_LINKER_OPTIMIZATION_HINT = 0x2e;
+constexpr uint32_t LC_VERSION_MIN_TVOS         = 0x2f;
+constexpr uint32_t LC_VERSION_MIN_WATCHOS      = 0x30;
+constexpr uint32_t LC_BUILD_VERSION            = 0x32;
+constexpr uint32_t LC_DYLD_EXPORTS_TRIE        = 0x33 | LC_REQ_DYLD;
+constexpr uint32_t LC_DYLD_CHAINED_FIXUPS      = 0x34 | LC_REQ_DYLD;
+
+constexpr uint8_t N_ARM_THUMB_DEF = 0x0008;
+
+constexpr uint32_t SECTION_TYPE            = 0x000000ff;
+constexpr uint32_t S_ZEROFILL              = 0x1;
+constexpr uint32_t S_GB_ZEROFILL           = 0xc;
+constexpr uint32_t S_THREAD_LOCAL_ZEROFILL = 0x12;
+constexpr uint32_t S_ATTR_PURE_INSTRUCTIONS = 0x80000000;
+constexpr uint32_t S_ATTR_SOME_INSTRUCTIONS = 0x00000400;
+
+constexpr uint64_t EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION = 0x04;
+
+constexpr uint32_t CPU_ARCH_ABI64 = 0x01000000;
+constexpr uint32_t CPU_TYPE_ARM   = 12;
+constexpr uint32_t CPU_TYPE_ARM64 = CPU_TYPE_ARM | CPU_ARCH_ABI64;
+
+constexpr uint8_t REBASE_TYPE_POINTER                              = 1;
+constexpr uint8_t REBASE_OPCODE_MASK                               = 0xf0;
+constexpr uint8_t REBASE_IMMEDIATE_MASK                            = 0x0f;
+constexpr uint8_t REBASE_OPCODE_DONE                               = 0x00;
+constexpr uint8_t REBASE_OPCODE_SET_TYPE_IMM                       = 0x10;
+constexpr uint8_t REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB        = 0x20;
+constexpr uint8_t REBASE_OPCODE_ADD_ADDR_ULEB                      = 0x30;
+constexpr uint8_t REBASE_OPCODE_ADD_ADDR_IMM_SCALED                = 0x40;
+constexpr uint8_t REBASE_OPCODE_DO_REBASE_IMM_TIMES                = 0x50;
+constexpr uint8_t REBASE_OPCODE_DO_REBASE_ULEB_TIMES               = 0x60;
+constexpr uint8_t REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB            = 0x70;
+constexpr uint8_t REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB = 0x80;
+
+constexpr uint8_t BIND_TYPE_POINTER                            = 1;
+constexpr int64_t BIND_SPECIAL_DYLIB_FLAT_LOOKUP               = -2;
+constexpr uint8_t BIND_SYMBOL_FLAGS_WEAK_IMPORT                = 0x1;
+constexpr uint8_t BIND_SYMBOL_FLAGS_NON_WEAK_DEFINITION        = 0x8;
+constexpr uint8_t BIND_OPCODE_MASK                             = 0xf0;
+constexpr uint8_t BIND_IMMEDIATE_MASK                          = 0x0f;
+constexpr uint8_t BIND_OPCODE_DONE                             = 0x00;
+constexpr uint8_t BIND_OPCODE_SET_DYLIB_ORDINAL_IMM            = 0x10;
+constexpr uint8_t BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB           = 0x20;
+constexpr uint8_t BIND_OPCODE_SET_DYLIB_SPECIAL_IMM            = 0x30;
+constexpr uint8_t BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM    = 0x40;
+constexpr uint8_t BIND_OPCODE_SET_TYPE_IMM                     = 0x50;
+constexpr uint8_t BIND_OPCODE_SET_ADDEND_SLEB                  = 0x60;
+constexpr uint8_t BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB      = 0x70;
+constexpr uint8_t BIND_OPCODE_ADD_ADDR_ULEB                    = 0x80;
+constexpr uint8_t BIND_OPCODE_DO_BIND                          = 0x90;
+constexpr uint8_t BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB            = 0xa0;
+constexpr uint8_t BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED      = 0xb0;
+constexpr uint8_t BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB = 0xc0;
+constexpr uint8_t BIND_OPCODE_THREADED                         = 0xd0;
+
+constexpr uint16_t DYLD_CHAINED_PTR_ARM64E            = 1;
+constexpr uint16_t DYLD_CHAINED_PTR_64                = 2;
+constexpr uint16_t DYLD_CHAINED_PTR_32                = 3;
+constexpr uint16_t DYLD_CHAINED_PTR_64_OFFSET         = 6;
+constexpr uint16_t DYLD_CHAINED_PTR_ARM64E_USERLAND   = 9;
+constexpr uint16_t DYLD_CHAINED_PTR_ARM64E_USERLAND24 = 12;
+constexpr uint16_t DYLD_CHAINED_PTR_START_NONE        = 0xffff;
+constexpr uint16_t DYLD_CHAINED_PTR_START_MULTI       = 0x8000;
+
+constexpr uint32_t DYLD_CHAINED_IMPORT          = 1;
+constexpr uint32_t DYLD_CHAINED_IMPORT_ADDEND   = 2;
+constexpr uint32_t DYLD_CHAINED_IMPORT_ADDEND64 = 3;
+
+struct mach_header {
+    uint32_t magic;
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint32_t filetype;
+    uint32_t ncmds;
+    uint32_t sizeofcmds;
+    uint32_t flags;
+};
+
+struct load_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+};
+
+struct segment_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    char segname[16];
+    uint32_t vmaddr;
+    uint32_t vmsize;
+    uint32_t fileoff;
+    uint32_t filesize;
+    uint32_t maxprot;
+    uint32_t initprot;
+    uint32_t nsects;
+    uint32_t flags;
+};
+
+struct segment_command_64 {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    char segname[16];
+    uint64_t vmaddr;
+    uint64_t vmsize;
+    uint64_t fileoff;
+    uint64_t filesize;
+    uint32_t maxprot;
+    uint32_t initprot;
+    uint32_t nsects;
+    uint32_t flags;
+};
+
+struct section {
+    char sectname[16];
+    char segname[16];
+    uint32_t addr;
+    uint32_t size;
+    uint32_t offset;
+    uint32_t align;
+    uint32_t reloff;
+    uint32_t nreloc;
+    uint32_t flags;
+    uint32_t reserved1;
+    uint32_t reserved2;
+};
+
+struct section_64 {
+    char sectname[16];
+    char segname[16];
+    uint64_t addr;
+    uint64_t size;
+    uint32_t offset;
+    uint32_t align;
+    uint32_t reloff;
+    uint32_t nreloc;
+    uint32_t flags;
+    uint32_t reserved1;
+    uint32_t reserved2;
+    uint32_t reserved3;
+};
+
+struct linkedit_data_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t dataoff;
+    uint32_t datasize;
+};
+
+struct dysymtab_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t ilocalsym;
+    uint32_t nlocalsym;
+    uint32_t iextdefsym;
+    uint32_t nextdefsym;
+    uint32_t iundefsym;
+    uint32_t nundefsym;
+    uint32_t tocoff;
+    uint32_t ntoc;
+    uint32_t modtaboff;
+    uint32_t nmodtab;
+    uint32_t extrefsymoff;
+    uint32_t nextrefsyms;
+    uint32_t indirectsymoff;
+    uint32_t nindirectsyms;
+    uint32_t extreloff;
+    uint32_t nextrel;
+    uint32_t locreloff;
+    uint32_t nlocrel;
+};
+
+struct dyld_info_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t rebase_off;
+    uint32_t rebase_size;
+    uint32_t bind_off;
+    uint32_t bind_size;
+    uint32_t weak_bind_off;
+    uint32_t weak_bind_size;
+    uint32_t lazy_bind_off;
+    uint32_t lazy_bind_size;
+    uint32_t export_off;
+    uint32_t export_size;
+};
+
+struct dyld_chained_fixups_header {
+    uint32_t fixups_version;
+    uint32_t starts_offset;
+    uint32_t imports_offset;
+    uint32_t symbols_offset;
+    uint32_t imports_count;
+    uint32_t imports_format;
+    uint32_t symbols_format;
+};
+
+// followed by seg_info_offset[seg_count], 0 for segments without fixups
+struct dyld_chained_starts_in_image {
+    uint32_t seg_count;
+};
+
+// followed by page_start[page_count]
+struct dyld_chained_starts_in_segment {
+    uint32_t size;
+    uint16_t page_size;
+    uint16_t pointer_format;
+    uint64_t segment_offset;
+    uint32_t max_valid_pointer;
+    uint16_t page_count;
+};
+
+struct dylib_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t name_offset;
+    uint32_t timestamp;
+    uint32_t current_version;
+    uint32_t compatibility_version;
+};
+
+struct build_version_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t platform;
+    uint32_t minos;
+    uint32_t sdk;
+    uint32_t ntools;
+};
+
+struct symtab_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t symoff;
+    uint32_t nsyms;
+    uint32_t stroff;
+    uint32_t strsize;
+};
+
+struct nlist {
+    uint32_t n_strx;
+    uint8_t n_type;
+    uint8_t n_sect;
+    uint16_t n_desc;
+    uint32_t n_value;
+};
+
+struct nlist_64 {
+    uint32_t n_strx;
+    uint8_t n_type;
+    uint8_t n_sect;
+    uint16_t n_desc;
+    uint64_t n_value;
+};
+
+struct fat_slice {
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t align;
+};
+
+// -arch spelling of the cpu types we convert, "cpu <type>" for anything else.
+std::string arch_name(uint32_t cputype);
+// The page size the linker rounds segments to, 16K on arm64 and 4K everywhere else.
+uint64_t page_size(uint32_t cputype);
+bool is_fat(std::span<const uint8_t> file);
+// Slices of a fat file, or a single slice covering the whole file for a thin one.
+std::vector<fat_slice> slices(std::span<const uint8_t> file);
+// Copies every slice out so it can change size, join_fat() lays them back out with the
+// alignment of the original layout.
+std::vector<std::vector<uint8_t>> split_fat(std::span<const uint8_t> file);
+std::vector<uint8_t> join_fat(std::vector<std::vector<uint8_t>> &slice_bufs,
+                              std::span<const fat_slice> layout, bool fat);
+
+struct load_command_ref {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint64_t offset;
+};
+
+struct segment_ref {
+    std::string_view name;
+    uint64_t vmaddr;
+    uint64_t vmsize;
+    uint64_t fileoff;
+    uint64_t filesize;
+    uint32_t maxprot;
+    uint32_t initprot;
+    uint32_t flags;
+    uint32_t index;
+    uint64_t cmd_offset;
+};
+
+struct section_ref {
+    std::string_view segname;
+    std::string_view sectname;
+    uint64_t addr;
+    uint64_t size;
+    uint32_t offset;
+    uint32_t flags;
+};
+
+// View over a single thin Mach-O image. Does not own or copy the bytes.
+class image {
+public:
+    explicit image(std::span<uint8_t> data);
+    // for read-only walks, nothing may be written through an image built this way
+    static image read_only(std::span<const uint8_t> data) {
+        return image{std::span<uint8_t>{const_cast<uint8_t *>(data.data()), data.size()}};
+    }
+
+    bool is64() const {
+        return is64_;
+    }
+    uint8_t pointer_size() const {
+        return is64_ ? 8 : 4;
+    }
+    uint32_t cputype() const {
+        return header().cputype;
+    }
+    uint32_t flags() const {
+        return header().flags;
+    }
+    void flags(uint32_t flags) {
+        header().flags = flags;
+    }
+    std::span<uint8_t> data() const {
+        return data_;
+    }
+
+    std::vector<load_command_ref> commands() const;
+    std::vector<segment_ref> segments() const;
+    std::vector<section_ref> sections() const;
+    uint64_t load_commands_size() const {
+        return header_size() + header().sizeofcmds;
+    }
+    std::optional<segment_ref> segment(std::string_view name) const;
+    std::optional<load_command_ref> find_command(uint32_t cmd) const;
+    // LC_DYLD_INFO_ONLY or LC_DYLD_INFO
+    dyld_info_command *dyld_info() const;
+
+    template <typename T> T *command_at(uint64_t offset) const {
+        return reinterpret_cast<T *>(data_.data() + offset);
+    }
+    std::span<uint8_t> bytes(uint64_t offset, uint64_t size) const {
+        return data_.subspan(offset, size);
+    }
+
+private:
+    mach_header &header() const {
+        return *reinterpret_cast<mach_header *>(data_.data());
+    }
+    uint64_t header_size() const {
+        return is64_ ? sizeof(mach_header) + sizeof(uint32_t) : sizeof(mach_header);
+    }
+
+    std::span<uint8_t> data_;
+    bool is64_;
+};
+
+struct defined_symbol {
+    std::string_view name;
+    uint64_t address;
+    uint16_t desc;
+};
+
+// External symbols defined in a section of the image, from the symbol table.
+std::vector<defined_symbol> defined_symbols(const image &img);
+
+// Appends blob to the end of __LINKEDIT, growing the segment, and returns its file offset. The
+// slice must end with __LINKEDIT, which holds once the code signature is gone. Invalidates any
+// image or pointer into slice_buf.
+std::optional<uint32_t> append_to_linkedit(std::vector<uint8_t> &slice_buf,
+                                           std::span<const uint8_t> blob);
+
+struct rebase_entry {
+    uint8_t seg_index{0};
+    uint64_t seg_offset{0};
+    uint8_t type{REBASE_TYPE_POINTER};
+
+    auto operator<=>(const rebase_entry &) const = default;
+};
+
+enum class bind_kind {
+    regular,
+    weak,
+    lazy,
+};
+
+struct bind_entry {
+    uint8_t seg_index{0};
+    uint64_t seg_offset{0};
+    uint8_t type{BIND_TYPE_POINTER};
+    int64_t ordinal{0};
+    std::string_view symbol;
+    uint8_t symbol_flags{0};
+    int64_t addend{0};
+    // weak streams announce strong definitions with a symbol but no location
+    bool has_location{true};
+    // lazy streams: where the entry starts, the offset its stub helper hands dyld
+    uint32_t lazy_offset{0};
+};
+
+std::optional<std::vector<rebase_entry>> decode_rebases(std::span<const uint8_t> opcodes,
+                                                        uint8_t pointer_size);
+// Entries must be sorted.
+std::vector<uint8_t> encode_rebases(std::span<const rebase_entry> entries, uint8_t pointer_size);
+
+uint64_t read_uleb(std::span<const uint8_t> buf, size_t &pos);
+int64_t read_sleb(std::span<const uint8_t> buf, size_t &pos);
+void write_uleb(std::vector<uint8_t> &buf, uint64_t val);
+void write_sleb(std::vector<uint8_t> &buf, int64_t val);
+
+// Returns std::nullopt for streams we can't represent (threaded binds, malformed opcodes).
+std::optional<std::vector<bind_entry>> decode_binds(std::span<const uint8_t> opcodes,
+                                                    uint8_t pointer_size, bind_kind kind);
+std::vector<uint8_t> encode_binds(std::span<const bind_entry> entries, uint8_t pointer_size,
+                                  bind_kind kind);
+
+// One pointer of a fixup chain as its segment's pointer_format lays it out.
+struct chained_pointer {
+    // to the next pointer of the chain in chained_stride() units, 0 ends it
+    uint64_t next{0};
+    // set for binds
+    std::optional<uint64_t> import;
+    int64_t addend{0};
+    // rebase target, an unslid vmaddr or an offset from the mach header
+    uint64_t target{0};
+    bool vmaddr_target{false};
+    // arm64e signed pointer, the diversity and key bits aren't part of the target
+    bool auth{false};
+    // top byte the rebased pointer carries
+    uint8_t high8{0};
+};
+
+// The 64-bit and arm64e formats, the 32-bit and firmware ones aren't.
+bool is_supported_chained_format(uint16_t format);
+uint32_t chained_stride(uint16_t format);
+chained_pointer decode_chained_pointer(uint64_t raw, uint16_t format);
+// pointer_format of each segment's chains by segment index, 0 for segments without any or an
+// image without chained fixups.
+std::vector<uint16_t> chained_pointer_formats(const image &img);
+
+} // namespace macho
@@ -0,0 +1,541 @@
+#undef NDEBUG
+#include "output-sink.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include <fmt/format.h>
+
+namespace fs = std::filesystem;
+
+// Reflinks src to dst where the filesystem supports it so the bytes are only stored once, falls
+// back to a plain copy.
+bool clone_file(const fs::path &src, const fs::path &dst) {
+    std::error_code ec;
+    fs::remove(dst, ec);
+#if defined(__APPLE__)
+    if (!clonefile(src.c_str(), dst.c_str(), 0)) {
+        return true;
+    }
+#elif defined(__linux__)
+    const int src_fd = open(src.c_str(), O_RDONLY);
+    if (src_fd >= 0) {
+        const int dst_fd  = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        const bool cloned = dst_fd >= 0 && !ioctl(dst_fd, FICLONE, src_fd);
+        if (dst_fd >= 0) {
+            close(dst_fd);
+        }
+        close(src_fd);
+        if (cloned) {
+            return true;
+        }
+    }
+#endif
+    return fs::copy_file(src, dst, fs::copy_options::overwrite_existing, ec);
+}
+
+namespace {
+
+// Where a file_sink output is written before it is renamed to out_path.
+fs::path temp_path(const fs::path &out_path) {
+    auto path = out_path;
+    path += fmt::format(".dylibify-tmp-{:d}", getpid());
+    return path;
+}
+
+bool rename_into_place(const fs::path &tmp_path, const fs::path &out_path) {
+    std::error_code ec;
+    fs::rename(tmp_path, out_path, ec);
+    if (ec) {
+        fmt::print("[!] Couldn't rename '{:s}' to '{:s}': {:s}\n", tmp_path.string(),
+                   out_path.string(), ec.message());
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+fs::path file_sink::stub_dir(const fs::path &out_path) {
+    return out_path.parent_path();
+}
+
+file_sink::file_sink(file_sink &&other) noexcept
+    : mode_{other.mode_}, written_{std::move(other.written_)} {}
+
+void file_sink::remember_written(const fs::path &path) {
+    if (mode_ == io_mode::buffered) {
+        return;
+    }
+    std::lock_guard lk{lock_};
+    written_.emplace_back(path);
+}
+
+bool file_sink::write(const fs::path &out_path, std::span<const uint8_t> bytes) {
+    const auto tmp_path = temp_path(out_path);
+    if (!write_file(tmp_path, bytes, mode_) || !rename_into_place(tmp_path, out_path)) {
+        return false;
+    }
+    remember_written(out_path);
+    return true;
+}
+
+bool file_sink::write_variant(const fs::path &base, const fs::path &out_path,
+                              std::span<const uint8_t> bytes,
+                              const std::vector<byte_range> &patched) {
+    const auto tmp_path = temp_path(out_path);
+    if (!clone_file(base, tmp_path)) {
+        fmt::print("[!] Couldn't clone '{:s}' to '{:s}'\n", base.string(), out_path.string());
+        return false;
+    }
+    const int fd = open(tmp_path.c_str(), O_WRONLY);
+    bool ok      = fd >= 0;
+    for (const auto &range : patched) {
+        ok = ok && pwrite(fd, bytes.data() + range.offset, range.size, range.offset) ==
+                       (ssize_t)range.size;
+    }
+    if (ok && mode_ != io_mode::buffered) {
+        // the patches are tiny, no point in aligning them for O_DIRECT
+        drop_page_cache(fd);
+    }
+    ok = fd >= 0 && !close(fd) && ok;
+    if (!ok) {
+        fmt::print("[!] Couldn't patch '{:s}': {:s}\n", tmp_path.string(), strerror(errno));
+        std::error_code ec;
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    if (!rename_into_place(tmp_path, out_path)) {
+        return false;
+    }
+    remember_written(out_path);
+    return true;
+}
+
+bool file_sink::copy(const fs::path &src, const fs::path &out_path) {
+    if (fs::absolute(src) == fs::absolute(out_path)) {
+        return true;
+    }
+    const auto tmp_path = temp_path(out_path);
+    return clone_file(src, tmp_path) && rename_into_place(tmp_path, out_path);
+}
+
+void file_sink::discard(const fs::path &out_path) {
+    std::error_code ec;
+    fs::remove(out_path, ec);
+}
+
+bool file_sink::finish() {
+    std::vector<fs::path> written;
+    {
+        std::lock_guard lk{lock_};
+        written.swap(written_);
+    }
+    if (written.empty()) {
+        return true;
+    }
+    if (!sync_filesystems(written)) {
+        fmt::print("[!] Couldn't sync the outputs\n");
+        return false;
+    }
+    for (const auto &path : written) {
+        evict_page_cache(path);
+    }
+    return true;
+}
+
+void file_sink::evict_written() {
+    std::lock_guard lk{lock_};
+    for (const auto &path : written_) {
+        evict_page_cache(path);
+    }
+    written_.clear();
+}
+
+// Only what the inner sink accepted is recorded, a failed write leaves nothing behind to discard.
+bool job_sink::write(const fs::path &out_path, std::span<const uint8_t> bytes) {
+    if (!sink_.write(out_path, bytes)) {
+        return false;
+    }
+    written_.emplace_back(out_path);
+    return true;
+}
+
+bool job_sink::write_variant(const fs::path &base, const fs::path &out_path,
+                             std::span<const uint8_t> bytes,
+                             const std::vector<byte_range> &patched) {
+    if (!sink_.write_variant(base, out_path, bytes, patched)) {
+        return false;
+    }
+    written_.emplace_back(out_path);
+    return true;
+}
+
+bool job_sink::copy(const fs::path &src, const fs::path &out_path) {
+    if (!sink_.copy(src, out_path)) {
+        return false;
+    }
+    written_.emplace_back(out_path);
+    return true;
+}
+
+void job_sink::discard_written() {
+    for (const auto &out_path : written_) {
+        sink_.discard(out_path);
+    }
+    written_.clear();
+}
+
+std::optional<pack_sink> pack_sink::create(const fs::path &pack_path, io_mode mode) {
+    auto writer = pack_writer::create(pack_path, mode != io_mode::buffered);
+    if (writer == std::nullopt) {
+        return std::nullopt;
+    }
+    auto scratch = fs::temp_directory_path() / fmt::format("dylibify-pack-{:d}", getpid());
+    fs::create_directories(scratch);
+    return pack_sink{std::move(*writer), scratch};
+}
+
+pack_sink::pack_sink(pack_writer &&writer, fs::path scratch)
+    : writer_{std::move(writer)}, scratch_{std::move(scratch)} {}
+
+pack_sink::pack_sink(pack_sink &&other) noexcept
+    : writer_{std::move(other.writer_)}, scratch_{std::move(other.scratch_)},
+      stub_dirs_{std::move(other.stub_dirs_)} {
+    other.writer_.reset();
+    other.scratch_.clear();
+}
+
+pack_sink::~pack_sink() {
+    if (writer_ != std::nullopt) {
+        finish();
+    }
+}
+
+fs::path pack_sink::stub_dir(const fs::path &out_path) {
+    // one scratch dir per output dir so stubs of different install dirs don't clobber each other
+    const auto out_dir = out_path.parent_path();
+    std::lock_guard lk{lock_};
+    auto it = stub_dirs_.find(out_dir);
+    if (it == stub_dirs_.end()) {
+        const auto dir = scratch_ / fmt::format("{:d}", stub_dirs_.size());
+        fs::create_directories(dir);
+        it = stub_dirs_.emplace(out_dir, dir).first;
+    }
+    return it->second;
+}
+
+bool pack_sink::write(const fs::path &out_path, std::span<const uint8_t> bytes) {
+    std::lock_guard lk{lock_};
+    assert(writer_ != std::nullopt);
+    return writer_->add(out_path.string(), bytes, 0755);
+}
+
+bool pack_sink::write_variant(const fs::path & /*base*/, const fs::path &out_path,
+                              std::span<const uint8_t> bytes,
+                              const std::vector<byte_range> & /*patched*/) {
+    // the pack is written sequentially anyway, the full image is no more expensive than a patch
+    return write(out_path, bytes);
+}
+
+bool pack_sink::copy(const fs::path &src, const fs::path &out_path) {
+    auto *fh = fopen(src.c_str(), "rb");
+    if (!fh) {
+        fmt::print("[!] Couldn't open '{:s}'\n", src.string());
+        return false;
+    }
+    std::vector<uint8_t> bytes(fs::file_size(src));
+    assert(fread(bytes.data(), bytes.size(), 1, fh) == 1);
+    assert(!fclose(fh));
+    std::lock_guard lk{lock_};
+    assert(writer_ != std::nullopt);
+    return writer_->add(out_path.string(), bytes, 0755);
+}
+
+void pack_sink::discard(const fs::path &out_path) {
+    std::lock_guard lk{lock_};
+    assert(writer_ != std::nullopt);
+    writer_->remove(out_path.string());
+}
+
+bool pack_sink::finish() {
+    std::lock_guard lk{lock_};
+    assert(writer_ != std::nullopt);
+    const bool ok = writer_->finish();
+    writer_.reset();
+    if (!scratch_.empty()) {
+        std::error_code ec;
+        fs::remove_all(scratch_, ec);
+    }
+    return ok;
+}
+
+namespace {
+
+// Journal records, one per line: a staging directory, a staged output, then the commit marker
+// once everything staged is durable. Only the directory records are synced as they're written,
+// the commit marker is what makes the rest count.
+constexpr char journal_dir    = 'D';
+constexpr char journal_stage  = 'S';
+constexpr char journal_commit = 'C';
+
+fs::path staging_dir(const fs::path &out_path) {
+    return out_path.parent_path() / fmt::format(".dylibify-staged-{:d}", getpid());
+}
+
+bool append_journal(int fd, const std::string &record) {
+    return ::write(fd, record.data(), record.size()) == (ssize_t)record.size();
+}
+
+// Makes the staged files and their directory entries durable.
+bool sync_staged(const std::map<fs::path, fs::path> &staged) {
+    std::vector<fs::path> staged_paths;
+    for (const auto &out : staged) {
+        staged_paths.emplace_back(out.second);
+    }
+    return sync_filesystems(staged_paths);
+}
+
+// Renames whatever is still staged into place and syncs the destination directories.
+bool publish_staged(const std::map<fs::path, fs::path> &staged) {
+    bool ok{true};
+    std::set<fs::path> dirs;
+    for (const auto &[out_path, staged_path] : staged) {
+        std::error_code ec;
+        fs::rename(staged_path, out_path, ec);
+        if (ec && fs::exists(staged_path)) {
+            fmt::print("[!] Couldn't publish '{:s}': {:s}\n", out_path.string(), ec.message());
+            ok = false;
+        }
+        dirs.emplace(out_path.parent_path().empty() ? fs::path{"."} : out_path.parent_path());
+    }
+    for (const auto &dir : dirs) {
+        ok = fsync_path(dir) && ok;
+    }
+    return ok;
+}
+
+void remove_staging_dirs(const std::set<fs::path> &dirs) {
+    for (const auto &dir : dirs) {
+        // intermediate stub dylibs, outputs of discarded jobs and anything a crash left before its
+        // record reached the disk
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+    }
+}
+
+} // namespace
+
+bool recover_journal(const fs::path &journal_path) {
+    std::ifstream in{journal_path};
+    if (!in) {
+        return true;
+    }
+    std::map<fs::path, fs::path> staged;
+    std::set<fs::path> dirs;
+    bool committed{false};
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.size() == 1 && line[0] == journal_commit) {
+            committed = true;
+            continue;
+        }
+        if (line.size() > 2 && line[0] == journal_dir && line[1] == '\t') {
+            dirs.emplace(line.substr(2));
+            continue;
+        }
+        // a record torn by the interruption has no second tab
+        const auto tab1 = line.find('\t');
+        const auto tab2 = line.find('\t', tab1 + 1);
+        if (line.empty() || line[0] != journal_stage || tab1 != 1 || tab2 == std::string::npos) {
+            continue;
+        }
+        const fs::path staged_path = line.substr(tab1 + 1, tab2 - tab1 - 1);
+        staged.emplace(line.substr(tab2 + 1), staged_path);
+        dirs.emplace(staged_path.parent_path());
+    }
+    in.close();
+
+    bool ok{true};
+    if (committed) {
+        fmt::print("[-] Finishing publication of {:d} outputs from journal '{:s}'\n",
+                   staged.size(), journal_path.string());
+        ok = publish_staged(staged);
+    } else {
+        fmt::print("[-] Discarding {:d} uncommitted outputs from journal '{:s}'\n",
+                   staged.size(), journal_path.string());
+    }
+    remove_staging_dirs(dirs);
+    if (ok) {
+        std::error_code ec;
+        fs::remove(journal_path, ec);
+    }
+    return ok;
+}
+
+std::optional<durable_sink> durable_sink::create(const fs::path &journal_path, io_mode mode) {
+    if (!recover_journal(journal_path)) {
+        fmt::print("[!] Couldn't recover journal '{:s}'\n", journal_path.string());
+        return std::nullopt;
+    }
+    const int fd = open(journal_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    const auto journal_dir =
+        journal_path.parent_path().empty() ? fs::path{"."} : journal_path.parent_path();
+    if (fd < 0 || !fsync_path(journal_dir)) {
+        fmt::print("[!] Couldn't create journal '{:s}'\n", journal_path.string());
+        if (fd >= 0) {
+            assert(!close(fd));
+        }
+        return std::nullopt;
+    }
+    return durable_sink{journal_path, fd, mode};
+}
+
+durable_sink::durable_sink(fs::path journal_path, int journal_fd, io_mode mode)
+    : journal_path_{std::move(journal_path)}, journal_fd_{journal_fd}, files_{mode} {}
+
+durable_sink::durable_sink(durable_sink &&other) noexcept
+    : journal_path_{std::move(other.journal_path_)}, journal_fd_{other.journal_fd_},
+      files_{std::move(other.files_)}, staged_{std::move(other.staged_)},
+      staging_dirs_{std::move(other.staging_dirs_)} {
+    other.journal_fd_ = -1;
+}
+
+durable_sink::~durable_sink() {
+    if (journal_fd_ >= 0) {
+        finish();
+    }
+}
+
+bool durable_sink::add_staging_dir(const fs::path &dir) {
+    if (staging_dirs_.contains(dir)) {
+        return true;
+    }
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    const auto record = fmt::format("{:c}\t{:s}\n", journal_dir, dir.string());
+    if (ec || !append_journal(journal_fd_, record) || fsync(journal_fd_)) {
+        fmt::print("[!] Couldn't journal staging directory '{:s}'\n", dir.string());
+        return false;
+    }
+    staging_dirs_.emplace(dir);
+    return true;
+}
+
+std::optional<fs::path> durable_sink::stage(const fs::path &out_path) {
+    std::lock_guard lk{lock_};
+    assert(journal_fd_ >= 0);
+    const auto it = staged_.find(out_path);
+    if (it != staged_.end()) {
+        return it->second;
+    }
+    const auto dir         = staging_dir(out_path);
+    const auto staged_path = dir / out_path.filename();
+    if (!add_staging_dir(dir)) {
+        return std::nullopt;
+    }
+    // synced by finish() along with everything else, recovery sweeps the directory if this
+    // record doesn't make it
+    if (!append_journal(journal_fd_, fmt::format("{:c}\t{:s}\t{:s}\n", journal_stage,
+                                                 staged_path.string(), out_path.string()))) {
+        fmt::print("[!] Couldn't journal '{:s}'\n", out_path.string());
+        return std::nullopt;
+    }
+    staged_.emplace(out_path, staged_path);
+    return staged_path;
+}
+
+fs::path durable_sink::stub_dir(const fs::path &out_path) {
+    // the fat stub is built where copy() stages it, so publishing it needs no copy
+    const auto dir = staging_dir(out_path);
+    std::lock_guard lk{lock_};
+    // a failure here fails the stub build or the copy() that stages it
+    add_staging_dir(dir);
+    return dir;
+}
+
+bool durable_sink::write(const fs::path &out_path, std::span<const uint8_t> bytes) {
+    const auto staged_path = stage(out_path);
+    if (!staged_path || !files_.write(*staged_path, bytes)) {
+        discard(out_path);
+        return false;
+    }
+    return true;
+}
+
+bool durable_sink::write_variant(const fs::path &base, const fs::path &out_path,
+                                 std::span<const uint8_t> bytes,
+                                 const std::vector<byte_range> &patched) {
+    const auto staged_base = stage(base);
+    const auto staged_path = stage(out_path);
+    if (!staged_base || !staged_path ||
+        !files_.write_variant(*staged_base, *staged_path, bytes, patched)) {
+        discard(out_path);
+        return false;
+    }
+    return true;
+}
+
+bool durable_sink::copy(const fs::path &src, const fs::path &out_path) {
+    const auto staged_path = stage(out_path);
+    if (!staged_path || !files_.copy(src, *staged_path)) {
+        discard(out_path);
+        return false;
+    }
+    return true;
+}
+
+void durable_sink::discard(const fs::path &out_path) {
+    std::lock_guard lk{lock_};
+    const auto it = staged_.find(out_path);
+    if (it == staged_.end()) {
+        return;
+    }
+    // the journal still lists it, recovery skips staged files that are gone
+    std::error_code ec;
+    fs::remove(it->second, ec);
+    staged_.erase(it);
+}
+
+bool durable_sink::finish() {
+    std::lock_guard lk{lock_};
+    assert(journal_fd_ >= 0);
+    // the staged files and every journal record have to be durable before the commit marker
+    const bool synced    = sync_staged(staged_) && !fsync(journal_fd_);
+    if (synced) {
+        // their writeback was only started
+        files_.evict_written();
+    }
+    const bool committed = synced &&
+                           append_journal(journal_fd_, fmt::format("{:c}\n", journal_commit)) &&
+                           !fsync(journal_fd_);
+    assert(!close(journal_fd_));
+    journal_fd_ = -1;
+    if (!committed) {
+        fmt::print("[!] Couldn't make the outputs durable, the next run with journal '{:s}' "
+                   "discards them\n",
+                   journal_path_.string());
+        return false;
+    }
+    const bool ok = publish_staged(staged_);
+    remove_staging_dirs(staging_dirs_);
+    if (ok) {
+        std::error_code ec;
+        fs::remove(journal_path_, ec);
+    }
+    return ok;
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "file-io.hpp"
+#include "pack-file.hpp"
+
+struct byte_range {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Where converted images and stub dylibs end up. Outputs are named by the path the user asked
+// for, a sink decides whether that is a real file or an entry in a pack.
+class output_sink {
+public:
+    virtual ~output_sink() = default;
+
+    // Directory to build the stub dylib for out_path in. clang and lipo need real files.
+    virtual std::filesystem::path stub_dir(const std::filesystem::path &out_path) = 0;
+    virtual bool write(const std::filesystem::path &out_path, std::span<const uint8_t> bytes) = 0;
+    // Writes bytes, an image that only differs from the one already written to base in the
+    // patched ranges.
+    virtual bool write_variant(const std::filesystem::path &base,
+                               const std::filesystem::path &out_path,
+                               std::span<const uint8_t> bytes,
+                               const std::vector<byte_range> &patched) = 0;
+    // Publishes a file built in stub_dir() as out_path.
+    virtual bool copy(const std::filesystem::path &src, const std::filesystem::path &out_path) = 0;
+    // Takes back out_path of a job that failed, so its outputs don't outlive it half written.
+    virtual void discard(const std::filesystem::path &out_path) = 0;
+    virtual bool finish() {
+        return true;
+    }
+};
+
+// Plain files next to each other, variants are reflinked from the first output of their group.
+// Each file is written under a temporary name and renamed into place, so none is ever seen half
+// written.
+class file_sink : public output_sink {
+public:
+    explicit file_sink(io_mode mode = io_mode::buffered) : mode_{mode} {}
+    file_sink(file_sink &&other) noexcept;
+
+    std::filesystem::path stub_dir(const std::filesystem::path &out_path) override;
+    bool write(const std::filesystem::path &out_path, std::span<const uint8_t> bytes) override;
+    bool write_variant(const std::filesystem::path &base, const std::filesystem::path &out_path,
+                       std::span<const uint8_t> bytes,
+                       const std::vector<byte_range> &patched) override;
+    bool copy(const std::filesystem::path &src, const std::filesystem::path &out_path) override;
+    void discard(const std::filesystem::path &out_path) override;
+    // Outside of buffered mode, waits for the outputs' writeback with one sync for the whole
+    // batch and then drops their pages.
+    bool finish() override;
+    // Drops the pages of everything written outside of buffered mode, once it has been synced.
+    void evict_written();
+
+private:
+    void remember_written(const std::filesystem::path &path);
+
+    io_mode mode_;
+    std::vector<std::filesystem::path> written_;
+    // concurrent jobs share the sink
+    std::mutex lock_;
+};
+
+// Everything goes into a single pack, stub dylibs are built in a private scratch directory that
+// is removed once the pack is finished.
+class pack_sink : public output_sink {
+public:
+    static std::optional<pack_sink> create(const std::filesystem::path &pack_path,
+                                           io_mode mode = io_mode::buffered);
+    pack_sink(pack_sink &&other) noexcept;
+    ~pack_sink() override;
+
+    std::filesystem::path stub_dir(const std::filesystem::path &out_path) override;
+    bool write(const std::filesystem::path &out_path, std::span<const uint8_t> bytes) override;
+    bool write_variant(const std::filesystem::path &base, const std::filesystem::path &out_path,
+                       std::span<const uint8_t> bytes,
+                       const std::vector<byte_range> &patched) override;
+    bool copy(const std::filesystem::path &src, const std::filesystem::path &out_path) override;
+    void discard(const std::filesystem::path &out_path) override;
+    bool finish() override;
+
+private:
+    pack_sink(pack_writer &&writer, std::filesystem::path scratch);
+
+    std::optional<pack_writer> writer_;
+    std::filesystem::path scratch_;
+    std::map<std::filesystem::path, std::filesystem::path> stub_dirs_;
+    // concurrent jobs share the pack
+    std::mutex lock_;
+};
+
+// File outputs that all appear at once. Everything is written to a staging directory next to
+// its destination, made durable with one syncfs() per filesystem and then renamed into place.
+// The journal lists the staged files: a run interrupted before the renames is rolled back by
+// the next run with the same journal, one interrupted during them is rolled forward, and the
+// staging directories it lists are removed either way. Outputs of jobs that failed are discarded
+// instead of published.
+class durable_sink : public output_sink {
+public:
+    static std::optional<durable_sink> create(const std::filesystem::path &journal_path,
+                                              io_mode mode = io_mode::buffered);
+    durable_sink(durable_sink &&other) noexcept;
+    ~durable_sink() override;
+
+    std::filesystem::path stub_dir(const std::filesystem::path &out_path) override;
+    bool write(const std::filesystem::path &out_path, std::span<const uint8_t> bytes) override;
+    bool write_variant(const std::filesystem::path &base, const std::filesystem::path &out_path,
+                       std::span<const uint8_t> bytes,
+                       const std::vector<byte_range> &patched) override;
+    bool copy(const std::filesystem::path &src, const std::filesystem::path &out_path) override;
+    // Unstages out_path, it is never published.
+    void discard(const std::filesystem::path &out_path) override;
+    // Syncs, commits the journal and publishes every staged output.
+    bool finish() override;
+
+private:
+    durable_sink(std::filesystem::path journal_path, int journal_fd, io_mode mode);
+    // Where out_path is written until finish(), journaled the first time it is asked for.
+    std::optional<std::filesystem::path> stage(const std::filesystem::path &out_path);
+    // Creates a staging directory and journals it durably before anything lands in it, so
+    // recovery can sweep whatever a crash left there. Caller holds lock_.
+    bool add_staging_dir(const std::filesystem::path &dir);
+
+    std::filesystem::path journal_path_;
+    int journal_fd_{-1};
+    file_sink files_;
+    // final path -> staged path
+    std::map<std::filesystem::path, std::filesystem::path> staged_;
+    std::set<std::filesystem::path> staging_dirs_;
+    // concurrent jobs share the journal
+    std::mutex lock_;
+};
+
+// One job's view of a shared sink, remembers what the job wrote so a failed job's outputs can be
+// discarded without touching the other jobs'.
+class job_sink : public output_sink {
+public:
+    explicit job_sink(output_sink &sink) : sink_{sink} {}
+
+    std::filesystem::path stub_dir(const std::filesystem::path &out_path) override {
+        return sink_.stub_dir(out_path);
+    }
+    bool write(const std::filesystem::path &out_path, std::span<const uint8_t> bytes) override;
+    bool write_variant(const std::filesystem::path &base, const std::filesystem::path &out_path,
+                       std::span<const uint8_t> bytes,
+                       const std::vector<byte_range> &patched) override;
+    bool copy(const std::filesystem::path &src, const std::filesystem::path &out_path) override;
+    void discard(const std::filesystem::path &out_path) override {
+        sink_.discard(out_path);
+    }
+    void discard_written();
+
+private:
+    output_sink &sink_;
+    std::vector<std::filesystem::path> written_;
+};
+
+// Finishes or undoes what an interrupted durable_sink left behind. Nothing to do without a
+// journal.
+bool recover_journal(const std::filesystem::path &journal_path);
+
+bool clone_file(const std::filesystem::path &src, const std::filesystem::path &dst);
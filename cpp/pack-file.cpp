@@ -0,0 +1,316 @@
+#undef NDEBUG
+#include "pack-file.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "file-io.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char file_magic[8]   = {'D', 'Y', 'L', 'P', 'A', 'C', 'K', '1'};
+constexpr char footer_magic[8] = {'D', 'Y', 'L', 'P', 'A', 'C', 'K', 'I'};
+constexpr char entry_magic[4]  = {'D', 'Y', 'L', 'E'};
+constexpr size_t entry_hdr_sz  = 24;
+constexpr size_t footer_sz     = 32;
+// big enough that NFS sees a handful of large WRITEs per output instead of many small ones
+constexpr size_t write_buf_sz = 8 * 1024 * 1024;
+
+void put_u32(std::vector<uint8_t> &buf, uint32_t val) {
+    for (int i = 0; i < 4; ++i) {
+        buf.emplace_back(val >> (i * 8));
+    }
+}
+
+void put_u64(std::vector<uint8_t> &buf, uint64_t val) {
+    for (int i = 0; i < 8; ++i) {
+        buf.emplace_back(val >> (i * 8));
+    }
+}
+
+uint32_t get_u32(const uint8_t *p) {
+    uint32_t val{0};
+    for (int i = 0; i < 4; ++i) {
+        val |= (uint32_t)p[i] << (i * 8);
+    }
+    return val;
+}
+
+uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size) {
+        const auto res = write(fd, data, size);
+        if (res < 0) {
+            return false;
+        }
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+} // namespace
+
+std::optional<pack_writer> pack_writer::create(const fs::path &path, bool uncached) {
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fmt::print("[!] Couldn't create pack '{:s}': {:s}\n", path.string(), strerror(errno));
+        return std::nullopt;
+    }
+    if (uncached) {
+        avoid_page_cache(fd);
+    }
+    pack_writer writer{fd, uncached};
+    if (!writer.append({reinterpret_cast<const uint8_t *>(file_magic), sizeof(file_magic)})) {
+        return std::nullopt;
+    }
+    return writer;
+}
+
+pack_writer::pack_writer(int fd, bool uncached) : fd_{fd}, uncached_{uncached} {
+    buf_.reserve(write_buf_sz);
+}
+
+pack_writer::pack_writer(pack_writer &&other) noexcept
+    : fd_{other.fd_}, uncached_{other.uncached_}, offset_{other.offset_},
+      buf_{std::move(other.buf_)}, entries_{std::move(other.entries_)} {
+    other.fd_ = -1;
+}
+
+pack_writer::~pack_writer() {
+    if (fd_ >= 0) {
+        finish();
+    }
+}
+
+bool pack_writer::flush() {
+    if (!write_all(fd_, buf_.data(), buf_.size())) {
+        fmt::print("[!] Error writing pack: {:s}\n", strerror(errno));
+        return false;
+    }
+    buf_.clear();
+    if (uncached_) {
+        drop_page_cache(fd_);
+    }
+    return true;
+}
+
+bool pack_writer::append(std::span<const uint8_t> bytes) {
+    offset_ += bytes.size();
+    if (buf_.size() + bytes.size() <= write_buf_sz) {
+        buf_.insert(buf_.end(), bytes.begin(), bytes.end());
+        return true;
+    }
+    if (!flush()) {
+        return false;
+    }
+    if (bytes.size() >= write_buf_sz) {
+        // already one large write, don't bounce it through the buffer
+        return write_all(fd_, bytes.data(), bytes.size());
+    }
+    buf_.insert(buf_.end(), bytes.begin(), bytes.end());
+    return true;
+}
+
+bool pack_writer::add(const std::string &name, std::span<const uint8_t> bytes, uint32_t mode) {
+    assert(fd_ >= 0);
+    std::vector<uint8_t> hdr;
+    hdr.insert(hdr.end(), entry_magic, entry_magic + sizeof(entry_magic));
+    put_u32(hdr, name.size());
+    put_u64(hdr, bytes.size());
+    put_u32(hdr, mode);
+    put_u32(hdr, 0);
+    hdr.insert(hdr.end(), name.begin(), name.end());
+    if (!append(hdr)) {
+        return false;
+    }
+    // indexed only once its bytes are in, a failed add leaves nothing to discard
+    const auto data_offset = offset_;
+    if (!append(bytes)) {
+        return false;
+    }
+    entries_.emplace_back(pack_entry{name, data_offset, bytes.size(), mode});
+    return true;
+}
+
+void pack_writer::remove(const std::string &name) {
+    assert(fd_ >= 0);
+    std::erase_if(entries_, [&](const pack_entry &entry) { return entry.name == name; });
+}
+
+bool pack_writer::finish() {
+    assert(fd_ >= 0);
+    const auto index_offset = offset_;
+    std::vector<uint8_t> index;
+    for (const auto &entry : entries_) {
+        put_u64(index, entry.data_offset);
+        put_u64(index, entry.size);
+        put_u32(index, entry.mode);
+        put_u32(index, entry.name.size());
+        index.insert(index.end(), entry.name.begin(), entry.name.end());
+    }
+    std::vector<uint8_t> footer;
+    put_u64(footer, index_offset);
+    put_u64(footer, index.size());
+    put_u64(footer, entries_.size());
+    footer.insert(footer.end(), footer_magic, footer_magic + sizeof(footer_magic));
+
+    bool ok = append(index) && append(footer) && flush();
+    if (ok && uncached_) {
+        // the flushes only started writeback, one sync for the whole pack lets the rest go
+        ok = !fsync(fd_);
+        drop_page_cache(fd_);
+    }
+    assert(!close(fd_));
+    fd_ = -1;
+    return ok;
+}
+
+std::optional<pack_reader> pack_reader::open(const fs::path &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fmt::print("[!] Couldn't open pack '{:s}': {:s}\n", path.string(), strerror(errno));
+        return std::nullopt;
+    }
+    std::error_code ec;
+    const auto size = fs::file_size(path, ec);
+    void *data      = size && !ec ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    assert(!close(fd));
+    if (ec || data == MAP_FAILED || size < sizeof(file_magic) || memcmp(data, file_magic, 8)) {
+        fmt::print("[!] '{:s}' isn't a dylibify pack\n", path.string());
+        if (data && data != MAP_FAILED) {
+            munmap(data, size);
+        }
+        return std::nullopt;
+    }
+
+    pack_reader reader{static_cast<const uint8_t *>(data), size};
+    if (!reader.read_index()) {
+        fmt::print("[-] Pack '{:s}' has no index, recovering entries by scanning\n",
+                   path.string());
+        if (!reader.scan_entries()) {
+            fmt::print("[!] Couldn't recover any entries from pack '{:s}'\n", path.string());
+            return std::nullopt;
+        }
+    }
+    return reader;
+}
+
+pack_reader::pack_reader(const uint8_t *data, size_t size) : data_{data}, size_{size} {}
+
+pack_reader::pack_reader(pack_reader &&other) noexcept
+    : data_{other.data_}, size_{other.size_}, entries_{std::move(other.entries_)} {
+    other.data_ = nullptr;
+}
+
+pack_reader::~pack_reader() {
+    if (data_) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+}
+
+bool pack_reader::read_index() {
+    if (size_ < sizeof(file_magic) + footer_sz) {
+        return false;
+    }
+    const auto *footer = data_ + size_ - footer_sz;
+    if (memcmp(footer + 24, footer_magic, sizeof(footer_magic))) {
+        return false;
+    }
+    const auto index_offset = get_u64(footer);
+    const auto index_size   = get_u64(footer + 8);
+    const auto count        = get_u64(footer + 16);
+    if (index_size > size_ - footer_sz || index_offset > size_ - footer_sz - index_size) {
+        return false;
+    }
+
+    const auto *p   = data_ + index_offset;
+    const auto *end = p + index_size;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (end - p < 24) {
+            return false;
+        }
+        pack_entry entry;
+        entry.data_offset   = get_u64(p);
+        entry.size          = get_u64(p + 8);
+        entry.mode          = get_u32(p + 16);
+        const auto name_len = get_u32(p + 20);
+        p += 24;
+        if ((uint64_t)(end - p) < name_len || entry.size > index_offset ||
+            entry.data_offset > index_offset - entry.size) {
+            return false;
+        }
+        entry.name.assign(reinterpret_cast<const char *>(p), name_len);
+        p += name_len;
+        entries_.emplace_back(std::move(entry));
+    }
+    return true;
+}
+
+bool pack_reader::scan_entries() {
+    entries_.clear();
+    size_t off = sizeof(file_magic);
+    while (off + entry_hdr_sz <= size_ && !memcmp(data_ + off, entry_magic, 4)) {
+        const auto name_len = get_u32(data_ + off + 4);
+        pack_entry entry;
+        entry.size        = get_u64(data_ + off + 8);
+        entry.mode        = get_u32(data_ + off + 16);
+        entry.data_offset = off + entry_hdr_sz + name_len;
+        if (entry.data_offset > size_ || entry.size > size_ - entry.data_offset) {
+            // torn final entry
+            break;
+        }
+        entry.name.assign(reinterpret_cast<const char *>(data_ + off + entry_hdr_sz), name_len);
+        off = entry.data_offset + entry.size;
+        entries_.emplace_back(std::move(entry));
+    }
+    return !entries_.empty();
+}
+
+const pack_entry *pack_reader::find(const std::string &name) const {
+    // later entries win, a batch may re-emit a stub shared by several jobs
+    for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+        if (it->name == name) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+std::span<const uint8_t> pack_reader::contents(const pack_entry &entry) const {
+    return {data_ + entry.data_offset, entry.size};
+}
+
+bool pack_reader::extract(const pack_entry &entry, const fs::path &dest) const {
+    if (dest.has_parent_path()) {
+        // a file entry where another one needs a directory fails here
+        std::error_code ec;
+        fs::create_directories(dest.parent_path(), ec);
+        if (ec) {
+            fmt::print("[!] Couldn't create '{:s}': {:s}\n", dest.parent_path().string(),
+                       ec.message());
+            return false;
+        }
+    }
+    const int fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, entry.mode);
+    if (fd < 0) {
+        fmt::print("[!] Couldn't create '{:s}': {:s}\n", dest.string(), strerror(errno));
+        return false;
+    }
+    const auto bytes = contents(entry);
+    const bool ok    = write_all(fd, bytes.data(), bytes.size());
+    if (!ok) {
+        fmt::print("[!] Couldn't write '{:s}': {:s}\n", dest.string(), strerror(errno));
+    }
+    return !close(fd) && ok;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// Append-only container for many output files. Writing a batch into one pack turns thousands of
+// creates/renames on a network filesystem into a single file written with large sequential
+// writes.
+//
+// Layout:
+//   file header:   "DYLPACK1"
+//   entries:       entry header ("DYLE", u32 name_len, u64 size, u32 mode, u32 pad) + name + data
+//   index:         per entry u64 data_offset, u64 size, u32 mode, u32 name_len, name
+//   footer:        u64 index_offset, u64 index_size, u64 entry_count, "DYLPACKI"
+// All integers are little endian. The per-entry headers let a reader recover the entries of a
+// pack whose writer died before the index was written.
+struct pack_entry {
+    std::string name;
+    uint64_t data_offset;
+    uint64_t size;
+    uint32_t mode;
+};
+
+class pack_writer {
+public:
+    // uncached starts writing back every flushed buffer and drops the pack's pages once
+    // finish() has synced it.
+    static std::optional<pack_writer> create(const std::filesystem::path &path,
+                                             bool uncached = false);
+    pack_writer(pack_writer &&other) noexcept;
+    pack_writer(const pack_writer &) = delete;
+    ~pack_writer();
+
+    bool add(const std::string &name, std::span<const uint8_t> bytes, uint32_t mode = 0644);
+    // Leaves the entry out of the index, its bytes stay in the pack and a recovering reader
+    // still finds them.
+    void remove(const std::string &name);
+    // Writes the index and footer, no entries can be added afterwards.
+    bool finish();
+
+private:
+    pack_writer(int fd, bool uncached);
+    bool append(std::span<const uint8_t> bytes);
+    bool flush();
+
+    int fd_{-1};
+    bool uncached_{false};
+    uint64_t offset_{0};
+    std::vector<uint8_t> buf_;
+    std::vector<pack_entry> entries_;
+};
+
+class pack_reader {
+public:
+    static std::optional<pack_reader> open(const std::filesystem::path &path);
+    pack_reader(pack_reader &&other) noexcept;
+    pack_reader(const pack_reader &) = delete;
+    ~pack_reader();
+
+    const std::vector<pack_entry> &entries() const {
+        return entries_;
+    }
+    const pack_entry *find(const std::string &name) const;
+    // Zero-copy view into the mapped pack.
+    std::span<const uint8_t> contents(const pack_entry &entry) const;
+    bool extract(const pack_entry &entry, const std::filesystem::path &dest) const;
+
+private:
+    pack_reader(const uint8_t *data, size_t size);
+    bool read_index();
+    bool scan_entries();
+
+    const uint8_t *data_{nullptr};
+    size_t size_{0};
+    std::vector<pack_entry> entries_;
+};
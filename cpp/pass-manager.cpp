@@ -0,0 +1,149 @@
+#undef NDEBUG
+#include "pass-manager.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+
+#include <fmt/format.h>
+
+#include "task-runtime.hpp"
+
+void pass_manager::add_pass(pass p) {
+    for (const auto id : p.uses) {
+        assert(id < analyses_.size());
+    }
+    passes_.emplace_back(std::move(p));
+}
+
+const std::shared_ptr<const void> &pass_manager::compute(analysis_id id) {
+    auto &a = *analyses_.at(id);
+    std::lock_guard lk{a.lock};
+    if (!a.value) {
+        // deps were registered first, so waiting on their locks can't go around in a circle
+        a.value = a.compute(*this);
+        ++a.times_computed;
+    }
+    return a.value;
+}
+
+uint32_t pass_manager::reads_of(analysis_id id) const {
+    const auto &a = *analyses_[id];
+    // taken from the input before any pass ran
+    if (a.snapshot) {
+        return 0;
+    }
+    uint32_t reads{a.reads};
+    for (const auto dep : a.deps) {
+        assert(dep < id);
+        reads |= reads_of(dep);
+    }
+    return reads;
+}
+
+void pass_manager::invalidate(uint32_t written) {
+    std::vector<bool> gone(analyses_.size());
+    for (analysis_id id = 0; id < analyses_.size(); ++id) {
+        auto &a = *analyses_[id];
+        if (a.snapshot) {
+            continue;
+        }
+        gone[id] = (a.reads & written) ||
+                   std::any_of(a.deps.begin(), a.deps.end(), [&](analysis_id dep) {
+                       return gone[dep];
+                   });
+        if (gone[id]) {
+            a.value.reset();
+        }
+    }
+}
+
+bool pass_manager::run(cancel_token &cancel) {
+    const auto num_passes = passes_.size();
+    std::vector<bool> needed(analyses_.size());
+    std::vector<analysis_id> pending;
+    std::vector<uint32_t> reads(num_passes);
+    for (size_t i = 0; i < num_passes; ++i) {
+        reads[i] = passes_[i].reads;
+        for (const auto id : passes_[i].uses) {
+            reads[i] |= reads_of(id);
+            pending.emplace_back(id);
+        }
+    }
+    while (!pending.empty()) {
+        const auto id = pending.back();
+        pending.pop_back();
+        if (!needed[id]) {
+            needed[id] = true;
+            pending.insert(pending.end(), analyses_[id]->deps.begin(), analyses_[id]->deps.end());
+        }
+    }
+
+    // a pass runs one step after the last earlier pass it conflicts with
+    std::vector<size_t> steps(num_passes);
+    for (size_t j = 0; j < num_passes; ++j) {
+        for (size_t i = 0; i < j; ++i) {
+            if ((passes_[i].writes & (reads[j] | passes_[j].writes)) ||
+                (passes_[j].writes & reads[i])) {
+                steps[j] = std::max(steps[j], steps[i] + 1);
+            }
+        }
+    }
+    num_steps_ = num_passes ? *std::max_element(steps.begin(), steps.end()) + 1 : 0;
+
+    {
+        task_group snapshots;
+        for (analysis_id id = 0; id < analyses_.size(); ++id) {
+            if (needed[id] && analyses_[id]->snapshot) {
+                snapshots.run([this, id] { compute(id); });
+            }
+        }
+        snapshots.wait();
+    }
+
+    for (size_t step = 0; step < num_steps_; ++step) {
+        std::vector<pass *> ready;
+        uint32_t written{0};
+        for (size_t i = 0; i < num_passes; ++i) {
+            if (steps[i] != step) {
+                continue;
+            }
+            ready.emplace_back(&passes_[i]);
+            written |= passes_[i].writes;
+            if (passes_[i].phase) {
+                cancel.checkpoint(passes_[i].phase);
+            }
+        }
+        cancel.check();
+        std::atomic<bool> ok{true};
+        {
+            task_group group;
+            for (size_t i = 1; i < ready.size(); ++i) {
+                group.run([this, &ok, p = ready[i]] {
+                    if (!p->run(*this)) {
+                        ok = false;
+                    }
+                });
+            }
+            if (!ready.front()->run(*this)) {
+                ok = false;
+            }
+            group.wait();
+        }
+        invalidate(written);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<std::string> pass_manager::computed_analyses() const {
+    std::vector<std::string> computed;
+    for (const auto &a : analyses_) {
+        if (a->times_computed) {
+            computed.emplace_back(fmt::format("{:s} x{:d}", a->name, a->times_computed));
+        }
+    }
+    return computed;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cancellation.hpp"
+
+// Runs a conversion of one unit (a slice's model) as registered passes. Passes declare the
+// analyses they use and the parts of the unit they read and write, as a bit mask whose meaning
+// is up to the pipeline.
+//
+// Analyses are computed the first time anything asks for them and cached until a pass writes a
+// part they read, or an analysis they depend on goes. Snapshot analyses describe the input as
+// it was: the ones an enabled pass needs are taken before the first pass runs and are never
+// invalidated. An analysis no pass needs never runs.
+//
+// Passes keep their registration order wherever one writes what the other reads or writes, the
+// others start alongside the passes before them on the task runtime.
+class pass_manager;
+
+using analysis_id = size_t;
+
+template <typename T> struct analysis_key {
+    analysis_id id;
+    operator analysis_id() const {
+        return id;
+    }
+};
+
+struct pass {
+    const char *name{nullptr};
+    // checkpoint the job reaches when this pass starts, nullptr to stay in the current phase
+    const char *phase{nullptr};
+    std::vector<analysis_id> uses{};
+    uint32_t reads{0};
+    uint32_t writes{0};
+    // false stops the pipeline
+    std::function<bool(pass_manager &)> run{};
+};
+
+class pass_manager {
+public:
+    template <typename T>
+    analysis_key<T> add_analysis(const char *name, uint32_t reads, std::vector<analysis_id> deps,
+                                 bool snapshot, std::function<T(pass_manager &)> compute) {
+        analyses_.emplace_back(std::make_unique<analysis>(
+            name, reads, std::move(deps), snapshot,
+            [compute = std::move(compute)](pass_manager &pm) -> std::shared_ptr<const void> {
+                return std::make_shared<const T>(compute(pm));
+            }));
+        return {analyses_.size() - 1};
+    }
+    void add_pass(pass p);
+
+    // Safe from concurrent passes. Only valid until the pass that asked returns.
+    template <typename T> const T &get(analysis_key<T> key) {
+        return *static_cast<const T *>(compute(key).get());
+    }
+
+    // Runs every pass, false once one failed.
+    bool run(cancel_token &cancel);
+
+    // For --verbose, after run().
+    size_t num_passes() const {
+        return passes_.size();
+    }
+    size_t num_steps() const {
+        return num_steps_;
+    }
+    // "<name> x<times computed>" of every analysis that ran.
+    std::vector<std::string> computed_analyses() const;
+
+private:
+    struct analysis {
+        analysis(const char *name, uint32_t reads, std::vector<analysis_id> deps, bool snapshot,
+                 std::function<std::shared_ptr<const void>(pass_manager &)> compute)
+            : name{name}, reads{reads}, deps{std::move(deps)}, snapshot{snapshot},
+              compute{std::move(compute)} {}
+
+        const char *name;
+        uint32_t reads;
+        std::vector<analysis_id> deps;
+        bool snapshot;
+        std::function<std::shared_ptr<const void>(pass_manager &)> compute;
+        std::mutex lock;
+        std::shared_ptr<const void> value;
+        size_t times_computed{0};
+    };
+
+    const std::shared_ptr<const void> &compute(analysis_id id);
+    // the parts an analysis and everything it depends on read after the passes started
+    uint32_t reads_of(analysis_id id) const;
+    // drops cached analyses that read written parts and the ones depending on those
+    void invalidate(uint32_t written);
+
+    std::vector<std::unique_ptr<analysis>> analyses_;
+    std::vector<pass> passes_;
+    size_t num_steps_{0};
+};
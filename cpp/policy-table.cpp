@@ -0,0 +1,268 @@
+#undef NDEBUG
+#include "policy-table.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char policy_magic[8] = {'D', 'Y', 'L', 'P', 'O', 'L', '0', '1'};
+constexpr size_t header_sz     = 32;
+// average keys per bucket, the usual trade between table size and build time
+constexpr uint64_t keys_per_bucket = 4;
+constexpr uint64_t max_seeds       = 16;
+
+uint64_t mix64(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t key_hash(uint64_t seed, policy_domain domain, std::string_view name) {
+    // FNV-1a over the domain and the name
+    uint64_t h = 0xcbf29ce484222325ull ^ mix64(seed);
+    h          = (h ^ (uint8_t)domain) * 0x100000001b3ull;
+    for (const auto c : name) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ull;
+    }
+    return mix64(h);
+}
+
+uint64_t slot_of(uint64_t hash, uint32_t displacement, uint64_t num_slots) {
+    return mix64(hash ^ ((displacement + 1ull) * 0x9e3779b97f4a7c15ull)) % num_slots;
+}
+
+size_t displacements_size(uint64_t num_buckets) {
+    return (num_buckets * sizeof(uint32_t) + 7) & ~7ull;
+}
+
+void put_u64(std::vector<uint8_t> &out, uint64_t val) {
+    for (int i = 0; i < 8; ++i) {
+        out.emplace_back(val >> (8 * i));
+    }
+}
+
+uint64_t get_u64(const uint8_t *p) {
+    uint64_t val;
+    std::memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+// Displacement per bucket for one seed, nullopt if some bucket can't be placed.
+std::optional<std::vector<uint32_t>> place_buckets(const std::vector<uint64_t> &hashes,
+                                                   uint64_t num_buckets) {
+    const auto n = hashes.size();
+    std::vector<std::vector<uint32_t>> buckets(num_buckets);
+    for (uint32_t i = 0; i < n; ++i) {
+        buckets[hashes[i] % num_buckets].emplace_back(i);
+    }
+    std::vector<uint32_t> order(num_buckets);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    // the last singleton buckets have few free slots left, give them room to search
+    const uint64_t max_displacement =
+        std::min<uint64_t>(UINT32_MAX, std::max<uint64_t>(1 << 20, 64 * n));
+    std::vector<uint32_t> displacements(num_buckets, 0);
+    std::vector<bool> taken(n);
+    std::vector<uint64_t> slots;
+    for (const auto b : order) {
+        const auto &keys = buckets[b];
+        if (keys.empty()) {
+            break;
+        }
+        bool placed{false};
+        for (uint64_t d = 0; !placed && d < max_displacement; ++d) {
+            slots.clear();
+            placed = true;
+            for (const auto k : keys) {
+                const auto slot = slot_of(hashes[k], d, n);
+                if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                    placed = false;
+                    break;
+                }
+                slots.emplace_back(slot);
+            }
+            if (placed) {
+                displacements[b] = d;
+                for (const auto slot : slots) {
+                    taken[slot] = true;
+                }
+            }
+        }
+        if (!placed) {
+            return std::nullopt;
+        }
+    }
+    return displacements;
+}
+
+} // namespace
+
+std::vector<uint8_t> compile_policy(const std::vector<policy_entry> &entries) {
+    std::map<std::pair<policy_domain, std::string_view>, uint8_t> merged;
+    for (const auto &entry : entries) {
+        merged[{entry.domain, entry.name}] |= entry.flags;
+    }
+    const uint64_t n           = merged.size();
+    const uint64_t num_buckets = n / keys_per_bucket + 1;
+
+    for (uint64_t seed = 0; seed < max_seeds; ++seed) {
+        std::vector<uint64_t> hashes;
+        hashes.reserve(n);
+        for (const auto &key : merged) {
+            hashes.emplace_back(key_hash(seed, key.first.first, key.first.second));
+        }
+        // fingerprints have to tell every key apart
+        auto sorted = hashes;
+        std::sort(sorted.begin(), sorted.end());
+        if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+            continue;
+        }
+        const auto displacements = place_buckets(hashes, num_buckets);
+        if (displacements == std::nullopt) {
+            continue;
+        }
+
+        std::vector<uint64_t> fingerprints(n);
+        std::vector<uint8_t> flags(n);
+        size_t i{0};
+        for (const auto &key : merged) {
+            const auto hash = hashes[i++];
+            const auto slot = slot_of(hash, (*displacements)[hash % num_buckets], n);
+            fingerprints[slot] = hash;
+            flags[slot]        = key.second;
+        }
+
+        std::vector<uint8_t> table(policy_magic, policy_magic + sizeof(policy_magic));
+        put_u64(table, seed);
+        put_u64(table, n);
+        put_u64(table, num_buckets);
+        for (const auto d : *displacements) {
+            for (int b = 0; b < 4; ++b) {
+                table.emplace_back(d >> (8 * b));
+            }
+        }
+        table.resize(header_sz + displacements_size(num_buckets));
+        for (const auto fp : fingerprints) {
+            put_u64(table, fp);
+        }
+        table.insert(table.end(), flags.begin(), flags.end());
+        return table;
+    }
+    // 16 seeds in a row with a fingerprint collision or an unplaceable bucket doesn't happen
+    assert(!"couldn't build a perfect hash for the policy");
+    return {};
+}
+
+bool write_policy_header(const fs::path &path, std::span<const uint8_t> table) {
+    std::ofstream out{path};
+    if (!out) {
+        fmt::print("[!] Couldn't create '{:s}'\n", path.string());
+        return false;
+    }
+    out << "// Generated by dylibify-lief-cpp --compile-policy-header, do not edit.\n"
+        << "#pragma once\n\n#include <cstdint>\n\n"
+        << fmt::format("alignas(8) inline constexpr uint8_t dylibify_embedded_policy[{:d}] = {{",
+                       table.size());
+    for (size_t i = 0; i < table.size(); ++i) {
+        out << (i % 16 ? " " : "\n    ") << fmt::format("0x{:02x},", table[i]);
+    }
+    out << "\n};\n";
+    return !!out.flush();
+}
+
+std::optional<policy_table> policy_table::view(std::span<const uint8_t> bytes) {
+    policy_table table{bytes, false};
+    if (!table.parse()) {
+        return std::nullopt;
+    }
+    return table;
+}
+
+std::optional<policy_table> policy_table::map(const fs::path &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fmt::print("[!] Couldn't open policy '{:s}': {:s}\n", path.string(), strerror(errno));
+        return std::nullopt;
+    }
+    const auto size = fs::file_size(path);
+    void *data      = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    assert(!close(fd));
+    if (data == MAP_FAILED || !data) {
+        fmt::print("[!] Couldn't map policy '{:s}'\n", path.string());
+        return std::nullopt;
+    }
+    policy_table table{{static_cast<const uint8_t *>(data), size}, true};
+    if (!table.parse()) {
+        fmt::print("[!] '{:s}' isn't a compiled dylibify policy\n", path.string());
+        return std::nullopt;
+    }
+    return table;
+}
+
+policy_table::policy_table(std::span<const uint8_t> bytes, bool mapped)
+    : bytes_{bytes}, mapped_{mapped} {}
+
+policy_table::policy_table(policy_table &&other) noexcept
+    : bytes_{other.bytes_}, mapped_{other.mapped_}, seed_{other.seed_},
+      num_keys_{other.num_keys_}, num_buckets_{other.num_buckets_},
+      displacements_{other.displacements_}, fingerprints_{other.fingerprints_},
+      flags_{other.flags_} {
+    other.mapped_ = false;
+}
+
+policy_table::~policy_table() {
+    if (mapped_) {
+        munmap(const_cast<uint8_t *>(bytes_.data()), bytes_.size());
+    }
+}
+
+bool policy_table::parse() {
+    if (bytes_.size() < header_sz || memcmp(bytes_.data(), policy_magic, sizeof(policy_magic)) ||
+        (uintptr_t)bytes_.data() % 8) {
+        return false;
+    }
+    seed_        = get_u64(bytes_.data() + 8);
+    num_keys_    = get_u64(bytes_.data() + 16);
+    num_buckets_ = get_u64(bytes_.data() + 24);
+    if (!num_buckets_ || num_keys_ > bytes_.size() || num_buckets_ > bytes_.size()) {
+        return false;
+    }
+    const auto disp_sz = displacements_size(num_buckets_);
+    if (bytes_.size() != header_sz + disp_sz + num_keys_ * sizeof(uint64_t) + num_keys_) {
+        return false;
+    }
+    const auto *p  = bytes_.data() + header_sz;
+    displacements_ = reinterpret_cast<const uint32_t *>(p);
+    fingerprints_  = reinterpret_cast<const uint64_t *>(p + disp_sz);
+    flags_         = p + disp_sz + num_keys_ * sizeof(uint64_t);
+    return true;
+}
+
+uint8_t policy_table::lookup(policy_domain domain, std::string_view name) const {
+    if (!num_keys_) {
+        return 0;
+    }
+    const auto hash = key_hash(seed_, domain, name);
+    const auto slot = slot_of(hash, displacements_[hash % num_buckets_], num_keys_);
+    return fingerprints_[slot] == hash ? flags_[slot] : 0;
+}
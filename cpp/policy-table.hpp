@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Removal policy and dylib availability compiled into a minimal perfect hash table, so
+// classifying a dylib or symbol is one hash and one probe straight out of the mapped file or the
+// embedded array. Built with hash-and-displace: keys are hashed into buckets, the buckets are
+// placed largest first, each with the first displacement that sends all of its keys to free
+// slots.
+//
+// Layout:
+//   header:        "DYLPOL01", u64 seed, u64 key count, u64 bucket count
+//   displacements: u32 per bucket, padded to 8 bytes
+//   fingerprints:  u64 per slot, the key's full hash
+//   flags:         u8 per slot
+// All integers are little endian. Keys themselves aren't stored, a key that isn't in the table
+// matches a slot's fingerprint with probability 2^-64.
+enum class policy_domain : uint8_t {
+    dylib,
+    symbol,
+};
+
+namespace policy_flags {
+// dylib: whether the host can load it, for --auto-remove-dylibs
+constexpr uint8_t available   = 1 << 0;
+constexpr uint8_t unavailable = 1 << 1;
+// dylib: removed from every output like --remove-dylib, if imported
+constexpr uint8_t remove = 1 << 2;
+// symbol: a weak definition that stays coalesced like --keep-weak-def
+constexpr uint8_t keep_weak_def = 1 << 3;
+} // namespace policy_flags
+
+struct policy_entry {
+    policy_domain domain;
+    std::string name;
+    uint8_t flags;
+};
+
+// Entries with the same domain and name are merged.
+std::vector<uint8_t> compile_policy(const std::vector<policy_entry> &entries);
+// A header defining dylibify_embedded_policy[], see DYLIBIFY_EMBEDDED_POLICY in CMakeLists.txt.
+bool write_policy_header(const std::filesystem::path &path, std::span<const uint8_t> table);
+
+class policy_table {
+public:
+    // Over bytes that outlive the table, 8-byte aligned.
+    static std::optional<policy_table> view(std::span<const uint8_t> bytes);
+    static std::optional<policy_table> map(const std::filesystem::path &path);
+    policy_table(policy_table &&other) noexcept;
+    policy_table(const policy_table &) = delete;
+    ~policy_table();
+
+    // 0 if the table has no entry.
+    uint8_t lookup(policy_domain domain, std::string_view name) const;
+    size_t size() const {
+        return num_keys_;
+    }
+
+private:
+    policy_table(std::span<const uint8_t> bytes, bool mapped);
+    bool parse();
+
+    std::span<const uint8_t> bytes_;
+    bool mapped_{false};
+    uint64_t seed_{0};
+    uint64_t num_keys_{0};
+    uint64_t num_buckets_{0};
+    const uint32_t *displacements_{nullptr};
+    const uint64_t *fingerprints_{nullptr};
+    const uint8_t *flags_{nullptr};
+};
@@ -0,0 +1,296 @@
+#undef NDEBUG
+#include "profiler.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+#include <fmt/format.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t max_frames  = 64;
+constexpr size_t max_samples = 1 << 16;
+// the handler and the signal trampoline
+constexpr size_t skip_frames = 2;
+
+struct stack_sample {
+    uint32_t depth;
+    void *frames[max_frames];
+};
+
+// Written from the signal handler, so no allocation there: slots are claimed with a single
+// atomic increment and samples past the end are only counted. Allocated by the first start(),
+// and left uninitialized so runs without --profile don't pay for it.
+std::unique_ptr<stack_sample[]> samples;
+std::atomic<size_t> num_samples{0};
+std::atomic<size_t> num_dropped{0};
+std::atomic<bool> profiler_active{false};
+
+void sigprof_handler(int, siginfo_t *, void *) {
+    const int saved_errno = errno;
+    const auto idx        = num_samples.fetch_add(1, std::memory_order_relaxed);
+    if (idx < max_samples) {
+        auto &sample = samples[idx];
+        sample.depth = backtrace(sample.frames, max_frames);
+    } else {
+        num_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    errno = saved_errno;
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// Just enough protobuf for profile.proto.
+class pb_writer {
+public:
+    void varint(uint64_t val) {
+        while (val >= 0x80) {
+            buf.emplace_back((val & 0x7f) | 0x80);
+            val >>= 7;
+        }
+        buf.emplace_back(val);
+    }
+    void tag(uint32_t field, uint32_t wire_type) {
+        varint((field << 3) | wire_type);
+    }
+    void field_varint(uint32_t field, uint64_t val) {
+        tag(field, 0);
+        varint(val);
+    }
+    void field_bytes(uint32_t field, const void *data, size_t size) {
+        tag(field, 2);
+        varint(size);
+        const auto *p = static_cast<const uint8_t *>(data);
+        buf.insert(buf.end(), p, p + size);
+    }
+    void field_message(uint32_t field, const pb_writer &msg) {
+        field_bytes(field, msg.buf.data(), msg.buf.size());
+    }
+    void field_packed(uint32_t field, const std::vector<uint64_t> &vals) {
+        pb_writer packed;
+        for (const auto val : vals) {
+            packed.varint(val);
+        }
+        field_message(field, packed);
+    }
+
+    std::vector<uint8_t> buf;
+};
+
+class string_table {
+public:
+    string_table() {
+        intern("");
+    }
+    uint64_t intern(const std::string &str) {
+        const auto it = ids_.find(str);
+        if (it != ids_.end()) {
+            return it->second;
+        }
+        strs_.emplace_back(str);
+        return ids_.emplace(str, strs_.size() - 1).first->second;
+    }
+    const std::vector<std::string> &strings() const {
+        return strs_;
+    }
+
+private:
+    std::map<std::string, uint64_t> ids_;
+    std::vector<std::string> strs_;
+};
+
+std::string demangle(const char *name) {
+    int status{-1};
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (!demangled) {
+        return name;
+    }
+    std::string res{demangled};
+    free(demangled);
+    return res;
+}
+
+} // namespace
+
+sampling_profiler::sampling_profiler(uint32_t hz) : hz_{hz} {
+    assert(hz_ > 0 && hz_ <= 1000000);
+}
+
+sampling_profiler::~sampling_profiler() {
+    if (running_) {
+        stop();
+    }
+}
+
+bool sampling_profiler::start() {
+    bool expected{false};
+    if (!profiler_active.compare_exchange_strong(expected, true)) {
+        fmt::print("[!] A profiler is already running\n");
+        return false;
+    }
+    if (!samples) {
+        samples = std::make_unique_for_overwrite<stack_sample[]>(max_samples);
+    }
+    num_samples = 0;
+    num_dropped = 0;
+    // the first backtrace() loads the unwinder, which isn't safe from a signal handler
+    void *prime[1];
+    backtrace(prime, 1);
+
+    struct sigaction sa {};
+    sa.sa_sigaction = sigprof_handler;
+    sa.sa_flags     = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    assert(!sigaction(SIGPROF, &sa, nullptr));
+
+    // tv_usec must stay below a second
+    const auto period_us = 1000000 / hz_;
+    itimerval timer{};
+    timer.it_interval.tv_sec  = period_us / 1000000;
+    timer.it_interval.tv_usec = period_us % 1000000;
+    timer.it_value            = timer.it_interval;
+    assert(!setitimer(ITIMER_PROF, &timer, nullptr));
+    start_ns_ = now_ns();
+    running_  = true;
+    return true;
+}
+
+void sampling_profiler::stop() {
+    assert(running_);
+    itimerval timer{};
+    assert(!setitimer(ITIMER_PROF, &timer, nullptr));
+    signal(SIGPROF, SIG_IGN);
+    duration_ns_    = now_ns() - start_ns_;
+    running_        = false;
+    profiler_active = false;
+}
+
+bool sampling_profiler::write_pprof(const fs::path &path) const {
+    assert(!running_);
+    const auto period_ns = 1000000000 / hz_;
+    const auto count     = std::min(num_samples.load(), max_samples);
+
+    string_table strings;
+    std::map<void *, uint64_t> location_ids;
+    std::map<std::string, uint64_t> function_ids;
+    struct mapping_info {
+        uint64_t id;
+        uint64_t start;
+        uint64_t limit;
+    };
+    std::map<std::string, mapping_info> mappings;
+    pb_writer locations, functions;
+
+    // identical stacks are merged into one sample
+    std::map<std::vector<uint64_t>, uint64_t> stacks;
+    for (size_t i = 0; i < count; ++i) {
+        const auto &sample = samples[i];
+        std::vector<uint64_t> stack;
+        for (uint32_t f = skip_frames; f < sample.depth; ++f) {
+            // return addresses point after the call, look up the call itself
+            auto *pc = static_cast<uint8_t *>(sample.frames[f]) - (f > skip_frames ? 1 : 0);
+            auto it  = location_ids.find(pc);
+            if (it == location_ids.end()) {
+                const auto loc_id = location_ids.size() + 1;
+                it                = location_ids.emplace(pc, loc_id).first;
+
+                Dl_info info{};
+                const bool resolved = dladdr(pc, &info);
+                pb_writer loc;
+                loc.field_varint(1, loc_id);
+                if (resolved && info.dli_fname) {
+                    auto &mapping = mappings[info.dli_fname];
+                    if (!mapping.id) {
+                        mapping = {mappings.size(), (uint64_t)info.dli_fbase,
+                                   (uint64_t)info.dli_fbase};
+                    }
+                    mapping.limit = std::max(mapping.limit, (uint64_t)pc + 1);
+                    loc.field_varint(2, mapping.id);
+                }
+                loc.field_varint(3, (uint64_t)pc);
+                if (resolved && info.dli_sname) {
+                    auto fn_it = function_ids.find(info.dli_sname);
+                    if (fn_it == function_ids.end()) {
+                        const auto fn_id = function_ids.size() + 1;
+                        fn_it            = function_ids.emplace(info.dli_sname, fn_id).first;
+                        pb_writer fn;
+                        fn.field_varint(1, fn_id);
+                        fn.field_varint(2, strings.intern(demangle(info.dli_sname)));
+                        fn.field_varint(3, strings.intern(info.dli_sname));
+                        fn.field_varint(4, strings.intern(info.dli_fname ? info.dli_fname : ""));
+                        functions.field_message(5, fn);
+                    }
+                    pb_writer line;
+                    line.field_varint(1, fn_it->second);
+                    loc.field_message(4, line);
+                }
+                locations.field_message(4, loc);
+            }
+            stack.emplace_back(it->second);
+        }
+        ++stacks[stack];
+    }
+
+    pb_writer profile;
+    const auto add_value_type = [&](uint32_t field, const char *type, const char *unit) {
+        pb_writer vt;
+        vt.field_varint(1, strings.intern(type));
+        vt.field_varint(2, strings.intern(unit));
+        profile.field_message(field, vt);
+    };
+    add_value_type(1, "samples", "count");
+    add_value_type(1, "cpu", "nanoseconds");
+    for (const auto &stack : stacks) {
+        pb_writer sample;
+        sample.field_packed(1, stack.first);
+        sample.field_packed(2, {stack.second, stack.second * period_ns});
+        profile.field_message(2, sample);
+    }
+    for (const auto &mapping : mappings) {
+        pb_writer m;
+        m.field_varint(1, mapping.second.id);
+        m.field_varint(2, mapping.second.start);
+        m.field_varint(3, mapping.second.limit);
+        m.field_varint(5, strings.intern(mapping.first));
+        profile.field_message(3, m);
+    }
+    profile.buf.insert(profile.buf.end(), locations.buf.begin(), locations.buf.end());
+    profile.buf.insert(profile.buf.end(), functions.buf.begin(), functions.buf.end());
+    for (const auto &str : strings.strings()) {
+        profile.field_bytes(6, str.data(), str.size());
+    }
+    profile.field_varint(9, start_ns_);
+    profile.field_varint(10, duration_ns_);
+    add_value_type(11, "cpu", "nanoseconds");
+    profile.field_varint(12, period_ns);
+
+    auto *fh = fopen(path.c_str(), "wb");
+    if (!fh) {
+        fmt::print("[!] Couldn't create profile '{:s}': {:s}\n", path.string(), strerror(errno));
+        return false;
+    }
+    assert(fwrite(profile.buf.data(), profile.buf.size(), 1, fh) == 1);
+    assert(!fclose(fh));
+    fmt::print("[-] Wrote {:d} samples ({:d} dropped) to profile '{:s}'\n", count,
+               num_dropped.load(), path.string());
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+// In-process SIGPROF sampling profiler. Stacks are captured into a fixed buffer from the signal
+// handler and symbolized when the profile is written, as an uncompressed pprof protobuf that
+// `pprof -http` and most flame graph tools read directly. Only one profiler can run at a time.
+class sampling_profiler {
+public:
+    explicit sampling_profiler(uint32_t hz = 997);
+    sampling_profiler(const sampling_profiler &) = delete;
+    ~sampling_profiler();
+
+    bool start();
+    void stop();
+    bool write_pprof(const std::filesystem::path &path) const;
+
+private:
+    uint32_t hz_;
+    bool running_{false};
+    int64_t start_ns_{0};
+    int64_t duration_ns_{0};
+};
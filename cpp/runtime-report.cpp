@@ -0,0 +1,231 @@
+#undef NDEBUG
+#include "runtime-report.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "macho-view.hpp"
+
+namespace {
+
+constexpr uint32_t METHOD_LIST_IS_RELATIVE = 0x80000000;
+constexpr uint32_t METHOD_LIST_ENTSIZE     = 0x0000fffc;
+
+// Follows pointers and relative offsets in the on-disk image. Rebased pointers hold their
+// unslid target, binds to other images hold nothing useful and come back as nullopt.
+class metadata_reader {
+public:
+    explicit metadata_reader(const macho::image &img)
+        : img_{img}, segments_{img.segments()}, formats_{macho::chained_pointer_formats(img)} {
+        for (const auto &seg : segments_) {
+            if (seg.name == "__TEXT") {
+                base_ = seg.vmaddr;
+            }
+        }
+    }
+
+    std::optional<uint64_t> file_offset(uint64_t vmaddr, uint64_t size) const {
+        for (const auto &seg : segments_) {
+            if (vmaddr >= seg.vmaddr && vmaddr + size <= seg.vmaddr + seg.filesize) {
+                return seg.fileoff + (vmaddr - seg.vmaddr);
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::optional<uint32_t> read32(uint64_t vmaddr) const {
+        const auto off = file_offset(vmaddr, 4);
+        if (off == std::nullopt) {
+            return std::nullopt;
+        }
+        uint32_t val;
+        std::memcpy(&val, img_.data().data() + *off, sizeof(val));
+        return val;
+    }
+
+    std::optional<uint64_t> read_pointer(uint64_t vmaddr) const {
+        const auto off = file_offset(vmaddr, img_.pointer_size());
+        if (off == std::nullopt) {
+            return std::nullopt;
+        }
+        uint64_t val{0};
+        std::memcpy(&val, img_.data().data() + *off, img_.pointer_size());
+        // segments without chains hold plain pointers
+        const auto format = pointer_format(vmaddr);
+        if (format) {
+            if (!macho::is_supported_chained_format(format)) {
+                return std::nullopt;
+            }
+            const auto ptr = macho::decode_chained_pointer(val, format);
+            if (ptr.import != std::nullopt) {
+                return std::nullopt;
+            }
+            val = ptr.vmaddr_target ? ptr.target : base_ + ptr.target;
+        }
+        return file_offset(val, 1) ? std::optional{val} : std::nullopt;
+    }
+
+    std::optional<std::string_view> read_string(uint64_t vmaddr) const {
+        const auto off = file_offset(vmaddr, 1);
+        if (off == std::nullopt) {
+            return std::nullopt;
+        }
+        const auto *str = reinterpret_cast<const char *>(img_.data().data() + *off);
+        return std::string_view{str, strnlen(str, img_.data().size() - *off)};
+    }
+
+    uint8_t pointer_size() const {
+        return img_.pointer_size();
+    }
+
+private:
+    uint16_t pointer_format(uint64_t vmaddr) const {
+        for (const auto &seg : segments_) {
+            if (vmaddr >= seg.vmaddr && vmaddr < seg.vmaddr + seg.vmsize) {
+                return formats_[seg.index];
+            }
+        }
+        return 0;
+    }
+
+    const macho::image &img_;
+    std::vector<macho::segment_ref> segments_;
+    // chained pointer format by segment index
+    std::vector<uint16_t> formats_;
+    uint64_t base_{0};
+};
+
+// Methods named "load" in a method_list_t.
+size_t count_load_methods(const metadata_reader &reader, uint64_t list_addr) {
+    const auto entsize_flags = reader.read32(list_addr);
+    const auto count         = reader.read32(list_addr + 4);
+    if (entsize_flags == std::nullopt || count == std::nullopt) {
+        return 0;
+    }
+    const bool relative = *entsize_flags & METHOD_LIST_IS_RELATIVE;
+    const auto entsize  = *entsize_flags & METHOD_LIST_ENTSIZE;
+    size_t loads{0};
+    for (uint32_t i = 0; i < *count; ++i) {
+        const auto method = list_addr + 8 + (uint64_t)i * entsize;
+        std::optional<uint64_t> name_addr;
+        if (relative) {
+            // relative to the field, pointing at the selector reference
+            const auto name_off = reader.read32(method);
+            if (name_off != std::nullopt) {
+                name_addr = reader.read_pointer(method + (int32_t)*name_off);
+            }
+        } else {
+            name_addr = reader.read_pointer(method);
+        }
+        if (name_addr != std::nullopt && reader.read_string(*name_addr) == "load") {
+            ++loads;
+        }
+    }
+    return loads;
+}
+
+// +load of a class lives in its metaclass' class_ro_t.
+std::optional<size_t> class_load_methods(const metadata_reader &reader, uint64_t cls_addr) {
+    const auto ptr  = reader.pointer_size();
+    const auto meta = reader.read_pointer(cls_addr);
+    if (meta == std::nullopt) {
+        return std::nullopt;
+    }
+    const auto data = reader.read_pointer(*meta + 4 * ptr);
+    if (data == std::nullopt) {
+        return std::nullopt;
+    }
+    // the low bits of the data pointer are flags (Swift classes set them)
+    const auto ro_addr = *data & ~7ull;
+    // flags, instanceStart, instanceSize, the 64-bit padding, ivarLayout, name, baseMethods
+    const auto methods = reader.read_pointer(ro_addr + 12 + (ptr == 8 ? 4 : 0) + 2 * ptr);
+    if (methods == std::nullopt) {
+        return 0;
+    }
+    return count_load_methods(reader, *methods);
+}
+
+// category_t is name, cls, instanceMethods, classMethods, ...
+size_t category_load_methods(const metadata_reader &reader, uint64_t cat_addr) {
+    const auto class_methods = reader.read_pointer(cat_addr + 3 * reader.pointer_size());
+    if (class_methods == std::nullopt) {
+        return 0;
+    }
+    return count_load_methods(reader, *class_methods);
+}
+
+} // namespace
+
+runtime_costs runtime_launch_costs(std::span<const uint8_t> slice) {
+    const auto img = macho::image::read_only(slice);
+    const metadata_reader reader{img};
+    const auto ptr = img.pointer_size();
+    runtime_costs costs;
+
+    for (const auto &sect : img.sections()) {
+        const auto num_ptrs = sect.size / ptr;
+        const auto entries  = [&](const auto &fn) {
+            for (uint64_t i = 0; i < num_ptrs; ++i) {
+                const auto entry = reader.read_pointer(sect.addr + i * ptr);
+                if (entry == std::nullopt) {
+                    ++costs.unresolved;
+                    continue;
+                }
+                fn(*entry);
+            }
+        };
+        if (sect.sectname == "__objc_classlist") {
+            costs.classes += num_ptrs;
+        } else if (sect.sectname == "__objc_nlclslist") {
+            costs.nonlazy_classes += num_ptrs;
+            entries([&](uint64_t cls) {
+                if (const auto loads = class_load_methods(reader, cls)) {
+                    costs.load_methods += *loads;
+                } else {
+                    ++costs.unresolved;
+                }
+            });
+        } else if (sect.sectname == "__objc_catlist") {
+            costs.categories += num_ptrs;
+        } else if (sect.sectname == "__objc_nlcatlist") {
+            costs.nonlazy_categories += num_ptrs;
+            entries(
+                [&](uint64_t cat) { costs.load_methods += category_load_methods(reader, cat); });
+        } else if (sect.sectname == "__objc_selrefs") {
+            costs.selector_refs += num_ptrs;
+        } else if (sect.sectname == "__swift5_proto") {
+            // 32-bit relative offsets to the conformance descriptors
+            costs.protocol_conformances += sect.size / sizeof(int32_t);
+        } else if (sect.sectname == "__swift5_types") {
+            costs.swift_types += sect.size / sizeof(int32_t);
+        }
+    }
+    return costs;
+}
+
+void print_runtime_report(std::span<const uint8_t> file) {
+    for (const auto &slice : macho::slices(file)) {
+        const auto costs = runtime_launch_costs(file.subspan(slice.offset, slice.size));
+        fmt::print("    {:<40s} {:>12s}\n", macho::arch_name(slice.cputype), "count");
+        const auto row = [](const char *name, size_t count) {
+            fmt::print("    {:<40s} {:>12d}\n", name, count);
+        };
+        row("classes", costs.classes);
+        row("non-lazy classes", costs.nonlazy_classes);
+        row("categories", costs.categories);
+        row("non-lazy categories", costs.nonlazy_categories);
+        row("+load methods", costs.load_methods);
+        row("selector references", costs.selector_refs);
+        row("swift protocol conformances", costs.protocol_conformances);
+        row("swift types", costs.swift_types);
+        if (costs.unresolved) {
+            row("unresolved (imported) entries", costs.unresolved);
+        }
+    }
+}
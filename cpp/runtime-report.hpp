@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// What the Objective-C and Swift runtimes do for an image when it loads, on top of dyld's
+// fixups: realizing non-lazy classes, attaching categories, running +load and scanning Swift
+// protocol conformances. Read straight from the metadata sections, no parsing.
+struct runtime_costs {
+    size_t classes{0};
+    // realized at load time instead of on first use, because they or a category implement +load
+    size_t nonlazy_classes{0};
+    size_t categories{0};
+    size_t nonlazy_categories{0};
+    size_t load_methods{0};
+    // uniqued at load time since only shared cache images come pre-optimized
+    size_t selector_refs{0};
+    size_t protocol_conformances{0};
+    size_t swift_types{0};
+    // class or category lists that pointed outside the image, +load counts are a lower bound
+    size_t unresolved{0};
+};
+
+// For one thin slice.
+runtime_costs runtime_launch_costs(std::span<const uint8_t> slice);
+
+// Per slice table of the above.
+void print_runtime_report(std::span<const uint8_t> file);
@@ -0,0 +1,189 @@
+#undef NDEBUG
+#include "sdk-index.hpp"
+
+#include <cassert>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include <fmt/format.h>
+
+#include "file-io.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// One record per line, names always last since install names may contain spaces:
+//   avail <0|1> <install name>
+//   dylib <cputype> <current version> <compat version> <install name>
+//   export <symbol>                  of the last dylib line
+//   reexport <install name>          of the last dylib line
+constexpr const char *index_magic = "dylibify-index 1";
+
+std::optional<std::tuple<int64_t, uint64_t, uint64_t>> file_version(const fs::path &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st)) {
+        return std::nullopt;
+    }
+#if defined(__APPLE__)
+    const int64_t mtime_ns = st.st_mtimespec.tv_sec * 1'000'000'000ll + st.st_mtimespec.tv_nsec;
+#else
+    const int64_t mtime_ns = st.st_mtim.tv_sec * 1'000'000'000ll + st.st_mtim.tv_nsec;
+#endif
+    return std::make_tuple(mtime_ns, (uint64_t)st.st_size, (uint64_t)st.st_ino);
+}
+
+} // namespace
+
+const export_index *sdk_index::exports_for(uint32_t cputype) const {
+    const auto it = export_indexes.find(cputype);
+    return it != export_indexes.end() ? &it->second : nullptr;
+}
+
+std::optional<sdk_index> read_sdk_index(const fs::path &path) {
+    std::ifstream in{path};
+    std::string line;
+    if (!in || !std::getline(in, line) || line != index_magic) {
+        fmt::print("[!] '{:s}' isn't a dylibify index\n", path.string());
+        return std::nullopt;
+    }
+
+    sdk_index index;
+    dylib_exports *entry{nullptr};
+    std::vector<std::string> entry_exports;
+    const auto finish_entry = [&] {
+        if (entry) {
+            entry->exports = symbol_dict{std::move(entry_exports)};
+        }
+        entry_exports.clear();
+    };
+    size_t line_num{1};
+    while (std::getline(in, line)) {
+        ++line_num;
+        if (line.empty()) {
+            continue;
+        }
+        std::istringstream fields{line};
+        std::string kind;
+        fields >> kind;
+        bool good{true};
+        if (kind == "avail") {
+            int avail{0};
+            good = !!(fields >> avail);
+            index.dylib_available[rest_of(fields)] = avail;
+        } else if (kind == "dylib") {
+            uint32_t cputype, current, compat;
+            good = !!(fields >> cputype >> current >> compat);
+            if (good) {
+                finish_entry();
+                entry                  = &index.export_indexes[cputype][rest_of(fields)];
+                entry->current_version = current;
+                entry->compat_version  = compat;
+            }
+        } else if (kind == "export" && entry) {
+            entry_exports.emplace_back(rest_of(fields));
+        } else if (kind == "reexport" && entry) {
+            entry->reexports.emplace_back(rest_of(fields));
+        } else {
+            good = false;
+        }
+        if (!good) {
+            fmt::print("[!] Bad record on line {:d} of index '{:s}'\n", line_num, path.string());
+            return std::nullopt;
+        }
+    }
+    finish_entry();
+    return index;
+}
+
+bool write_sdk_index(const fs::path &path, const sdk_index &index) {
+    auto tmp_path = path;
+    tmp_path += fmt::format(".tmp-{:d}", getpid());
+    {
+        std::ofstream out{tmp_path};
+        if (!out) {
+            fmt::print("[!] Couldn't create index '{:s}'\n", tmp_path.string());
+            return false;
+        }
+        out << index_magic << '\n';
+        for (const auto &[install_name, avail] : index.dylib_available) {
+            out << "avail " << (int)avail << ' ' << install_name << '\n';
+        }
+        for (const auto &[cputype, exp_index] : index.export_indexes) {
+            for (const auto &[install_name, entry] : exp_index) {
+                out << "dylib " << cputype << ' ' << entry.current_version << ' '
+                    << entry.compat_version << ' ' << install_name << '\n';
+                for (const auto &sym : entry.exports) {
+                    out << "export " << sym << '\n';
+                }
+                for (const auto &reexport : entry.reexports) {
+                    out << "reexport " << reexport << '\n';
+                }
+            }
+        }
+        if (!out.flush()) {
+            fmt::print("[!] Couldn't write index '{:s}'\n", tmp_path.string());
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+        fmt::print("[!] Couldn't replace index '{:s}': {:s}\n", path.string(), ec.message());
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+index_watcher::index_watcher(fs::path path, snapshot<sdk_index> &target,
+                             std::chrono::milliseconds interval)
+    : path_{std::move(path)}, target_{target}, interval_{interval} {}
+
+index_watcher::~index_watcher() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard lk{lock_};
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+}
+
+bool index_watcher::start() {
+    assert(!thread_.joinable());
+    if (!poll() || version_ == std::nullopt) {
+        fmt::print("[!] Couldn't load index '{:s}'\n", path_.string());
+        return false;
+    }
+    thread_ = std::thread{[this] {
+        std::unique_lock lk{lock_};
+        while (!cv_.wait_for(lk, interval_, [this] { return stopping_; })) {
+            // a bad or half-copied file leaves the current snapshot in place until the next one
+            poll();
+        }
+    }};
+    return true;
+}
+
+bool index_watcher::poll() {
+    const auto version = file_version(path_);
+    if (version == std::nullopt || version == version_) {
+        return true;
+    }
+    // a bad version is only reported once, the next replacement gets another try
+    version_   = version;
+    auto index = read_sdk_index(path_);
+    if (index == std::nullopt) {
+        return false;
+    }
+    fmt::print("[-] Loaded index '{:s}': {:d} dylibs, {:d} archs\n", path_.string(),
+               index->dylib_available.size(), index->export_indexes.size());
+    target_.store(std::make_shared<const sdk_index>(std::move(*index)));
+    return true;
+}
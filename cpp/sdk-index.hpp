@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "snapshot.hpp"
+#include "symbol-dict.hpp"
+
+// What auto-removal and re-export flattening know about the SDK and host, saved to a file so a
+// long-running service can pick up a new SDK by swapping the file instead of restarting.
+struct dylib_exports {
+    uint32_t current_version{0x00010000};
+    uint32_t compat_version{0x00010000};
+    symbol_dict exports;
+    std::vector<std::string> reexports;
+};
+
+using export_index = std::map<std::string, dylib_exports>;
+
+struct sdk_index {
+    // install name -> whether the host can load it
+    std::map<std::string, bool> dylib_available;
+    // by cputype, an arch that is present covers every dylib reachable from what it lists
+    std::map<uint32_t, export_index> export_indexes;
+
+    // nullptr if the index doesn't cover cputype
+    const export_index *exports_for(uint32_t cputype) const;
+};
+
+std::optional<sdk_index> read_sdk_index(const std::filesystem::path &path);
+// Through a temporary and a rename, so readers see either the old or the new file.
+bool write_sdk_index(const std::filesystem::path &path, const sdk_index &index);
+
+// Publishes the index file at path into target, and again every time the file is replaced.
+// Jobs that already pinned the previous snapshot finish on it.
+class index_watcher {
+public:
+    index_watcher(std::filesystem::path path, snapshot<sdk_index> &target,
+                  std::chrono::milliseconds interval = std::chrono::seconds{2});
+    index_watcher(const index_watcher &) = delete;
+    ~index_watcher();
+
+    // Loads the file once, false if it can't be read, then watches it in the background.
+    bool start();
+
+private:
+    // true if the file is unchanged or was reloaded
+    bool poll();
+
+    std::filesystem::path path_;
+    snapshot<sdk_index> &target_;
+    std::chrono::milliseconds interval_;
+    // mtime, size and inode of the version last published
+    std::optional<std::tuple<int64_t, uint64_t, uint64_t>> version_;
+    std::mutex lock_;
+    std::condition_variable cv_;
+    bool stopping_{false};
+    std::thread thread_;
+};
@@ -0,0 +1,159 @@
+#undef NDEBUG
+#include "size-report.hpp"
+
+#include <cassert>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "macho-view.hpp"
+
+using namespace std::string_literals;
+
+namespace {
+
+// Rows are matched across the files by (segname, sectname). Segments have no sectname, LINKEDIT
+// tables are named like sections of __LINKEDIT and the header has no segname.
+using size_key = std::pair<std::string, std::string>;
+
+struct size_item {
+    size_key key;
+    std::string name;
+    uint64_t size;
+};
+
+const std::map<uint32_t, std::string> linkedit_data_names{
+    {macho::LC_CODE_SIGNATURE, "code signature"},
+    {macho::LC_SEGMENT_SPLIT_INFO, "segment split info"},
+    {macho::LC_FUNCTION_STARTS, "function starts"},
+    {macho::LC_DATA_IN_CODE, "data in code"},
+    {macho::LC_DYLD_EXPORTS_TRIE, "exports trie"},
+    {macho::LC_DYLD_CHAINED_FIXUPS, "chained fixups"},
+};
+
+bool is_zerofill(uint32_t flags) {
+    const auto type = flags & macho::SECTION_TYPE;
+    return type == macho::S_ZEROFILL || type == macho::S_GB_ZEROFILL ||
+           type == macho::S_THREAD_LOCAL_ZEROFILL;
+}
+
+std::vector<size_item> size_breakdown(const macho::image &img) {
+    std::vector<size_item> items;
+    const std::string header_name{"header + load commands"};
+    items.emplace_back(size_item{{"", header_name}, header_name, img.load_commands_size()});
+
+    const auto sections = img.sections();
+    for (const auto &seg : img.segments()) {
+        const std::string seg_name{seg.name};
+        items.emplace_back(size_item{{seg_name, ""}, seg_name, seg.filesize});
+        for (const auto &sect : sections) {
+            if (sect.segname != seg.name) {
+                continue;
+            }
+            items.emplace_back(size_item{{std::string{sect.segname}, std::string{sect.sectname}},
+                                         fmt::format("  {:s},{:s}", sect.segname, sect.sectname),
+                                         is_zerofill(sect.flags) ? 0 : sect.size});
+        }
+        if (seg.name != "__LINKEDIT") {
+            continue;
+        }
+
+        const auto add_table = [&](const std::string &table, uint64_t size) {
+            items.emplace_back(size_item{{seg_name, table}, "  " + table, size});
+        };
+        for (const auto &lc : img.commands()) {
+            if (lc.cmd == macho::LC_SYMTAB) {
+                const auto *symtab = img.command_at<macho::symtab_command>(lc.offset);
+                const auto nlist_sz =
+                    img.is64() ? sizeof(macho::nlist_64) : sizeof(macho::nlist);
+                add_table("symtab", symtab->nsyms * nlist_sz);
+                add_table("strtab", symtab->strsize);
+            } else if (lc.cmd == macho::LC_DYSYMTAB) {
+                const auto *dysymtab = img.command_at<macho::dysymtab_command>(lc.offset);
+                add_table("indirect symbols", dysymtab->nindirectsyms * sizeof(uint32_t));
+                add_table("relocations", (dysymtab->nextrel + dysymtab->nlocrel) * 8ull);
+            } else if (lc.cmd == macho::LC_DYLD_INFO || lc.cmd == macho::LC_DYLD_INFO_ONLY) {
+                const auto *dyld_info = img.command_at<macho::dyld_info_command>(lc.offset);
+                add_table("rebase opcodes", dyld_info->rebase_size);
+                add_table("bind opcodes", dyld_info->bind_size);
+                add_table("weak bind opcodes", dyld_info->weak_bind_size);
+                add_table("lazy bind opcodes", dyld_info->lazy_bind_size);
+                add_table("exports trie", dyld_info->export_size);
+            } else if (const auto it = linkedit_data_names.find(lc.cmd);
+                       it != linkedit_data_names.end()) {
+                const auto *data = img.command_at<macho::linkedit_data_command>(lc.offset);
+                add_table(it->second, data->datasize);
+            }
+        }
+    }
+    return items;
+}
+
+void print_row(const std::string &name, std::optional<uint64_t> in_size,
+               std::optional<uint64_t> out_size) {
+    const auto delta = (int64_t)out_size.value_or(0) - (int64_t)in_size.value_or(0);
+    fmt::print("    {:<40s} {:>12s} {:>12s} {:>+12d}\n", name,
+               in_size ? fmt::format("{:d}", *in_size) : "-"s,
+               out_size ? fmt::format("{:d}", *out_size) : "-"s, delta);
+}
+
+} // namespace
+
+void print_size_report(std::span<const uint8_t> in_file, std::span<const uint8_t> out_file,
+                       const size_attribution &attribution) {
+    const auto in_slices  = macho::slices(in_file);
+    const auto out_slices = macho::slices(out_file);
+    assert(in_slices.size() == out_slices.size());
+
+    for (size_t i = 0; i < in_slices.size(); ++i) {
+        const auto in_img =
+            macho::image::read_only(in_file.subspan(in_slices[i].offset, in_slices[i].size));
+        const auto out_img =
+            macho::image::read_only(out_file.subspan(out_slices[i].offset, out_slices[i].size));
+        const auto in_items  = size_breakdown(in_img);
+        const auto out_items = size_breakdown(out_img);
+
+        fmt::print("    {:<40s} {:>12s} {:>12s} {:>12s}\n", macho::arch_name(in_img.cputype()),
+                   "input", "output", "delta");
+        std::map<size_key, uint64_t> out_sizes;
+        for (const auto &out_item : out_items) {
+            out_sizes.emplace(out_item.key, out_item.size);
+        }
+        std::set<size_key> printed;
+        for (const auto &in_item : in_items) {
+            const auto it = out_sizes.find(in_item.key);
+            print_row(in_item.name, in_item.size,
+                      it != out_sizes.end() ? std::optional{it->second} : std::nullopt);
+            printed.emplace(in_item.key);
+        }
+        for (const auto &out_item : out_items) {
+            if (!printed.contains(out_item.key)) {
+                print_row(out_item.name, std::nullopt, out_item.size);
+            }
+        }
+        print_row("slice total", in_slices[i].size, out_slices[i].size);
+    }
+    print_row("file total", in_file.size(), out_file.size());
+
+    fmt::print("    {:<40s} {:>12s}\n", "operation", "file bytes");
+    int64_t attributed{0};
+    for (const auto &op : attribution.file) {
+        fmt::print("    {:<40s} {:>+12d}\n", op.first, op.second);
+        attributed += op.second;
+    }
+    const auto total_delta = (int64_t)out_file.size() - (int64_t)in_file.size();
+    fmt::print("    {:<40s} {:>+12d}\n", "unattributed (relayout, padding)",
+               total_delta - attributed);
+
+    // these only change the file's size if the commands outgrow the padding, which relayout
+    // above accounts for
+    fmt::print("    {:<40s} {:>12s}\n", "operation", "load command bytes");
+    int64_t commands_delta{0};
+    for (const auto &op : attribution.load_commands) {
+        fmt::print("    {:<40s} {:>+12d}\n", op.first, op.second);
+        commands_delta += op.second;
+    }
+    fmt::print("    {:<40s} {:>+12d}\n", "total", commands_delta);
+}
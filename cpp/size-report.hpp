@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <span>
+#include <string>
+
+// Bytes added (positive) or removed (negative) by each conversion operation. Load commands come
+// out of and go into the padding after them, so their bytes are kept apart from the ones that
+// change the file's size.
+struct size_attribution {
+    std::map<std::string, int64_t> file;
+    std::map<std::string, int64_t> load_commands;
+};
+
+// Breaks both files down by load commands, segment, section and LINKEDIT table, slice by slice,
+// followed by the per-operation attribution of file and load command bytes. Only walks headers,
+// no parsing.
+void print_size_report(std::span<const uint8_t> in_file, std::span<const uint8_t> out_file,
+                       const size_attribution &attribution);
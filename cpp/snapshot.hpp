@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+// A published, immutable T that readers pin with load() and writers replace wholesale with
+// store(). Readers keep whatever version they pinned for as long as they hold it and never wait on
+// a writer, and a replaced version is freed when its last reader lets go of it.
+template <typename T> class snapshot {
+public:
+    explicit snapshot(std::shared_ptr<const T> initial = std::make_shared<const T>())
+        : current_{std::move(initial)} {}
+    snapshot(const snapshot &) = delete;
+
+    std::shared_ptr<const T> load() const {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        return current_.load(std::memory_order_acquire);
+#else
+        return std::atomic_load_explicit(&current_, std::memory_order_acquire);
+#endif
+    }
+
+    void store(std::shared_ptr<const T> next) {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        current_.store(std::move(next), std::memory_order_release);
+#else
+        std::atomic_store_explicit(&current_, std::move(next), std::memory_order_release);
+#endif
+    }
+
+private:
+#if defined(__cpp_lib_atomic_shared_ptr)
+    std::atomic<std::shared_ptr<const T>> current_;
+#else
+    std::shared_ptr<const T> current_;
+#endif
+};
@@ -0,0 +1,95 @@
+#undef NDEBUG
+#include "symbol-dict.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include "macho-view.hpp"
+
+// Block heads are <len> <bytes>, the others <shared prefix len> <suffix len> <suffix bytes>.
+symbol_dict::symbol_dict(std::vector<std::string> strings) {
+    std::sort(strings.begin(), strings.end());
+    strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+    size_ = strings.size();
+    block_offsets_.reserve((size_ + block_size - 1) / block_size);
+    for (size_t i = 0; i < strings.size(); ++i) {
+        const auto &str = strings[i];
+        if (i % block_size == 0) {
+            assert(data_.size() <= UINT32_MAX);
+            block_offsets_.emplace_back(data_.size());
+            macho::write_uleb(data_, str.size());
+            data_.insert(data_.end(), str.begin(), str.end());
+            continue;
+        }
+        const auto &prev = strings[i - 1];
+        const auto shared =
+            std::mismatch(prev.begin(), prev.end(), str.begin(), str.end()).first - prev.begin();
+        macho::write_uleb(data_, shared);
+        macho::write_uleb(data_, str.size() - shared);
+        data_.insert(data_.end(), str.begin() + shared, str.end());
+    }
+    data_.shrink_to_fit();
+}
+
+std::string_view symbol_dict::block_head(size_t block) const {
+    size_t pos      = block_offsets_[block];
+    const auto len  = macho::read_uleb(data_, pos);
+    const auto *str = reinterpret_cast<const char *>(data_.data() + pos);
+    return std::string_view{str, len};
+}
+
+bool symbol_dict::contains(std::string_view str) const {
+    if (!size_) {
+        return false;
+    }
+    // the last block whose head isn't past str
+    size_t lo{0}, hi{block_offsets_.size()};
+    while (hi - lo > 1) {
+        const auto mid = lo + (hi - lo) / 2;
+        if (block_head(mid) <= str) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    auto it        = iterator{this, lo * block_size};
+    const auto end = iterator{this, std::min(size_, (lo + 1) * block_size)};
+    for (; it != end; ++it) {
+        const auto cmp = std::string_view{*it}.compare(str);
+        if (!cmp) {
+            return true;
+        }
+        if (cmp > 0) {
+            break;
+        }
+    }
+    return false;
+}
+
+symbol_dict::iterator::iterator(const symbol_dict *dict, size_t idx) : dict_{dict}, idx_{idx} {
+    if (idx_ < dict_->size_) {
+        assert(idx_ % block_size == 0);
+        pos_ = dict_->block_offsets_[idx_ / block_size];
+        decode();
+    }
+}
+
+symbol_dict::iterator &symbol_dict::iterator::operator++() {
+    if (++idx_ < dict_->size_) {
+        decode();
+    }
+    return *this;
+}
+
+void symbol_dict::iterator::decode() {
+    const auto &data = dict_->data_;
+    size_t shared{0};
+    if (idx_ % block_size) {
+        shared = macho::read_uleb(data, pos_);
+    }
+    const auto len = macho::read_uleb(data, pos_);
+    assert(shared <= cur_.size() && pos_ + len <= data.size());
+    cur_.resize(shared);
+    cur_.append(reinterpret_cast<const char *>(data.data() + pos_), len);
+    pos_ += len;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// An immutable sorted set of strings, front-coded in blocks: each block starts with a full
+// string and the rest only store what differs from their predecessor. Mangled names share long
+// prefixes, so this is several times smaller than a std::set. Lookups binary search the block
+// heads and scan one block.
+class symbol_dict {
+public:
+    static constexpr size_t block_size = 16;
+
+    symbol_dict() = default;
+    // Needn't be sorted or unique.
+    explicit symbol_dict(std::vector<std::string> strings);
+
+    bool contains(std::string_view str) const;
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return !size_;
+    }
+    // Bytes held, for comparing against the uncompressed strings.
+    size_t memory_usage() const {
+        return data_.capacity() + block_offsets_.capacity() * sizeof(uint32_t);
+    }
+
+    // Decodes into a buffer of its own, the reference is valid until the next increment.
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type        = std::string;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const std::string *;
+        using reference         = const std::string &;
+
+        iterator() = default;
+        reference operator*() const {
+            return cur_;
+        }
+        pointer operator->() const {
+            return &cur_;
+        }
+        iterator &operator++();
+        bool operator==(const iterator &other) const {
+            return idx_ == other.idx_;
+        }
+
+    private:
+        friend class symbol_dict;
+        iterator(const symbol_dict *dict, size_t idx);
+        void decode();
+
+        const symbol_dict *dict_{nullptr};
+        size_t idx_{0};
+        size_t pos_{0};
+        std::string cur_;
+    };
+
+    iterator begin() const {
+        return iterator{this, 0};
+    }
+    iterator end() const {
+        return iterator{this, size_};
+    }
+
+private:
+    // The full string a block starts with.
+    std::string_view block_head(size_t block) const;
+
+    std::vector<uint8_t> data_;
+    std::vector<uint32_t> block_offsets_;
+    size_t size_{0};
+};
@@ -0,0 +1,291 @@
+#undef NDEBUG
+#include "synth-macho.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include "macho-view.hpp"
+
+namespace {
+
+constexpr uint32_t CPU_ARCH_ABI64         = 0x01000000;
+constexpr uint32_t CPU_TYPE_X86           = 7;
+constexpr uint32_t CPU_SUBTYPE_X86_64_ALL = 3;
+constexpr uint32_t MH_EXECUTE             = 0x2;
+constexpr uint32_t MH_NOUNDEFS            = 0x1;
+constexpr uint32_t MH_DYLDLINK            = 0x4;
+constexpr uint32_t MH_TWOLEVEL            = 0x80;
+constexpr uint32_t MH_PIE                 = 0x200000;
+constexpr uint32_t LC_LOAD_DYLINKER       = 0xe;
+constexpr uint32_t LC_MAIN                = 0x28 | macho::LC_REQ_DYLD;
+constexpr uint32_t S_NON_LAZY_PTRS        = 0x6;
+constexpr uint32_t S_ATTR_PURE_INSTRS     = 0x80000000;
+constexpr uint32_t PLATFORM_MACOS         = 1;
+constexpr uint32_t VM_PROT_R              = 1;
+constexpr uint32_t VM_PROT_RW             = 3;
+constexpr uint32_t VM_PROT_RX             = 5;
+constexpr uint64_t page_sz                = 0x4000;
+constexpr uint64_t image_base             = 0x100000000;
+
+struct entry_point_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint64_t entryoff;
+    uint64_t stacksize;
+};
+
+uint64_t align_up(uint64_t val, uint64_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+void copy_name(char (&dst)[16], const char *src) {
+    memset(dst, 0, sizeof(dst));
+    strncpy(dst, src, sizeof(dst));
+}
+
+class lc_writer {
+public:
+    explicit lc_writer(std::vector<uint8_t> &buf) : buf_{buf} {}
+
+    template <typename T> void add(const T &cmd) {
+        put(cmd);
+        ++ncmds_;
+    }
+    template <typename T> void put(const T &val) {
+        assert(off_ + sizeof(T) <= page_sz);
+        memcpy(buf_.data() + off_, &val, sizeof(T));
+        off_ += sizeof(T);
+    }
+    // Load commands that end in a path string.
+    template <typename T>
+    void add_with_path(T cmd, uint32_t T::*name_offset, const std::string &path) {
+        cmd.*name_offset = sizeof(T);
+        cmd.cmdsize      = align_up(sizeof(T) + path.size() + 1, 8);
+        const auto start = off_;
+        add(cmd);
+        memcpy(buf_.data() + off_, path.c_str(), path.size());
+        off_ = start + cmd.cmdsize;
+    }
+    uint32_t ncmds() const {
+        return ncmds_;
+    }
+    uint32_t size() const {
+        return off_ - sizeof(macho::mach_header) - 4;
+    }
+
+private:
+    std::vector<uint8_t> &buf_;
+    size_t off_{sizeof(macho::mach_header) + 4};
+    uint32_t ncmds_{0};
+};
+
+struct dylinker_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t name_offset;
+};
+
+std::vector<uint8_t> synthesize_slice(uint32_t cputype, uint64_t slice_size) {
+    const bool is_x86 = (cputype & ~CPU_ARCH_ABI64) == CPU_TYPE_X86;
+    cputype |= CPU_ARCH_ABI64;
+
+    // _main exported at the start of __text
+    const std::array<uint8_t, 16> export_trie{0x00, 0x01, '_', 'm', 'a', 'i', 'n', 0x00,
+                                              0x09, 0x04, 0x00, 0x80, 0x80, 0x01, 0x00, 0x00};
+    const std::string strtab{"\0_main\0_malloc\0\0", 16};
+    const std::array<macho::rebase_entry, 1> rebases{{{2, 0x10, macho::REBASE_TYPE_POINTER}}};
+    macho::bind_entry got_bind;
+    got_bind.seg_index  = 2;
+    got_bind.seg_offset = 0;
+    got_bind.ordinal    = 1;
+    got_bind.symbol     = "_malloc";
+    const auto rebase_ops = macho::encode_rebases(rebases, 8);
+    const auto bind_ops   = macho::encode_binds({&got_bind, 1}, 8, macho::bind_kind::regular);
+
+    const uint64_t linkedit_sz = align_up(rebase_ops.size(), 8) + align_up(bind_ops.size(), 8) +
+                                 export_trie.size() + 2 * sizeof(macho::nlist_64) + 8 +
+                                 strtab.size();
+    const uint64_t text_sz =
+        std::max<uint64_t>(0x40, slice_size > 2 * page_sz + linkedit_sz
+                                     ? slice_size - 2 * page_sz - linkedit_sz
+                                     : 0);
+    const uint64_t text_seg_sz = align_up(page_sz + text_sz, page_sz);
+    const uint64_t data_off    = text_seg_sz;
+    const uint64_t le_off      = data_off + page_sz;
+
+    std::vector<uint8_t> buf(le_off + linkedit_sz);
+    // filler instructions, nop
+    for (uint64_t i = page_sz; i < page_sz + text_sz; i += 4) {
+        const uint32_t insn = is_x86 ? 0x90909090 : 0xd503201f;
+        memcpy(buf.data() + i, &insn, std::min<uint64_t>(4, page_sz + text_sz - i));
+    }
+    const uint64_t text_addr = image_base + page_sz;
+    memcpy(buf.data() + data_off + 0x10, &text_addr, sizeof(text_addr));
+
+    uint64_t off           = le_off;
+    const auto place_bytes = [&](std::span<const uint8_t> bytes, uint64_t align) {
+        const auto start = off;
+        std::copy(bytes.begin(), bytes.end(), buf.begin() + off);
+        off += align_up(bytes.size(), align);
+        return start;
+    };
+    const auto rebase_off = place_bytes(rebase_ops, 8);
+    const auto bind_off   = place_bytes(bind_ops, 8);
+    const auto export_off = place_bytes(export_trie, 8);
+    std::array<macho::nlist_64, 2> syms{};
+    syms[0]            = {1, macho::N_SECT | macho::N_EXT, 1, 0, text_addr};
+    syms[1]            = {7, macho::N_EXT, 0, 1 << 8, 0};
+    const auto sym_off = place_bytes(
+        {reinterpret_cast<const uint8_t *>(syms.data()), sizeof(syms)}, 8);
+    const uint32_t indirect_sym{1};
+    const auto indirect_off =
+        place_bytes({reinterpret_cast<const uint8_t *>(&indirect_sym), sizeof(indirect_sym)}, 8);
+    const auto str_off = place_bytes(
+        {reinterpret_cast<const uint8_t *>(strtab.data()), strtab.size()}, 8);
+    assert(off == buf.size());
+
+    lc_writer lcs{buf};
+    macho::segment_command_64 pagezero{};
+    pagezero.cmd     = macho::LC_SEGMENT_64;
+    pagezero.cmdsize = sizeof(pagezero);
+    copy_name(pagezero.segname, "__PAGEZERO");
+    pagezero.vmsize = image_base;
+    lcs.add(pagezero);
+
+    macho::segment_command_64 text{};
+    text.cmd     = macho::LC_SEGMENT_64;
+    text.cmdsize = sizeof(text) + sizeof(macho::section_64);
+    copy_name(text.segname, "__TEXT");
+    text.vmaddr   = image_base;
+    text.vmsize   = text_seg_sz;
+    text.filesize = text_seg_sz;
+    text.maxprot  = VM_PROT_RX;
+    text.initprot = VM_PROT_RX;
+    text.nsects   = 1;
+    lcs.add(text);
+    macho::section_64 text_sect{};
+    copy_name(text_sect.sectname, "__text");
+    copy_name(text_sect.segname, "__TEXT");
+    text_sect.addr   = text_addr;
+    text_sect.size   = text_sz;
+    text_sect.offset = page_sz;
+    text_sect.align  = 2;
+    text_sect.flags  = S_ATTR_PURE_INSTRS;
+    lcs.put(text_sect);
+
+    macho::segment_command_64 data{};
+    data.cmd     = macho::LC_SEGMENT_64;
+    data.cmdsize = sizeof(data) + 2 * sizeof(macho::section_64);
+    copy_name(data.segname, "__DATA");
+    data.vmaddr   = image_base + data_off;
+    data.vmsize   = page_sz;
+    data.fileoff  = data_off;
+    data.filesize = page_sz;
+    data.maxprot  = VM_PROT_RW;
+    data.initprot = VM_PROT_RW;
+    data.nsects   = 2;
+    lcs.add(data);
+    macho::section_64 got{};
+    copy_name(got.sectname, "__got");
+    copy_name(got.segname, "__DATA");
+    got.addr   = data.vmaddr;
+    got.size   = 8;
+    got.offset = data_off;
+    got.align  = 3;
+    got.flags  = S_NON_LAZY_PTRS;
+    lcs.put(got);
+    macho::section_64 data_sect{};
+    copy_name(data_sect.sectname, "__data");
+    copy_name(data_sect.segname, "__DATA");
+    data_sect.addr   = data.vmaddr + 0x10;
+    data_sect.size   = 8;
+    data_sect.offset = data_off + 0x10;
+    data_sect.align  = 3;
+    lcs.put(data_sect);
+
+    macho::segment_command_64 linkedit{};
+    linkedit.cmd     = macho::LC_SEGMENT_64;
+    linkedit.cmdsize = sizeof(linkedit);
+    copy_name(linkedit.segname, "__LINKEDIT");
+    linkedit.vmaddr   = image_base + le_off;
+    linkedit.vmsize   = align_up(linkedit_sz, page_sz);
+    linkedit.fileoff  = le_off;
+    linkedit.filesize = linkedit_sz;
+    linkedit.maxprot  = VM_PROT_R;
+    linkedit.initprot = VM_PROT_R;
+    lcs.add(linkedit);
+
+    macho::dyld_info_command dyld_info{};
+    dyld_info.cmd         = macho::LC_DYLD_INFO_ONLY;
+    dyld_info.cmdsize     = sizeof(dyld_info);
+    dyld_info.rebase_off  = rebase_off;
+    dyld_info.rebase_size = align_up(rebase_ops.size(), 8);
+    dyld_info.bind_off    = bind_off;
+    dyld_info.bind_size   = align_up(bind_ops.size(), 8);
+    dyld_info.export_off  = export_off;
+    dyld_info.export_size = export_trie.size();
+    lcs.add(dyld_info);
+
+    macho::symtab_command symtab{};
+    symtab.cmd     = macho::LC_SYMTAB;
+    symtab.cmdsize = sizeof(symtab);
+    symtab.symoff  = sym_off;
+    symtab.nsyms   = syms.size();
+    symtab.stroff  = str_off;
+    symtab.strsize = strtab.size();
+    lcs.add(symtab);
+
+    macho::dysymtab_command dysymtab{};
+    dysymtab.cmd            = macho::LC_DYSYMTAB;
+    dysymtab.cmdsize        = sizeof(dysymtab);
+    dysymtab.iextdefsym     = 0;
+    dysymtab.nextdefsym     = 1;
+    dysymtab.iundefsym      = 1;
+    dysymtab.nundefsym      = 1;
+    dysymtab.indirectsymoff = indirect_off;
+    dysymtab.nindirectsyms  = 1;
+    lcs.add(dysymtab);
+
+    dylinker_command dylinker{LC_LOAD_DYLINKER, 0, 0};
+    lcs.add_with_path(dylinker, &dylinker_command::name_offset, "/usr/lib/dyld");
+
+    lcs.add(entry_point_command{LC_MAIN, sizeof(entry_point_command), page_sz, 0});
+
+    macho::dylib_command libsystem{macho::LC_LOAD_DYLIB, 0, 0, 2, 0x05000000, 0x00010000};
+    lcs.add_with_path(libsystem, &macho::dylib_command::name_offset,
+                      "/usr/lib/libSystem.B.dylib");
+
+    lcs.add(macho::build_version_command{macho::LC_BUILD_VERSION,
+                                         sizeof(macho::build_version_command), PLATFORM_MACOS,
+                                         0x000b0000, 0x000b0000, 0});
+
+    macho::mach_header hdr{};
+    hdr.magic      = macho::MH_MAGIC_64;
+    hdr.cputype    = cputype;
+    hdr.cpusubtype = is_x86 ? CPU_SUBTYPE_X86_64_ALL : 0;
+    hdr.filetype   = MH_EXECUTE;
+    hdr.ncmds      = lcs.ncmds();
+    hdr.sizeofcmds = lcs.size();
+    hdr.flags      = MH_NOUNDEFS | MH_DYLDLINK | MH_TWOLEVEL | MH_PIE;
+    memcpy(buf.data(), &hdr, sizeof(hdr));
+    return buf;
+}
+
+} // namespace
+
+std::vector<uint8_t> synthesize_executable(std::span<const uint32_t> cputypes,
+                                           uint64_t total_size) {
+    assert(!cputypes.empty());
+    std::vector<std::vector<uint8_t>> slice_bufs;
+    std::vector<macho::fat_slice> layout;
+    for (const auto cputype : cputypes) {
+        slice_bufs.emplace_back(synthesize_slice(cputype, total_size / cputypes.size()));
+        const auto *hdr = reinterpret_cast<const macho::mach_header *>(slice_bufs.back().data());
+        layout.emplace_back(
+            macho::fat_slice{hdr->cputype, hdr->cpusubtype, 0, slice_bufs.back().size(), 14});
+    }
+    return macho::join_fat(slice_bufs, layout, cputypes.size() > 1);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Builds a minimal, dylibify-able MH_EXECUTE of roughly total_size bytes with one slice per
+// cputype (fat when there are several). Each slice has a __text of filler instructions, one
+// rebased pointer in __data and a __got entry bound to libSystem's _malloc, which is enough to
+// drive every conversion pass. 32-bit cputypes are generated as their 64-bit counterpart.
+std::vector<uint8_t> synthesize_executable(std::span<const uint32_t> cputypes,
+                                           uint64_t total_size);
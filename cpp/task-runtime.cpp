@@ -0,0 +1,194 @@
+#undef NDEBUG
+#include "task-runtime.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <optional>
+
+namespace {
+
+struct worker_identity {
+    const task_runtime *runtime{nullptr};
+    size_t idx{0};
+};
+
+thread_local worker_identity current_worker;
+
+} // namespace
+
+task_runtime &task_runtime::instance() {
+    static task_runtime runtime{std::max(std::thread::hardware_concurrency(), 2u) - 1};
+    return runtime;
+}
+
+task_runtime::task_runtime(size_t num_workers) {
+    for (size_t i = 0; i <= num_workers; ++i) {
+        queues_.emplace_back(std::make_unique<task_queue>());
+    }
+    for (size_t i = 0; i < num_workers; ++i) {
+        threads_.emplace_back(&task_runtime::worker, this, i);
+    }
+}
+
+task_runtime::~task_runtime() {
+    {
+        std::lock_guard lk{sleep_lock_};
+        stopping_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+    assert(!queued_ && !jobs_queued_);
+}
+
+void task_runtime::spawn(task fn) {
+    // workers keep their own spawns local, everyone else goes through the shared queue
+    const auto idx = current_worker.runtime == this ? current_worker.idx : threads_.size();
+    {
+        std::lock_guard lk{queues_[idx]->lock};
+        queues_[idx]->tasks.emplace_back(std::move(fn));
+        queued_.fetch_add(1);
+    }
+    wake();
+}
+
+void task_runtime::spawn_job(task fn) {
+    {
+        std::lock_guard lk{jobs_.lock};
+        jobs_.tasks.emplace_back(std::move(fn));
+        jobs_queued_.fetch_add(1);
+    }
+    wake();
+}
+
+void task_runtime::wake() {
+    {
+        std::lock_guard lk{sleep_lock_};
+        ++wake_gen_;
+    }
+    sleep_cv_.notify_all();
+}
+
+void task_runtime::help_until(const std::function<bool()> &done, bool run_jobs) {
+    while (true) {
+        uint64_t gen;
+        {
+            std::lock_guard lk{sleep_lock_};
+            gen = wake_gen_;
+        }
+        // done() may take the caller's locks, which are also held around spawn(), so it is never
+        // evaluated under sleep_lock_
+        if (done()) {
+            return;
+        }
+        if (run_one(run_jobs)) {
+            continue;
+        }
+        std::unique_lock lk{sleep_lock_};
+        sleep_cv_.wait(lk,
+                       [&] { return queued_ || (run_jobs && jobs_queued_) || wake_gen_ != gen; });
+    }
+}
+
+bool task_runtime::run_one(bool run_jobs) {
+    if (!queued_ && !(run_jobs && jobs_queued_)) {
+        return false;
+    }
+    const auto own = current_worker.runtime == this ? current_worker.idx : threads_.size();
+    std::optional<task> fn;
+    // newest local task first for locality, then the oldest task of everyone else
+    {
+        auto &queue = *queues_[own];
+        std::lock_guard lk{queue.lock};
+        if (!queue.tasks.empty()) {
+            fn = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            queued_.fetch_sub(1);
+        }
+    }
+    for (size_t i = 1; fn == std::nullopt && i < queues_.size(); ++i) {
+        auto &queue = *queues_[(own + i) % queues_.size()];
+        std::lock_guard lk{queue.lock};
+        if (!queue.tasks.empty()) {
+            fn = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queued_.fetch_sub(1);
+        }
+    }
+    // jobs only once the fork-join work of the running ones is taken
+    if (fn == std::nullopt && run_jobs) {
+        std::lock_guard lk{jobs_.lock};
+        if (!jobs_.tasks.empty()) {
+            fn = std::move(jobs_.tasks.front());
+            jobs_.tasks.pop_front();
+            jobs_queued_.fetch_sub(1);
+        }
+    }
+    if (fn == std::nullopt) {
+        return false;
+    }
+    (*fn)();
+    return true;
+}
+
+void task_runtime::worker(size_t idx) {
+    current_worker = {this, idx};
+    while (true) {
+        if (run_one(true)) {
+            continue;
+        }
+        std::unique_lock lk{sleep_lock_};
+        sleep_cv_.wait(lk, [&] { return stopping_ || queued_ || jobs_queued_; });
+        if (stopping_ && !queued_ && !jobs_queued_) {
+            return;
+        }
+    }
+}
+
+task_group::~task_group() {
+    runtime_.help_until([&] { return !pending_; });
+}
+
+void task_group::run(std::function<void()> fn) {
+    pending_.fetch_add(1);
+    runtime_.spawn([this, fn = std::move(fn)] {
+        try {
+            fn();
+        } catch (...) {
+            std::lock_guard lk{error_lock_};
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+        // the group may be gone as soon as pending_ drops to zero
+        auto &runtime = runtime_;
+        if (pending_.fetch_sub(1) == 1) {
+            runtime.wake();
+        }
+    });
+}
+
+void task_group::wait() {
+    runtime_.help_until([&] { return !pending_; });
+    std::exception_ptr error;
+    {
+        std::lock_guard lk{error_lock_};
+        std::swap(error, error_);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+    if (!n) {
+        return;
+    }
+    task_group group;
+    for (size_t i = 1; i < n; ++i) {
+        group.run([&fn, i] { fn(i); });
+    }
+    fn(0);
+    group.wait();
+}
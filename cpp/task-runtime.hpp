@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing task runtime shared by every level of parallelism in the tool: jobs, fat slices
+// and LINKEDIT tables all spawn onto the same workers, so nesting them never runs more threads
+// than the machine has. Each worker owns a deque it pushes and pops at the back, idle workers
+// steal from the front of the others. Threads that wait on tasks (task_group::wait(),
+// help_until()) run queued tasks instead of blocking, which is what makes nested fork-join safe.
+// Whole jobs are spawned separately and only idle workers and waits that ask for them take one,
+// so a fork-join wait inside a job never runs another job on its stack.
+class task_runtime {
+public:
+    using task = std::function<void()>;
+
+    // Sized to the machine, the thread that waits is the last worker.
+    static task_runtime &instance();
+
+    explicit task_runtime(size_t num_workers);
+    task_runtime(const task_runtime &) = delete;
+    // Runs whatever is still queued first.
+    ~task_runtime();
+
+    // Workers plus the waiting caller.
+    size_t concurrency() const {
+        return threads_.size() + 1;
+    }
+
+    // Tasks mustn't throw, task_group and job_scheduler catch for the ones they spawn.
+    void spawn(task fn);
+    // A job, taken in FIFO order after the fork-join tasks.
+    void spawn_job(task fn);
+    // Runs queued tasks on the calling thread until done() holds, jobs too if run_jobs. done()
+    // is re-evaluated after every task and whenever wake() is called, so whoever makes it true
+    // must call wake().
+    void help_until(const std::function<bool()> &done, bool run_jobs = false);
+    void wake();
+
+private:
+    struct task_queue {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    bool run_one(bool run_jobs);
+    void worker(size_t idx);
+
+    // one per worker and a last one for threads outside the runtime
+    std::vector<std::unique_ptr<task_queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> queued_{0};
+    task_queue jobs_;
+    std::atomic<size_t> jobs_queued_{0};
+    std::mutex sleep_lock_;
+    std::condition_variable sleep_cv_;
+    uint64_t wake_gen_{0};
+    bool stopping_{false};
+};
+
+// Fork-join scope. The first exception thrown by a task is rethrown from wait(), e.g. a
+// job_cancelled from a checkpoint inside one slice cancels the whole conversion.
+class task_group {
+public:
+    explicit task_group(task_runtime &runtime = task_runtime::instance()) : runtime_{runtime} {}
+    task_group(const task_group &) = delete;
+    // Waits for stragglers but drops their exceptions.
+    ~task_group();
+
+    void run(std::function<void()> fn);
+    void wait();
+
+private:
+    task_runtime &runtime_;
+    std::atomic<size_t> pending_{0};
+    std::mutex error_lock_;
+    std::exception_ptr error_;
+};
+
+// Calls fn(i) for every i in [0, n), the calling thread takes the first index.
+void parallel_for(size_t n, const std::function<void(size_t)> &fn);
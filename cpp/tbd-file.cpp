@@ -0,0 +1,245 @@
+#undef NDEBUG
+#include "tbd-file.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+size_t indent_of(const std::string &line) {
+    return line.find_first_not_of(' ');
+}
+
+std::string trim(const std::string &str) {
+    const auto first = str.find_first_not_of(" \t\r");
+    if (first == std::string::npos) {
+        return {};
+    }
+    return str.substr(first, str.find_last_not_of(" \t\r") - first + 1);
+}
+
+std::string unquote(const std::string &str) {
+    if (str.size() >= 2 && (str.front() == '\'' || str.front() == '"') &&
+        str.back() == str.front()) {
+        return str.substr(1, str.size() - 2);
+    }
+    return str;
+}
+
+// "[ a, 'b', c ]" with the brackets already balanced.
+std::vector<std::string> parse_flow_list(const std::string &value) {
+    std::vector<std::string> items;
+    const auto open  = value.find('[');
+    const auto close = value.rfind(']');
+    if (open == std::string::npos || close == std::string::npos || close < open) {
+        return items;
+    }
+    std::stringstream list{value.substr(open + 1, close - open - 1)};
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        item = unquote(trim(item));
+        if (!item.empty()) {
+            items.emplace_back(std::move(item));
+        }
+    }
+    return items;
+}
+
+// One "- archs: ..." entry of an exports list.
+struct export_block {
+    std::vector<std::string> archs;
+    std::vector<std::string> symbols;
+    std::vector<std::string> objc_classes;
+    std::vector<std::string> objc_eh_types;
+    std::vector<std::string> objc_ivars;
+};
+
+// "4" of "tbd-version: 4" or "!tapi-tbd-v3", nothing on junk.
+std::optional<int> parse_version(const std::string &str) {
+    int version{};
+    const auto res = std::from_chars(str.data(), str.data() + str.size(), version);
+    if (res.ec != std::errc{} || res.ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
+    return version;
+}
+
+bool block_has_arch(const export_block &block, const std::string &arch) {
+    for (const auto &entry : block.archs) {
+        // v4 targets are "<arch>-<platform>"
+        if (entry == arch || entry.substr(0, entry.find('-')) == arch) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+std::optional<std::set<std::string>> read_tbd_exports(const fs::path &path,
+                                                      const std::string &arch) {
+    std::ifstream in{path};
+    if (!in) {
+        return std::nullopt;
+    }
+
+    std::set<std::string> exports;
+    bool in_document{false};
+    int version{1};
+    std::string section;
+    std::optional<export_block> block;
+    const auto flush = [&] {
+        if (block == std::nullopt || !block_has_arch(*block, arch)) {
+            block.reset();
+            return;
+        }
+        for (auto &sym : block->symbols) {
+            exports.emplace(std::move(sym));
+        }
+        // v1 and v2 list classes and ivars with the C symbol underscore
+        const auto strip = [&](std::string &name) {
+            if (version <= 2 && name.starts_with('_')) {
+                name.erase(0, 1);
+            }
+        };
+        for (auto &cls : block->objc_classes) {
+            strip(cls);
+            exports.emplace("_OBJC_CLASS_$_" + cls);
+            exports.emplace("_OBJC_METACLASS_$_" + cls);
+        }
+        for (const auto &cls : block->objc_eh_types) {
+            exports.emplace("_OBJC_EHTYPE_$_" + cls);
+        }
+        for (auto &ivar : block->objc_ivars) {
+            strip(ivar);
+            exports.emplace("_OBJC_IVAR_$_" + ivar);
+        }
+        block.reset();
+    };
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (trim(line).empty() || trim(line).starts_with('#')) {
+            continue;
+        }
+        if (line.starts_with("---")) {
+            flush();
+            in_document = true;
+            section.clear();
+            const auto tag = trim(line.substr(3));
+            if (!tag.starts_with("!tapi-tbd-v")) {
+                version = 1;
+                continue;
+            }
+            const auto tag_version = parse_version(tag.substr(11));
+            if (tag_version == std::nullopt) {
+                return std::nullopt;
+            }
+            version = *tag_version;
+            continue;
+        }
+        if (line.starts_with("...")) {
+            flush();
+            in_document = false;
+            continue;
+        }
+        if (!in_document) {
+            // not a tbd
+            return std::nullopt;
+        }
+
+        // flow lists may continue over several lines
+        while (std::count(line.begin(), line.end(), '[') >
+                   std::count(line.begin(), line.end(), ']') &&
+               in) {
+            std::string cont;
+            std::getline(in, cont);
+            line += " " + trim(cont);
+        }
+
+        const auto indent = indent_of(line);
+        auto content      = trim(line);
+        const bool item   = content.starts_with("- ");
+        if (item) {
+            content = trim(content.substr(2));
+        }
+        const auto colon = content.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        const auto key   = content.substr(0, colon);
+        const auto value = trim(content.substr(colon + 1));
+
+        if (!indent && !item) {
+            flush();
+            section = key;
+            if (key == "tbd-version") {
+                const auto doc_version = parse_version(value);
+                if (doc_version == std::nullopt) {
+                    return std::nullopt;
+                }
+                version = *doc_version;
+            }
+            continue;
+        }
+        if (section != "exports" && section != "reexports") {
+            continue;
+        }
+        if (item) {
+            flush();
+            block.emplace();
+        }
+        if (block == std::nullopt) {
+            continue;
+        }
+        if (key == "archs" || key == "targets") {
+            block->archs = parse_flow_list(value);
+        } else if (key == "symbols" || key == "weak-symbols" || key == "weak-def-symbols" ||
+                   key == "thread-local-symbols") {
+            for (auto &sym : parse_flow_list(value)) {
+                block->symbols.emplace_back(std::move(sym));
+            }
+        } else if (key == "objc-classes") {
+            block->objc_classes = parse_flow_list(value);
+        } else if (key == "objc-eh-types") {
+            block->objc_eh_types = parse_flow_list(value);
+        } else if (key == "objc-ivars") {
+            block->objc_ivars = parse_flow_list(value);
+        }
+    }
+    flush();
+    return exports;
+}
+
+std::optional<fs::path> find_tbd(const fs::path &sdk_root, const std::string &install_name) {
+    if (install_name.starts_with("@")) {
+        return std::nullopt;
+    }
+    const auto dylib_path = sdk_root / fs::path{install_name}.relative_path();
+    std::vector<fs::path> candidates;
+    auto tbd_path = dylib_path;
+    if (tbd_path.extension() == ".dylib") {
+        tbd_path.replace_extension(".tbd");
+    } else {
+        tbd_path += ".tbd";
+    }
+    candidates.emplace_back(tbd_path);
+    // Foo.framework/Versions/A/Foo -> Foo.framework/Foo.tbd
+    const auto versions_dir = dylib_path.parent_path().parent_path();
+    if (versions_dir.filename() == "Versions") {
+        candidates.emplace_back(versions_dir.parent_path() /
+                                (dylib_path.filename().string() + ".tbd"));
+    }
+    for (const auto &candidate : candidates) {
+        if (fs::exists(candidate)) {
+            return candidate;
+        }
+    }
+    return std::nullopt;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <set>
+#include <string>
+
+// Text-based stubs (.tbd), the YAML export lists the SDKs ship instead of dylibs. Only the bits
+// a stub needs are read: the exported symbols, weak and thread-local ones included, and
+// Objective-C classes, exception types and ivars. Every document of the file counts, which is
+// how inlined re-exported libraries are described. Handles tbd v1 through v4.
+// Symbol names as they appear in nlists, Objective-C classes as "_OBJC_CLASS_$_<name>" and
+// "_OBJC_METACLASS_$_<name>", exception types as "_OBJC_EHTYPE_$_<name>" and ivars as
+// "_OBJC_IVAR_$_<class>.<ivar>". arch is the -arch spelling ("arm64", "x86_64"). Fails if the
+// file isn't a tbd or has a malformed version.
+std::optional<std::set<std::string>> read_tbd_exports(const std::filesystem::path &path,
+                                                      const std::string &arch);
+
+// The .tbd the SDK ships for a dylib install name, if any. Framework binaries live under
+// Versions/<v>/ on disk but SDKs only keep the top-level tbd.
+std::optional<std::filesystem::path> find_tbd(const std::filesystem::path &sdk_root,
+                                              const std::string &install_name);
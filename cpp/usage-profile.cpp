@@ -0,0 +1,101 @@
+#undef NDEBUG
+#include "usage-profile.hpp"
+
+#include <fstream>
+#include <sstream>
+
+#include <fmt/format.h>
+
+#include "file-io.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr const char *usage_magic = "dylibify-usage 1";
+
+} // namespace
+
+bool usage_profile::unused_dylib(std::string_view install_name) const {
+    const auto it = dylibs.find(install_name);
+    return it != dylibs.end() && !it->second;
+}
+
+bool usage_profile::called(std::string_view symbol) const {
+    const auto it = symbols.find(symbol);
+    return it != symbols.end() && it->second.calls;
+}
+
+bool usage_profile::covers_dylib(std::string_view install_name) const {
+    return runs && dylibs.contains(install_name);
+}
+
+bool usage_profile::binds_eagerly(std::string_view symbol) const {
+    const auto it = symbols.find(symbol);
+    // the summed first-call time over all runs is what lazy binding costs per run on average
+    return runs && it != symbols.end() && it->second.first_call_ns > bind_ns * runs;
+}
+
+std::string usage_profile::evidence(std::string_view symbol) const {
+    const auto it = symbols.find(symbol);
+    if (it == symbols.end()) {
+        return fmt::format("not called in {:d} runs", runs);
+    }
+    const auto &usage = it->second;
+    return fmt::format("{:d} calls in {:d}/{:d} runs, first call {:d} ns", usage.calls,
+                       usage.runs_called, runs,
+                       usage.runs_called ? usage.first_call_ns / usage.runs_called : 0);
+}
+
+std::optional<usage_profile> read_usage_profile(const fs::path &path) {
+    std::ifstream in{path};
+    std::string line;
+    if (!in || !std::getline(in, line) || line != usage_magic) {
+        fmt::print("[!] '{:s}' isn't a dylibify usage profile\n", path.string());
+        return std::nullopt;
+    }
+
+    usage_profile profile;
+    size_t line_num{1};
+    while (std::getline(in, line)) {
+        ++line_num;
+        // concatenated profiles repeat the header
+        if (line.empty() || line == usage_magic) {
+            continue;
+        }
+        std::istringstream fields{line};
+        std::string kind;
+        fields >> kind;
+        bool good{true};
+        if (kind == "runs") {
+            uint64_t runs{0};
+            good = !!(fields >> runs);
+            profile.runs += runs;
+        } else if (kind == "bind-cost") {
+            good = !!(fields >> profile.bind_ns);
+        } else if (kind == "dylib") {
+            uint64_t runs_used{0};
+            good = !!(fields >> runs_used);
+            const auto name = rest_of(fields);
+            good            = good && !name.empty();
+            profile.dylibs[name] += runs_used;
+        } else if (kind == "stub") {
+            symbol_usage usage;
+            good            = !!(fields >> usage.calls >> usage.runs_called >> usage.first_call_ns);
+            const auto name = rest_of(fields);
+            good            = good && !name.empty();
+            auto &sym       = profile.symbols[name];
+            sym.calls += usage.calls;
+            sym.runs_called += usage.runs_called;
+            sym.first_call_ns += usage.first_call_ns;
+        } else {
+            good = false;
+        }
+        if (!good) {
+            fmt::print("[!] Bad record on line {:d} of usage profile '{:s}'\n", line_num,
+                       path.string());
+            return std::nullopt;
+        }
+    }
+    return profile;
+}
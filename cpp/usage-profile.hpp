@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// What the converted images did at runtime, aggregated over many runs, and the binding policy
+// that makes the cheapest one that still works:
+//   - a dependency no run used is removed, the image never loads it
+//   - a symbol of a removed dylib that is only reached through its stub and never called is a
+//     weak import through flat lookup instead of a stub, so it needs no stub dylib
+//   - a lazily bound symbol whose first call costs more per run than binding it at load is
+//     bound at load
+// Whatever instruments the host writes one record per line, names last:
+//   dylibify-usage 1
+//   runs <n>
+//   bind-cost <ns>                                       one bind at load, 500 if not given
+//   dylib <runs used in> <install name>
+//   stub <calls> <runs called in> <first-call ns> <symbol>
+// First-call times are summed over the runs the symbol was called in. Records of the same name
+// add up, so profiles of separate runs are aggregated by concatenating them.
+struct symbol_usage {
+    uint64_t calls{0};
+    uint64_t runs_called{0};
+    uint64_t first_call_ns{0};
+};
+
+struct usage_profile {
+    uint64_t runs{0};
+    uint64_t bind_ns{500};
+    // install name -> runs it was used in
+    std::map<std::string, uint64_t, std::less<>> dylibs;
+    std::map<std::string, symbol_usage, std::less<>> symbols;
+
+    // Seen in the profile and used in none of its runs.
+    bool unused_dylib(std::string_view install_name) const;
+    bool called(std::string_view symbol) const;
+    // Whether the runs say anything about the dylib's symbols, ones without a record weren't
+    // called.
+    bool covers_dylib(std::string_view install_name) const;
+    // Average first-call time per run above the cost of binding at load.
+    bool binds_eagerly(std::string_view symbol) const;
+    // "<calls> calls in <runs called>/<runs> runs, first call <ns> ns", for the stats.
+    std::string evidence(std::string_view symbol) const;
+};
+
+std::optional<usage_profile> read_usage_profile(const std::filesystem::path &path);